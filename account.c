@@ -7,6 +7,7 @@
 #include "irc.h"
 
 IMPLEMENT_HOOKABLE(account_del);
+IMPLEMENT_HOOKABLE(account_auth);
 
 static struct dict *account_list;
 static struct database *account_db;
@@ -34,6 +35,7 @@ void account_fini()
 
 	dict_free(account_list);
 	clear_account_del_hooks();
+	clear_account_auth_hooks();
 }
 
 static void account_db_read(struct database *db)
@@ -221,6 +223,7 @@ void account_user_add(struct user_account *account, struct irc_user *user)
 
 	user->account = account;
 	dict_insert(account->users, user->nick, user);
+	CALL_HOOKS(account_auth, (account, user, 1));
 }
 
 void account_user_del(struct user_account *account, struct irc_user *user)
@@ -229,5 +232,6 @@ void account_user_del(struct user_account *account, struct irc_user *user)
 
 	user->account = NULL;
 	dict_delete(account->users, user->nick);
+	CALL_HOOKS(account_auth, (account, user, 0));
 }
 
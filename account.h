@@ -21,6 +21,7 @@ void account_user_add(struct user_account *account, struct irc_user *user);
 void account_user_del(struct user_account *account, struct irc_user *user);
 
 DECLARE_HOOKABLE(account_del, (struct user_account *account));
+DECLARE_HOOKABLE(account_auth, (struct user_account *account, struct irc_user *user, unsigned int authed));
 
 #endif
 
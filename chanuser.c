@@ -10,6 +10,7 @@ IMPLEMENT_HOOKABLE(channel_del);
 IMPLEMENT_HOOKABLE(channel_complete);
 IMPLEMENT_HOOKABLE(user_del);
 IMPLEMENT_HOOKABLE(chanuser_del);
+IMPLEMENT_HOOKABLE(chanuser_changed);
 
 void chanuser_init()
 {
@@ -23,6 +24,7 @@ void chanuser_fini()
 	clear_channel_complete_hooks();
 	clear_user_del_hooks();
 	clear_chanuser_del_hooks();
+	clear_chanuser_changed_hooks();
 
 	chanuser_flush();
 	dict_free(users);
@@ -254,7 +256,7 @@ struct irc_chanuser* channel_user_add(struct irc_channel *channel, struct irc_us
 	if((chanuser = channel_user_find(channel, user)))
 	{
 		log_append(LOG_WARNING, "User %s was already in %s; re-adding him", user->nick, channel->name);
-		chanuser->flags = flags;
+		channel_user_set_flags(chanuser, flags);
 		return chanuser;
 	}
 
@@ -268,10 +270,20 @@ struct irc_chanuser* channel_user_add(struct irc_channel *channel, struct irc_us
 
 	dict_insert(channel->users, user->nick, chanuser);
 	dict_insert(user->channels, channel->name, chanuser);
+	CALL_HOOKS(chanuser_changed, (chanuser));
 
 	return chanuser;
 }
 
+void channel_user_set_flags(struct irc_chanuser *chanuser, int flags)
+{
+	if(chanuser->flags == flags)
+		return;
+
+	chanuser->flags = flags;
+	CALL_HOOKS(chanuser_changed, (chanuser));
+}
+
 struct irc_chanuser* channel_user_find(struct irc_channel *channel, struct irc_user *user)
 {
 	return dict_find(channel->users, user->nick);
@@ -55,6 +55,7 @@ void user_rename(struct irc_user *user, const char *nick);
 
 struct irc_chanuser* channel_user_add(struct irc_channel *channel, struct irc_user *user, int flags);
 struct irc_chanuser* channel_user_find(struct irc_channel *channel, struct irc_user *user);
+void channel_user_set_flags(struct irc_chanuser *chanuser, int flags);
 int channel_user_del(struct irc_channel *channel, struct irc_user *user, unsigned int del_type, int check_dead, const char *reason);
 
 struct irc_ban* channel_ban_add(struct irc_channel *channel, const char *mask);
@@ -67,5 +68,6 @@ DECLARE_HOOKABLE(channel_del, (struct irc_channel *channel, const char *reason))
 DECLARE_HOOKABLE(channel_complete, (struct irc_channel *channel));
 DECLARE_HOOKABLE(user_del, (struct irc_user *user, unsigned int quit, const char *reason));
 DECLARE_HOOKABLE(chanuser_del, (struct irc_chanuser *user, unsigned int del_type, const char *reason));
+DECLARE_HOOKABLE(chanuser_changed, (struct irc_chanuser *user)); // joined or op/voice changed
 
 #endif
@@ -121,10 +121,7 @@ void parse_channel_modes(struct irc_channel *channel, int argc, char **argv)
 				else if(*modes == 'v')
 					flags = MODE_VOICE;
 
-				if(add)
-					chanuser->flags |= flags;
-				else
-					chanuser->flags &= ~flags;
+				channel_user_set_flags(chanuser, add ? (chanuser->flags | flags) : (chanuser->flags & ~flags));
 
 				debug("Mode change in %s for %s: %c%c", channel->name, user->nick, add ? '+' : '-', *modes);
 				break;
@@ -443,7 +440,7 @@ CHANUSER_IRC_HANDLER(num_namereply)
 			user = user_add_nick(namev[i]);
 
 		if((chanuser = channel_user_find(channel, user)))
-			chanuser->flags = flags;
+			channel_user_set_flags(chanuser, flags);
 		else
 			channel_user_add(channel, user, flags);
 	}
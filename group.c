@@ -3,6 +3,8 @@
 #include "account.h"
 #include "database.h"
 
+IMPLEMENT_HOOKABLE(group_changed);
+
 static struct dict *group_list;
 static struct database *group_db;
 
@@ -36,6 +38,7 @@ void group_fini()
 		group_del(dict_first_data(group_list));
 
 	dict_free(group_list);
+	clear_group_changed_hooks();
 }
 
 static void group_db_read(struct database *db)
@@ -121,6 +124,7 @@ void group_member_add(struct access_group *group, struct user_account *account)
 {
 	stringlist_add(group->members, strdup(account->name));
 	dict_insert(account->groups, group->name, group);
+	CALL_HOOKS(group_changed, (group));
 }
 
 void group_member_del(struct access_group *group, struct user_account *account)
@@ -130,6 +134,7 @@ void group_member_del(struct access_group *group, struct user_account *account)
 	stringlist_del(group->members, pos);
 	dict_delete(account->groups, group->name);
 	debug("removed %s from %s", group->name, account->name);
+	CALL_HOOKS(group_changed, (group));
 }
 
 int group_has_member(const char *group_name, const struct user_account *account)
@@ -2,6 +2,7 @@
 #define GROUP_H
 
 #include "stringlist.h"
+#include "hook.h"
 
 #define VALID_GROUP_CHARS	"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890_-"
 
@@ -25,5 +26,7 @@ void group_member_add(struct access_group *group, struct user_account *account);
 void group_member_del(struct access_group *group, struct user_account *account);
 int group_has_member(const char *group_name, const struct user_account *account);
 
+DECLARE_HOOKABLE(group_changed, (struct access_group *group));
+
 #endif
 
@@ -110,7 +110,8 @@ void bitly_shorten(const char *url, bitly_shortened_f *callback, void *ctx, bitl
 	request->ctx = ctx;
 	request->callback = callback;
 	request->free_f = free_f;
-	request->http = HTTPRequest_create(urlbuf, event_func, read_func);
+	// Short links never change, so keep them around for a day
+	request->http = HTTPRequest_create_cached(urlbuf, event_func, read_func, 86400);
 	HTTPRequest_connect(request->http);
 	if(bitly_conf.timeout > 0)
 		timer_add(this, "request_timeout", now + bitly_conf.timeout, (timer_f *)bitly_timeout, request, 0, 0);
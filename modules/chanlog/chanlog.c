@@ -9,6 +9,8 @@
 #include "chanuser.h"
 #include "conf.h"
 #include "timer.h"
+#include "logwriter.h"
+#include "logpurge.h"
 
 #define CHANLOG_ACTIVE if(argc < 2 || !chanreg_module_active(cmod, argv[1])) return
 
@@ -16,11 +18,14 @@ MODULE_DEPENDS("tools", "commands", "chanreg", NULL);
 
 struct chanlog {
 	char *target;
-	FILE *fd;
+	struct logfile *file;
+	uint32_t day; // YYYYMMDD of the last line
 };
 
 static struct {
 	const char *directory;
+	struct logwriter_params writer;
+	enum logpurge_compress compress;
 } chanlog_conf;
 
 static struct dict *chanlogs;
@@ -29,19 +34,22 @@ static struct chanreg_module *cmod;
 static void chanlog_init();
 static void chanlog_fini();
 
-static FILE *fd_find(const char *);
+static struct chanlog *chanlog_find(const char *);
 static int chanlog_add(const char *);
 static void chanlog_del(const char *);
 static void chanlog_readconf();
 static void chanlog_timer_add();
 static void chanlog_timer_del();
-static int chanlog_purge(const char *target);
+static int chanlog_purge();
 static void chanlog_rotate();
 
 static void chanuser_del_hook(struct irc_chanuser *user, unsigned int del_type, const char *reason);
 static void chanlog_timer(void *bound, void *data);
 static void chanlog_chmod(const char *target, unsigned int mode);
 
+static const char *chanlog_timestamp(uint32_t *day);
+static void chanlog_switch_day(struct chanlog *clog, uint32_t day);
+static void chanlog_write(struct chanlog *clog, uint32_t day, const char *format, ...) PRINTF_LIKE(3, 4);
 static void chanlog(const char *target, const char *format, ...);
 static void chanlog_free(struct chanlog *);
 static int cmod_enabled(struct chanreg *, enum cmod_enable_reason);
@@ -79,6 +87,8 @@ MODULE_INIT
 	chanlogs = dict_create();
 	dict_set_free_funcs(chanlogs, NULL, (dict_free_f*)chanlog_free);
 
+	logwriter_init();
+	logpurge_init();
 	chanlog_readconf();
 	chanlog_init();
 }
@@ -100,6 +110,8 @@ MODULE_FINI
 
 	chanreg_module_unreg(cmod);
 	dict_free(chanlogs);
+	logpurge_fini();
+	logwriter_fini();
 }
 
 static void chanlog_init()
@@ -120,7 +132,7 @@ static void chanlog_fini()
 		chanlog_del(((struct chanlog *)node->data)->target);
 }
 
-static FILE *fd_find(const char *target)
+static struct chanlog *chanlog_find(const char *target)
 {
 	if(!target)
 		return NULL;
@@ -128,10 +140,10 @@ static FILE *fd_find(const char *target)
 	struct chanlog *clog = dict_find(chanlogs, target);
 	if(!clog)
 	{
-		debug("Could not find associated fd for target '%s'", target);
+		debug("Could not find associated logfile for target '%s'", target);
 		return NULL;
 	}
-	return clog->fd;
+	return clog;
 }
 
 static int chanlog_add(const char *target)
@@ -140,8 +152,7 @@ static int chanlog_add(const char *target)
 	const char *szMode;
 	struct tm *timeinfo;
 	struct chanlog *item;
-	FILE *fd;
-	int len;
+	int fd, len;
 	struct chanreg *reg;
 	unsigned int mode = 0600;
 
@@ -187,18 +198,12 @@ static int chanlog_add(const char *target)
 	snprintf(dirname + len, sizeof(dirname) - len, "/%d-%02d-%02d.log", timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, timeinfo->tm_mday);
 
 	strtolower(dirname + len);
-	// Try to open file for reading
-	fd = fopen(dirname, "a");
-	if(!fd)
+	// Open the file here so failing to create it still disables the module; the writer thread owns it afterwards
+	if((fd = open(dirname, O_WRONLY | O_APPEND | O_CREAT, mode)) == -1)
 	{
-		// File doesn't seem to exist, opening it for writing will create it
-		fd = fopen(dirname, "w");
-		if(!fd)
-		{
-			debug("Could not open/create logfile '%s' in chanlog-module, disabling module", dirname);
-			chanreg_module_disable(reg, cmod, 0, CDR_DISABLED);
-			return -1;
-		}
+		debug("Could not open/create logfile '%s' in chanlog-module, disabling module", dirname);
+		chanreg_module_disable(reg, cmod, 0, CDR_DISABLED);
+		return -1;
 	}
 
 	// Make sure the correct filemode was set
@@ -208,41 +213,73 @@ static int chanlog_add(const char *target)
 	item = malloc(sizeof(struct chanlog));
 	memset(item, 0, sizeof(struct chanlog));
 	item->target = strdup(target);
-	item->fd = fd;
+	item->day = (timeinfo->tm_year + 1900) * 10000 + (timeinfo->tm_mon + 1) * 100 + timeinfo->tm_mday;
+	dirname[len] = '\0';
+	item->file = logwriter_open(dirname, mode, fd, item->day);
 	dict_insert(chanlogs, item->target, item);
 
 	str = asctime(timeinfo);
 	str[strlen(str) - 1] = '\0';
-
-	fprintf(fd, "Session Start: %s\n", str);
-	fflush(fd);
+	chanlog_write(item, item->day, "Session Start: %s\n", str);
 
 	return 0;
 }
 
 static void chanlog_del(const char *target)
 {
-	FILE *fd;
-	struct tm *timeinfo;
+	struct chanlog *clog;
+	uint32_t day;
 	char *str;
 
-	assert((fd = fd_find(target)));
-	timeinfo = localtime(&now);
-	str = asctime(timeinfo);
+	assert((clog = chanlog_find(target)));
+	chanlog_timestamp(&day);
+	chanlog_switch_day(clog, day);
+	str = asctime(localtime(&now));
 	str[strlen(str) - 1] = '\0';
-	fprintf(fd, "Session Close: %s\n\n", str);
+	chanlog_write(clog, clog->day, "Session Close: %s\n\n", str);
 	dict_delete(chanlogs, target);
 }
 
 static void chanlog_free(struct chanlog *clog)
 {
-	fclose(clog->fd);
+	logwriter_close(clog->file);
 	free(clog->target);
 	free(clog);
 }
 
 static void chanlog_readconf()
 {
+	const char *str;
+
+	str = conf_get("chanlog/flush_interval", DB_STRING);
+	chanlog_conf.writer.flush_interval = str ? atoi(str) : 5;
+	str = conf_get("chanlog/flush_size", DB_STRING);
+	chanlog_conf.writer.flush_size = str ? strtoul(str, NULL, 10) : 64 * 1024;
+	str = conf_get("chanlog/fsync", DB_STRING);
+	if(!str || !strcasecmp(str, "never"))
+		chanlog_conf.writer.fsync = LW_FSYNC_NEVER;
+	else if(!strcasecmp(str, "flush"))
+		chanlog_conf.writer.fsync = LW_FSYNC_FLUSH;
+	else if(!strcasecmp(str, "close"))
+		chanlog_conf.writer.fsync = LW_FSYNC_CLOSE;
+	else
+	{
+		log_append(LOG_WARNING, "Invalid value '%s' for chanlog/fsync (never|flush|close); using never", str);
+		chanlog_conf.writer.fsync = LW_FSYNC_NEVER;
+	}
+	logwriter_configure(&chanlog_conf.writer);
+
+	str = conf_get("chanlog/compress", DB_STRING);
+	if(!str || !strcasecmp(str, "none"))
+		chanlog_conf.compress = LOGPURGE_COMPRESS_NONE;
+	else if(!strcasecmp(str, "gzip"))
+		chanlog_conf.compress = LOGPURGE_COMPRESS_GZIP;
+	else
+	{
+		log_append(LOG_WARNING, "Unsupported value '%s' for chanlog/compress (none|gzip); not compressing logs", str);
+		chanlog_conf.compress = LOGPURGE_COMPRESS_NONE;
+	}
+
 	chanlog_conf.directory = conf_get("chanlog/directory", DB_STRING);
 	if(!chanlog_conf.directory)
 	{
@@ -274,122 +311,109 @@ static void chanlog_timer_del()
 	timer_del_boundname(NULL, "chanlog_timer");
 }
 
-static int chanlog_purge(const char *target)
+static int chanlog_purge()
 {
-	DIR *dir, *subdir;
-	char cwd[PATH_MAX], filedate[11] = {0};
+	struct dict *channels;
 	const char *str;
-	struct dirent *direntry;
-	struct stat attribut;
-	int day, month, year, purge_after, count = 0;
-	time_t date, today;
-	struct tm *timeinfo;
-	struct chanreg *creg;
 
 	if(!chanlog_conf.directory)
 		return -1;
 
-	if(!(dir = opendir(chanlog_conf.directory)))
-		return -2;
-
-	today = time(NULL);
-	timeinfo = localtime(&today);
-	timeinfo->tm_hour = timeinfo->tm_min = timeinfo->tm_sec = 0;
-	today = mktime(timeinfo);
-	if(today == -1)
-		return -3;
-
-	while((direntry = readdir(dir)))
+	// The chanreg settings are only accessible from the main thread
+	channels = dict_create();
+	dict_set_free_funcs(channels, free, NULL);
+	dict_iter(node, chanreg_dict())
 	{
-		if(!IsChannelName(direntry->d_name) || (target && strcasecmp(target, direntry->d_name)))
-			continue;
+		struct chanreg *creg = node->data;
+		str = chanreg_setting_get(creg, cmod, "PurgeAfter");
+		dict_insert(channels, strdup(creg->channel), (void *)(intptr_t)(str ? atoi(str) : 0));
+	}
 
-		// Only check channel if it needs log purging at all
-		creg = chanreg_find(direntry->d_name);
-		if(!creg)
-			continue;
+	if(logpurge_start(chanlog_conf.directory, channels, chanlog_conf.compress))
+	{
+		log_append(LOG_WARNING, "Chanlog: Previous purge of logfiles is still running");
+		return -2;
+	}
+	return 0;
+}
 
-		str = chanreg_setting_get(creg, cmod, "PurgeAfter");
-		if(!str || !(purge_after = atoi(str)))
-			continue;
+static void chanlog_rotate()
+{
+	uint32_t day;
 
-		snprintf(cwd, sizeof(cwd), "%s/%s", chanlog_conf.directory, direntry->d_name);
-		stat(cwd, &attribut);
+	debug("Rotating channel logfiles.");
+	chanlog_timestamp(&day);
+	dict_iter(node, chanlogs)
+		chanlog_switch_day(node->data, day);
+}
 
-		if(attribut.st_mode & S_IFDIR)
-		{
-			// This is a directory, loop through the logs
-			if((subdir = opendir(cwd)))
-			{
-				int len = strlen(cwd);
-				while((direntry = readdir(subdir)))
-				{
-					snprintf(cwd + len, sizeof(cwd) - len, "/%s", direntry->d_name);
-					stat(cwd, &attribut);
+// The timestamp prefix only changes once per second, so it is formatted once for all lines
+static const char *chanlog_timestamp(uint32_t *day)
+{
+	static char timestamp[32];
+	static time_t timestamp_time = 0;
+	static uint32_t timestamp_day = 0;
 
-					// This also takes care of . and .. // To avoid trigraph warnings
-					if(!(attribut.st_mode & S_IFREG) || match("????" "-??" "-??" ".log", direntry->d_name))
-						continue;
+	if(timestamp_time != now)
+	{
+		struct tm *timeinfo = localtime(&now);
+		strftime(timestamp, sizeof(timestamp), "[%d.%m.%Y %H:%M:%S]", timeinfo);
+		timestamp_day = (timeinfo->tm_year + 1900) * 10000 + (timeinfo->tm_mon + 1) * 100 + timeinfo->tm_mday;
+		timestamp_time = now;
+	}
 
-					// Now try to convert the first 10 chars to a valid date so we can compare it...
-					strncpy(filedate, direntry->d_name, sizeof(filedate) - 1);
-					sscanf(filedate, "%4d-%2d-%2d", &year, &month, &day);
-					if(!check_date(day, month, year))
-						continue;
+	*day = timestamp_day;
+	return timestamp;
+}
 
-					// We got a year, a month and a day
-					timeinfo->tm_year = year - 1900;
-					timeinfo->tm_mon = month - 1;
-					timeinfo->tm_mday = day;
-					if((date = mktime(timeinfo)) == -1)
-					{
-						debug("mktime() returned -1");
-						continue;
-					}
+// Ends the session in the file of the previous day and starts it in the new one
+static void chanlog_switch_day(struct chanlog *clog, uint32_t day)
+{
+	char *str;
 
-					if(((today - date) / 60 / 60 / 24) >= purge_after)
-					{
-						debug("Purging logfile %s", direntry->d_name);
-						count++;
-						unlink(cwd);
-					}
+	if(clog->day == day)
+		return;
 
-				}
-				closedir(subdir);
-			}
-			else
-				debug("Could not open subdirectory: %s", direntry->d_name);
-		}
-	}
-	closedir(dir);
-	return count;
+	str = asctime(localtime(&now));
+	str[strlen(str) - 1] = '\0';
+	chanlog_write(clog, clog->day, "Session Close: %s\n\n", str);
+	chanlog_write(clog, day, "Session Start: %s\n", str);
+	clog->day = day;
 }
 
-static void chanlog_rotate()
+static void chanlog_write(struct chanlog *clog, uint32_t day, const char *format, ...)
 {
-	debug("Rotating channel logfiles.");
-	chanlog_fini();
-	chanlog_init();
+	va_list args;
+	char buf[1024];
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	if(len < 0)
+		return;
+	logwriter_append(clog->file, day, buf, min((size_t)len, sizeof(buf) - 1));
 }
 
 static void chanlog(const char *target, const char *format, ...)
 {
 	va_list args;
-	FILE *fd;
-	char buf[900] = {0}, timestamp[50] = {0};
+	struct chanlog *clog;
+	const char *timestamp;
+	uint32_t day;
+	char buf[900] = {0};
 
-	if(!(fd = fd_find(target)))
+	if(!(clog = chanlog_find(target)))
 		return;
 
 	va_start(args, format);
 	vsnprintf(buf, sizeof(buf), format, args);
 	va_end(args);
 
-	struct tm *timeinfo = localtime(&now);
-	strftime(timestamp, sizeof(timestamp), "[%d.%m.%Y %H:%M:%S]", timeinfo);
-	fprintf(fd, "%s %s\n", timestamp, strip_codes(buf));
-
-	fflush(fd);
+	timestamp = chanlog_timestamp(&day);
+	chanlog_switch_day(clog, day);
+	chanlog_write(clog, day, "%s %s\n", timestamp, strip_codes(buf));
 }
 
 static int cmod_enabled(struct chanreg *creg, enum cmod_enable_reason reason)
@@ -486,6 +510,11 @@ const char *cset_logfilemode_encoder(struct chanreg *reg, const char *old_value,
 		struct stat attribute;
 		unsigned int mode = ((str[0] - '0') << 6) | ((str[1] - '0') << 3) | (str[2] - '0');
 
+		struct chanlog *clog;
+
+		if((clog = dict_find(chanlogs, reg->channel)))
+			logwriter_set_mode(clog->file, mode);
+
 		snprintf(path, sizeof(path), "%s/%s", chanlog_conf.directory, reg->channel);
 		stat(path, &attribute);
 		if((attribute.st_mode & S_IFDIR))
@@ -497,7 +526,7 @@ const char *cset_logfilemode_encoder(struct chanreg *reg, const char *old_value,
 				{
 					snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
 					stat(file, &attribute);
-					if(!(attribute.st_mode & S_IFREG) || match("????" "-??" "-??" ".log", entry->d_name))
+					if(!(attribute.st_mode & S_IFREG) || (match("????" "-??" "-??" ".log", entry->d_name) && match("????" "-??" "-??" ".log.gz", entry->d_name)))
 						continue;
 
 					chanlog_chmod(file, mode);
@@ -528,8 +557,9 @@ static void chanuser_del_hook(struct irc_chanuser *user, unsigned int del_type,
 
 static void chanlog_timer(void *bound, void *data)
 {
+	debug("Chanlog: %llu bytes written to logfiles so far", (unsigned long long)logwriter_flushed_bytes());
 	chanlog_rotate();
-	chanlog_purge(NULL);
+	chanlog_purge();
 	chanlog_timer_add();
 }
 
@@ -0,0 +1,387 @@
+#include "global.h"
+#include "surgebot.h"
+#include "dict.h"
+#include "ptrlist.h"
+#include "tools.h"
+#include "logpurge.h"
+
+#include <pthread.h>
+#include <zlib.h>
+
+// Yesterday's log may still receive its Session Close line, so only older logs are compressed
+#define LOGPURGE_COMPRESS_AGE		2
+#define LOGPURGE_REPORT_INTERVAL	30
+
+struct logpurge_result
+{
+	unsigned int channels;
+	unsigned int files;
+	unsigned int purged;
+	unsigned int compressed;
+	unsigned int errors;
+	uint64_t bytes_saved;
+};
+
+static void *purge_worker_main(void *arg);
+static void purge_channel(int parent_fd, const char *name, int purge_after, struct logpurge_result *result);
+static int purge_compress(int dir_fd, const char *name, struct logpurge_result *result);
+static int32_t parse_log_name(const char *name, uint8_t *compressed);
+static int32_t day_number(int year, int month, int day);
+static int purge_terminated();
+static void purge_log(enum log_level level, const char *format, ...) PRINTF_LIKE(2, 3);
+static void purge_flush_log();
+static void purge_check();
+static void purge_cleanup();
+
+static const uint8_t days_in_month[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_t worker;
+	enum {
+		PURGE_IDLE	= 0, // no worker thread, no results waiting
+		PURGE_ACTIVE	= 1, // worker thread running
+		PURGE_FINISHED	= 2  // worker thread done, not joined yet
+	} state;
+	uint8_t terminate;
+
+	// Owned by the worker thread while it is running
+	char *directory;
+	struct dict *channels;
+	enum logpurge_compress compress;
+	int32_t today;
+
+	// Protected by mutex
+	struct logpurge_result result;
+	struct ptrlist *messages; // log_append() must not be called from the worker thread
+
+	time_t started;
+	time_t last_report;
+} purge;
+
+
+void logpurge_init()
+{
+	memset(&purge, 0, sizeof(purge));
+	pthread_mutex_init(&purge.mutex, NULL);
+	purge.messages = ptrlist_create();
+	ptrlist_set_free_func(purge.messages, free);
+}
+
+void logpurge_fini()
+{
+	if(purge.state != PURGE_IDLE)
+	{
+		pthread_mutex_lock(&purge.mutex);
+		purge.terminate = 1;
+		pthread_mutex_unlock(&purge.mutex);
+		pthread_join(purge.worker, NULL);
+		unreg_loop_func(purge_check);
+		purge_flush_log();
+		log_append(LOG_INFO, "Chanlog: Aborted purging logfiles");
+		purge_cleanup();
+	}
+
+	ptrlist_free(purge.messages);
+	pthread_mutex_destroy(&purge.mutex);
+}
+
+int logpurge_start(const char *directory, struct dict *channels, enum logpurge_compress compress)
+{
+	struct tm *timeinfo;
+
+	if(purge.state != PURGE_IDLE)
+	{
+		dict_free(channels);
+		return -1;
+	}
+
+	timeinfo = localtime(&now);
+	purge.directory = strdup(directory);
+	purge.channels = channels;
+	purge.compress = compress;
+	purge.today = day_number(timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, timeinfo->tm_mday);
+	memset(&purge.result, 0, sizeof(purge.result));
+	purge.terminate = 0;
+	purge.started = purge.last_report = now;
+	purge.state = PURGE_ACTIVE;
+
+	pthread_create(&purge.worker, NULL, purge_worker_main, NULL);
+	reg_loop_func(purge_check);
+	return 0;
+}
+
+static void *purge_worker_main(void *arg)
+{
+	struct logpurge_result result;
+	struct dirent *entry;
+	struct dict_node *node;
+	DIR *dir;
+	int fd;
+
+	memset(&result, 0, sizeof(result));
+	if((fd = open(purge.directory, O_RDONLY | O_DIRECTORY)) == -1 || !(dir = fdopendir(fd)))
+	{
+		purge_log(LOG_WARNING, "Chanlog: Could not open log directory %s: %s", purge.directory, strerror(errno));
+		if(fd != -1)
+			close(fd);
+		result.errors++;
+	}
+	else
+	{
+		while(!purge_terminated() && (entry = readdir(dir)))
+		{
+			// Only directories of registered channels are checked at all
+			if(!IsChannelName(entry->d_name) || !(node = dict_find_node(purge.channels, entry->d_name)))
+				continue;
+
+			purge_channel(dirfd(dir), entry->d_name, (intptr_t)node->data, &result);
+
+			pthread_mutex_lock(&purge.mutex);
+			purge.result = result;
+			pthread_mutex_unlock(&purge.mutex);
+		}
+		closedir(dir);
+	}
+
+	pthread_mutex_lock(&purge.mutex);
+	purge.result = result;
+	purge.state = PURGE_FINISHED;
+	pthread_mutex_unlock(&purge.mutex);
+	return NULL;
+}
+
+static void purge_channel(int parent_fd, const char *name, int purge_after, struct logpurge_result *result)
+{
+	struct dirent *entry;
+	struct stat sb;
+	uint8_t compressed;
+	int32_t day, age;
+	DIR *dir;
+	int fd;
+
+	// Fails with ENOTDIR for anything but a directory, so no stat() is needed
+	if((fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY)) == -1)
+		return;
+	if(!(dir = fdopendir(fd)))
+	{
+		close(fd);
+		return;
+	}
+
+	result->channels++;
+	while(!purge_terminated() && (entry = readdir(dir)))
+	{
+		// This also takes care of . and ..
+		if((day = parse_log_name(entry->d_name, &compressed)) < 0)
+			continue;
+
+		if(entry->d_type != DT_REG &&
+		   (entry->d_type != DT_UNKNOWN || fstatat(fd, entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) || !S_ISREG(sb.st_mode)))
+			continue;
+
+		result->files++;
+		age = purge.today - day;
+		if(purge_after && age >= purge_after)
+		{
+			purge_log(LOG_DEBUG, "Purging logfile %s/%s", name, entry->d_name);
+			if(unlinkat(fd, entry->d_name, 0) == 0)
+				result->purged++;
+			else
+			{
+				purge_log(LOG_WARNING, "Chanlog: Could not delete %s/%s: %s", name, entry->d_name, strerror(errno));
+				result->errors++;
+			}
+		}
+		else if(!compressed && purge.compress != LOGPURGE_COMPRESS_NONE && age >= LOGPURGE_COMPRESS_AGE)
+		{
+			if(purge_compress(fd, entry->d_name, result) == 0)
+				result->compressed++;
+			else
+			{
+				purge_log(LOG_WARNING, "Chanlog: Could not compress %s/%s", name, entry->d_name);
+				result->errors++;
+			}
+		}
+	}
+
+	closedir(dir);
+}
+
+// Replaces name by name.gz; the file keeps its mode
+static int purge_compress(int dir_fd, const char *name, struct logpurge_result *result)
+{
+	// name is always a "YYYY-MM-DD.log" name, but the buffers fit any file name
+	char tmp_name[NAME_MAX + 9], gz_name[NAME_MAX + 4], buf[65536];
+	struct stat sb, gz_sb;
+	gzFile gz;
+	ssize_t len;
+	int src_fd, dst_fd;
+
+	snprintf(gz_name, sizeof(gz_name), "%s.gz", name);
+	snprintf(tmp_name, sizeof(tmp_name), ".%s.tmp", gz_name);
+
+	if((src_fd = openat(dir_fd, name, O_RDONLY)) == -1)
+		return -1;
+	if(fstat(src_fd, &sb) || (dst_fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC, sb.st_mode & 0777)) == -1)
+	{
+		close(src_fd);
+		return -1;
+	}
+
+	fchmod(dst_fd, sb.st_mode & 0777);
+	if(!(gz = gzdopen(dst_fd, "wb6")))
+	{
+		close(dst_fd);
+		close(src_fd);
+		unlinkat(dir_fd, tmp_name, 0);
+		return -1;
+	}
+
+	while((len = read(src_fd, buf, sizeof(buf))) > 0)
+	{
+		if(gzwrite(gz, buf, len) != len)
+		{
+			len = -1;
+			break;
+		}
+	}
+
+	close(src_fd);
+	if(gzclose(gz) != Z_OK || len < 0 || renameat(dir_fd, tmp_name, dir_fd, gz_name))
+	{
+		unlinkat(dir_fd, tmp_name, 0);
+		return -1;
+	}
+
+	unlinkat(dir_fd, name, 0);
+	if(fstatat(dir_fd, gz_name, &gz_sb, 0) == 0 && gz_sb.st_size < sb.st_size)
+		result->bytes_saved += sb.st_size - gz_sb.st_size;
+	return 0;
+}
+
+// Returns the day number of a "YYYY-MM-DD.log" or "YYYY-MM-DD.log.gz" filename or -1
+static int32_t parse_log_name(const char *name, uint8_t *compressed)
+{
+	int year, month, day;
+
+	for(int i = 0; i < 10; i++)
+	{
+		if(i == 4 || i == 7 ? name[i] != '-' : !isdigit((unsigned char)name[i]))
+			return -1;
+	}
+
+	if(!strcmp(name + 10, ".log"))
+		*compressed = 0;
+	else if(!strcmp(name + 10, ".log.gz"))
+		*compressed = 1;
+	else
+		return -1;
+
+	year = (name[0] - '0') * 1000 + (name[1] - '0') * 100 + (name[2] - '0') * 10 + (name[3] - '0');
+	month = (name[5] - '0') * 10 + (name[6] - '0');
+	day = (name[8] - '0') * 10 + (name[9] - '0');
+	// check_date() uses localtime(), which is not safe to call from this thread
+	if(month < 1 || month > 12 || day < 1 || day > days_in_month[month - 1] + (month == 2 && !(year % 4) && ((year % 100) || !(year % 400))))
+		return -1;
+
+	return day_number(year, month, day);
+}
+
+// Days since 1970-01-01; avoids mktime() and its timezone lookups for every file
+static int32_t day_number(int year, int month, int day)
+{
+	int era, yoe, doy;
+
+	year -= month <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+static int purge_terminated()
+{
+	int terminate;
+
+	pthread_mutex_lock(&purge.mutex);
+	terminate = purge.terminate;
+	pthread_mutex_unlock(&purge.mutex);
+	return terminate;
+}
+
+static void purge_log(enum log_level level, const char *format, ...)
+{
+	char buf[MAXLEN];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	pthread_mutex_lock(&purge.mutex);
+	ptrlist_add(purge.messages, level, strdup(buf));
+	pthread_mutex_unlock(&purge.mutex);
+}
+
+// Logs the messages of the worker thread; called from the main thread
+static void purge_flush_log()
+{
+	struct ptrlist *messages;
+
+	pthread_mutex_lock(&purge.mutex);
+	if(!purge.messages->count)
+	{
+		pthread_mutex_unlock(&purge.mutex);
+		return;
+	}
+
+	messages = purge.messages;
+	purge.messages = ptrlist_create();
+	ptrlist_set_free_func(purge.messages, free);
+	pthread_mutex_unlock(&purge.mutex);
+
+	for(unsigned int i = 0; i < messages->count; i++)
+		log_append(messages->data[i]->type, "%s", (char *)messages->data[i]->ptr);
+	ptrlist_free(messages);
+}
+
+static void purge_check()
+{
+	struct logpurge_result result;
+	uint8_t finished;
+
+	purge_flush_log();
+
+	pthread_mutex_lock(&purge.mutex);
+	result = purge.result;
+	finished = (purge.state == PURGE_FINISHED);
+	pthread_mutex_unlock(&purge.mutex);
+
+	if(!finished)
+	{
+		if((now - purge.last_report) >= LOGPURGE_REPORT_INTERVAL)
+		{
+			purge.last_report = now;
+			log_append(LOG_INFO, "Chanlog: Purging logfiles for %lus: %u channels, %u files checked, %u purged, %u compressed",
+				   (unsigned long)(now - purge.started), result.channels, result.files, result.purged, result.compressed);
+		}
+		return;
+	}
+
+	unreg_loop_func(purge_check);
+	pthread_join(purge.worker, NULL);
+	log_append(LOG_INFO, "Chanlog: Purged %u and compressed %u of %u logfiles in %u channels in %lus (%llu bytes saved, %u errors)",
+		   result.purged, result.compressed, result.files, result.channels, (unsigned long)(now - purge.started),
+		   (unsigned long long)result.bytes_saved, result.errors);
+	purge_cleanup();
+}
+
+static void purge_cleanup()
+{
+	MyFree(purge.directory);
+	dict_free(purge.channels);
+	purge.channels = NULL;
+	purge.state = PURGE_IDLE;
+}
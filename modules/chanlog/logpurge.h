@@ -0,0 +1,17 @@
+#ifndef LOGPURGE_H
+#define LOGPURGE_H
+
+enum logpurge_compress
+{
+	LOGPURGE_COMPRESS_NONE,
+	LOGPURGE_COMPRESS_GZIP
+};
+
+void logpurge_init();
+void logpurge_fini();
+// Purges and compresses the logs below directory in a background thread; the results are logged
+// from the main loop. channels maps channel names to the number of days after which their logs
+// are deleted (0 = never) and is owned by logpurge afterwards. Returns -1 if a purge is still running.
+int logpurge_start(const char *directory, struct dict *channels, enum logpurge_compress compress);
+
+#endif
@@ -0,0 +1,456 @@
+#include "global.h"
+#include "surgebot.h"
+#include "ptrlist.h"
+#include "logwriter.h"
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define LOG_BLOCK_SIZE		4096
+#define LOG_BLOCKS_FREE_MAX	64
+#define LOG_IOV_MAX		64
+
+struct log_block
+{
+	struct log_block *next;
+	uint32_t day;
+	size_t len;
+	char data[LOG_BLOCK_SIZE];
+};
+
+struct logfile
+{
+	char *dir;
+	unsigned int mode;
+	uint8_t closed;
+
+	// Buffered data; protected by writer.mutex
+	struct log_block *head, *tail;
+
+	// Only used by the writer thread
+	struct log_block *flushing;
+	uint8_t closing; // closed was set when flushing was taken
+	unsigned int open_mode;
+	int fd;
+	uint32_t fd_day;
+};
+
+static void *writer_main(void *arg);
+static size_t writer_write(struct logfile *file);
+static int writer_open_day(struct logfile *file, uint32_t day);
+static void writer_close_fd(struct logfile *file);
+static int writev_full(int fd, struct iovec *iov, int count);
+static struct log_block *block_alloc(uint32_t day);
+static void block_release(struct log_block *block);
+static void logfile_free(struct logfile *file);
+static void writer_log(enum log_level level, const char *format, ...) PRINTF_LIKE(2, 3);
+static void writer_check();
+
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	uint8_t running;
+	uint8_t terminate;
+
+	struct logwriter_params params;
+	struct ptrlist *files;
+	struct log_block *free_blocks;
+	unsigned int free_count;
+	size_t pending;
+	uint64_t flushed_bytes;
+	struct ptrlist *messages; // log_append() must not be called from the writer thread
+
+	enum logwriter_fsync fsync; // copy of params.fsync for the writer thread
+} writer;
+
+
+void logwriter_init()
+{
+	memset(&writer, 0, sizeof(writer));
+	pthread_mutex_init(&writer.mutex, NULL);
+	pthread_cond_init(&writer.cond, NULL);
+	writer.files = ptrlist_create();
+	writer.messages = ptrlist_create();
+	ptrlist_set_free_func(writer.messages, free);
+	writer.params.flush_interval = 5;
+	writer.params.flush_size = 64 * 1024;
+	writer.params.fsync = LW_FSYNC_NEVER;
+
+	pthread_create(&writer.thread, NULL, writer_main, NULL);
+	writer.running = 1;
+	reg_loop_func(writer_check);
+}
+
+void logwriter_fini()
+{
+	struct log_block *block;
+
+	if(!writer.running)
+		return;
+
+	pthread_mutex_lock(&writer.mutex);
+	writer.terminate = 1;
+	pthread_cond_signal(&writer.cond);
+	pthread_mutex_unlock(&writer.mutex);
+	pthread_join(writer.thread, NULL);
+	writer.running = 0;
+	unreg_loop_func(writer_check);
+	writer_check();
+	ptrlist_free(writer.messages);
+
+	// The writer thread wrote everything; only files that were never closed are left
+	for(unsigned int i = 0; i < writer.files->count; i++)
+		logfile_free(writer.files->data[i]->ptr);
+	ptrlist_free(writer.files);
+
+	while((block = writer.free_blocks))
+	{
+		writer.free_blocks = block->next;
+		free(block);
+	}
+
+	pthread_cond_destroy(&writer.cond);
+	pthread_mutex_destroy(&writer.mutex);
+}
+
+void logwriter_configure(const struct logwriter_params *params)
+{
+	pthread_mutex_lock(&writer.mutex);
+	writer.params = *params;
+	if(!writer.params.flush_interval)
+		writer.params.flush_interval = 1;
+	pthread_cond_signal(&writer.cond);
+	pthread_mutex_unlock(&writer.mutex);
+}
+
+struct logfile *logwriter_open(const char *dir, unsigned int mode, int fd, uint32_t day)
+{
+	struct logfile *file = malloc(sizeof(struct logfile));
+	memset(file, 0, sizeof(struct logfile));
+	file->dir = strdup(dir);
+	file->mode = mode;
+	file->open_mode = mode;
+	file->fd = fd;
+	file->fd_day = day;
+
+	pthread_mutex_lock(&writer.mutex);
+	ptrlist_add(writer.files, 0, file);
+	pthread_mutex_unlock(&writer.mutex);
+	return file;
+}
+
+void logwriter_set_mode(struct logfile *file, unsigned int mode)
+{
+	pthread_mutex_lock(&writer.mutex);
+	file->mode = mode;
+	pthread_mutex_unlock(&writer.mutex);
+}
+
+void logwriter_append(struct logfile *file, uint32_t day, const char *str, size_t len)
+{
+	struct log_block *block;
+
+	pthread_mutex_lock(&writer.mutex);
+	writer.pending += len;
+	while(len)
+	{
+		size_t n;
+
+		if(!(block = file->tail) || block->day != day || block->len == LOG_BLOCK_SIZE)
+		{
+			block = block_alloc(day);
+			if(file->tail)
+				file->tail->next = block;
+			else
+				file->head = block;
+			file->tail = block;
+		}
+
+		n = min(len, LOG_BLOCK_SIZE - block->len);
+		memcpy(block->data + block->len, str, n);
+		block->len += n;
+		str += n;
+		len -= n;
+	}
+
+	if(writer.pending >= writer.params.flush_size)
+		pthread_cond_signal(&writer.cond);
+	pthread_mutex_unlock(&writer.mutex);
+}
+
+void logwriter_close(struct logfile *file)
+{
+	pthread_mutex_lock(&writer.mutex);
+	file->closed = 1;
+	pthread_cond_signal(&writer.cond);
+	pthread_mutex_unlock(&writer.mutex);
+}
+
+uint64_t logwriter_flushed_bytes()
+{
+	uint64_t bytes;
+
+	pthread_mutex_lock(&writer.mutex);
+	bytes = writer.flushed_bytes;
+	pthread_mutex_unlock(&writer.mutex);
+	return bytes;
+}
+
+static void *writer_main(void *arg)
+{
+	struct ptrlist *work = ptrlist_create();
+	uint8_t terminate, again = 0;
+
+	pthread_mutex_lock(&writer.mutex);
+	while(1)
+	{
+		size_t written = 0;
+
+		if(!again && !writer.terminate && writer.pending < writer.params.flush_size)
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += writer.params.flush_interval;
+			pthread_cond_timedwait(&writer.cond, &writer.mutex, &ts);
+		}
+
+		// Take the buffered data of all files; new lines go into new blocks meanwhile
+		terminate = writer.terminate;
+		writer.fsync = writer.params.fsync;
+		for(unsigned int i = 0; i < writer.files->count; i++)
+		{
+			struct logfile *file = writer.files->data[i]->ptr;
+			if(!file->head && !file->closed)
+				continue;
+
+			file->flushing = file->head;
+			file->head = file->tail = NULL;
+			file->closing = file->closed;
+			file->open_mode = file->mode;
+			ptrlist_add(work, 0, file);
+		}
+		writer.pending = 0;
+		again = 0;
+		pthread_mutex_unlock(&writer.mutex);
+
+		for(unsigned int i = 0; i < work->count; i++)
+		{
+			struct logfile *file = work->data[i]->ptr;
+			written += writer_write(file);
+			if(file->closing)
+				writer_close_fd(file);
+			else if(writer.fsync == LW_FSYNC_FLUSH && file->fd != -1)
+				fdatasync(file->fd);
+		}
+
+		pthread_mutex_lock(&writer.mutex);
+		writer.flushed_bytes += written;
+		for(unsigned int i = 0; i < work->count; i++)
+		{
+			struct logfile *file = work->data[i]->ptr;
+			block_release(file->flushing);
+			file->flushing = NULL;
+			if(!file->closing)
+				continue;
+
+			// Lines appended right before logwriter_close() need another pass which reopens the file
+			if(file->head)
+				again = 1;
+			else
+			{
+				ptrlist_del_ptr(writer.files, file);
+				logfile_free(file);
+			}
+		}
+		ptrlist_clear(work);
+
+		if(terminate && !again)
+			break;
+	}
+	pthread_mutex_unlock(&writer.mutex);
+
+	ptrlist_free(work);
+	return NULL;
+}
+
+// Writes the blocks taken from file and returns the number of bytes written
+static size_t writer_write(struct logfile *file)
+{
+	struct iovec iov[LOG_IOV_MAX];
+	struct log_block *block = file->flushing;
+	size_t written = 0;
+
+	while(block)
+	{
+		uint32_t day = block->day;
+		size_t len = 0;
+		int count = 0;
+
+		// Daily rotation: the first line of a new day opens the file of that day
+		if(file->fd == -1 || file->fd_day != day)
+			writer_open_day(file, day);
+
+		for(; block && block->day == day && count < LOG_IOV_MAX; block = block->next)
+		{
+			iov[count].iov_base = block->data;
+			iov[count].iov_len = block->len;
+			len += block->len;
+			count++;
+		}
+
+		if(file->fd != -1 && writev_full(file->fd, iov, count) == 0)
+			written += len;
+	}
+
+	return written;
+}
+
+static int writer_open_day(struct logfile *file, uint32_t day)
+{
+	char path[PATH_MAX];
+
+	writer_close_fd(file);
+	snprintf(path, sizeof(path), "%s/%04u-%02u-%02u.log", file->dir, day / 10000, (day / 100) % 100, day % 100);
+	if(mkdir(file->dir, file->open_mode | 0700) && errno != EEXIST)
+		writer_log(LOG_WARNING, "Chanlog: Could not create directory %s: %s", file->dir, strerror(errno));
+
+	if((file->fd = open(path, O_WRONLY | O_APPEND | O_CREAT, file->open_mode)) == -1)
+	{
+		writer_log(LOG_ERROR, "Chanlog: Could not open logfile %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if(fchmod(file->fd, file->open_mode))
+		writer_log(LOG_ERROR, "Chanlog: Could not set provided filemode %o on: %s", file->open_mode, path);
+
+	file->fd_day = day;
+	return 0;
+}
+
+static void writer_close_fd(struct logfile *file)
+{
+	if(file->fd == -1)
+		return;
+
+	if(writer.fsync != LW_FSYNC_NEVER)
+		fdatasync(file->fd);
+	close(file->fd);
+	file->fd = -1;
+}
+
+static int writev_full(int fd, struct iovec *iov, int count)
+{
+	while(count)
+	{
+		ssize_t res = writev(fd, iov, count);
+		if(res < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			writer_log(LOG_ERROR, "Chanlog: Could not write to logfile: %s", strerror(errno));
+			return -1;
+		}
+
+		// Skip what has been written
+		while(count && (size_t)res >= iov->iov_len)
+		{
+			res -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if(count)
+		{
+			iov->iov_base = (char *)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+
+	return 0;
+}
+
+// Must be called with writer.mutex held
+static struct log_block *block_alloc(uint32_t day)
+{
+	struct log_block *block;
+
+	if((block = writer.free_blocks))
+	{
+		writer.free_blocks = block->next;
+		writer.free_count--;
+	}
+	else
+		block = malloc(sizeof(struct log_block));
+
+	block->next = NULL;
+	block->day = day;
+	block->len = 0;
+	return block;
+}
+
+// Releases a chain of blocks; must be called with writer.mutex held
+static void block_release(struct log_block *block)
+{
+	struct log_block *next;
+
+	for(; block; block = next)
+	{
+		next = block->next;
+		if(writer.free_count >= LOG_BLOCKS_FREE_MAX)
+		{
+			free(block);
+			continue;
+		}
+
+		block->next = writer.free_blocks;
+		writer.free_blocks = block;
+		writer.free_count++;
+	}
+}
+
+static void logfile_free(struct logfile *file)
+{
+	block_release(file->head);
+	if(file->fd != -1)
+		close(file->fd);
+	free(file->dir);
+	free(file);
+}
+
+static void writer_log(enum log_level level, const char *format, ...)
+{
+	char buf[MAXLEN];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	pthread_mutex_lock(&writer.mutex);
+	ptrlist_add(writer.messages, level, strdup(buf));
+	pthread_mutex_unlock(&writer.mutex);
+}
+
+// Logs the messages of the writer thread; called from the main loop
+static void writer_check()
+{
+	struct ptrlist *messages;
+
+	pthread_mutex_lock(&writer.mutex);
+	if(!writer.messages->count)
+	{
+		pthread_mutex_unlock(&writer.mutex);
+		return;
+	}
+
+	messages = writer.messages;
+	writer.messages = ptrlist_create();
+	ptrlist_set_free_func(writer.messages, free);
+	pthread_mutex_unlock(&writer.mutex);
+
+	for(unsigned int i = 0; i < messages->count; i++)
+		log_append(messages->data[i]->type, "%s", (char *)messages->data[i]->ptr);
+	ptrlist_free(messages);
+}
@@ -0,0 +1,33 @@
+#ifndef LOGWRITER_H
+#define LOGWRITER_H
+
+struct logfile;
+
+enum logwriter_fsync
+{
+	LW_FSYNC_NEVER,
+	LW_FSYNC_FLUSH,	// after every flush
+	LW_FSYNC_CLOSE	// when a file is closed or rotated
+};
+
+struct logwriter_params
+{
+	unsigned int flush_interval; // seconds
+	size_t flush_size; // flush as soon as this many bytes are buffered
+	enum logwriter_fsync fsync;
+};
+
+// Days are passed as YYYYMMDD; the file of a day is <dir>/YYYY-MM-DD.log
+void logwriter_init();
+void logwriter_fini();
+void logwriter_configure(const struct logwriter_params *params);
+// Takes ownership of fd, which must be the file of the given day
+struct logfile *logwriter_open(const char *dir, unsigned int mode, int fd, uint32_t day);
+void logwriter_set_mode(struct logfile *file, unsigned int mode);
+// Lines of a different day than the previous ones go into the file of that day
+void logwriter_append(struct logfile *file, uint32_t day, const char *str, size_t len);
+// Remaining data is written before the file is closed
+void logwriter_close(struct logfile *file);
+uint64_t logwriter_flushed_bytes();
+
+#endif
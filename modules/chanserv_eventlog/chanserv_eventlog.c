@@ -38,6 +38,7 @@ static void chanserv_fetch_events(void *bound, struct chanreg *reg);
 
 static struct module *this;
 static struct db_table *event_table;
+static struct db_batch *event_batch;
 static struct chanreg_module *cmod;
 static struct dict *last_events;
 
@@ -63,6 +64,8 @@ MODULE_INIT
 	event_table = db_table_open("chanserv_events", event_table_cols);
 	if(!event_table)
 		log_append(LOG_ERROR, "Could not open eventlog table.");
+	else
+		event_batch = db_batch_create(event_table, NULL, NULL, "time", "channel", "nick", "ident", "host", "account", "command", NULL);
 
 	last_events = dict_create();
 	dict_set_free_funcs(last_events, NULL, free);
@@ -78,6 +81,8 @@ MODULE_FINI
 	chanreg_module_unreg(cmod);
 	dict_free(last_events);
 
+	if(event_batch)
+		db_batch_free(event_batch);
 	if(event_table)
 		db_table_close(event_table);
 }
@@ -185,6 +190,9 @@ static void srvx_response_events(struct srvx_request *r, const char *channelname
 			continue;
 		}
 	}
+
+	if(event_batch)
+		db_batch_commit(event_batch);
 }
 
 static void chanserv_event_add(struct chanreg *reg, struct tm calendar, const char *channel, const char *issuer, const char *command)
@@ -285,17 +293,17 @@ static void chanserv_event_add(struct chanreg *reg, struct tm calendar, const ch
 
 	*last_event_ts = event.timestamp;
 
-	if(event_table)
+	// Rows are written by db_batch_commit() once the whole response was parsed
+	if(event_batch)
 	{
-		db_row_insert(event_table,
-			"time",		event.timestamp,
-			"channel",	reg->channel,
-			"nick",		event.src.nick,
-			"ident",	event.src.ident,
-			"host",		event.src.host,
-			"account",	event.account,
-			"command",	event.command,
-			NULL);
+		db_batch_add(event_batch,
+			event.timestamp,
+			reg->channel,
+			event.src.nick,
+			event.src.ident,
+			event.src.host,
+			event.account,
+			event.command);
 	}
 
 	// If event should be kept at some point, store it and don't free it here
@@ -13,6 +13,8 @@
 #include "conf.h"
 #include "sock.h"
 #include "list.h"
+#include "ptrlist.h"
+#include "stringbuffer.h"
 
 MODULE_DEPENDS("commands", "help", "chanjoin", NULL);
 
@@ -24,6 +26,14 @@ struct chanspy_client
 	unsigned int dead : 1;
 };
 
+// All spies reading from the same source channel
+struct spy_channel
+{
+	char *name; // spy->channel, i.e. "#channel", "*", "<#channel" or "<*"
+	struct ptrlist *spies;
+	int flags; // flags of all spies combined
+};
+
 static struct
 {
 	const char *listen_host;
@@ -65,13 +75,23 @@ static struct chanspy *spy_find(const char *name);
 static void spy_free(struct chanspy *spy);
 static void cj_success(struct cj_channel *chan, const char *key, void *ctx, unsigned int first_time);
 static void cj_error(struct cj_channel *chan, const char *key, void *ctx, const char *reason);
+static void spy_index_add(struct chanspy *spy);
+static void spy_index_del(struct chanspy *spy);
+static struct spy_channel *spy_channel_find(const char *channel, unsigned int remote, unsigned int type);
+static void spy_channel_free(struct spy_channel *chan);
+static void spy_write(struct chanspy *spy, const char *fmt, ...) PRINTF_LIKE(2, 3);
+static void spy_flush_tmr(void *bound, void *data);
 static void spy_notice(struct chanspy *spy, const char *fmt, ...) PRINTF_LIKE(2, 3);
 static void spy_gotmsg(const char *channel, unsigned int remote, unsigned int type, const char *fmt, ...)  PRINTF_LIKE(4, 5);
+static void spy_gotmsg_user(struct irc_user *user, const char *extra_channel, unsigned int type, const char *fmt, ...)  PRINTF_LIKE(4, 5);
+static void spy_send(struct spy_channel *chan, const char *channel, unsigned int type, const char *msg);
 static char *modechar(const char *chan, const char *nick);
 
 static struct module *this;
 static struct database *chanspy_db = NULL;
 static struct dict *spies;
+static struct dict *spy_channels;
+static struct ptrlist *spies_unflushed;
 static const char *spy_flags = "PANQmjpkqnt";
 static char spy_flags_inverse[256];
 static struct sock *listen_sock = NULL;
@@ -81,6 +101,9 @@ MODULE_INIT
 {
 	this = self;
 
+	spy_channels = dict_create();
+	dict_set_free_funcs(spy_channels, NULL, (dict_free_f *)spy_channel_free);
+	spies_unflushed = ptrlist_create();
 	spies = dict_create();
 	dict_set_free_funcs(spies, NULL, (dict_free_f *)spy_free);
 
@@ -144,7 +167,11 @@ MODULE_FINI
 	unreg_irc_handler("NICK", nick);
 	unreg_irc_handler("TOPIC", topic);
 
+	timer_del_boundname(this, "chanspy_flush");
+	spy_flush_tmr(NULL, NULL);
 	dict_free(spies);
+	dict_free(spy_channels);
+	ptrlist_free(spies_unflushed);
 }
 
 static void chanspy_conf_reload()
@@ -279,17 +306,15 @@ static void chanspy_server_event(struct sock *sock, enum sock_event event, int e
 				struct chanspy_client *client = chanspy_clients->data[i];
 				if(client->sock == sock)
 				{
-					if(client->chan)
+					struct spy_channel *chan;
+					if(client->chan && (chan = spy_channel_find(client->chan, 1, 0)))
 					{
-						dict_iter(node, spies)
+						for(unsigned int j = 0; j < chan->spies->count; j++)
 						{
-							struct chanspy *spy = node->data;
-							if((*spy->channel == '<' && !strcasecmp(spy->channel + 1, client->chan)))
-							{
-								spy->active = 0;
-								spy->last_error = (event == EV_ERROR) ? strerror(err) : "Disconnected";
-								spy_notice(spy, "Chanspy client disconnected: %s", ((event == EV_ERROR) ? strerror(err) : "Client hung up"));
-							}
+							struct chanspy *spy = chan->spies->data[j]->ptr;
+							spy->active = 0;
+							spy->last_error = (event == EV_ERROR) ? strerror(err) : "Disconnected";
+							spy_notice(spy, "Chanspy client disconnected: %s", ((event == EV_ERROR) ? strerror(err) : "Client hung up"));
 						}
 					}
 
@@ -335,15 +360,17 @@ static void chanspy_server_read(struct sock *sock, char *buf, size_t len)
 
 	if(argc > 1 && !strcmp(argv[0], "CHAN") && IsSpySourceChannelName(argv[1]) && client->authed)
 	{
+		struct spy_channel *chan;
+
 		if(client->chan)
 			free(client->chan);
 		client->chan = strdup(argv[1]);
 
-		dict_iter(node, spies)
+		if((chan = spy_channel_find(client->chan, 1, 0)))
 		{
-			struct chanspy *spy = node->data;
-			if((*spy->channel == '<' && !strcasecmp(spy->channel + 1, client->chan)))
+			for(unsigned int i = 0; i < chan->spies->count; i++)
 			{
+				struct chanspy *spy = chan->spies->data[i]->ptr;
 				spy->active = 1;
 				spy_notice(spy, "Chanspy client connected from %s.", inet_ntoa(((struct sockaddr_in *)sock->sockaddr_remote)->sin_addr));
 			}
@@ -370,11 +397,11 @@ static void chanspy_server_read(struct sock *sock, char *buf, size_t len)
 	}
 	else if(argc > 1 && !strcasecmp(argv[0], "MSG"))
 	{
-		dict_iter(node, spies)
+		struct spy_channel *chan;
+		if((chan = spy_channel_find(client->chan, 1, 0)))
 		{
-			struct chanspy *spy = node->data;
-			if(*spy->channel == '<' && !strcasecmp(spy->channel + 1, client->chan))
-				spy_notice(spy, "%s", argv[1]);
+			for(unsigned int i = 0; i < chan->spies->count; i++)
+				spy_notice(chan->spies->data[i]->ptr, "%s", argv[1]);
 		}
 	}
 }
@@ -497,6 +524,8 @@ static struct chanspy *spy_add(const char *name, const char *channel, const char
 	spy->channel = strdup(channel);
 	spy->target = strdup(target);
 	spy->flags = flags;
+	if(*target == '>')
+		spy->send_buf = stringbuffer_create();
 	if(*channel == '<')
 	{
 		spy->active = 0;
@@ -545,6 +574,7 @@ static struct chanspy *spy_add(const char *name, const char *channel, const char
 	}
 
 	dict_insert(spies, spy->name, spy);
+	spy_index_add(spy);
 	return spy;
 }
 
@@ -561,6 +591,13 @@ static void spy_free(struct chanspy *spy)
 			chanjoin_delchan(spy->channel, this, spy->name);
 	}
 
+	spy_index_del(spy);
+	if(spy->send_buf)
+	{
+		ptrlist_del_ptr(spies_unflushed, spy);
+		stringbuffer_free(spy->send_buf);
+	}
+
 	free(spy->name);
 	free(spy->channel);
 	free(spy->target);
@@ -594,6 +631,102 @@ static void cj_error(struct cj_channel *chan, const char *key, void *ctx, const
 	spy_notice(spy, "Chanspy on %s (%s) reported error: %s", spy->channel, spy->name, reason);
 }
 
+static void spy_index_add(struct chanspy *spy)
+{
+	struct spy_channel *chan;
+
+	if(!(chan = dict_find(spy_channels, spy->channel)))
+	{
+		chan = malloc(sizeof(struct spy_channel));
+		chan->name = strdup(spy->channel);
+		chan->spies = ptrlist_create();
+		chan->flags = 0;
+		dict_insert(spy_channels, chan->name, chan);
+	}
+
+	ptrlist_add(chan->spies, 0, spy);
+	chan->flags |= spy->flags;
+}
+
+static void spy_index_del(struct chanspy *spy)
+{
+	struct spy_channel *chan;
+
+	if(!(chan = dict_find(spy_channels, spy->channel)))
+		return;
+
+	ptrlist_del_ptr(chan->spies, spy);
+	if(!chan->spies->count)
+	{
+		dict_delete(spy_channels, chan->name);
+		return;
+	}
+
+	chan->flags = 0;
+	for(unsigned int i = 0; i < chan->spies->count; i++)
+		chan->flags |= ((struct chanspy *)chan->spies->data[i]->ptr)->flags;
+}
+
+// Returns the spies of a channel if at least one of them is interested in type (0 matches any type)
+static struct spy_channel *spy_channel_find(const char *channel, unsigned int remote, unsigned int type)
+{
+	struct spy_channel *chan;
+
+	// spy->channel is "<#channel" when the spy data is read from a socket
+	if(remote)
+	{
+		char key[MAXLEN];
+		snprintf(key, sizeof(key), "<%s", channel);
+		chan = dict_find(spy_channels, key);
+	}
+	else
+		chan = dict_find(spy_channels, channel);
+
+	if(!chan || (type && !(chan->flags & type)))
+		return NULL;
+	return chan;
+}
+
+static void spy_channel_free(struct spy_channel *chan)
+{
+	ptrlist_free(chan->spies);
+	free(chan->name);
+	free(chan);
+}
+
+// Output for remote targets is collected and written once per main loop iteration
+static void spy_write(struct chanspy *spy, const char *fmt, ...)
+{
+	va_list args;
+
+	if(!spy->sock)
+		return;
+
+	if(!spy->send_buf->len)
+	{
+		if(!spies_unflushed->count)
+			timer_add(this, "chanspy_flush", now, spy_flush_tmr, NULL, 0, 0);
+		ptrlist_add(spies_unflushed, 0, spy);
+	}
+
+	va_start(args, fmt);
+	stringbuffer_append_vprintf(spy->send_buf, fmt, args);
+	va_end(args);
+}
+
+static void spy_flush_tmr(void *bound, void *data)
+{
+	for(unsigned int i = 0; i < spies_unflushed->count; i++)
+	{
+		struct chanspy *spy = spies_unflushed->data[i]->ptr;
+		if(spy->sock)
+			sock_write(spy->sock, spy->send_buf->string, spy->send_buf->len);
+		stringbuffer_flush(spy->send_buf);
+	}
+
+	ptrlist_clear(spies_unflushed);
+}
+
 static void spy_notice(struct chanspy *spy, const char *fmt, ...)
 {
 	char buf[MAXLEN];
@@ -605,35 +738,85 @@ static void spy_notice(struct chanspy *spy, const char *fmt, ...)
 
 	if(*spy->target != '>') // Not a remote target
 		irc_send_raw("NOTICE %s :%s", spy->target, buf);
-	else if(spy->sock) // Remote target with a valid socket
-		sock_write_fmt(spy->sock, "MSG :%s\n", buf);
-
+	else
+		spy_write(spy, "MSG :%s\n", buf);
 }
 
 static void spy_gotmsg(const char *channel, unsigned int remote, unsigned int type, const char *fmt, ...)
 {
+	struct spy_channel *chan;
 	char buf[MAXLEN];
 	va_list args;
 
+	// Most events happen in channels nobody is spying on
+	if(!(chan = spy_channel_find(channel, remote, type)))
+		return;
+
 	va_start(args, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, args);
 	va_end(args);
 
-	dict_iter(node, spies)
+	spy_send(chan, channel, type, buf);
+}
+
+// Sends the same message to the spies of all channels of user and extra_channel
+static void spy_gotmsg_user(struct irc_user *user, const char *extra_channel, unsigned int type, const char *fmt, ...)
+{
+	struct spy_channel *chan;
+	char buf[MAXLEN];
+	va_list args;
+	unsigned int found = 0;
+
+	if(extra_channel && spy_channel_find(extra_channel, 0, type))
+		found = 1;
+
+	if(user && !found)
 	{
-		struct chanspy *spy = node->data;
-		if(!(spy->flags & type))
-			continue;
+		dict_iter(node, user->channels)
+		{
+			struct irc_chanuser *chanuser = node->data;
+			if(spy_channel_find(chanuser->channel->name, 0, type))
+			{
+				found = 1;
+				break;
+			}
+		}
+	}
+
+	if(!found)
+		return;
 
-		// spy->channel is "<#channel" when the spy data is read from a socket
-		if((!remote && !strcasecmp(spy->channel, channel)) || (remote && *spy->channel == '<' && !strcasecmp(spy->channel + 1, channel)))
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if(user)
+	{
+		dict_iter(node, user->channels)
 		{
-			if(*spy->target != '>') // Not a remote target
-				irc_send_raw("PRIVMSG %s :[%s] %s", spy->target, channel, buf);
-			else if(spy->sock) // Remote target and connected to it
-				sock_write_fmt(spy->sock, "SPY %d :%s\n", type, buf);
+			struct irc_chanuser *chanuser = node->data;
+			if((chan = spy_channel_find(chanuser->channel->name, 0, type)))
+				spy_send(chan, chanuser->channel->name, type, buf);
 		}
 	}
+
+	if(extra_channel && (chan = spy_channel_find(extra_channel, 0, type)))
+		spy_send(chan, extra_channel, type, buf);
+}
+
+static void spy_send(struct spy_channel *chan, const char *channel, unsigned int type, const char *msg)
+{
+	for(unsigned int i = 0; i < chan->spies->count; i++)
+	{
+		struct chanspy *spy = chan->spies->data[i]->ptr;
+		if(!(spy->flags & type))
+			continue;
+
+		if(*spy->target != '>') // Not a remote target
+			irc_send_raw("PRIVMSG %s :[%s] %s", spy->target, channel, msg);
+		else
+			spy_write(spy, "SPY %d :%s\n", type, msg);
+	}
 }
 
 static char *modechar(const char *chan, const char *nick)
@@ -666,33 +849,12 @@ IRC_HANDLER(privmsg)
 		{
 			char *action = strdup(argv[2] + 8);
 			action[strlen(action)-1] = '\0';
-			if(user)
-			{
-				dict_iter(node, user->channels)
-				{
-					struct irc_chanuser *chanuser = node->data;
-					spy_gotmsg(chanuser->channel->name, 0, CSPY_QUERY, "[PM] * %s %s", src->nick, action);
-				}
-			}
-
-			if(!user || !user->account)
-				spy_gotmsg("*", 0, CSPY_QUERY, "[PM] * %s %s", src->nick, action);
-
+			spy_gotmsg_user(user, ((!user || !user->account) ? "*" : NULL), CSPY_QUERY, "[PM] * %s %s", src->nick, action);
 			free(action);
 		}
 		else
 		{
-			if(user)
-			{
-				dict_iter(node, user->channels)
-				{
-					struct irc_chanuser *chanuser = node->data;
-					spy_gotmsg(chanuser->channel->name, 0, CSPY_QUERY, "[PM] <%s> %s", src->nick, argv[2]);
-				}
-			}
-
-			if(!user || !user->account)
-				spy_gotmsg("*", 0, CSPY_QUERY, "[PM] <%s> %s", src->nick, argv[2]);
+			spy_gotmsg_user(user, ((!user || !user->account) ? "*" : NULL), CSPY_QUERY, "[PM] <%s> %s", src->nick, argv[2]);
 		}
 	}
 	else if(IsChannelName(argv[1]))
@@ -771,12 +933,7 @@ IRC_HANDLER(nick)
 	struct irc_user *user;
 	assert(argc > 1);
 	assert(user = user_find(argv[1])); // chanuser_irc handles it first -> the user is already renamed
-
-	dict_iter(node, user->channels)
-	{
-		struct irc_chanuser *chanuser = node->data;
-		spy_gotmsg(chanuser->channel->name, 0, CSPY_NICK, "* %s is now known as %s", src->nick, argv[1]);
-	}
+	spy_gotmsg_user(user, NULL, CSPY_NICK, "* %s is now known as %s", src->nick, argv[1]);
 }
 
 IRC_HANDLER(topic)
@@ -26,6 +26,7 @@ struct chanspy
 	unsigned int active : 1;
 	const char *last_error;
 	struct sock *sock;
+	struct stringbuffer *send_buf; // remote output, written once per main loop iteration
 };
 
 #define IsSpySourceChannelName(NAME)	(IsChannelName((NAME)) || !strcmp((NAME), "*"))
@@ -0,0 +1,117 @@
+#include "global.h"
+#include "cmdtrie.h"
+
+static struct cmdtrie_node *cmdtrie_child(const struct cmdtrie_node *node, unsigned char c);
+static int cmdtrie_del_path(struct cmdtrie_node *node, const char *name);
+
+struct cmdtrie_node *cmdtrie_create()
+{
+	struct cmdtrie_node *root = malloc(sizeof(struct cmdtrie_node));
+	memset(root, 0, sizeof(struct cmdtrie_node));
+	return root;
+}
+
+void cmdtrie_free(struct cmdtrie_node *root)
+{
+	struct cmdtrie_node *child, *next;
+
+	for(child = root->children; child; child = next)
+	{
+		next = child->next;
+		cmdtrie_free(child);
+	}
+
+	free(root);
+}
+
+void cmdtrie_add(struct cmdtrie_node *root, const char *name, struct cmd_binding *binding)
+{
+	struct cmdtrie_node *node = root, **link, *child;
+
+	for(; *name; name++)
+	{
+		unsigned char c = tolower((unsigned char)*name);
+
+		for(link = &node->children; *link && (*link)->c < c; link = &(*link)->next)
+			;
+
+		if(!(child = *link) || child->c != c)
+		{
+			child = malloc(sizeof(struct cmdtrie_node));
+			memset(child, 0, sizeof(struct cmdtrie_node));
+			child->c = c;
+			child->next = *link;
+			*link = child;
+		}
+
+		node = child;
+	}
+
+	node->binding = binding;
+}
+
+void cmdtrie_del(struct cmdtrie_node *root, const char *name)
+{
+	cmdtrie_del_path(root, name);
+}
+
+struct cmdtrie_node *cmdtrie_walk(const struct cmdtrie_node *node, const char *str)
+{
+	for(; node && *str; str++)
+		node = cmdtrie_child(node, tolower((unsigned char)*str));
+
+	return (struct cmdtrie_node *)node;
+}
+
+unsigned int cmdtrie_iter(const struct cmdtrie_node *node, cmdtrie_iter_f *func, void *ctx)
+{
+	unsigned int count = 0;
+
+	for(const struct cmdtrie_node *child = node->children; child; child = child->next)
+	{
+		if(child->binding)
+		{
+			func(child->binding, ctx);
+			count++;
+		}
+
+		count += cmdtrie_iter(child, func, ctx);
+	}
+
+	return count;
+}
+
+static struct cmdtrie_node *cmdtrie_child(const struct cmdtrie_node *node, unsigned char c)
+{
+	struct cmdtrie_node *child;
+
+	for(child = node->children; child && child->c < c; child = child->next)
+		;
+
+	return (child && child->c == c) ? child : NULL;
+}
+
+// Returns non-zero if node became empty and can be removed by the caller
+static int cmdtrie_del_path(struct cmdtrie_node *node, const char *name)
+{
+	struct cmdtrie_node **link;
+
+	if(!*name)
+		node->binding = NULL;
+	else
+	{
+		unsigned char c = tolower((unsigned char)*name);
+
+		for(link = &node->children; *link && (*link)->c < c; link = &(*link)->next)
+			;
+
+		if(*link && (*link)->c == c && cmdtrie_del_path(*link, name + 1))
+		{
+			struct cmdtrie_node *child = *link;
+			*link = child->next;
+			free(child);
+		}
+	}
+
+	return !node->binding && !node->children;
+}
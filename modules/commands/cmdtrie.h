@@ -0,0 +1,26 @@
+#ifndef CMDTRIE_H
+#define CMDTRIE_H
+
+struct cmd_binding;
+
+// Case-insensitive trie over binding names; "gline add" is reached via "gline", " " and "add"
+struct cmdtrie_node
+{
+	unsigned char c;
+	struct cmdtrie_node *next; // sibling with the next larger character
+	struct cmdtrie_node *children;
+	struct cmd_binding *binding;
+};
+
+typedef void (cmdtrie_iter_f)(struct cmd_binding *binding, void *ctx);
+
+struct cmdtrie_node *cmdtrie_create();
+void cmdtrie_free(struct cmdtrie_node *root);
+void cmdtrie_add(struct cmdtrie_node *root, const char *name, struct cmd_binding *binding);
+void cmdtrie_del(struct cmdtrie_node *root, const char *name);
+// Continues a lookup at node; returns NULL if no binding name starts with the path walked so far
+struct cmdtrie_node *cmdtrie_walk(const struct cmdtrie_node *node, const char *str);
+// Calls func for all bindings below node (excluding node itself) in alphabetical order
+unsigned int cmdtrie_iter(const struct cmdtrie_node *node, cmdtrie_iter_f *func, void *ctx);
+
+#endif
@@ -3,20 +3,84 @@
 #include "modules/parser/parser.h"
 #include "group.h"
 #include "chanuser.h"
+#include "account.h"
+
+#define RULE_CACHE_SIZE	512 // must be a power of two
 
 DECLARE_LIST(command_rule_list, struct command_rule *)
 IMPLEMENT_LIST(command_rule_list, struct command_rule *)
 
+enum rule_opcode
+{
+	OP_CONST,	// acc = value
+	OP_CALL,	// acc = func(name, arg)
+	OP_NOT,		// acc = !acc
+	OP_JUMP_FALSE,	// left side of && is false -> skip the right side
+	OP_JUMP_TRUE	// left side of || is true -> skip the right side
+};
+
+struct rule_op
+{
+	enum rule_opcode	opcode;
+	pf_retval		value;
+	unsigned int		target;
+	parser_func_f		*func;
+	const char		*name;
+	const char		*arg;
+};
+
 struct command_rule
 {
 	unsigned int	idx;
 	char		*rule_str;
 	struct parser_token_list	*rule;
+
+	// Compiled from rule; names and arguments point into its tokens
+	struct rule_op	*ops;
+	unsigned int	op_count;
+	unsigned int	cacheable : 1;
+};
+
+struct rule_cache_entry
+{
+	unsigned int			rule_idx; // 0 if unused
+	unsigned int			generation;
+	const struct irc_user		*user;
+	const struct user_account	*account;
+	char				*channelname;
+	enum command_rule_result	result;
 };
 
 static struct parser *parser = NULL;
 static struct command_rule_list *rules;
 static unsigned int next_rule_idx = 1;
+static struct dict *cacheable_funcs;
+
+// Results of rules that only call cacheable functions, keyed on (rule, user, account, channel).
+// Every change of group memberships, auth state, channel users and their modes invalidates all entries.
+static struct
+{
+	unsigned int enabled;
+	unsigned int generation;
+	struct rule_cache_entry entries[RULE_CACHE_SIZE];
+} rule_cache;
+
+static unsigned int rule_prepare(struct command_rule *crule);
+static void rule_unprepare(struct command_rule *crule);
+static int rule_compile_seq(struct command_rule *crule, const struct parser_token_list *tokens, unsigned int *pos);
+static int rule_compile_operand(struct command_rule *crule, const struct parser_token_list *tokens, unsigned int *pos);
+static unsigned int rule_emit(struct command_rule *crule, enum rule_opcode opcode);
+static enum command_rule_result rule_run(const struct command_rule *crule, struct command_rule_context *ctx);
+static struct rule_cache_entry *rule_cache_slot(unsigned int rule_idx, const struct irc_user *user, const char *channelname);
+static void rule_cache_invalidate();
+static void rule_cache_clear();
+static void group_changed_hook(struct access_group *group);
+static void account_auth_hook(struct user_account *account, struct irc_user *user, unsigned int authed);
+static void account_del_hook(struct user_account *account);
+static void chanuser_changed_hook(struct irc_chanuser *chanuser);
+static void chanuser_del_hook(struct irc_chanuser *chanuser, unsigned int del_type, const char *reason);
+static void user_del_hook(struct irc_user *user, unsigned int quit, const char *reason);
+static void channel_del_hook(struct irc_channel *channel, const char *reason);
 
 PARSER_FUNC(group);
 PARSER_FUNC(inchannel);
@@ -30,12 +94,24 @@ void command_rule_init()
 {
 	rules = command_rule_list_create();
 	parser = parser_create();
-	REG_COMMAND_RULE("group", group);
-	REG_COMMAND_RULE("inchannel", inchannel);
-	REG_COMMAND_RULE("channel", channel);
-	REG_COMMAND_RULE("mask", mask);
-	REG_COMMAND_RULE("opped", opped);
-	REG_COMMAND_RULE("voiced", voiced);
+	cacheable_funcs = dict_create();
+	dict_set_free_funcs(cacheable_funcs, free, NULL);
+	memset(&rule_cache, 0, sizeof(rule_cache));
+
+	REG_COMMAND_RULE_CACHED("group", group);
+	REG_COMMAND_RULE_CACHED("inchannel", inchannel);
+	REG_COMMAND_RULE_CACHED("channel", channel);
+	REG_COMMAND_RULE("mask", mask); // nick changes do not invalidate the cache
+	REG_COMMAND_RULE_CACHED("opped", opped);
+	REG_COMMAND_RULE_CACHED("voiced", voiced);
+
+	reg_group_changed_hook(group_changed_hook);
+	reg_account_auth_hook(account_auth_hook);
+	reg_account_del_hook(account_del_hook);
+	reg_chanuser_changed_hook(chanuser_changed_hook);
+	reg_chanuser_del_hook(chanuser_del_hook);
+	reg_user_del_hook(user_del_hook);
+	reg_channel_del_hook(channel_del_hook);
 }
 
 void command_rule_fini()
@@ -46,6 +122,17 @@ void command_rule_fini()
 	command_rule_unreg("mask");
 	command_rule_unreg("opped");
 	command_rule_unreg("voiced");
+
+	unreg_group_changed_hook(group_changed_hook);
+	unreg_account_auth_hook(account_auth_hook);
+	unreg_account_del_hook(account_del_hook);
+	unreg_chanuser_changed_hook(chanuser_changed_hook);
+	unreg_chanuser_del_hook(chanuser_del_hook);
+	unreg_user_del_hook(user_del_hook);
+	unreg_channel_del_hook(channel_del_hook);
+
+	rule_cache_clear();
+	dict_free(cacheable_funcs);
 	parser_free(parser);
 	command_rule_list_free(rules);
 }
@@ -58,6 +145,19 @@ void command_rule_reg(const char *name, parser_func_f *func)
 	// Adding new rules is pretty safe since we try to compile uncompiled rules when needed.
 }
 
+void command_rule_reg_cached(const char *name, parser_func_f *func)
+{
+	command_rule_reg(name, func);
+	dict_insert(cacheable_funcs, strdup(name), func);
+}
+
+void command_rule_cache_enable(unsigned int enabled)
+{
+	if(rule_cache.enabled && !enabled)
+		rule_cache_clear();
+	rule_cache.enabled = enabled;
+}
+
 void command_rule_unreg(const char *name)
 {
 	// By default the parser module has no function list modifiable after parsing so we
@@ -67,13 +167,11 @@ void command_rule_unreg(const char *name)
 
 	debug("Deleting command rule function '%s'", name);
 	for(unsigned int i = 0; i < rules->count; i++)
-	{
-		if(rules->data[i]->rule)
-			parser_free_tokens(rules->data[i]->rule);
-		rules->data[i]->rule = NULL;
-	}
+		rule_unprepare(rules->data[i]);
 
 	dict_delete(parser->funcs, name);
+	dict_delete(cacheable_funcs, name);
+	rule_cache_invalidate();
 }
 
 unsigned int command_rule_validate(const char *rule)
@@ -96,9 +194,10 @@ unsigned int command_rule_compile(const char *rule)
 
 	assert_return(rule, 0);
 	crule = malloc(sizeof(struct command_rule));
+	memset(crule, 0, sizeof(struct command_rule));
 	crule->idx = next_rule_idx++;
 	crule->rule_str = strdup(rule);
-	crule->rule = parser_tokenize(parser, rule);
+	rule_prepare(crule);
 	command_rule_list_add(rules, crule);
 
 	return crule->idx;
@@ -122,7 +221,7 @@ unsigned int command_rule_executable(unsigned int rule_idx)
 	assert_return(crule = command_rule_get(rule_idx), 0);
 
 	// Rule is not compiled and compilation failed
-	if(!crule->rule && !(crule->rule = parser_tokenize(parser, crule->rule_str)))
+	if(!rule_prepare(crule))
 	{
 		log_append(LOG_WARNING, "Rule '%s' is not executable: compilation failed.", crule->rule_str);
 		return 0;
@@ -135,30 +234,44 @@ enum command_rule_result command_rule_exec(unsigned int rule_idx, const struct i
 {
 	struct command_rule_context ctx;
 	struct command_rule *crule;
-	int res;
+	struct rule_cache_entry *entry = NULL;
+	enum command_rule_result res;
 
 	assert_return(crule = command_rule_get(rule_idx), CR_ERROR);
 
 	// Rule is not compiled and compilation failed
-	if(!crule->rule && !(crule->rule = parser_tokenize(parser, crule->rule_str)))
+	if(!rule_prepare(crule))
 	{
 		log_append(LOG_WARNING, "Could not execute rule '%s'; compilation failed.", crule->rule_str);
 		return CR_ERROR;
 	}
 
+	if(rule_cache.enabled && crule->cacheable)
+	{
+		entry = rule_cache_slot(rule_idx, user, channelname);
+		if(entry->rule_idx == rule_idx && entry->generation == rule_cache.generation)
+			return entry->result;
+	}
+
 	ctx.src     = src;
 	ctx.user    = user;
 	ctx.channel = channel;
 	ctx.channelname = channelname;
 
-	res = parser_execute(parser, crule->rule, &ctx);
+	res = rule_run(crule, &ctx);
 
-	if(res == 1)
-		return CR_ALLOW;
-	else if(res == 0)
-		return CR_DENY;
-	else
-		return CR_ERROR;
+	if(entry && res != CR_ERROR)
+	{
+		MyFree(entry->channelname);
+		entry->rule_idx = rule_idx;
+		entry->generation = rule_cache.generation;
+		entry->user = user;
+		entry->account = user ? user->account : NULL;
+		entry->channelname = channelname ? strdup(channelname) : NULL;
+		entry->result = res;
+	}
+
+	return res;
 }
 
 void command_rule_free(unsigned int rule_idx)
@@ -169,9 +282,248 @@ void command_rule_free(unsigned int rule_idx)
 
 	command_rule_list_del(rules, crule);
 	free(crule->rule_str);
+	rule_unprepare(crule);
+	free(crule);
+	// Rule indexes are never reused, so cached results of this rule can not be hit again
+}
+
+// Tokenizes and compiles the rule unless that was done already; returns 0 on failure
+static unsigned int rule_prepare(struct command_rule *crule)
+{
+	unsigned int pos = 0;
+
+	if(crule->ops)
+		return 1;
+
+	if(!crule->rule && !(crule->rule = parser_tokenize(parser, crule->rule_str)))
+		return 0;
+
+	// Every token results in at most one operation
+	crule->ops = malloc((crule->rule->count + 1) * sizeof(struct rule_op));
+	crule->op_count = 0;
+	crule->cacheable = 1;
+
+	if(!crule->rule->count || rule_compile_seq(crule, crule->rule, &pos) || pos != crule->rule->count)
+	{
+		log_append(LOG_WARNING, "Could not compile rule '%s'", crule->rule_str);
+		rule_unprepare(crule);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void rule_unprepare(struct command_rule *crule)
+{
 	if(crule->rule)
 		parser_free_tokens(crule->rule);
-	free(crule);
+	MyFree(crule->ops);
+	crule->rule = NULL;
+	crule->op_count = 0;
+}
+
+// Operands are evaluated from left to right without precedence, like parser_execute() does:
+// "a || b && c" is "(a || b) && c". A jump skips the right operand if the left one decides the result.
+static int rule_compile_seq(struct command_rule *crule, const struct parser_token_list *tokens, unsigned int *pos)
+{
+	unsigned int jump;
+
+	if(rule_compile_operand(crule, tokens, pos))
+		return -1;
+
+	while(*pos < tokens->count && tokens->data[*pos]->type != T_CLOSE_PAREN)
+	{
+		enum token_type type = tokens->data[(*pos)++]->type;
+
+		if(type != T_AND && type != T_OR)
+			return -1;
+
+		jump = rule_emit(crule, (type == T_AND) ? OP_JUMP_FALSE : OP_JUMP_TRUE);
+		if(rule_compile_operand(crule, tokens, pos))
+			return -1;
+		crule->ops[jump].target = crule->op_count;
+	}
+
+	return 0;
+}
+
+static int rule_compile_operand(struct command_rule *crule, const struct parser_token_list *tokens, unsigned int *pos)
+{
+	struct parser_token *token;
+	struct parser_func_token *ftok;
+	unsigned int neg = 0, op;
+
+	while(*pos < tokens->count && tokens->data[*pos]->type == T_NOT)
+	{
+		neg = !neg;
+		(*pos)++;
+	}
+
+	if(*pos >= tokens->count)
+		return -1;
+
+	token = tokens->data[(*pos)++];
+	switch(token->type)
+	{
+		case T_TRUE:
+		case T_FALSE:
+			op = rule_emit(crule, OP_CONST);
+			crule->ops[op].value = (token->type == T_TRUE) ? RET_TRUE : RET_FALSE;
+			break;
+
+		case T_FUNC:
+			// The function was already looked up by the tokenizer
+			ftok = token->data;
+			op = rule_emit(crule, OP_CALL);
+			crule->ops[op].func = ftok->func;
+			crule->ops[op].name = ftok->name;
+			crule->ops[op].arg = ftok->arg->len ? ftok->arg->string : NULL;
+			if(dict_find(cacheable_funcs, ftok->name) != ftok->func)
+				crule->cacheable = 0;
+			break;
+
+		case T_OPEN_PAREN:
+			if(rule_compile_seq(crule, tokens, pos))
+				return -1;
+			if(*pos >= tokens->count || tokens->data[*pos]->type != T_CLOSE_PAREN)
+				return -1;
+			(*pos)++;
+			break;
+
+		default:
+			return -1;
+	}
+
+	if(neg)
+		rule_emit(crule, OP_NOT);
+
+	return 0;
+}
+
+static unsigned int rule_emit(struct command_rule *crule, enum rule_opcode opcode)
+{
+	struct rule_op *op = &crule->ops[crule->op_count];
+
+	memset(op, 0, sizeof(struct rule_op));
+	op->opcode = opcode;
+	return crule->op_count++;
+}
+
+static enum command_rule_result rule_run(const struct command_rule *crule, struct command_rule_context *ctx)
+{
+	pf_retval acc = RET_NONE;
+	unsigned int pc = 0;
+
+	while(pc < crule->op_count)
+	{
+		const struct rule_op *op = &crule->ops[pc++];
+
+		switch(op->opcode)
+		{
+			case OP_CONST:
+				acc = op->value;
+				break;
+
+			case OP_CALL:
+				acc = op->func(ctx, op->name, op->arg);
+				if(acc != RET_TRUE && acc != RET_FALSE)
+				{
+					log_append(LOG_WARNING, "Rule function %s(%s) failed in rule '%s'", op->name, (op->arg ? op->arg : ""), crule->rule_str);
+					return CR_ERROR;
+				}
+				break;
+
+			case OP_NOT:
+				acc = (acc == RET_TRUE) ? RET_FALSE : RET_TRUE;
+				break;
+
+			case OP_JUMP_FALSE:
+				if(acc == RET_FALSE)
+					pc = op->target;
+				break;
+
+			case OP_JUMP_TRUE:
+				if(acc == RET_TRUE)
+					pc = op->target;
+				break;
+		}
+	}
+
+	if(acc == RET_TRUE)
+		return CR_ALLOW;
+	else if(acc == RET_FALSE)
+		return CR_DENY;
+	else
+		return CR_ERROR;
+}
+
+static struct rule_cache_entry *rule_cache_slot(unsigned int rule_idx, const struct irc_user *user, const char *channelname)
+{
+	struct rule_cache_entry *entry;
+	const struct user_account *account = user ? user->account : NULL;
+	uint32_t hash = rule_idx * 2654435761u;
+
+	hash ^= (uint32_t)((uintptr_t)user >> 4) * 40503u;
+	hash ^= (uint32_t)((uintptr_t)account >> 4);
+	for(const char *c = channelname; c && *c; c++)
+		hash = hash * 31 + tolower((unsigned char)*c);
+
+	entry = &rule_cache.entries[hash & (RULE_CACHE_SIZE - 1)];
+
+	// A different key in the slot is treated like an outdated entry and replaced by the caller
+	if(entry->rule_idx != rule_idx || entry->user != user || entry->account != account ||
+	   (entry->channelname ? (!channelname || strcasecmp(entry->channelname, channelname)) : channelname != NULL))
+		entry->generation = rule_cache.generation - 1;
+
+	return entry;
+}
+
+static void rule_cache_invalidate()
+{
+	rule_cache.generation++;
+}
+
+static void rule_cache_clear()
+{
+	for(unsigned int i = 0; i < RULE_CACHE_SIZE; i++)
+		MyFree(rule_cache.entries[i].channelname);
+	memset(rule_cache.entries, 0, sizeof(rule_cache.entries));
+	rule_cache_invalidate();
+}
+
+static void group_changed_hook(struct access_group *group)
+{
+	rule_cache_invalidate();
+}
+
+static void account_auth_hook(struct user_account *account, struct irc_user *user, unsigned int authed)
+{
+	rule_cache_invalidate();
+}
+
+static void account_del_hook(struct user_account *account)
+{
+	rule_cache_invalidate();
+}
+
+static void chanuser_changed_hook(struct irc_chanuser *chanuser)
+{
+	rule_cache_invalidate();
+}
+
+static void chanuser_del_hook(struct irc_chanuser *chanuser, unsigned int del_type, const char *reason)
+{
+	rule_cache_invalidate();
+}
+
+static void user_del_hook(struct irc_user *user, unsigned int quit, const char *reason)
+{
+	rule_cache_invalidate();
+}
+
+static void channel_del_hook(struct irc_channel *channel, const char *reason)
+{
+	rule_cache_invalidate();
 }
 
 PARSER_FUNC(group)
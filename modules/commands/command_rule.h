@@ -6,6 +6,9 @@
 typedef struct parser_token_list command_rule;
 
 #define REG_COMMAND_RULE(NAME, FUNC)	command_rule_reg(NAME, __parser_func_ ## FUNC)
+// For functions whose result only depends on the account, its groups, the channel name and the
+// users and modes of channels; results of rules only calling such functions can be cached.
+#define REG_COMMAND_RULE_CACHED(NAME, FUNC)	command_rule_reg_cached(NAME, __parser_func_ ## FUNC)
 
 enum command_rule_result
 {
@@ -25,6 +28,8 @@ struct command_rule_context
 void command_rule_init();
 void command_rule_fini();
 void command_rule_reg(const char *name, parser_func_f *func);
+void command_rule_reg_cached(const char *name, parser_func_f *func);
+void command_rule_cache_enable(unsigned int enabled);
 void command_rule_unreg(const char *name);
 unsigned int command_rule_validate(const char *rule);
 unsigned int command_rule_compile(const char *rule);
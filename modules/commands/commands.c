@@ -2,6 +2,7 @@
 #include "module.h"
 #include "command_rule.h"
 #include "commands.h"
+#include "cmdtrie.h"
 #include "group.h"
 #include "database.h"
 #include "stringbuffer.h"
@@ -13,6 +14,30 @@
 
 MODULE_DEPENDS("parser",  NULL);
 
+enum alias_part_type
+{
+	AP_TEXT,
+	AP_NICK,
+	AP_IDENT,
+	AP_HOST,
+	AP_ARGS
+};
+
+struct alias_part
+{
+	enum alias_part_type type;
+	unsigned int lbound, ubound; // AP_ARGS; ubound is UINT_MAX for $N-*
+	const char *text; // AP_TEXT, unescaped and not null-terminated
+	size_t len;
+};
+
+struct alias_template
+{
+	unsigned int count;
+	struct alias_part *parts;
+	char *text;
+};
+
 static struct
 {
 	unsigned int stealth;
@@ -22,6 +47,7 @@ static struct
 extern struct surgebot_conf bot_conf;
 static struct dict *command_list;
 static struct dict *binding_list;
+static struct cmdtrie_node *binding_trie;
 static struct database *command_db;
 
 IRC_HANDLER(privmsg);
@@ -30,8 +56,12 @@ static void command_db_read(struct database *db);
 static int command_db_write(struct database *db);
 static void handle_command(struct irc_source *src, struct irc_user *user, struct irc_channel *channel, const char *msg);
 static int binding_expand_alias(struct cmd_binding *binding, struct irc_source *src, unsigned int argc, char **argv, char **exp_argv);
+static struct alias_template *alias_compile(const char *name, const char *alias);
+static void alias_append(char *buf, size_t *used, size_t size, const char *str, size_t len);
+static void alias_free(struct alias_template *tmpl);
+static struct cmd_binding *binding_active(struct cmd_binding *binding);
 static int binding_check_access(struct irc_source *src, struct irc_user *user, struct irc_channel *channel, char *channelname, struct cmd_binding *binding, unsigned int quiet);
-static int show_subcmds(struct irc_source *src, struct irc_user *user, const char *prefix, int check_access);
+static int show_subcmds(struct irc_source *src, struct irc_user *user, const struct cmdtrie_node *node, const char *prefix, int check_access);
 static char *make_cmd_key(struct module *module, const char *cmd);
 static void module_loaded(struct module *module);
 static void module_unloaded(struct module *module);
@@ -41,6 +71,7 @@ MODULE_INIT
 {
 	command_list = dict_create();
 	binding_list = dict_create();
+	binding_trie = cmdtrie_create();
 	dict_set_free_funcs(command_list, free, NULL);
 
 	command_rule_init();
@@ -70,6 +101,7 @@ MODULE_FINI
 	command_rule_fini();
 	dict_free(command_list);
 	dict_free(binding_list);
+	cmdtrie_free(binding_trie);
 }
 
 
@@ -77,6 +109,7 @@ static void command_conf_reload()
 {
 	const char *str;
 	command_conf.stealth = conf_bool("commands/stealth");
+	command_rule_cache_enable(conf_bool("commands/rule_cache"));
 
 	str = conf_get("commands/log_channel", DB_STRING);
 	command_conf.log_channel = str && *str ? str : NULL;
@@ -153,15 +186,16 @@ IRC_HANDLER(privmsg)
 static void handle_command(struct irc_source *src, struct irc_user *user, struct irc_channel *channel, const char *msg)
 {
 	int is_privmsg = (channel == NULL);
-	char *orig_argv[MAXARG], *exp_argv[MAXARG], **argv, *msg_dup, *arg_string, *channel_arg = NULL;
+	char msg_buf[MAXLEN], *orig_argv[MAXARG], *exp_argv[MAXARG], **argv, *arg_string, *channel_arg = NULL;
 	unsigned int argc, count;
 	int ret;
-	struct stringbuffer *name, *log_entry;
+	struct stringbuffer *log_entry;
 	struct cmd_binding *binding = NULL, *fallback = NULL;
+	struct cmdtrie_node *node, *sub_node = NULL;
 	struct command *cmd;
 
-	msg_dup = strdup(msg);
-	argc = tokenize(msg_dup, orig_argv, MAXARG, ' ', 0);
+	safestrncpy(msg_buf, msg, sizeof(msg_buf));
+	argc = tokenize(msg_buf, orig_argv, MAXARG, ' ', 0);
 	argv = orig_argv;
 
 	if(argc && IsChannelName(argv[0]))
@@ -175,43 +209,36 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 	{
 		if(!command_conf.stealth || (user && user->account))
 			reply("Command missing.");
-		free(msg_dup);
 		return;
 	}
 
-	fallback = binding_find_active(argv[0]);
-
-	// more arguments -> check if we have a two-part command (like "gline add")
-	if(argc > 1)
+	// A single walk finds argv[0], the two-part commands starting with it (like "gline add") and argv[0] argv[1]
+	if((node = cmdtrie_walk(binding_trie, argv[0])))
 	{
-		name = stringbuffer_create();
-		stringbuffer_append_string(name, argv[0]);
-		stringbuffer_append_char(name, ' ');
-		stringbuffer_append_string(name, argv[1]);
-
-		if((binding = binding_find_active(name->string)))
-		{
-			debug("Found binding: %s", binding->name);
+		fallback = binding_active(node->binding);
+		sub_node = cmdtrie_walk(node, " ");
+	}
 
-			// argv[0] should always be the command, so merge argv[0] and argv[1] and remove argv[1]
-			argv[0][strlen(argv[0])] = ' ';
-			argv[1] = argv[0];
-			argv++;
-			argc--;
-		}
+	// more arguments -> check if we have a two-part command
+	if(argc > 1 && sub_node && (node = cmdtrie_walk(sub_node, argv[1])) && (binding = binding_active(node->binding)))
+	{
+		debug("Found binding: %s", binding->name);
 
-		stringbuffer_free(name);
+		// argv[0] should always be the command, so merge argv[0] and argv[1] and remove argv[1]
+		argv[0][strlen(argv[0])] = ' ';
+		argv[1] = argv[0];
+		argv++;
+		argc--;
 	}
 
-	// no command and no fallback -> search for other commands starting with argv[0] and display them
+	// no command and no fallback -> display the commands starting with argv[0]
 	if(binding == NULL && fallback == NULL)
 	{
-		count = show_subcmds(src, user, argv[0], 1);
+		count = sub_node ? show_subcmds(src, user, sub_node, argv[0], 1) : 0;
 
 		if(!count && is_privmsg && (!command_conf.stealth || (user && user->account)))
 			reply("$b%s$b is an unknown command.", argv[0]);
 
-		free(msg_dup);
 		return;
 	}
 	else if(binding == NULL && fallback)
@@ -226,7 +253,6 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 	{
 		if(!command_conf.stealth || (user && user->account))
 			reply("$b%s$b can only be used via $b/msg $N %s$b", binding->name, binding->name);
-		free(msg_dup);
 		return;
 	}
 
@@ -234,7 +260,6 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 	{
 		if(!command_conf.stealth || (user && user->account))
 			reply("You cannot put a channel name before $b%s$b.", binding->name);
-		free(msg_dup);
 		return;
 	}
 
@@ -255,7 +280,6 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 		{
 			if(!command_conf.stealth || (user && user->account))
 				reply("You must provide a channel name that exists and is known to the bot.");
-			free(msg_dup);
 			return;
 		}
 	}
@@ -267,7 +291,6 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 		{
 			if(!command_conf.stealth || (user && user->account))
 				reply("Alias for $b%s$b could not be expanded; check log file for details.", binding->name);
-			free(msg_dup);
 			return;
 		}
 
@@ -280,7 +303,6 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 			{
 				if(!command_conf.stealth || (user && user->account))
 					reply("You must provide a channel name that exists and is known to the bot.");
-				free(msg_dup);
 				return;
 			}
 
@@ -293,7 +315,6 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 	if((cmd->flags & CMD_REQUIRE_CHANNEL) && !channel)
 	{
 		reply("This command can only be used in channels.");
-		free(msg_dup);
 		return;
 	}
 
@@ -303,7 +324,6 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 	if(!binding_check_access(src, user, channel, channel_arg, binding, 0))
 	{
 		// Replies are done by binding_check_access() if the user lacks access
-		free(msg_dup);
 		return;
 	}
 
@@ -312,7 +332,6 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 	{
 		if(!command_conf.stealth || (user && user->account))
 			reply("$b%s$b requires more arguments.", binding->name);
-		free(msg_dup);
 		return;
 	}
 
@@ -383,128 +402,187 @@ static void handle_command(struct irc_source *src, struct irc_user *user, struct
 	{
 		log_append(LOG_WARNING, "Command %s.%s returned unknown value %d", cmd->module->name, cmd->name, ret);
 	}
-
-	free(msg_dup);
 }
 
 static int binding_expand_alias(struct cmd_binding *binding, struct irc_source *src, unsigned int argc, char **argv, char **exp_argv)
 {
-	char *alias = binding->alias;
+	struct alias_template *tmpl = binding->alias_tmpl;
 	static char buf[MAXLEN];
-	unsigned int buf_used = 0, buf_size = sizeof(buf);
-	unsigned int lbound, ubound, lnumlen, unumlen;
-	char *num_end = NULL, *num_end_2 = NULL;
+	size_t buf_used = 0, buf_size, cmd_len;
+
+	if(!tmpl)
+	{
+		log_append(LOG_WARNING, "Invalid alias for %s: %s", binding->name, binding->alias);
+		return 0;
+	}
 
-	memset(buf, 0, sizeof(buf));
-	buf_size -= strlen(argv[0]) + 1; // space for the command so total argv len does not exceed MAXLEN
+	// space for the command so total argv len does not exceed MAXLEN
+	cmd_len = strlen(argv[0]) + 1;
+	buf_size = cmd_len < sizeof(buf) ? sizeof(buf) - cmd_len : 1;
 
-	while(*alias && buf_used < buf_size)
+	for(unsigned int i = 0; i < tmpl->count; i++)
 	{
-		if(*alias == '\\') // something escaped
-		{
-			alias++;
-			if(*alias == '\0')
-			{
-				log_append(LOG_WARNING, "Unexpected \\ at the end of alias for %s: %s", binding->name, binding->alias);
-				return 0;
-			}
+		struct alias_part *part = &tmpl->parts[i];
 
-			buf[buf_used++] = *alias++;
-		}
-		else if(*alias != '$') // regular char
+		switch(part->type)
 		{
-			buf[buf_used++] = *alias++;
+			case AP_TEXT:
+				alias_append(buf, &buf_used, buf_size, part->text, part->len);
+				break;
+			case AP_NICK:
+				alias_append(buf, &buf_used, buf_size, src->nick, strlen(src->nick));
+				break;
+			case AP_IDENT:
+				alias_append(buf, &buf_used, buf_size, src->ident, strlen(src->ident));
+				break;
+			case AP_HOST:
+				alias_append(buf, &buf_used, buf_size, src->host, strlen(src->host));
+				break;
+			case AP_ARGS:
+				if(part->lbound >= argc)
+					break;
+
+				for(unsigned int j = part->lbound, ubound = min(part->ubound, argc - 1); j <= ubound; j++)
+				{
+					alias_append(buf, &buf_used, buf_size, argv[j], strlen(argv[j]));
+					if(j < ubound)
+						alias_append(buf, &buf_used, buf_size, " ", 1);
+				}
+				break;
 		}
-		else // *alias == '$' -> alias replacement
-		{
-			alias++;
+	}
 
-			if(*alias == '\0')
-			{
-				log_append(LOG_WARNING, "Unexpected $ at the end of alias for %s: %s", binding->name, binding->alias);
-				return 0;
-			}
-			else if(!strncasecmp(alias, "nick", 4))
-			{
-				safestrncpy(buf+buf_used, src->nick, buf_size-buf_used);
-				buf_used += strlen(src->nick);
-				alias += 4;
-			}
-			else if(!strncasecmp(alias, "ident", 5))
+	buf[buf_used] = '\0';
+	debug("Alias:       \"%s\"", binding->alias);
+	debug("expanded to: \"%s\"", buf);
+	exp_argv[0] = argv[0];
+	return tokenize(buf, exp_argv+1, MAXARG-1, ' ', 0) + 1;
+}
+
+// Parses an alias once when the binding is created; returns NULL if it is invalid
+static struct alias_template *alias_compile(const char *name, const char *alias)
+{
+	struct alias_template *tmpl;
+	struct alias_part *part, *text_part = NULL;
+	const char *pos = alias;
+	char *num_end;
+	size_t text_len = 0;
+
+	// Every part consumes at least one character of the alias
+	tmpl = malloc(sizeof(struct alias_template));
+	tmpl->count = 0;
+	tmpl->parts = malloc(strlen(alias) * sizeof(struct alias_part));
+	tmpl->text = malloc(strlen(alias));
+
+	while(*pos)
+	{
+		if(*pos != '$') // regular or escaped char
+		{
+			if(*pos == '\\' && *++pos == '\0')
 			{
-				safestrncpy(buf+buf_used, src->ident, buf_size-buf_used);
-				buf_used += strlen(src->ident);
-				alias += 5;
+				log_append(LOG_WARNING, "Unexpected \\ at the end of alias for %s: %s", name, alias);
+				alias_free(tmpl);
+				return NULL;
 			}
-			else if(!strncasecmp(alias, "host", 4))
+
+			if(!text_part)
 			{
-				safestrncpy(buf+buf_used, src->host, buf_size-buf_used);
-				buf_used += strlen(src->host);
-				alias += 4;
+				text_part = &tmpl->parts[tmpl->count++];
+				text_part->type = AP_TEXT;
+				text_part->text = tmpl->text + text_len;
+				text_part->len = 0;
 			}
-			else if(ct_isdigit(*alias))
+
+			tmpl->text[text_len++] = *pos++;
+			text_part->len++;
+			continue;
+		}
+
+		// *pos == '$' -> alias replacement
+		text_part = NULL;
+		part = &tmpl->parts[tmpl->count++];
+		pos++;
+
+		if(*pos == '\0')
+		{
+			log_append(LOG_WARNING, "Unexpected $ at the end of alias for %s: %s", name, alias);
+			alias_free(tmpl);
+			return NULL;
+		}
+		else if(!strncasecmp(pos, "nick", 4))
+		{
+			part->type = AP_NICK;
+			pos += 4;
+		}
+		else if(!strncasecmp(pos, "ident", 5))
+		{
+			part->type = AP_IDENT;
+			pos += 5;
+		}
+		else if(!strncasecmp(pos, "host", 4))
+		{
+			part->type = AP_HOST;
+			pos += 4;
+		}
+		else if(ct_isdigit(*pos))
+		{
+			part->type = AP_ARGS;
+			part->lbound = strtoul(pos, &num_end, 10);
+			if(*num_end == '-') // possibly multiple arguments
 			{
-				lbound = strtoul(alias, &num_end, 10);
-				if(*num_end == '-') // possibly multiple arguments
+				num_end++;
+				if(ct_isdigit(*num_end)) // end arg
+					part->ubound = strtoul(num_end, &num_end, 10);
+				else if(*num_end == '*') // as many args as possible
 				{
-					lnumlen = num_end - alias;
-
+					part->ubound = UINT_MAX;
 					num_end++;
-					if(ct_isdigit(*num_end)) // end arg
-					{
-						ubound = strtoul(num_end, &num_end_2, 10);
-						unumlen = num_end_2 - num_end;
-					}
-					else if(*num_end == '*') // as many args as possible
-					{
-						ubound = argc - 1;
-						unumlen = 1;
-					}
-					else if(*num_end == '\0') // end of alias and ubound missing
-					{
-						log_append(LOG_WARNING, "Invalid alias argument '$%d-' in alias for %s: %s", lbound, binding->name, binding->alias);
-						return 0;
-					}
-					else // ubound missing
-					{
-						log_append(LOG_WARNING, "Invalid alias argument '$%d-%c' in alias for %s: %s", lbound, *num_end, binding->name, binding->alias);
-						return 0;
-					}
-
-					alias += lnumlen + 1 + unumlen;
 				}
-				else // only a single argument
+				else if(*num_end == '\0') // end of alias and ubound missing
 				{
-					ubound = lbound;
-					alias = num_end;
+					log_append(LOG_WARNING, "Invalid alias argument '$%d-' in alias for %s: %s", part->lbound, name, alias);
+					alias_free(tmpl);
+					return NULL;
 				}
-
-				if(lbound < argc)
+				else // ubound missing
 				{
-					if(ubound >= argc)
-						ubound = argc - 1;
-
-					for(unsigned int i = lbound; i <= ubound; i++)
-					{
-						safestrncpy(buf+buf_used, argv[i], buf_size-buf_used);
-						buf_used += strlen(argv[i]);
-						if(buf_used < buf_size && i < ubound)
-							buf[buf_used++] = ' ';
-					}
+					log_append(LOG_WARNING, "Invalid alias argument '$%d-%c' in alias for %s: %s", part->lbound, *num_end, name, alias);
+					alias_free(tmpl);
+					return NULL;
 				}
 			}
-			else
-			{
-				log_append(LOG_WARNING, "Invalid alias argument '$%c' in alias for %s: %s", *alias, binding->name, binding->alias);
-				return 0;
-			}
+			else // only a single argument
+				part->ubound = part->lbound;
+
+			pos = num_end;
+		}
+		else
+		{
+			log_append(LOG_WARNING, "Invalid alias argument '$%c' in alias for %s: %s", *pos, name, alias);
+			alias_free(tmpl);
+			return NULL;
 		}
 	}
 
-	debug("Alias:       \"%s\"", binding->alias);
-	debug("expanded to: \"%s\"", buf);
-	exp_argv[0] = argv[0];
-	return tokenize(buf, exp_argv+1, MAXARG-1, ' ', 0) + 1;
+	return tmpl;
+}
+
+// Appends as much of str as fits into buf while leaving room for the terminating null byte
+static void alias_append(char *buf, size_t *used, size_t size, const char *str, size_t len)
+{
+	if(*used + 1 >= size)
+		return;
+
+	len = min(len, size - 1 - *used);
+	memcpy(buf + *used, str, len);
+	*used += len;
+}
+
+static void alias_free(struct alias_template *tmpl)
+{
+	free(tmpl->parts);
+	free(tmpl->text);
+	free(tmpl);
 }
 
 static int binding_check_access(struct irc_source *src, struct irc_user *user, struct irc_channel *channel, char *channelname, struct cmd_binding *binding, unsigned int quiet)
@@ -588,33 +666,43 @@ static int binding_check_access(struct irc_source *src, struct irc_user *user, s
 	return 1;
 }
 
-static int show_subcmds(struct irc_source *src, struct irc_user *user, const char *prefix, int check_access)
+struct subcmd_ctx
 {
-	struct stringlist *completions = stringlist_create();
-	int count;
+	struct irc_source *src;
+	struct irc_user *user;
+	int check_access;
+	struct stringlist *completions;
+};
 
-	dict_iter(node, binding_list)
-	{
-		struct cmd_binding *binding = node->data;
-		if(binding->module == NULL || binding->cmd == NULL)
-			continue;
+static void subcmd_add(struct cmd_binding *binding, void *ctx_ptr)
+{
+	struct subcmd_ctx *ctx = ctx_ptr;
+	struct irc_source *src = ctx->src;
 
-		if(!strncasecmp(binding->name, prefix, strlen(prefix)) && binding->name[strlen(prefix)] == ' ')
-		{
-			if(!check_access || binding_check_access(src, user, NULL, NULL, binding, 1))
-				stringlist_add(completions, strdup(binding->name));
-		}
-	}
+	if(!binding_active(binding))
+		return;
+
+	if(!ctx->check_access || binding_check_access(src, ctx->user, NULL, NULL, binding, 1))
+		stringlist_add(ctx->completions, strdup(binding->name));
+}
 
-	if(completions->count && (!command_conf.stealth || (user && user->account)))
+// node is the trie node of "<prefix> "
+static int show_subcmds(struct irc_source *src, struct irc_user *user, const struct cmdtrie_node *node, const char *prefix, int check_access)
+{
+	struct subcmd_ctx ctx = { src, user, check_access, stringlist_create() };
+	int count;
+
+	cmdtrie_iter(node, subcmd_add, &ctx);
+
+	if(ctx.completions->count && (!command_conf.stealth || (user && user->account)))
 	{
 		reply("Possible sub-commands of $b%s$b are:", prefix);
-		for(unsigned int i = 0; i < completions->count; i++)
-			reply("  %s", completions->data[i]);
+		for(unsigned int i = 0; i < ctx.completions->count; i++)
+			reply("  %s", ctx.completions->data[i]);
 	}
 
-	count = completions->count;
-	stringlist_free(completions);
+	count = ctx.completions->count;
+	stringlist_free(ctx.completions);
 	return count;
 }
 
@@ -792,6 +880,7 @@ struct cmd_binding *binding_add(const char *name, const char *module_name, const
 	binding->cmd_name = strdup(cmd_name);
 	binding->cmd = command_find(binding->module, cmd_name);
 	binding->alias = (alias && strlen(alias)) ? strdup(alias) : NULL;
+	binding->alias_tmpl = binding->alias ? alias_compile(binding->name, binding->alias) : NULL;
 
 	if(rule)
 	{
@@ -812,18 +901,23 @@ struct cmd_binding *binding_add(const char *name, const char *module_name, const
 	}
 
 	dict_insert(binding_list, binding->name, binding);
+	cmdtrie_add(binding_trie, binding->name, binding);
 	return binding;
 }
 
 struct cmd_binding *binding_find(const char *name)
 {
-	return dict_find(binding_list, name);
+	struct cmdtrie_node *node = cmdtrie_walk(binding_trie, name);
+	return node ? node->binding : NULL;
 }
 
 struct cmd_binding *binding_find_active(const char *name)
 {
-	struct cmd_binding *binding = dict_find(binding_list, name);
+	return binding_active(binding_find(name));
+}
 
+static struct cmd_binding *binding_active(struct cmd_binding *binding)
+{
 	if(binding == NULL || binding->module == NULL || binding->cmd == NULL)
 		return NULL;
 
@@ -868,6 +962,7 @@ int binding_set_rule(struct cmd_binding *binding, const char *rule)
 void binding_del(struct cmd_binding *binding)
 {
 	dict_delete(binding_list, binding->name);
+	cmdtrie_del(binding_trie, binding->name);
 	if(binding->cmd)
 	{
 		binding->cmd->bind_count--;
@@ -878,6 +973,8 @@ void binding_del(struct cmd_binding *binding)
 	free(binding->cmd_name);
 	if(binding->alias)
 		free(binding->alias);
+	if(binding->alias_tmpl)
+		alias_free(binding->alias_tmpl);
 	if(binding->rule)
 		free(binding->rule);
 	if(binding->comp_rule)
@@ -18,6 +18,8 @@ typedef int (command_f)(struct irc_source *src, struct irc_user *user, struct ir
 #define CMD_REQUIRE_CHANNEL     0x080 // require an existing channel
 #define CMD_IGNORE_LOGINMASK	0x100
 
+struct alias_template;
+
 struct command
 {
 	char		*name;
@@ -45,6 +47,7 @@ struct cmd_binding
 	struct command	*cmd;
 
 	char		*alias;
+	struct alias_template *alias_tmpl; // NULL if the alias is invalid
 
 	char		*rule;
 	unsigned int	comp_rule;
@@ -4,10 +4,11 @@
 #include "conf.h"
 #include "timer.h"
 #include "stringbuffer.h"
+#include "ptrlist.h"
 #include "db.h"
-#include <postgresql/libpq-fe.h>
+#include "modules/pgsql/pgsql.h"
 
-MODULE_DEPENDS(NULL);
+MODULE_DEPENDS("pgsql", NULL);
 
 IMPLEMENT_SLIST(db_nv_list, struct db_named_value)
 
@@ -24,35 +25,112 @@ enum {
 	ORDER_DESC
 };
 
+// An async select waiting for its result
 struct pgsql_async
 {
 	struct db_table *table;
-	PGconn *conn;
-	struct sock *sock;
-	struct pgsql_async *next;
-	enum {
-		PGSQL_ASYNC_CONNECTING,
-		PGSQL_ASYNC_QUERY,
-		PGSQL_ASYNC_BUSY,
-		PGSQL_ASYNC_ABORTING,
-		PGSQL_ASYNC_IDLE,
-		PGSQL_ASYNC_DEAD
-	} state;
-	db_select_cb *cb;
+	db_select_cb *cb; // NULL once the module is unloaded
 	void *ctx;
 	db_free_ctx_f *free_ctx_func;
 	struct db_nv_list *values;
-	struct db_nv_list *filter;
-	struct db_nv_list *order;
 };
 
 
+enum db_stmt_op
+{
+	DB_STMT_INSERT,
+	DB_STMT_UPDATE,
+	DB_STMT_DELETE,
+	DB_STMT_SELECT
+};
+
+// A statement for one query shape (table, operation, columns, filter, order)
+struct db_stmt
+{
+	char *key;
+	char *sql;
+	char name[32];
+	unsigned int generation; // connection it was prepared on; 0 if never prepared
+};
+
+// Binary query parameters
+struct db_params
+{
+	unsigned int count;
+	unsigned int size;
+	Oid *types;
+	char **values;
+	int *lengths;
+	int *formats;
+};
+
+// A set of rows collected by db_batch_add() and written with a single statement
+struct db_batch
+{
+	struct db_table *table;
+	struct db_nv_list *columns;
+	struct db_nv_list *conflict; // set by db_batch_upsert()
+	struct dict *keys; // conflict key -> row number + 1 of the rows collected so far
+	db_batch_cb *cb;
+	void *ctx;
+	unsigned int rows;
+	struct stringbuffer *data; // COPY rows in text format
+	struct db_params *params; // multi-row INSERT parameters
+};
+
+// The rows of a batch at the time it was flushed
+struct db_batch_chunk
+{
+	struct db_batch *batch; // NULL once the batch was freed
+	char *table;
+	char *sql;
+	struct stringbuffer *data;
+	struct db_params *params;
+	unsigned int rows;
+	size_t sent;
+	struct db_batch_chunk *next;
+};
+
+// Nonblocking connection which writes flushed batches one after another
+struct pgsql_batch_conn
+{
+	struct pgsql *pg; // pooled connection; we use its libpq connection directly for COPY
+	PGconn *conn; // set once pg is connected
+	struct sock *sock;
+	enum {
+		PGSQL_BATCH_DOWN,
+		PGSQL_BATCH_CONNECTING,
+		PGSQL_BATCH_IDLE,
+		PGSQL_BATCH_COPY_START, // waiting for the server to enter COPY IN
+		PGSQL_BATCH_COPY_DATA, // sending rows
+		PGSQL_BATCH_RESULT // waiting for the result of the command
+	} state;
+	unsigned int error : 1; // current chunk failed
+	struct db_batch_chunk *head, *tail;
+};
+
+// Connections come from the pgsql module's pool
 struct pgsql_database
 {
-	PGconn *conn;
-	struct pgsql_async *async;
+	struct pgsql *conn; // synchronous queries and prepared statements
+	struct pgsql *async; // async selects, pipelined on one connection
+	struct ptrlist *selects; // async selects waiting for their result
+	struct dict *stmts;
+	struct pgsql_batch_conn batch;
 } db_;
 
+// Type OIDs from the server's pg_type.h
+#define DB_INT8OID	20
+#define DB_INT4OID	23
+#define DB_TEXTOID	25
+#define DB_TIMESTAMPOID	1114
+// Seconds between the unix epoch and the PostgreSQL epoch (2000-01-01)
+#define DB_EPOCH_OFFSET	946684800
+// Parameters a single statement may have
+#define DB_MAX_PARAMS	65535
+#define DB_BATCH_ROWS	500
+#define DB_BATCH_DELAY	2
+
 static const char *pgsql_select_table_oid = "SELECT oid FROM pg_class WHERE relname=$1";
 static const char *pgsql_select_column_typname = "SELECT typname FROM pg_type INNER JOIN pg_attribute ON pg_type.oid=pg_attribute.atttypid WHERE pg_attribute.attname=$2 AND pg_attribute.attrelid=$1;";
 static const char *pgsql_type_name[DBTYPE_NUM_TYPES] = {
@@ -64,24 +142,53 @@ static const char *pgsql_type_name[DBTYPE_NUM_TYPES] = {
 
 static struct {
 	const char *connect_string;
+	unsigned int batch_rows;
+	unsigned int batch_delay;
 } db_conf = { 0 };
 
 static void db_conf_reload();
-static db_serial_t pgsql_get_serial(struct db_table *table, struct column_desc *desc, struct stringlist *values);
-static int pgsql_send_query(struct pgsql_async *async);
-static void pgsql_async_event(struct sock *sock, enum sock_event event, int err);
-static struct pgsql_async *pgsql_get_async(struct db_table *table);
+static PGconn *db_sync_conn();
+static const char *db_error();
+static void pgsql_async_result(struct pgsql *conn, PGresult *res, void *ctx);
+static void pgsql_async_free(struct pgsql_async *async);
 static void db_table_free(struct db_table *table);
 static int db_vget_values(struct db_table *table, va_list *args, struct db_nv_list *values, db_serial_t **pserial, int *pserial_idx);
 static int db_vget_names(struct db_table *table, va_list *args, struct db_nv_list *values);
 static int db_vget_order(struct db_table *table, va_list *args, struct db_nv_list *values);
-static int db_get_values(struct db_table *table, struct stringbuffer *cv, struct stringlist *values, struct db_nv_list *nvv, const char *sep, int reject_write_only);
-static int db_get_order(struct db_table *table, struct stringbuffer *cv, struct db_nv_list *nvv);
+static struct db_params *db_params_create();
+static void db_params_free(struct db_params *params);
+static void db_params_add(struct db_params *params, Oid type, const void *value, int len);
+static void db_params_add_int(struct db_params *params, Oid type, int64_t value, int len);
+static int db_bind_values(struct db_table *table, struct db_params *params, struct db_nv_list *nvv, int reject_write_only);
+static void db_bind_order(struct db_params *params, struct db_nv_list *nvv);
+static struct db_stmt *db_stmt_get(struct db_table *table, enum db_stmt_op op, struct db_nv_list *columns, struct db_nv_list *filter, struct db_nv_list *order);
+static void db_stmt_free(struct db_stmt *stmt);
+static PGresult *db_stmt_exec(struct db_stmt *stmt, struct db_params *params);
+static int64_t db_get_binary_int(PGresult *res, int row, int field);
 static int db_put_values(struct db_table *table, PGresult *res, int row, struct db_nv_list *values, int dup);
 static int db_vput_values_in(struct db_table *table, va_list *args, struct db_nv_list *values);
 static int db_vput_values_out(struct db_table *table, va_list *args, struct db_nv_list *values);
-static PGresult *do_PQexecParams(PGconn **conn, const char *command, int nParams, char **paramValues);
-static PGresult *do_PQexec(PGconn **conn, const char *command);
+static void db_conn_release();
+static void db_batch_flush(struct db_batch *batch);
+static void db_batch_flush_tmr(void *bound, struct db_batch *batch);
+static void db_batch_copy_append(struct stringbuffer *sbuf, const char *str);
+static char *db_batch_key(struct db_batch *batch, struct db_nv_list *values);
+static int db_batch_replace(struct db_batch *batch, unsigned int row, struct db_nv_list *values);
+static void db_batch_chunk_free(struct db_batch_chunk *chunk);
+static void db_batch_chunk_done(unsigned int error);
+static int db_batch_conn_start();
+static void db_batch_conn_attach();
+static void db_batch_conn_ready(struct pgsql *conn, int ok, void *ctx);
+static void db_batch_conn_close();
+static void db_batch_conn_lost(const char *error);
+static void db_batch_conn_next();
+static void db_batch_conn_flush();
+static void db_batch_conn_send_data();
+static void db_batch_conn_results();
+static void db_batch_conn_event(struct sock *sock, enum sock_event event, int err);
+static void db_batch_conn_drain();
+static PGresult *do_PQexecParams(const char *command, int nParams, char **paramValues);
+static PGresult *do_PQexec(const char *command);
 static int do_row_insert(struct db_table *table, struct db_nv_list *values);
 static int do_row_update(struct db_table *table, struct db_nv_list *filter, struct db_nv_list *updates);
 static int do_row_drop(struct db_table *table, struct db_nv_list *filter);
@@ -90,7 +197,10 @@ static int do_async_select(struct db_table *table, db_select_cb cb, void *ctx, d
 static int do_sync_select(struct db_table *table, db_select_cb cb, void *ctx, db_free_ctx_f *free_ctx_func, struct db_nv_list *filter, struct db_nv_list *values, struct db_nv_list *order);
 #ifdef DB_TEST
 static void run_test();
+static void run_benchmark();
 struct db_table *test_table;
+static struct db_table *upsert_table;
+static struct db_batch *bench_batch, *upsert_batch;
 #endif
 
 static struct module *this;
@@ -103,10 +213,13 @@ MODULE_INIT
 	reg_conf_reload_func(db_conf_reload);
 	db_conf_reload();
 
-	db->conn = PQconnectdb(db_conf.connect_string);
-	if(PQstatus(db->conn) == CONNECTION_BAD)
-		log_append(LOG_ERROR, "PQconnectdb failed: %s", PQerrorMessage(db->conn));
-	db->async = NULL;
+	db->stmts = dict_create();
+	dict_set_free_funcs(db->stmts, NULL, (dict_free_f *)db_stmt_free);
+	db->selects = ptrlist_create();
+
+	// The connection is established in the background until the first query needs it
+	if(!(db->conn = pgsql_init(db_conf.connect_string)))
+		log_append(LOG_ERROR, "Could not connect to database");
 
 #ifdef DB_TEST
 	debug("DB TEST\n\n\n");
@@ -118,27 +231,31 @@ MODULE_INIT
 
 MODULE_FINI
 {
-	while(db->async)
+	db_batch_conn_drain();
+
+	// The modules which started these selects are gone already
+	for(unsigned int i = 0; i < db->selects->count; i++)
 	{
-		struct pgsql_async *async = db->async;
-		db->async = async->next;
-		if(async->conn)
-			PQfinish(async->conn);
-		if(async->sock)
-			sock_close(async->sock);
-		if(async->values)
-		{
-			db_nv_list_clear(async->values);
-			free(async->values);
-		}
-		free(async);
+		struct pgsql_async *async = db->selects->data[i]->ptr;
+		async->cb = NULL;
 	}
 
+	if(db->async)
+		pgsql_fini(db->async);
+	ptrlist_free(db->selects);
+
 #ifdef DB_TEST
+	if(bench_batch)
+		db_batch_free(bench_batch);
+	if(upsert_batch)
+		db_batch_free(upsert_batch);
 	if(test_table)
 		db_table_close(test_table);
+	if(upsert_table)
+		db_table_close(upsert_table);
 #endif
-	PQfinish(db->conn);
+	db_conn_release();
+	dict_free(db->stmts);
 	unreg_conf_reload_func(db_conf_reload);
 }
 
@@ -156,321 +273,96 @@ static void db_conf_reload()
 		db_conf.connect_string = old_cs ? old_cs : "";
 	}
 
+	db_conf.batch_rows = ((str = conf_get("db/batch_rows", DB_STRING)) ? (unsigned int)atoi(str) : DB_BATCH_ROWS);
+	db_conf.batch_delay = ((str = conf_get("db/batch_delay", DB_STRING)) ? (unsigned int)atoi(str) : DB_BATCH_DELAY);
+	if(!db_conf.batch_rows)
+		db_conf.batch_rows = 1;
+
 	if(old_cs && strcasecmp(db_conf.connect_string, old_cs))
 	{
 		debug("Changing connect string from '%s' to '%s'", old_cs, db_conf.connect_string);
-		if(db->conn)
-			PQfinish(db->conn);
+		db_conn_release();
+		db->conn = pgsql_init(db_conf.connect_string);
 
-		db->conn = PQconnectdb(db_conf.connect_string);
-		if(PQstatus(db->conn) == CONNECTION_BAD)
-			log_append(LOG_ERROR, "PQconnectdb failed: %s", PQerrorMessage(db->conn));
+		// Selects still running on the old connection are answered first
+		if(db->async)
+		{
+			pgsql_fini(db->async);
+			db->async = NULL;
+		}
 
-		for(struct pgsql_async *async = db->async; async; async = async->next)
+		if(db->batch.state == PGSQL_BATCH_IDLE)
 		{
-			if(async->state == PGSQL_ASYNC_IDLE)
-			{
-				debug("Killing idle async pgsql connection");
-				PQfinish(async->conn);
-				async->conn = NULL;
-				async->state = PGSQL_ASYNC_DEAD;
-			}
+			debug("Closing idle batch pgsql connection");
+			db_batch_conn_close();
 		}
 	}
 }
 
 
-static int pgsql_send_query(struct pgsql_async *async)
+// Returns the connection for synchronous queries; NULL if the database cannot be reached
+static PGconn *db_sync_conn()
 {
-	struct stringbuffer *query;
-	struct stringlist *params;
-	int rval;
-
-	debug("sending async query; state: %d; PQstatus = %d", async->state, PQstatus(async->conn));
-
-	query = stringbuffer_create();
-	params = stringlist_create();
-	stringbuffer_append_printf(query, "SELECT * FROM \"%s\" ", async->table->name);
-	if(async->filter->count)
-	{
-		stringbuffer_append_string(query, "WHERE ");
-		rval = db_get_values(async->table, query, params, async->filter, " AND ", 0);
-		if(rval)
-			goto out;
-	}
-
-	if(async->order->count)
-	{
-		stringbuffer_append_string(query, " ORDER BY ");
-		rval = db_get_order(async->table, query, async->order);
-		if(rval)
-			goto out;
-	}
-
-	if(!PQsendQueryParams(async->conn, query->string, params->count, NULL, (const char*const*)params->data, NULL, NULL, 0))
-	{
-		debug("PQsendQueryParams failed: %s", PQerrorMessage(async->conn));
-		rval = 1;
-		goto out;
-	}
-
-	debug("Query: %s", query->string);
-	debug("Params:");
-	for(unsigned int ii = 0; ii < params->count; ++ii)
-		debug("   $%u = %s", ii+1, params->data[ii]);
-	rval = 0;
-out:
-	debug("rval = %d", rval);
-	if(rval == 0)
-	{
-		if(PQflush(async->conn) == 0)
-		{
-			async->sock->want_write = 0;
-			async->sock->want_read = 1;
-		}
-		else
-		{
-			async->sock->want_write = 1;
-			async->sock->want_read = 0;
-		}
-	}
+	if(!db->conn && !(db->conn = pgsql_init(db_conf.connect_string)))
+		return NULL;
 
-	async->state = rval ? PGSQL_ASYNC_IDLE : PGSQL_ASYNC_BUSY;
-	db_nv_list_clear(async->filter);
-	free(async->filter);
-	async->filter = NULL;
-	db_nv_list_clear(async->order);
-	free(async->order);
-	async->order = NULL;
-	if(rval != 0)
-	{
-		db_nv_list_clear(async->values);
-		free(async->values);
-		async->values = NULL;
-		async->cb(async->ctx, NULL, 0, 0, 1);
-		if(rval == 1)
-		{
-			PQfinish(async->conn);
-			async->conn = NULL;
-			async->state = PGSQL_ASYNC_DEAD;
-		}
-	}
-	stringlist_free(params);
-	stringbuffer_free(query);
-	return rval;
+	return pgsql_conn(db->conn);
 }
 
-static void pgsql_async_event(struct sock *sock, enum sock_event event, int err)
+static const char *db_error()
 {
-	struct pgsql_async *async = (struct pgsql_async *)sock->ctx;
-
-	debug("pg async event: %d", event);
-	if(async->state == PGSQL_ASYNC_CONNECTING)
-	{
-		debug("replacing async event with EV_CONNECT");
-		event = EV_CONNECT;
-	}
-
-	switch(event)
-	{
-		case EV_WRITE:
-			if(PQflush(async->conn) == 0)
-			{
-				sock->want_write = 0;
-				sock->want_read = 1;
-			}
-			break;
-
-		case EV_CONNECT:{
-			unsigned int ready = 0;
-			switch(PQconnectPoll(async->conn))
-			{
-				case PGRES_POLLING_READING:
-					sock->want_read = 1;
-					sock->want_write = 0;
-					break;
-
-				case PGRES_POLLING_WRITING:
-					sock->want_read = 0;
-					sock->want_write = 1;
-					break;
-
-				case PGRES_POLLING_FAILED:
-					if(async->cb)
-						async->cb(async->ctx, NULL, 0, 0, 1);
-					if(async->values)
-					{
-						db_nv_list_clear(async->values);
-						free(async->values);
-						async->values = NULL;
-					}
-					PQfinish(async->conn);
-					async->conn = NULL;
-					async->state = PGSQL_ASYNC_DEAD;
-					log_append(LOG_ERROR, "Async connection failed to database.");
-					break;
-
-				case PGRES_POLLING_OK:
-					ready = 1;
-					async->state = async->filter ? PGSQL_ASYNC_QUERY : PGSQL_ASYNC_IDLE;
-					break;
-
-				default: /* needed to squash gcc warning for the deprecated PGRES_POLLING_ACTIVE enum */
-					break;
-			}
-
-			if(async->state == PGSQL_ASYNC_QUERY && ready)
-				pgsql_send_query(async);
-
-			break;
-		}
-
-		case EV_READ:
-			if(!PQconsumeInput(async->conn))
-			{
-				log_append(LOG_ERROR, "PQconsumeInput failed: %s", PQerrorMessage(async->conn));
-				if(async->values)
-				{
-					db_nv_list_clear(async->values);
-					free(async->values);
-					async->values = NULL;
-				}
-				PQfinish(async->conn);
-				async->conn = NULL;
-				async->state = PGSQL_ASYNC_DEAD;
-				break;
-			}
-
-			/* If it is still busy, we cannot do anything further. */
-			while(!PQisBusy(async->conn))
-			{
-				PGresult *res;
-				unsigned int ii, count;
-
-				debug("entered PQisBusy loop");
-				/* Get result row; if done, release async and break out. */
-				res = PQgetResult(async->conn);
-				if(!res)
-				{
-					debug("PQgetResult == NULL");
-					async->sock->want_read = 0;
-					if(async->values)
-					{
-						db_nv_list_clear(async->values);
-						free(async->values);
-						async->values = NULL;
-					}
-					if(async->free_ctx_func)
-						async->free_ctx_func(async->ctx);
-					async->cb = NULL;
-					async->state = PGSQL_ASYNC_IDLE;
-					debug("state is now %d", async->state);
-					break;
-				}
-
-				count = PQntuples(res);
-				debug("PQntuples = %d", count);
-				if(count == 0) // no rows
-					async->cb(async->ctx, NULL, 0, 0, 0);
-
-				for(ii = 0; ii < count; ++ii)
-				{
-					/* Usable row: unpack into async->values. */
-					if(db_put_values(async->table, res, ii, async->values, 0))
-						continue;
-					/* Make callback, maybe asking to stop. */
-					if((async->state == PGSQL_ASYNC_BUSY) && async->cb(async->ctx, async->values, ii + 1, count, 0))
-					{
-						async->state = PGSQL_ASYNC_ABORTING;
-						PQrequestCancel(async->conn);
-					}
-				}
-				/* Release the result object. */
-				PQclear(res);
-			}
+	return db->conn ? PQerrorMessage(db->conn->conn) : "no connection to database";
+}
 
-			if(async->state == PGSQL_ASYNC_QUERY)
-				pgsql_send_query(async);
-			break;
+// Our prepared statements must not stay behind on a pooled connection
+static void db_conn_release()
+{
+	if(!db->conn)
+		return;
 
-		default:
-			break;
-	}
+	if(!db->conn->connecting && PQstatus(db->conn->conn) == CONNECTION_OK)
+		PQclear(PQexec(db->conn->conn, "DEALLOCATE ALL"));
 
-	debug("event func complete");
+	pgsql_fini(db->conn);
+	db->conn = NULL;
 }
 
-static struct pgsql_async *pgsql_get_async(struct db_table *table)
+static void pgsql_async_result(UNUSED_ARG(struct pgsql *conn), PGresult *res, void *ctx)
 {
-	struct pgsql_async *async;
+	struct pgsql_async *async = ctx;
+	unsigned int ii, count;
 
-	/* Search for a currently idle request. */
-	for(async = db->async; async; async = async->next)
-		if(async->state == PGSQL_ASYNC_IDLE)
-			return async;
+	ptrlist_del_ptr(db->selects, async);
 
-	unsigned int revive = 0;
-	/* Search for a currently idle request. */
-	for(async = db->async; async; async = async->next)
+	if(!async->cb)
+		;
+	else if(!res)
+		async->cb(async->ctx, NULL, 0, 0, 1);
+	else if(!(count = PQntuples(res))) // no rows
+		async->cb(async->ctx, NULL, 0, 0, 0);
+	else
 	{
-		if(async->state == PGSQL_ASYNC_DEAD)
+		for(ii = 0; ii < count; ++ii)
 		{
-			debug("Reviving dead async struct");
-			revive = 1;
-			break;
+			/* Usable row: unpack into async->values. */
+			if(db_put_values(async->table, res, ii, async->values, 0))
+				continue;
+			/* Make callback, maybe asking to stop; the remaining rows have been received already. */
+			if(async->cb(async->ctx, async->values, ii + 1, count, 0))
+				break;
 		}
 	}
 
-	/* Make sure we still have the connection argument. */
-	/*
-	args = conf_get_child(db->cfg, "args", CONF_STRING);
-	if (!args) {
-		log_append(LOG_ERROR, "'args' config field disappeared for database %s.", db->base.name);
-		return NULL;
-	}
-	*/
-
-	/* Allocate and link in a new connection (so we do not leak it in
-	 * the event of a later failure).
-	 */
-	if(!revive)
-	{
-		debug("Creating new async struct");
-		async = malloc(sizeof(struct pgsql_async));
-		memset(async, 0, sizeof(struct pgsql_async));
-		async->next = db->async;
-		db->async = async;
-	}
-
-	/* Start the connection. */
-	async->conn = PQconnectStart(db_conf.connect_string);
-	if(!async->conn)
-	{
-		log_append(LOG_ERROR, "Unable to PQconnectStart().");
-		return NULL;
-	}
-
-	PQsetnonblocking(async->conn, 1);
-	async->state = PGSQL_ASYNC_CONNECTING;
-	int status = PQstatus(async->conn);
-	debug("PQstatus after connect = %d", status);
-	switch(status)
-	{
-		case CONNECTION_BAD:
-			log_append(LOG_ERROR, "Async connection failed to database.");
-			return NULL;
+	if(res && async->cb && async->free_ctx_func)
+		async->free_ctx_func(async->ctx);
+	pgsql_async_free(async);
+}
 
-		default:
-			async->sock = sock_create(SOCK_NOSOCK, pgsql_async_event, NULL);
-			async->sock->config_poll = 1;
-			async->sock->want_write = 1;
-			async->sock->ctx = async;
-			async->sock->flags |= SOCK_CONNECT;
-			sock_set_fd(async->sock, PQsocket(async->conn));
-			debug("add socket with SOCK_CONNECT");
-			break;
-	}
-	return async;
+static void pgsql_async_free(struct pgsql_async *async)
+{
+	db_nv_list_clear(async->values);
+	free(async->values);
+	free(async);
 }
 
 const char *db_type_to_name(enum db_type type)
@@ -500,10 +392,10 @@ struct db_table *db_table_open(const char *name, const struct column_desc *cols)
 
 	/* Does the table exist? */
 	params[0] = name;
-	res = do_PQexecParams(&db->conn, pgsql_select_table_oid, 1, (char **)params);
+	res = do_PQexecParams(pgsql_select_table_oid, 1, (char **)params);
 	if(!res || (PQresultStatus(res) != PGRES_TUPLES_OK))
 	{
-		log_append(LOG_ERROR, "Error trying to find table %s: %s", name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
+		log_append(LOG_ERROR, "Error trying to find table %s: %s", name, (res ? PQresultErrorMessage(res) : db_error()));
 		PQclear(res);
 		return NULL;
 	}
@@ -521,10 +413,10 @@ struct db_table *db_table_open(const char *name, const struct column_desc *cols)
 			stringbuffer_append_printf(cv, "\"%s\" %s", cols[ii].name, pgsql_type_name[cols[ii].type]);
 		}
 		stringbuffer_append_string(cv, ") WITHOUT OIDS");
-		res = PQexec(db->conn, cv->string);
+		res = do_PQexec(cv->string);
 		if(!res || (PQresultStatus(res) != PGRES_COMMAND_OK))
 		{
-			log_append(LOG_ERROR, "Error trying to create table %s: %s", name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
+			log_append(LOG_ERROR, "Error trying to create table %s: %s", name, (res ? PQresultErrorMessage(res) : db_error()));
 			PQclear(res);
 			stringbuffer_free(cv);
 			return NULL;
@@ -544,10 +436,10 @@ struct db_table *db_table_open(const char *name, const struct column_desc *cols)
 		{
 			/* Query the column's type. */
 			params[1] = cols[ii].name;
-			res = do_PQexecParams(&db->conn, pgsql_select_column_typname, 2, (char **)params);
+			res = do_PQexecParams(pgsql_select_column_typname, 2, (char **)params);
 			if(!res || (PQresultStatus(res) != PGRES_TUPLES_OK))
 			{
-				log_append(LOG_ERROR, "Error trying to find type for column %s in table %s: %s", params[1], name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
+				log_append(LOG_ERROR, "Error trying to find type for column %s in table %s: %s", params[1], name, (res ? PQresultErrorMessage(res) : db_error()));
 				PQclear(res);
 				return NULL;
 			}
@@ -561,11 +453,11 @@ struct db_table *db_table_open(const char *name, const struct column_desc *cols)
 				log_append(LOG_INFO, "Table %s missing column %s, attempting to create it.", name, params[1]);
 				cv = stringbuffer_create();
 				stringbuffer_append_printf(cv, "ALTER TABLE \"%s\" ADD COLUMN \"%s\" %s", name, params[1], pgsql_type_name[cols[ii].type]);
-				res2 = do_PQexec(&db->conn, cv->string);
+				res2 = do_PQexec(cv->string);
 				stringbuffer_free(cv);
 				if(!res2 || (PQresultStatus(res2) != PGRES_COMMAND_OK))
 				{
-					log_append(LOG_ERROR, "Unable to add missing column %s to table %s: %s", params[1], name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
+					log_append(LOG_ERROR, "Unable to add missing column %s to table %s: %s", params[1], name, (res ? PQresultErrorMessage(res) : db_error()));
 					PQclear(res2);
 					return NULL;
 				}
@@ -753,11 +645,57 @@ static int db_vget_order(struct db_table *table, va_list *args, struct db_nv_lis
 	return 0;
 }
 
-static int db_get_values(struct db_table *table, struct stringbuffer *cv, struct stringlist *values, struct db_nv_list *nvv, const char *sep, int reject_write_only)
+static struct db_params *db_params_create()
+{
+	struct db_params *params = malloc(sizeof(struct db_params));
+	memset(params, 0, sizeof(struct db_params));
+	return params;
+}
+
+static void db_params_free(struct db_params *params)
+{
+	for(unsigned int ii = 0; ii < params->count; ++ii)
+		free(params->values[ii]);
+	free(params->types);
+	free(params->values);
+	free(params->lengths);
+	free(params->formats);
+	free(params);
+}
+
+static void db_params_add(struct db_params *params, Oid type, const void *value, int len)
+{
+	if(params->count == params->size)
+	{
+		params->size = params->size ? params->size * 2 : 8;
+		params->types = realloc(params->types, params->size * sizeof(Oid));
+		params->values = realloc(params->values, params->size * sizeof(char *));
+		params->lengths = realloc(params->lengths, params->size * sizeof(int));
+		params->formats = realloc(params->formats, params->size * sizeof(int));
+	}
+
+	params->types[params->count] = type;
+	params->values[params->count] = malloc(len + 1);
+	memcpy(params->values[params->count], value, len);
+	params->values[params->count][len] = '\0';
+	params->lengths[params->count] = len;
+	params->formats[params->count] = 1; // binary
+	params->count++;
+}
+
+static void db_params_add_int(struct db_params *params, Oid type, int64_t value, int len)
+{
+	unsigned char buf[8];
+
+	// Binary parameters are sent in network byte order
+	for(int ii = len - 1; ii >= 0; --ii, value >>= 8)
+		buf[ii] = value & 0xff;
+	db_params_add(params, type, buf, len);
+}
+
+static int db_bind_values(struct db_table *table, struct db_params *params, struct db_nv_list *nvv, int reject_write_only)
 {
 	struct column_desc *desc;
-	int rval;
-	char value[64];
 
 	for(unsigned int ii = 0; ii < nvv->count; ++ii)
 	{
@@ -769,97 +707,223 @@ static int db_get_values(struct db_table *table, struct stringbuffer *cv, struct
 		if(!desc)
 		{
 			log_append(LOG_ERROR, "Tried to operate on %s with non-existent column %s.", table->name, dnv->name);
-			rval = 1;
-			goto out;
+			return 1;
 		}
 
-		/* Append element to query string */
-		if(ii)
-			stringbuffer_append_string(cv, sep);
-		stringbuffer_append_printf(cv, "\"%s\"=$%u", dnv->name, values->count + 1);
-
 		/* Figure out what type it is and append that to query value list. */
 		switch(desc->type)
 		{
 			case DBTYPE_INTEGER:
-				snprintf(value, sizeof(value), "%d", dnv->u.integer);
-				stringlist_add(values, strdup(value));
+				db_params_add_int(params, DB_INT4OID, dnv->u.integer, 4);
 				break;
 
-			case DBTYPE_DATETIME: {
-				struct tm tm;
-
-				memset(&tm, 0, sizeof(tm));
-				if (!gmtime_r(&dnv->u.datetime, &tm)) {
-					log_append(LOG_ERROR, "Could not gmtime_r(%ld).", dnv->u.datetime);
-					rval = 2;
-					goto out;
-				}
-
-				if (!strftime(value, sizeof(value), "%Y-%m-%d %H:%M:%S-00", &tm)) {
-					log_append(LOG_ERROR, "Could not strftime(%ld).", dnv->u.datetime);
-					rval = 3;
-					goto out;
-				}
-
-				stringlist_add(values, strdup(value));
+			case DBTYPE_DATETIME:
+				// We store UTC; binary timestamps are microseconds since 2000-01-01
+				db_params_add_int(params, DB_TIMESTAMPOID, ((int64_t)dnv->u.datetime - DB_EPOCH_OFFSET) * 1000000, 8);
 				break;
-			}
 
-			case DBTYPE_STRING:
-				stringlist_add(values, strdup(dnv->u.string));
+			case DBTYPE_STRING: {
+				const char *str = dnv->u.string ? dnv->u.string : "";
+				db_params_add(params, DB_TEXTOID, str, strlen(str));
 				break;
+			}
 
 			case DBTYPE_SERIAL:
 				if(reject_write_only)
 				{
 					log_append(LOG_ERROR, "Must not write to serial column %s in table %s.", desc->name, table->name);
-					rval = 5;
-					goto out;
+					return 5;
 				}
-				snprintf(value, sizeof(value), "%d", dnv->u.serial);
-				stringlist_add(values, strdup(value));
+				db_params_add_int(params, DB_INT4OID, dnv->u.serial, 4);
 				break;
 
 			default:
 				log_append(LOG_ERROR, "Unhandled type %d for column %s in table %s.", desc->type, desc->name, table->name);
-				rval = 4;
-				goto out;
+				return 4;
 		}
 	}
-	rval = 0;
 
-out:
-	return rval;
+	return 0;
 }
 
-static int db_get_order(struct db_table *table, struct stringbuffer *cv, struct db_nv_list *nvv)
+static void db_bind_order(struct db_params *params, struct db_nv_list *nvv)
 {
-	int limit, offset;
-
-	limit = offset = 0;
 	for(unsigned int ii = 0; ii < nvv->count; ++ii)
 	{
 		const struct db_named_value *dnv = &nvv->data[ii];
 
 		if(!strcmp(dnv->name, "$LIMIT"))
-			limit = dnv->u.integer;
+			db_params_add_int(params, DB_INT8OID, dnv->u.integer, 8);
 		else if(!strcmp(dnv->name, "$OFFSET"))
-			offset = -dnv->u.integer;
+			db_params_add_int(params, DB_INT8OID, -dnv->u.integer, 8);
+	}
+}
+
+static void db_stmt_append_names(struct stringbuffer *sbuf, struct db_nv_list *nvv)
+{
+	stringbuffer_append_char(sbuf, '|');
+	for(unsigned int ii = 0; nvv && ii < nvv->count; ++ii)
+	{
+		if(ii)
+			stringbuffer_append_char(sbuf, ',');
+		stringbuffer_append_string(sbuf, nvv->data[ii].name);
+	}
+}
+
+static void db_stmt_append_assignments(struct stringbuffer *sbuf, struct db_nv_list *nvv, const char *sep, unsigned int *param)
+{
+	for(unsigned int ii = 0; ii < nvv->count; ++ii)
+	{
+		if(ii)
+			stringbuffer_append_string(sbuf, sep);
+		stringbuffer_append_printf(sbuf, "\"%s\"=$%u", nvv->data[ii].name, ++*param);
+	}
+}
+
+// Returns the cached statement for the given query shape, creating it if necessary
+static struct db_stmt *db_stmt_get(struct db_table *table, enum db_stmt_op op, struct db_nv_list *columns, struct db_nv_list *filter, struct db_nv_list *order)
+{
+	static unsigned int next_id = 0;
+	struct stringbuffer *key, *sql, *returning;
+	struct db_stmt *stmt;
+	unsigned int param = 0, first;
+
+	key = stringbuffer_create();
+	stringbuffer_append_printf(key, "%d|%s", op, table->name);
+	db_stmt_append_names(key, columns);
+	db_stmt_append_names(key, filter);
+	stringbuffer_append_char(key, '|');
+	for(unsigned int ii = 0; order && ii < order->count; ++ii)
+	{
+		const struct db_named_value *dnv = &order->data[ii];
+		if(*dnv->name == '$')
+			stringbuffer_append_string(key, dnv->name);
 		else
-		{
-			/* Append element to query string */
-			if(ii)
-				stringbuffer_append_string(cv, ", ");
-			stringbuffer_append_printf(cv, "\"%s\" %s", dnv->name, (dnv->u.integer == ORDER_DESC ? "DESC" : "ASC"));
-		}
+			stringbuffer_append_printf(key, "%c%s", (dnv->u.integer == ORDER_DESC ? '-' : '+'), dnv->name);
 	}
 
-	if(limit)
-		stringbuffer_append_printf(cv, " LIMIT %u", limit);
-	if(offset)
-		stringbuffer_append_printf(cv, " OFFSET %u", offset);
-	return 0;
+	if((stmt = dict_find(db->stmts, key->string)))
+	{
+		stringbuffer_free(key);
+		return stmt;
+	}
+
+	sql = stringbuffer_create();
+	switch(op)
+	{
+		case DB_STMT_INSERT:
+			stringbuffer_append_printf(sql, "INSERT INTO \"%s\" (", table->name);
+			for(unsigned int ii = 0; ii < columns->count; ++ii)
+				stringbuffer_append_printf(sql, "%s\"%s\"", (ii ? ", " : ""), columns->data[ii].name);
+			stringbuffer_append_string(sql, ") VALUES (");
+			// Serial columns are filled by the statement itself and returned, saving a nextval round trip
+			returning = stringbuffer_create();
+			for(unsigned int ii = 0; ii < columns->count; ++ii)
+			{
+				const struct column_desc *desc = dict_find(table->columns, columns->data[ii].name);
+				if(desc->type == DBTYPE_SERIAL)
+				{
+					stringbuffer_append_printf(sql, "%snextval('%s_%s_seq')", (ii ? ", " : ""), table->name, desc->name);
+					stringbuffer_append_printf(returning, "%s\"%s\"", (returning->len ? ", " : " RETURNING "), desc->name);
+				}
+				else
+					stringbuffer_append_printf(sql, "%s$%u", (ii ? ", " : ""), ++param);
+			}
+			stringbuffer_append_char(sql, ')');
+			stringbuffer_append_string(sql, returning->string);
+			stringbuffer_free(returning);
+			break;
+
+		case DB_STMT_UPDATE:
+			stringbuffer_append_printf(sql, "UPDATE \"%s\" SET ", table->name);
+			db_stmt_append_assignments(sql, columns, ", ", &param);
+			stringbuffer_append_string(sql, " WHERE ");
+			db_stmt_append_assignments(sql, filter, " AND ", &param);
+			break;
+
+		case DB_STMT_DELETE:
+			stringbuffer_append_printf(sql, "DELETE FROM \"%s\" WHERE ", table->name);
+			db_stmt_append_assignments(sql, filter, " AND ", &param);
+			break;
+
+		case DB_STMT_SELECT:
+			stringbuffer_append_string(sql, "SELECT ");
+			if(!columns || !columns->count)
+				stringbuffer_append_char(sql, '*');
+			for(unsigned int ii = 0; columns && ii < columns->count; ++ii)
+				stringbuffer_append_printf(sql, "%s\"%s\"", (ii ? ", " : ""), columns->data[ii].name);
+			stringbuffer_append_printf(sql, " FROM \"%s\"", table->name);
+			if(filter && filter->count)
+			{
+				stringbuffer_append_string(sql, " WHERE ");
+				db_stmt_append_assignments(sql, filter, " AND ", &param);
+			}
+
+			first = 1;
+			for(unsigned int ii = 0; order && ii < order->count; ++ii)
+			{
+				const struct db_named_value *dnv = &order->data[ii];
+				if(*dnv->name == '$')
+					continue;
+				stringbuffer_append_string(sql, (first ? " ORDER BY " : ", "));
+				stringbuffer_append_printf(sql, "\"%s\" %s", dnv->name, (dnv->u.integer == ORDER_DESC ? "DESC" : "ASC"));
+				first = 0;
+			}
+
+			// Parameters are bound in the same order by db_bind_order()
+			for(unsigned int ii = 0; order && ii < order->count; ++ii)
+			{
+				if(!strcmp(order->data[ii].name, "$LIMIT"))
+					stringbuffer_append_printf(sql, " LIMIT $%u", ++param);
+				else if(!strcmp(order->data[ii].name, "$OFFSET"))
+					stringbuffer_append_printf(sql, " OFFSET $%u", ++param);
+			}
+			break;
+
+	}
+
+	stmt = malloc(sizeof(struct db_stmt));
+	memset(stmt, 0, sizeof(struct db_stmt));
+	stmt->key = strdup(key->string);
+	stmt->sql = strdup(sql->string);
+	snprintf(stmt->name, sizeof(stmt->name), "db_stmt_%u", next_id++);
+	dict_insert(db->stmts, stmt->key, stmt);
+
+	stringbuffer_free(key);
+	stringbuffer_free(sql);
+	return stmt;
+}
+
+static void db_stmt_free(struct db_stmt *stmt)
+{
+	free(stmt->key);
+	free(stmt->sql);
+	free(stmt);
+}
+
+// Decodes a binary int2/int4/int8 field
+static int64_t db_get_binary_int(PGresult *res, int row, int field)
+{
+	const unsigned char *value;
+	uint64_t val = 0;
+	int len;
+
+	if(PQgetisnull(res, row, field))
+		return 0;
+
+	value = (const unsigned char *)PQgetvalue(res, row, field);
+	len = PQgetlength(res, row, field);
+	if(len != 2 && len != 4 && len != 8)
+		return 0;
+
+	for(int ii = 0; ii < len; ++ii)
+		val = (val << 8) | value[ii];
+
+	// Sign-extend narrower types
+	if(len < 8 && (value[0] & 0x80))
+		val |= ~(uint64_t)0 << (len * 8);
+
+	return (int64_t)val;
 }
 
 static int db_put_values(struct db_table *table, PGresult *res, int row, struct db_nv_list *values, int dup)
@@ -881,35 +945,28 @@ static int db_put_values(struct db_table *table, PGresult *res, int row, struct
 		}
 		desc = dict_find(table->columns, dnv->name);
 		assert_return(desc != NULL, 7);
-		value = PQgetvalue(res, row, field);
+
+		// All our statements request binary results
 		switch(desc->type)
 		{
 			case DBTYPE_INTEGER:
-				dnv->u.integer = value ? atoi(value) : 0;
+				dnv->u.integer = db_get_binary_int(res, row, field);
 				break;
 
 			case DBTYPE_DATETIME:
-				if(value)
-				{
-					struct tm tm;
-					memset(&tm, 0, sizeof(tm));
-					if(strptime(value, "%Y-%m-%d %H:%M:%S", &tm))
-						dnv->u.datetime = mktime(&tm);
-					else
-						dnv->u.datetime = 0;
-				}
-				else
-				{
+				if(PQgetisnull(res, row, field))
 					dnv->u.datetime = 0;
-				}
+				else
+					dnv->u.datetime = db_get_binary_int(res, row, field) / 1000000 + DB_EPOCH_OFFSET;
 				break;
 
 			case DBTYPE_STRING:
+				value = PQgetvalue(res, row, field);
 				dnv->u.string = (value && dup) ? strdup(value) : (char *)value;
 				break;
 
 			case DBTYPE_SERIAL:
-				dnv->u.serial = value ? atoi(value) : 0;
+				dnv->u.serial = db_get_binary_int(res, row, field);
 				break;
 
 			default:
@@ -1017,29 +1074,6 @@ static int db_vput_values_out(struct db_table *table, va_list *args, struct db_n
 	return 0;
 }
 
-static db_serial_t pgsql_get_serial(struct db_table *table, struct column_desc *desc, struct stringlist *values)
-{
-	struct stringbuffer *cv;
-	PGresult *res;
-	char *value;
-
-	cv = stringbuffer_create();
-	stringbuffer_append_printf(cv, "SELECT nextval('%s_%s_seq')", table->name, desc->name);
-	res = do_PQexec(&db->conn, cv->string);
-	if(!res || (PQresultStatus(res) != PGRES_TUPLES_OK))
-	{
-		log_append(LOG_ERROR, "Error trying to get serial number from %s.%s: %s", table->name, desc->name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
-		PQclear(res);
-		stringbuffer_free(cv);
-		return 0;
-	}
-	stringbuffer_free(cv);
-	value = strdup(PQgetvalue(res, 0, 0));
-	stringlist_add(values, value);
-	PQclear(res);
-	return atoi(value);
-}
-
 int db_row_insert(struct db_table *table, ...)
 {
 	struct db_nv_list values;
@@ -1237,256 +1271,966 @@ int db_async_select(struct db_table *table, db_select_cb cb, void *ctx, db_free_
 	return res;
 }
 
-// actual db access functions
-static PGresult *do_PQexecParams(PGconn **conn, const char *command, int nParams, char **paramValues)
+struct db_batch *db_batch_create(struct db_table *table, db_batch_cb *cb, void *ctx, ...)
 {
-	PGresult *res;
+	struct db_batch *batch;
+	struct db_nv_list *columns;
+	va_list args;
+	int res;
 
-	if(PQstatus(*conn) == CONNECTION_BAD)
+	columns = malloc(sizeof(struct db_nv_list));
+	memset(columns, 0, sizeof(struct db_nv_list));
+	va_start(args, ctx);
+	res = db_vget_names(table, &args, columns);
+	va_end(args);
+
+	for(unsigned int ii = 0; !res && ii < columns->count; ++ii)
 	{
-		debug("reconnecting - before query");
-		PQfinish(*conn);
-		*conn = PQconnectdb(db_conf.connect_string);
-		if(PQstatus(*conn) == CONNECTION_BAD)
-			log_append(LOG_ERROR, "PQconnectdb failed: %s", PQerrorMessage(*conn));
+		struct column_desc *desc = dict_find(table->columns, columns->data[ii].name);
+		if(desc->type == DBTYPE_SERIAL)
+		{
+			log_append(LOG_ERROR, "Must not write to serial column %s in table %s.", desc->name, table->name);
+			res = 5;
+		}
 	}
-	res = PQexecParams(*conn, command, nParams, NULL, (const char*const*)paramValues, NULL, NULL, 0);
-	debug("conn status after query: %d bad: %d", PQstatus(*conn), PQstatus(*conn) == CONNECTION_BAD);
-	if(PQstatus(*conn) == CONNECTION_BAD)
+
+	if(res || !columns->count)
 	{
-		debug("reconnecting - after query");
-		if(res)
-			PQclear(res);
-		PQfinish(*conn);
-		*conn = PQconnectdb(db_conf.connect_string);
-		if(PQstatus(*conn) == CONNECTION_BAD)
-			log_append(LOG_ERROR, "PQconnectdb failed: %s", PQerrorMessage(*conn));
-		res = PQexecParams(*conn, command, nParams, NULL, (const char*const*)paramValues, NULL, NULL, 0);
+		db_nv_list_clear(columns);
+		free(columns);
+		return NULL;
 	}
 
-	return res;
+	batch = malloc(sizeof(struct db_batch));
+	memset(batch, 0, sizeof(struct db_batch));
+	batch->table = table;
+	batch->columns = columns;
+	batch->cb = cb;
+	batch->ctx = ctx;
+	return batch;
 }
 
-static PGresult *do_PQexec(PGconn **conn, const char *command)
+// Makes the batch update existing rows which conflict on the given columns instead of failing
+int db_batch_upsert(struct db_batch *batch, ...)
 {
-	PGresult *res;
+	struct db_nv_list *conflict;
+	va_list args;
+	int res;
 
-	if(PQstatus(*conn) == CONNECTION_BAD)
+	conflict = malloc(sizeof(struct db_nv_list));
+	memset(conflict, 0, sizeof(struct db_nv_list));
+	va_start(args, batch);
+	res = db_vget_names(batch->table, &args, conflict);
+	va_end(args);
+	if(res || !conflict->count)
 	{
-		debug("reconnecting - before query");
-		*conn = PQconnectdb(db_conf.connect_string);
-		if(PQstatus(*conn) == CONNECTION_BAD)
-			log_append(LOG_ERROR, "PQconnectdb failed: %s", PQerrorMessage(*conn));
+		db_nv_list_clear(conflict);
+		free(conflict);
+		return res ? res : 1;
 	}
-	res = PQexec(*conn, command);
-	if(PQstatus(*conn) == CONNECTION_BAD)
+
+	// Rows collected so far are encoded for COPY
+	db_batch_flush(batch);
+	if(batch->conflict)
 	{
-		debug("reconnecting - after query");
-		if(res)
-			PQclear(res);
-		*conn = PQconnectdb(db_conf.connect_string);
-		if(PQstatus(*conn) == CONNECTION_BAD)
-			log_append(LOG_ERROR, "PQconnectdb failed: %s", PQerrorMessage(*conn));
-		res = PQexec(*conn, command);
+		db_nv_list_clear(batch->conflict);
+		free(batch->conflict);
 	}
+	batch->conflict = conflict;
+	if(!batch->keys)
+	{
+		batch->keys = dict_create();
+		dict_set_free_funcs(batch->keys, free, NULL);
+	}
+	return 0;
+}
 
-	return res;
+int db_batch_add(struct db_batch *batch, ...)
+{
+	struct db_nv_list values;
+	struct db_named_value dvv;
+	va_list args;
+	int res = 0;
+
+	memset(&values, 0, sizeof(values));
+	memset(&dvv, 0, sizeof(dvv));
+	va_start(args, batch);
+	for(unsigned int ii = 0; ii < batch->columns->count; ++ii)
+	{
+		struct column_desc *desc = dict_find(batch->table->columns, batch->columns->data[ii].name);
+
+		dvv.name = desc->name;
+		switch(desc->type)
+		{
+			case DBTYPE_INTEGER:
+				dvv.u.integer = va_arg(args, int);
+				break;
+			case DBTYPE_DATETIME:
+				dvv.u.datetime = va_arg(args, time_t);
+				break;
+			case DBTYPE_STRING:
+				dvv.u.string = va_arg(args, char *);
+				break;
+			default: // rejected by db_batch_create()
+				break;
+		}
+		db_nv_list_add(&values, dvv);
+	}
+	va_end(args);
+
+	if(batch->conflict)
+	{
+		char *key = db_batch_key(batch, &values);
+		intptr_t row;
+		unsigned int count;
+
+		if(!batch->params)
+			batch->params = db_params_create();
+
+		// One statement must not update a row twice, so a row with a key already in the batch replaces that one
+		if((row = (intptr_t)dict_find(batch->keys, key)))
+		{
+			res = db_batch_replace(batch, row - 1, &values);
+			free(key);
+			db_nv_list_clear(&values);
+			return res;
+		}
+
+		count = batch->params->count;
+		if((res = db_bind_values(batch->table, batch->params, &values, 1)))
+		{
+			// Drop the parameters of the incomplete row
+			while(batch->params->count > count)
+				free(batch->params->values[--batch->params->count]);
+			free(key);
+		}
+		else
+			dict_insert(batch->keys, key, (void *)(intptr_t)(batch->rows + 1));
+	}
+	else
+	{
+		if(!batch->data)
+			batch->data = stringbuffer_create();
+
+		for(unsigned int ii = 0; ii < values.count; ++ii)
+		{
+			const struct db_named_value *dnv = &values.data[ii];
+			struct column_desc *desc = dict_find(batch->table->columns, dnv->name);
+			char buf[32];
+			struct tm tm;
+
+			if(ii)
+				stringbuffer_append_char(batch->data, '\t');
+
+			switch(desc->type)
+			{
+				case DBTYPE_INTEGER:
+					stringbuffer_append_printf(batch->data, "%d", dnv->u.integer);
+					break;
+				case DBTYPE_DATETIME:
+					// We store UTC
+					strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", gmtime_r(&dnv->u.datetime, &tm));
+					stringbuffer_append_string(batch->data, buf);
+					break;
+				case DBTYPE_STRING:
+					db_batch_copy_append(batch->data, dnv->u.string ? dnv->u.string : "");
+					break;
+				default:
+					break;
+			}
+		}
+		stringbuffer_append_char(batch->data, '\n');
+	}
+
+	db_nv_list_clear(&values);
+	if(res)
+		return res;
+
+	batch->rows++;
+	if(batch->rows >= db_conf.batch_rows || (batch->params && batch->params->count + batch->columns->count > DB_MAX_PARAMS))
+		db_batch_flush(batch);
+	else if(batch->rows == 1)
+		timer_add(batch, "db_batch_flush", now + db_conf.batch_delay, (timer_f *)db_batch_flush_tmr, batch, 0, 0);
+	return 0;
 }
 
-static int do_row_insert(struct db_table *table, struct db_nv_list *in_values)
+void db_batch_commit(struct db_batch *batch)
 {
-	struct stringbuffer *query, *value_fmt;
-	struct stringlist *values;
-	struct column_desc *desc;
-	char value[64];
-	PGresult *res;
-	int rval;
+	db_batch_flush(batch);
+}
 
-	query = stringbuffer_create();
-	value_fmt = stringbuffer_create();
-	values = stringlist_create();
-	stringbuffer_append_printf(query, "INSERT INTO \"%s\" (", table->name);
+// Pending rows are still written, but the callback will not be called for them anymore
+void db_batch_free(struct db_batch *batch)
+{
+	db_batch_flush(batch);
+	for(struct db_batch_chunk *chunk = db->batch.head; chunk; chunk = chunk->next)
+	{
+		if(chunk->batch == batch)
+			chunk->batch = NULL;
+	}
 
-	for(unsigned int ii = 0; ii < in_values->count; ++ii)
+	db_nv_list_clear(batch->columns);
+	free(batch->columns);
+	if(batch->conflict)
 	{
-		struct db_named_value *dnv;
+		db_nv_list_clear(batch->conflict);
+		free(batch->conflict);
+	}
+	if(batch->keys)
+		dict_free(batch->keys);
+	free(batch);
+}
 
-		dnv = &in_values->data[ii];
-		/* Find the column or bail out. */
-		desc = dict_find(table->columns, dnv->name);
-		if(!desc)
+static void db_batch_flush(struct db_batch *batch)
+{
+	struct db_nv_list *columns = batch->columns;
+	struct db_batch_chunk *chunk;
+	struct stringbuffer *sql;
+
+	if(!batch->rows)
+		return;
+
+	timer_del_boundname(batch, "db_batch_flush");
+
+	sql = stringbuffer_create();
+	if(batch->conflict)
+	{
+		unsigned int param = 0, first = 1;
+
+		stringbuffer_append_printf(sql, "INSERT INTO \"%s\" (", batch->table->name);
+		for(unsigned int ii = 0; ii < columns->count; ++ii)
+			stringbuffer_append_printf(sql, "%s\"%s\"", (ii ? ", " : ""), columns->data[ii].name);
+		stringbuffer_append_string(sql, ") VALUES ");
+		for(unsigned int row = 0; row < batch->rows; ++row)
 		{
-			log_append(LOG_ERROR, "Tried to db_row_insert('%s', %d values) with non-existent column %s.", table->name, in_values->count, dnv->name);
-			rval = 1;
-			goto out;
+			stringbuffer_append_string(sql, (row ? ", (" : "("));
+			for(unsigned int ii = 0; ii < columns->count; ++ii)
+				stringbuffer_append_printf(sql, "%s$%u", (ii ? ", " : ""), ++param);
+			stringbuffer_append_char(sql, ')');
 		}
 
-		/* Append elements to query strings. */
-		if(ii)
+		stringbuffer_append_string(sql, " ON CONFLICT (");
+		for(unsigned int ii = 0; ii < batch->conflict->count; ++ii)
+			stringbuffer_append_printf(sql, "%s\"%s\"", (ii ? ", " : ""), batch->conflict->data[ii].name);
+		stringbuffer_append_char(sql, ')');
+
+		for(unsigned int ii = 0; ii < columns->count; ++ii)
+		{
+			unsigned int key = 0;
+			for(unsigned int jj = 0; !key && jj < batch->conflict->count; ++jj)
+				key = !strcmp(columns->data[ii].name, batch->conflict->data[jj].name);
+			if(key)
+				continue;
+
+			stringbuffer_append_string(sql, (first ? " DO UPDATE SET " : ", "));
+			stringbuffer_append_printf(sql, "\"%s\"=EXCLUDED.\"%s\"", columns->data[ii].name, columns->data[ii].name);
+			first = 0;
+		}
+
+		if(first)
+			stringbuffer_append_string(sql, " DO NOTHING");
+	}
+	else
+	{
+		stringbuffer_append_printf(sql, "COPY \"%s\" (", batch->table->name);
+		for(unsigned int ii = 0; ii < columns->count; ++ii)
+			stringbuffer_append_printf(sql, "%s\"%s\"", (ii ? ", " : ""), columns->data[ii].name);
+		stringbuffer_append_string(sql, ") FROM STDIN");
+	}
+
+	chunk = malloc(sizeof(struct db_batch_chunk));
+	memset(chunk, 0, sizeof(struct db_batch_chunk));
+	chunk->batch = batch;
+	chunk->table = strdup(batch->table->name);
+	chunk->sql = strdup(sql->string);
+	chunk->data = batch->data;
+	chunk->params = batch->params;
+	chunk->rows = batch->rows;
+	stringbuffer_free(sql);
+
+	batch->data = NULL;
+	batch->params = NULL;
+	batch->rows = 0;
+	if(batch->keys)
+		dict_clear(batch->keys);
+
+	if(db->batch.tail)
+		db->batch.tail->next = chunk;
+	else
+		db->batch.head = chunk;
+	db->batch.tail = chunk;
+
+	db_batch_conn_next();
+}
+
+static void db_batch_flush_tmr(UNUSED_ARG(void *bound), struct db_batch *batch)
+{
+	db_batch_flush(batch);
+}
+
+// Encodes the conflict columns of a row; the column types keep the encoding unambiguous
+static char *db_batch_key(struct db_batch *batch, struct db_nv_list *values)
+{
+	struct stringbuffer *sbuf = stringbuffer_create();
+	char *key;
+
+	for(unsigned int ii = 0; ii < batch->conflict->count; ++ii)
+	{
+		for(unsigned int jj = 0; jj < values->count; ++jj)
 		{
-			stringbuffer_append_string(query, ", ");
-			stringbuffer_append_string(value_fmt, ", ");
+			const struct db_named_value *dnv = &values->data[jj];
+			struct column_desc *desc;
+
+			if(strcmp(dnv->name, batch->conflict->data[ii].name))
+				continue;
+
+			desc = dict_find(batch->table->columns, dnv->name);
+			if(desc->type == DBTYPE_INTEGER)
+				stringbuffer_append_printf(sbuf, "%d;", dnv->u.integer);
+			else if(desc->type == DBTYPE_DATETIME)
+				stringbuffer_append_printf(sbuf, "%ld;", (long)dnv->u.datetime);
+			else if(desc->type == DBTYPE_STRING)
+				stringbuffer_append_printf(sbuf, "%zu:%s", (dnv->u.string ? strlen(dnv->u.string) : 0), (dnv->u.string ? dnv->u.string : ""));
+			break;
 		}
+	}
 
-		stringbuffer_append_char(query, '"');
-		stringbuffer_append_string(query, dnv->name);
-		stringbuffer_append_char(query, '"');
-		stringbuffer_append_printf(value_fmt, "$%u", ii+1);
+	key = strdup(sbuf->string);
+	stringbuffer_free(sbuf);
+	return key;
+}
 
-		/* Figure out what type it is and append that to query value list. */
-		switch(desc->type)
+// Overwrites the parameters of a collected row; the batch keeps its position in the statement
+static int db_batch_replace(struct db_batch *batch, unsigned int row, struct db_nv_list *values)
+{
+	struct db_params *params = db_params_create();
+	unsigned int first = row * batch->columns->count;
+	int res;
+
+	if(!(res = db_bind_values(batch->table, params, values, 1)))
+	{
+		for(unsigned int ii = 0; ii < params->count; ++ii)
 		{
-			case DBTYPE_INTEGER:
-				snprintf(value, sizeof(value), "%d", dnv->u.integer);
-				stringlist_add(values, strdup(value));
+			free(batch->params->values[first + ii]);
+			batch->params->values[first + ii] = params->values[ii];
+			batch->params->lengths[first + ii] = params->lengths[ii];
+		}
+		params->count = 0;
+	}
+
+	db_params_free(params);
+	return res;
+}
+
+// Escapes a value for COPY's text format
+static void db_batch_copy_append(struct stringbuffer *sbuf, const char *str)
+{
+	for(; *str; str++)
+	{
+		switch(*str)
+		{
+			case '\\':
+				stringbuffer_append_string(sbuf, "\\\\");
+				break;
+			case '\t':
+				stringbuffer_append_string(sbuf, "\\t");
+				break;
+			case '\n':
+				stringbuffer_append_string(sbuf, "\\n");
 				break;
+			case '\r':
+				stringbuffer_append_string(sbuf, "\\r");
+				break;
+			default:
+				stringbuffer_append_char(sbuf, *str);
+				break;
+		}
+	}
+}
 
-			case DBTYPE_DATETIME: {
-				struct tm tm;
+static void db_batch_chunk_free(struct db_batch_chunk *chunk)
+{
+	if(chunk->data)
+		stringbuffer_free(chunk->data);
+	if(chunk->params)
+		db_params_free(chunk->params);
+	free(chunk->table);
+	free(chunk->sql);
+	free(chunk);
+}
 
-				memset(&tm, 0, sizeof(tm));
-				if(!gmtime_r(&dnv->u.datetime, &tm)) {
-					log_append(LOG_ERROR, "Could not gmtime_r(%ld).", dnv->u.datetime);
-					rval = 2;
-					goto out;
-				}
+// Removes the first queued chunk and reports its outcome
+static void db_batch_chunk_done(unsigned int error)
+{
+	struct db_batch_chunk *chunk = db->batch.head;
 
-				if(!strftime(value, sizeof(value), "%Y-%m-%d %H:%M:%S-00", &tm)) {
-					log_append(LOG_ERROR, "Could not strftime(%ld).", dnv->u.datetime);
-					rval = 3;
-					goto out;
-				}
+	if(!(db->batch.head = chunk->next))
+		db->batch.tail = NULL;
 
-				stringlist_add(values, strdup(value));
-				break;
-			}
+	if(chunk->batch && chunk->batch->cb)
+		chunk->batch->cb(chunk->batch->ctx, chunk->rows, error);
+	db_batch_chunk_free(chunk);
+}
 
-			case DBTYPE_STRING:
-				stringlist_add(values, strdup(dnv->u.string ? dnv->u.string : ""));
+static int db_batch_conn_start()
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+
+	if(!(bc->pg = pgsql_init(db_conf.connect_string)))
+	{
+		log_append(LOG_ERROR, "Batch connection failed to database: no connection available");
+		return 1;
+	}
+
+	switch(pgsql_when_ready(bc->pg, db_batch_conn_ready, NULL))
+	{
+		case 0:
+			db_batch_conn_attach();
+			return 0;
+
+		case 1:
+			bc->state = PGSQL_BATCH_CONNECTING;
+			return 0;
+
+		default:
+			log_append(LOG_ERROR, "Batch connection failed to database: %s", PQerrorMessage(bc->pg->conn));
+			db_batch_conn_close();
+			return 1;
+	}
+}
+
+// Takes over the pooled connection's libpq connection once it is established
+static void db_batch_conn_attach()
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+
+	bc->conn = bc->pg->conn;
+	PQsetnonblocking(bc->conn, 1);
+	bc->state = PGSQL_BATCH_IDLE;
+	bc->sock = sock_create(SOCK_NOSOCK|SOCK_QUIET, db_batch_conn_event, NULL);
+	bc->sock->config_poll = 1;
+	bc->sock->want_read = 1;
+	bc->sock->ctx = bc;
+	sock_set_fd(bc->sock, PQsocket(bc->conn));
+}
+
+static void db_batch_conn_ready(UNUSED_ARG(struct pgsql *conn), int ok, UNUSED_ARG(void *ctx))
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+
+	if(!ok)
+	{
+		log_append(LOG_ERROR, "Batch connection failed to database: %s", PQerrorMessage(bc->pg->conn));
+		db_batch_conn_close();
+		while(bc->head)
+			db_batch_chunk_done(1);
+		return;
+	}
+
+	db_batch_conn_attach();
+	db_batch_conn_next();
+}
+
+static void db_batch_conn_close()
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+
+	if(bc->sock)
+	{
+		// The fd belongs to libpq, so keep the socket code from closing it
+		bc->sock->fd = -1;
+		sock_close(bc->sock);
+		bc->sock = NULL;
+	}
+
+	// The pool drops the connection if it is in the middle of something
+	if(bc->pg)
+	{
+		pgsql_fini(bc->pg);
+		bc->pg = NULL;
+	}
+
+	bc->conn = NULL;
+	bc->state = PGSQL_BATCH_DOWN;
+}
+
+static void db_batch_conn_lost(const char *error)
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+	unsigned int busy = (bc->state >= PGSQL_BATCH_COPY_START);
+	unsigned int connecting = (bc->state == PGSQL_BATCH_CONNECTING);
+
+	log_append(LOG_ERROR, "Batch connection to database lost: %s", error);
+	db_batch_conn_close();
+
+	// Do not keep reconnecting to a server which drops new connections
+	if(connecting)
+	{
+		while(bc->head)
+			db_batch_chunk_done(1);
+		return;
+	}
+
+	// The statement in flight was rolled back; the remaining ones get a new connection
+	if(busy)
+		db_batch_chunk_done(1);
+	db_batch_conn_next();
+}
+
+static void db_batch_conn_next()
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+	struct db_batch_chunk *chunk;
+	int sent;
+
+	if(!bc->head)
+		return;
+
+	if(bc->state == PGSQL_BATCH_DOWN && db_batch_conn_start())
+	{
+		while(bc->head)
+			db_batch_chunk_done(1);
+		return;
+	}
+
+	if(bc->state != PGSQL_BATCH_IDLE)
+		return;
+
+	chunk = bc->head;
+	bc->error = 0;
+	if(chunk->params)
+	{
+		bc->state = PGSQL_BATCH_RESULT;
+		sent = PQsendQueryParams(bc->conn, chunk->sql, chunk->params->count, chunk->params->types, (const char*const*)chunk->params->values, chunk->params->lengths, chunk->params->formats, 0);
+	}
+	else
+	{
+		bc->state = PGSQL_BATCH_COPY_START;
+		sent = PQsendQuery(bc->conn, chunk->sql);
+	}
+
+	if(!sent)
+	{
+		db_batch_conn_lost(strdupa(PQerrorMessage(bc->conn)));
+		return;
+	}
+
+	db_batch_conn_flush();
+}
+
+static void db_batch_conn_flush()
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+	int ret;
+
+	if((ret = PQflush(bc->conn)) == -1)
+	{
+		db_batch_conn_lost(strdupa(PQerrorMessage(bc->conn)));
+		return;
+	}
+
+	bc->sock->want_write = (ret == 1);
+	bc->sock->want_read = 1;
+}
+
+static void db_batch_conn_send_data()
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+	struct db_batch_chunk *chunk = bc->head;
+	int ret;
+
+	while(chunk->sent < chunk->data->len)
+	{
+		size_t len = chunk->data->len - chunk->sent;
+		if(len > 65536)
+			len = 65536;
+
+		if((ret = PQputCopyData(bc->conn, chunk->data->string + chunk->sent, len)) == 0)
+		{
+			// libpq's buffer is full, continue once the socket is writable
+			bc->sock->want_write = 1;
+			return;
+		}
+		else if(ret < 0)
+		{
+			db_batch_conn_lost(strdupa(PQerrorMessage(bc->conn)));
+			return;
+		}
+
+		chunk->sent += len;
+	}
+
+	if((ret = PQputCopyEnd(bc->conn, NULL)) == 0)
+	{
+		bc->sock->want_write = 1;
+		return;
+	}
+	else if(ret < 0)
+	{
+		db_batch_conn_lost(strdupa(PQerrorMessage(bc->conn)));
+		return;
+	}
+
+	bc->state = PGSQL_BATCH_RESULT;
+	db_batch_conn_flush();
+}
+
+static void db_batch_conn_results()
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+	PGresult *res;
+
+	while((bc->state == PGSQL_BATCH_COPY_START || bc->state == PGSQL_BATCH_RESULT) && !PQisBusy(bc->conn))
+	{
+		if(!(res = PQgetResult(bc->conn)))
+		{
+			// The statement is complete
+			bc->state = PGSQL_BATCH_IDLE;
+			db_batch_chunk_done(bc->error);
+			db_batch_conn_next();
+			continue;
+		}
+
+		switch(PQresultStatus(res))
+		{
+			case PGRES_COPY_IN:
+				bc->state = PGSQL_BATCH_COPY_DATA;
 				break;
 
-			case DBTYPE_SERIAL:
-				/* Special behavior for special column type! */
-				dnv->u.serial = pgsql_get_serial(table, desc, values);
+			case PGRES_COMMAND_OK:
 				break;
 
 			default:
-				log_append(LOG_ERROR, "Unhandled type %d for column %s in table %s.", desc->type, desc->name, table->name);
-				rval = 4;
-				goto out;
+				log_append(LOG_ERROR, "Could not write %u rows to %s: %s", bc->head->rows, bc->head->table, PQresultErrorMessage(res));
+				bc->error = 1;
+				// A failing COPY never enters COPY IN
+				bc->state = PGSQL_BATCH_RESULT;
+				break;
+		}
+		PQclear(res);
+
+		if(bc->state == PGSQL_BATCH_COPY_DATA)
+			db_batch_conn_send_data();
+	}
+}
+
+static void db_batch_conn_event(struct sock *sock, enum sock_event event, int err)
+{
+	struct pgsql_batch_conn *bc = sock->ctx;
+	int ret;
+
+	switch(event)
+	{
+		case EV_WRITE:
+			if((ret = PQflush(bc->conn)) == -1)
+				db_batch_conn_lost(strdupa(PQerrorMessage(bc->conn)));
+			else if(ret == 0 && bc->state == PGSQL_BATCH_COPY_DATA)
+				db_batch_conn_send_data();
+			else
+				sock->want_write = (ret == 1);
+			break;
+
+		case EV_READ:
+			if(!PQconsumeInput(bc->conn))
+			{
+				db_batch_conn_lost(strdupa(PQerrorMessage(bc->conn)));
+				break;
+			}
+			db_batch_conn_results();
+			break;
+
+		case EV_HANGUP:
+		case EV_ERROR:
+			db_batch_conn_lost(err ? strerror(err) : "connection closed");
+			break;
+
+		default:
+			break;
+	}
+}
+
+// Writes everything still queued before the module goes away
+static void db_batch_conn_drain()
+{
+	struct pgsql_batch_conn *bc = &db->batch;
+	PGresult *res;
+
+	// Once COPY has been ended the server may already have committed the rows
+	if(bc->state == PGSQL_BATCH_RESULT && bc->conn)
+	{
+		PQsetnonblocking(bc->conn, 0);
+		PQflush(bc->conn);
+		while((res = PQgetResult(bc->conn)))
+		{
+			if(PQresultStatus(res) != PGRES_COMMAND_OK)
+			{
+				log_append(LOG_ERROR, "Could not write %u rows to %s: %s", bc->head->rows, bc->head->table, PQresultErrorMessage(res));
+				bc->error = 1;
+			}
+			PQclear(res);
+		}
+		db_batch_chunk_done(bc->error);
+	}
+
+	// Anything else is rolled back with the connection and written on the main one
+	db_batch_conn_close();
+	while(bc->head)
+	{
+		struct db_batch_chunk *chunk = bc->head;
+		PGconn *conn = db_sync_conn();
+		unsigned int error = 0;
+
+		if(!conn)
+			res = NULL;
+		else if(chunk->params)
+			res = PQexecParams(conn, chunk->sql, chunk->params->count, chunk->params->types, (const char*const*)chunk->params->values, chunk->params->lengths, chunk->params->formats, 0);
+		else if((res = PQexec(conn, chunk->sql)) && PQresultStatus(res) == PGRES_COPY_IN)
+		{
+			PQclear(res);
+			PQputCopyData(conn, chunk->data->string, chunk->data->len);
+			PQputCopyEnd(conn, NULL);
+			res = PQgetResult(conn);
+			// Collect the NULL which ends the command
+			PQclear(PQgetResult(conn));
+		}
+
+		if(!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			log_append(LOG_ERROR, "Could not write %u rows to %s: %s", chunk->rows, chunk->table, (res ? PQresultErrorMessage(res) : db_error()));
+			error = 1;
 		}
+		PQclear(res);
+		db_batch_chunk_done(error);
+	}
+}
+
+// actual db access functions
+static PGresult *do_PQexecParams(const char *command, int nParams, char **paramValues)
+{
+	PGresult *res = NULL;
+	PGconn *conn;
+
+	// If the connection broke during the query, it was most likely not processed -> retry once
+	for(unsigned int attempt = 0; attempt < 2; ++attempt)
+	{
+		if(!(conn = db_sync_conn()))
+			return NULL;
+
+		res = PQexecParams(conn, command, nParams, NULL, (const char*const*)paramValues, NULL, NULL, 0);
+		if(PQstatus(conn) != CONNECTION_BAD)
+			break;
+
+		debug("reconnecting - after query");
+		PQclear(res);
+		res = NULL;
+	}
+
+	return res;
+}
+
+static PGresult *do_PQexec(const char *command)
+{
+	PGresult *res = NULL;
+	PGconn *conn;
+
+	for(unsigned int attempt = 0; attempt < 2; ++attempt)
+	{
+		if(!(conn = db_sync_conn()))
+			return NULL;
+
+		res = PQexec(conn, command);
+		if(PQstatus(conn) != CONNECTION_BAD)
+			break;
+
+		debug("reconnecting - after query");
+		PQclear(res);
+		res = NULL;
 	}
 
-	/* Now put together the rest of the query string. */
-	stringbuffer_append_printf(query, ") VALUES (%s)", value_fmt->string);
-	res = do_PQexecParams(&db->conn, query->string, values->count, values->data);
-	if(!res || (PQresultStatus(res) != PGRES_COMMAND_OK))
+	return res;
+}
+
+static PGresult *db_stmt_exec(struct db_stmt *stmt, struct db_params *params)
+{
+	PGresult *res = NULL;
+	PGconn *conn;
+
+	for(unsigned int attempt = 0; attempt < 2; ++attempt)
 	{
-		log_append(LOG_ERROR, "Failure INSERTing to %s: %s", table->name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
+		if(!(conn = db_sync_conn()))
+			return NULL;
+
+		// Prepared statements die with the session
+		if(stmt->generation != db->conn->generation)
+		{
+			res = PQprepare(conn, stmt->name, stmt->sql, params->count, params->types);
+			if(res && PQresultStatus(res) == PGRES_COMMAND_OK)
+			{
+				PQclear(res);
+				stmt->generation = db->conn->generation;
+			}
+			else if(PQstatus(conn) != CONNECTION_BAD)
+			{
+				log_append(LOG_ERROR, "Could not prepare statement %s: %s", stmt->sql, (res ? PQresultErrorMessage(res) : PQerrorMessage(conn)));
+				PQclear(res);
+				return NULL;
+			}
+			else
+			{
+				PQclear(res);
+				continue;
+			}
+		}
+
+		res = PQexecPrepared(conn, stmt->name, params->count, (const char*const*)params->values, params->lengths, params->formats, 1);
+		if(PQstatus(conn) != CONNECTION_BAD)
+			break;
+
+		debug("reconnecting - after query");
+		PQclear(res);
+		res = NULL;
+	}
+
+	debug("Query: %s", stmt->sql);
+	return res;
+}
+
+static int do_row_insert(struct db_table *table, struct db_nv_list *in_values)
+{
+	struct db_params *params;
+	struct db_stmt *stmt;
+	struct column_desc *desc;
+	struct db_nv_list bound;
+	PGresult *res;
+	int rval, serials = 0;
+
+	params = db_params_create();
+	memset(&bound, 0, sizeof(bound));
+	for(unsigned int ii = 0; ii < in_values->count; ++ii)
+	{
+		struct db_named_value *dnv;
+
+		dnv = &in_values->data[ii];
+		/* Find the column or bail out. */
+		desc = dict_find(table->columns, dnv->name);
+		if(!desc)
+		{
+			log_append(LOG_ERROR, "Tried to db_row_insert('%s', %d values) with non-existent column %s.", table->name, in_values->count, dnv->name);
+			rval = 1;
+			goto out;
+		}
+
+		/* Special behavior for special column type! The statement fills in the serial itself. */
+		if(desc->type == DBTYPE_SERIAL)
+			serials++;
+		else
+			db_nv_list_add(&bound, *dnv);
+	}
+
+	rval = db_bind_values(table, params, &bound, 0);
+	if(rval)
+		goto out;
+
+	stmt = db_stmt_get(table, DB_STMT_INSERT, in_values, NULL, NULL);
+	res = db_stmt_exec(stmt, params);
+	if(!res || (PQresultStatus(res) != (serials ? PGRES_TUPLES_OK : PGRES_COMMAND_OK)) || (serials && PQntuples(res) != 1))
+	{
+		log_append(LOG_ERROR, "Failure INSERTing to %s: %s", table->name, (res ? PQresultErrorMessage(res) : db_error()));
 		PQclear(res);
 		rval = 5;
 		goto out;
 	}
+
+	// RETURNING lists the serial columns in the order they were given
+	for(unsigned int ii = 0, field = 0; serials && ii < in_values->count; ++ii)
+	{
+		desc = dict_find(table->columns, in_values->data[ii].name);
+		if(desc->type == DBTYPE_SERIAL)
+			in_values->data[ii].u.serial = db_get_binary_int(res, 0, field++);
+	}
 	PQclear(res);
-	debug("Query: %s", query->string);
-	debug("Params:");
-	for(unsigned int ii = 0; ii < values->count; ++ii)
-		debug("   $%u = %s", ii+1, values->data[ii]);
 	rval = 0;
 out:
-	stringlist_free(values);
-	stringbuffer_free(query);
-	stringbuffer_free(value_fmt);
+	db_nv_list_clear(&bound);
+	db_params_free(params);
 	return rval;
 }
 
 static int do_row_update(struct db_table *table, struct db_nv_list *filter, struct db_nv_list *updates)
 {
-	struct stringbuffer *query;
-	struct stringlist *params;
+	struct db_params *params;
+	struct db_stmt *stmt;
 	PGresult *res;
 	unsigned int rval;
 
-	query = stringbuffer_create();
-	params = stringlist_create();
-	stringbuffer_append_printf(query, "UPDATE \"%s\" SET ", table->name);
-	rval = db_get_values(table, query, params, updates, ", ", 1);
+	params = db_params_create();
+	rval = db_bind_values(table, params, updates, 1);
 	if(rval)
 		goto out;
-	stringbuffer_append_string(query, " WHERE ");
-	rval = db_get_values(table, query, params, filter, " AND ", 0);
+	rval = db_bind_values(table, params, filter, 0);
 	if(rval)
 		goto out;
-	res = do_PQexecParams(&db->conn, query->string, params->count, params->data);
+
+	stmt = db_stmt_get(table, DB_STMT_UPDATE, updates, filter, NULL);
+	res = db_stmt_exec(stmt, params);
 	if (!res || (PQresultStatus(res) != PGRES_COMMAND_OK)) {
-		log_append(LOG_ERROR, "Failure UPDATEing %s: %s", table->name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
+		log_append(LOG_ERROR, "Failure UPDATEing %s: %s", table->name, (res ? PQresultErrorMessage(res) : db_error()));
 		PQclear(res);
 		rval = 5;
 		goto out;
 	}
 	PQclear(res);
-	debug("Query: %s", query->string);
-	debug("Params:");
-	for(unsigned int ii = 0; ii < params->count; ++ii)
-		debug("   $%u = %s", ii+1, params->data[ii]);
 	rval = 0;
 out:
-	stringbuffer_free(query);
-	stringlist_free(params);
+	db_params_free(params);
 	return rval;
 }
 
 static int do_row_drop(struct db_table *table, struct db_nv_list *filter)
 {
-	struct stringbuffer *query;
-	struct stringlist *params;
+	struct db_params *params;
+	struct db_stmt *stmt;
 	PGresult *res;
 	unsigned int rval;
 
-	query = stringbuffer_create();
-	params = stringlist_create();
-	stringbuffer_append_printf(query, "DELETE FROM \"%s\" WHERE ", table->name);
-	rval = db_get_values(table, query, params, filter, " AND ", 0);
+	params = db_params_create();
+	rval = db_bind_values(table, params, filter, 0);
 	if(rval)
 		goto out;
 
-	res = do_PQexecParams(&db->conn, query->string, params->count, params->data);
+	stmt = db_stmt_get(table, DB_STMT_DELETE, NULL, filter, NULL);
+	res = db_stmt_exec(stmt, params);
 	if(!res || (PQresultStatus(res) != PGRES_COMMAND_OK)) {
-		log_append(LOG_ERROR, "Failure UPDATEing %s: %s", table->name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
+		log_append(LOG_ERROR, "Failure UPDATEing %s: %s", table->name, (res ? PQresultErrorMessage(res) : db_error()));
 		PQclear(res);
 		rval = 5;
 		goto out;
 	}
 	PQclear(res);
-
-	debug("Query: %s", query->string);
-	debug("Params:");
-	for(unsigned int ii = 0; ii < params->count; ++ii)
-		debug("   $%u = %s", ii+1, params->data[ii]);
 	rval = 0;
 out:
-	stringbuffer_free(query);
-	stringlist_free(params);
+	db_params_free(params);
 	return rval;
 }
 
 static int do_row_get(struct db_table *table, struct db_nv_list *filter, struct db_nv_list *values)
 {
-	struct stringbuffer *query;
-	struct stringlist *params;
+	struct db_params *params;
+	struct db_stmt *stmt;
 	PGresult *res;
 	unsigned int rval;
 
-	query = stringbuffer_create();
-	params = stringlist_create();
-	stringbuffer_append_printf(query, "SELECT * FROM \"%s\" WHERE ", table->name);
-	rval = db_get_values(table, query, params, filter, " AND ", 0);
+	params = db_params_create();
+	rval = db_bind_values(table, params, filter, 0);
 	if(rval)
 		goto out;
-	res = do_PQexecParams(&db->conn, query->string, params->count, params->data);
+
+	// db_row_get() has always required a WHERE clause
+	stmt = db_stmt_get(table, DB_STMT_SELECT, values, filter, NULL);
+	res = filter->count ? db_stmt_exec(stmt, params) : NULL;
 	if(!res || (PQresultStatus(res) != PGRES_TUPLES_OK))
 	{
-		log_append(LOG_ERROR, "Failure SELECTing %s: %s", table->name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
+		log_append(LOG_ERROR, "Failure SELECTing %s: %s", table->name, (res ? PQresultErrorMessage(res) : db_error()));
 		PQclear(res);
 		rval = 5;
 		goto out;
@@ -1497,47 +2241,29 @@ static int do_row_get(struct db_table *table, struct db_nv_list *filter, struct
 	else
 		rval = 6;
 	PQclear(res);
-
-	debug("Query: %s", query->string);
-	debug("Params:");
-	for(unsigned int ii = 0; ii < params->count; ++ii)
-		debug("   $%u = %s", ii+1, params->data[ii]);
 out:
-	stringbuffer_free(query);
-	stringlist_free(params);
+	db_params_free(params);
 	return rval;
 }
 
 static int do_sync_select(struct db_table *table, db_select_cb cb, void *ctx, db_free_ctx_f *free_ctx_func, struct db_nv_list *filter, struct db_nv_list *values, struct db_nv_list *order)
 {
-	struct stringbuffer *query;
-	struct stringlist *params;
+	struct db_params *params;
+	struct db_stmt *stmt;
 	PGresult *res;
 	unsigned int ii, count, rval;
 
-	query = stringbuffer_create();
-	params = stringlist_create();
-	stringbuffer_append_printf(query, "SELECT * FROM \"%s\" ", table->name);
-	if(filter->count)
-	{
-		stringbuffer_append_string(query, "WHERE ");
-		rval = db_get_values(table, query, params, filter, " AND ", 0);
-		if(rval)
-			goto out;
-	}
-
-	if(order->count)
-	{
-		stringbuffer_append_string(query, " ORDER BY ");
-		rval = db_get_order(table, query, order);
-		if(rval)
-			goto out;
-	}
+	params = db_params_create();
+	rval = db_bind_values(table, params, filter, 0);
+	if(rval)
+		goto out;
+	db_bind_order(params, order);
 
-	res = do_PQexecParams(&db->conn, query->string, params->count, params->data);
+	stmt = db_stmt_get(table, DB_STMT_SELECT, values, filter, order);
+	res = db_stmt_exec(stmt, params);
 	if(!res || (PQresultStatus(res) != PGRES_TUPLES_OK))
 	{
-		log_append(LOG_ERROR, "Failure SELECTing %s: %s", table->name, (res ? PQresultErrorMessage(res) : PQerrorMessage(db->conn)));
+		log_append(LOG_ERROR, "Failure SELECTing %s: %s", table->name, (res ? PQresultErrorMessage(res) : db_error()));
 		PQclear(res);
 		rval = 5;
 		goto out;
@@ -1557,52 +2283,73 @@ static int do_sync_select(struct db_table *table, db_select_cb cb, void *ctx, db
 	}
 
 	PQclear(res);
-	debug("Query: %s", query->string);
-	debug("Params:");
-	for(unsigned int ii = 0; ii < params->count; ++ii)
-		debug("   $%u = %s", ii+1, params->data[ii]);
 	rval = 0;
 out:
 	if(free_ctx_func)
 		free_ctx_func(ctx);
-	stringbuffer_free(query);
-	stringlist_free(params);
+	db_params_free(params);
 	return rval;
 }
 
 static int do_async_select(struct db_table *table, db_select_cb cb, void *ctx, db_free_ctx_f *free_ctx_func, struct db_nv_list *filter, struct db_nv_list *values, struct db_nv_list *order)
 {
 	struct pgsql_async *async;
+	struct db_params *params;
+	struct db_stmt *stmt;
+	int rval;
 
-	if(!(async = pgsql_get_async(table)))
-	{
-		db_nv_list_clear(filter);
-		db_nv_list_clear(values);
-		db_nv_list_clear(order);
-		free(filter);
-		free(values);
-		free(order);
-		return 1;
-	}
-
+	async = malloc(sizeof(struct pgsql_async));
+	memset(async, 0, sizeof(struct pgsql_async));
 	async->table = table;
 	async->cb = cb;
 	async->ctx = ctx;
 	async->free_ctx_func = free_ctx_func;
-	async->filter = filter;
-	async->order = order;
-	if(async->values)
-		log_append(LOG_WARNING, "MEMLEAK: async struct still had values != 0!");
 	async->values = values;
-	debug("async->state = %d", async->state);
-	if(async->state == PGSQL_ASYNC_IDLE)
-		return pgsql_send_query(async);
-	return 0;
-}
 
+	params = db_params_create();
+	if(!(stmt = db_stmt_get(table, DB_STMT_SELECT, values, filter, order)))
+	{
+		rval = 2;
+		goto out;
+	}
+
+	rval = db_bind_values(table, params, filter, 0);
+	if(rval)
+		goto out;
+	db_bind_order(params, order);
+
+	if(!db->async && !(db->async = pgsql_init(db_conf.connect_string)))
+	{
+		rval = 1;
+		goto out;
+	}
+
+	// The statement is only prepared on the main connection, so send its text along
+	if(pgsql_query_async_params(db->async, stmt->sql, params->count, params->types, (const char*const*)params->values, params->lengths, params->formats, 1, pgsql_async_result, async))
+	{
+		rval = 1;
+		goto out;
+	}
+
+	debug("Query: %s", stmt->sql);
+	ptrlist_add(db->selects, 0, async);
+	rval = 0;
+out:
+	if(rval)
+		pgsql_async_free(async);
+	db_nv_list_clear(filter);
+	free(filter);
+	db_nv_list_clear(order);
+	free(order);
+	db_params_free(params);
+	return rval;
+}
 
 /* testing */
 #ifdef DB_TEST
+#include <sys/time.h>
+#include <sys/resource.h>
+
 static const struct column_desc test_cols[] = {
 	{ "id", DBTYPE_SERIAL },
 	{ "chartest", DBTYPE_STRING },
@@ -1610,6 +2357,12 @@ static const struct column_desc test_cols[] = {
 	{ NULL, DBTYPE_NUM_TYPES }
 };
 
+static const struct column_desc upsert_cols[] = {
+	{ "name", DBTYPE_STRING },
+	{ "value", DBTYPE_INTEGER },
+	{ NULL, DBTYPE_NUM_TYPES }
+};
+
 DB_SELECT_CB(test_cb)
 {
 	unsigned int ctx_num = (int)ctx;
@@ -1634,6 +2387,38 @@ void second_query(void *bound, void *data)
 	timer_add(this, "2nd_query", now + 10, second_query, test_table, 0, 1);
 }
 
+// The key added twice to one batch must be written once, with the values added last
+static void upsert_cb(UNUSED_ARG(void *ctx), unsigned int rows, unsigned int error)
+{
+	int value = 0;
+
+	if(error || rows != 2 || db_row_get(upsert_table, "name", "a", NULL, "value", &value, NULL) || value != 3)
+		log_append(LOG_ERROR, "upsert with a duplicate key: %u rows, error %u, value %d", rows, error, value);
+	else
+		debug("upsert with a duplicate key stored the last row");
+
+	db_batch_free(upsert_batch);
+	upsert_batch = NULL;
+}
+
+static void run_upsert_test()
+{
+	if(!(upsert_table = db_table_open("test_upsert", upsert_cols)))
+		return;
+
+	PQclear(do_PQexec("CREATE UNIQUE INDEX IF NOT EXISTS test_upsert_name ON test_upsert (name)"));
+	db_row_drop(upsert_table, "name", "a", NULL);
+	db_row_drop(upsert_table, "name", "b", NULL);
+
+	debug("batch upsert");
+	upsert_batch = db_batch_create(upsert_table, upsert_cb, NULL, "name", "value", NULL);
+	db_batch_upsert(upsert_batch, "name", NULL);
+	db_batch_add(upsert_batch, "a", 1);
+	db_batch_add(upsert_batch, "b", 2);
+	db_batch_add(upsert_batch, "a", 3);
+	db_batch_commit(upsert_batch);
+}
+
 static void run_test()
 {
 	test_table = db_table_open("test", test_cols);
@@ -1663,5 +2448,108 @@ static void run_test()
 
 	debug("delete");
 	db_row_drop(test_table, "id", serial-1, NULL);
+
+	run_upsert_test();
+	run_benchmark();
+}
+
+#define BENCH_ROWS	1000
+
+DB_SELECT_CB(bench_cb)
+{
+	(*(unsigned int *)ctx)++;
+	return 0;
+}
+
+struct bench_time
+{
+	struct timeval wall;
+	struct rusage usage;
+};
+
+static void bench_start(struct bench_time *start)
+{
+	gettimeofday(&start->wall, NULL);
+	getrusage(RUSAGE_SELF, &start->usage);
+}
+
+// Logs wall clock and cpu time per operation since bench_start()
+static void bench_report(const struct bench_time *start, const char *what)
+{
+	struct bench_time end;
+	double wall, cpu;
+
+	bench_start(&end);
+	wall = (end.wall.tv_sec - start->wall.tv_sec) * 1000000.0 + (end.wall.tv_usec - start->wall.tv_usec);
+	cpu = (end.usage.ru_utime.tv_sec + end.usage.ru_stime.tv_sec - start->usage.ru_utime.tv_sec - start->usage.ru_stime.tv_sec) * 1000000.0 +
+	      (end.usage.ru_utime.tv_usec + end.usage.ru_stime.tv_usec - start->usage.ru_utime.tv_usec - start->usage.ru_stime.tv_usec);
+	debug("benchmark: %u %s, %.1f us each (%.1f us cpu)", BENCH_ROWS, what, wall / BENCH_ROWS, cpu / BENCH_ROWS);
+}
+
+static struct bench_time batch_start;
+static unsigned int batch_rows, batch_failed;
+
+// Called for each flushed chunk of the batch started by run_benchmark()
+static void bench_batch_cb(UNUSED_ARG(void *ctx), unsigned int rows, unsigned int error)
+{
+	batch_rows += rows;
+	if(error)
+		batch_failed += rows;
+	if(batch_rows < BENCH_ROWS)
+		return;
+
+	bench_report(&batch_start, "batched inserts");
+	db_batch_free(bench_batch);
+	bench_batch = NULL;
+	batch_failed += !!db_row_drop(test_table, "chartest", "batch", NULL);
+	debug("benchmark: %u batched rows failed", batch_failed);
+}
+
+// Times the statements every table user issues; run against a local server to see the effect of the statement cache
+static void run_benchmark()
+{
+	struct bench_time start;
+	db_serial_t first = 0, serial;
+	unsigned int rows = 0, failed = 0;
+	char *str;
+
+	bench_start(&start);
+	for(unsigned int i = 0; i < BENCH_ROWS; i++)
+	{
+		serial = 0;
+		failed += !!db_row_insert(test_table, "id", &serial, "chartest", "bench", "datetest", now, NULL);
+		if(!first)
+			first = serial;
+	}
+	bench_report(&start, "inserts");
+
+	bench_start(&start);
+	for(unsigned int i = 0; i < BENCH_ROWS; i++)
+	{
+		str = NULL;
+		failed += !!db_row_get(test_table, "id", first + i, NULL, "chartest", &str, NULL);
+		free(str);
+	}
+	bench_report(&start, "row gets");
+
+	bench_start(&start);
+	for(unsigned int i = 0; i < BENCH_ROWS; i++)
+		failed += !!db_row_update(test_table, "id", first + i, NULL, "datetest", now + i, NULL);
+	bench_report(&start, "updates");
+
+	bench_start(&start);
+	for(unsigned int i = 0; i < BENCH_ROWS; i++)
+		failed += !!db_sync_select(test_table, bench_cb, &rows, NULL, "id", first + i, NULL, "id", "chartest", "datetest", NULL, NULL);
+	bench_report(&start, "selects");
+
+	failed += !!db_row_drop(test_table, "chartest", "bench", NULL);
+	debug("benchmark: %u rows selected, %u operations failed", rows, failed);
+
+	// The same number of rows through COPY; reported by bench_batch_cb() once all chunks are stored
+	bench_batch = db_batch_create(test_table, bench_batch_cb, NULL, "chartest", "datetest", NULL);
+	bench_start(&batch_start);
+	for(unsigned int i = 0; i < BENCH_ROWS; i++)
+		batch_failed += !!db_batch_add(bench_batch, "batch", now);
+	db_batch_commit(bench_batch);
 }
 #endif
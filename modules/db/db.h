@@ -41,6 +41,11 @@ struct db_table {
 typedef int (db_select_cb)(void *ctx, struct db_nv_list *values, unsigned int rownum, unsigned int rowcount, unsigned int error);
 #define DB_EMPTY_RESULT() (rowcount == 0)
 
+struct db_batch;
+// Called once for every flushed batch; error is non-zero if its rows were not stored.
+// An upserted row which replaced one with the same key in the same batch is not counted.
+typedef void (db_batch_cb)(void *ctx, unsigned int rows, unsigned int error);
+
 const char *db_type_to_name(enum db_type type);
 enum db_type db_type_from_name(const char *name);
 
@@ -56,4 +61,10 @@ int db_sync_select(struct db_table *table, db_select_cb cb, void *ctx, db_free_c
 int db_vasync_select(struct db_table *table, db_select_cb cb, void *ctx, db_free_ctx_f *free_ctx_func, va_list *args);
 int db_async_select(struct db_table *table, db_select_cb cb, void *ctx, db_free_ctx_f *free_ctx_func, ...);
 
+struct db_batch *db_batch_create(struct db_table *table, db_batch_cb *cb, void *ctx, ...);
+int db_batch_upsert(struct db_batch *batch, ...);
+int db_batch_add(struct db_batch *batch, ...);
+void db_batch_commit(struct db_batch *batch);
+void db_batch_free(struct db_batch *batch);
+
 #endif
@@ -113,7 +113,7 @@ COMMAND(google)
 	request_encoded = urlencode(obj->request);
 	sprintf(request, google_conf.url, request_encoded);
 
-	http = HTTPRequest_create(request, event_func, read_func);
+	http = HTTPRequest_create_cached(request, event_func, read_func, 0);
 
 	obj->http = http;
 	obj->id = strdup(http->id);
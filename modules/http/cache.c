@@ -0,0 +1,546 @@
+#include "global.h"
+#include "conf.h"
+#include "tools.h"
+#include "http.h"
+#include "cache.h"
+
+#define HTTP_CACHE_FILE_MAGIC	"surgebot-http-cache 1"
+
+struct http_cache_entry
+{
+	char *key;
+	time_t expires;
+	unsigned int refcount;
+	size_t size;
+
+	int status;
+	unsigned char failed; // request timed out or failed; replayed as H_EV_TIMEOUT
+	struct dict *headers;
+	struct stringbuffer *body;
+
+	// LRU list, most recently used first
+	struct http_cache_entry *prev;
+	struct http_cache_entry *next;
+};
+
+// Identical requests waiting for the same upstream response
+struct http_cache_flight
+{
+	char *key;
+	unsigned int ttl;
+	struct HTTPRequest *leader;
+	struct ptrlist *followers;
+	struct http_cache_entry *result;
+};
+
+static struct {
+	size_t max_size;
+	unsigned int ttl;
+	unsigned int negative_ttl;
+	const char *file;
+} http_cache_conf;
+
+static struct dict *cache_entries;
+static struct dict *cache_flights;
+static struct {
+	struct http_cache_entry *head;
+	struct http_cache_entry *tail;
+	size_t size;
+} cache_lru;
+
+static void http_cache_conf_reload();
+static char *http_cache_key(struct HTTPRequest *http);
+static struct http_cache_entry *http_cache_entry_create(const char *key, int status, unsigned char failed, struct dict *headers, const char *body, size_t body_len);
+static void http_cache_entry_put(struct http_cache_entry *entry);
+static void http_cache_entry_fill(struct http_cache_entry *entry, struct HTTPRequest *http);
+static void http_cache_insert(struct http_cache_entry *entry);
+static void http_cache_remove(struct http_cache_entry *entry);
+static void http_cache_evict(size_t needed);
+static void http_cache_flight_free(struct http_cache_flight *flight);
+static void http_cache_load(const char *filename);
+static struct http_cache_entry *http_cache_read_entry(FILE *fp, const char *line);
+static void http_cache_save(const char *filename);
+
+void http_cache_init()
+{
+	cache_entries = dict_create();
+	cache_flights = dict_create();
+	memset(&cache_lru, 0, sizeof(cache_lru));
+
+	reg_conf_reload_func(http_cache_conf_reload);
+	http_cache_conf_reload();
+
+	if(http_cache_conf.file)
+		http_cache_load(http_cache_conf.file);
+}
+
+void http_cache_fini()
+{
+	unreg_conf_reload_func(http_cache_conf_reload);
+
+	if(http_cache_conf.file)
+		http_cache_save(http_cache_conf.file);
+
+	// Requests still waiting for a response are freed by the caller; detach them first
+	dict_iter(node, cache_flights)
+	{
+		struct http_cache_flight *flight = node->data;
+		if(flight->leader)
+			flight->leader->flight = NULL;
+		for(unsigned int i = 0; i < flight->followers->count; i++)
+			((struct HTTPRequest *)flight->followers->data[i]->ptr)->flight = NULL;
+		http_cache_flight_free(flight);
+	}
+	dict_free(cache_flights);
+
+	while(cache_lru.head)
+		http_cache_remove(cache_lru.head);
+	dict_free(cache_entries);
+}
+
+static void http_cache_conf_reload()
+{
+	char *str;
+
+	http_cache_conf.max_size	= ((str = conf_get("http/cache_size", DB_STRING)) ? strtoul(str, NULL, 10) : 1048576);
+	http_cache_conf.ttl		= ((str = conf_get("http/cache_ttl", DB_STRING)) ? atoi(str) : 600);
+	http_cache_conf.negative_ttl	= ((str = conf_get("http/cache_negative_ttl", DB_STRING)) ? atoi(str) : 30);
+	http_cache_conf.file		= conf_get("http/cache_file", DB_STRING);
+
+	if(cache_lru.size > http_cache_conf.max_size)
+		http_cache_evict(0);
+}
+
+struct HTTPRequest *HTTPRequest_create_cached(const char *host, http_event_f *event_func, http_read_f *read_func, unsigned int ttl)
+{
+	struct HTTPRequest *http = HTTPRequest_create(host, event_func, read_func);
+	http->cache_ttl = ttl ? ttl : http_cache_conf.ttl;
+	return http;
+}
+
+enum http_cache_result http_cache_lookup(struct HTTPRequest *http, enum HTTPRequest_event *event)
+{
+	struct http_cache_entry *entry;
+	struct http_cache_flight *flight;
+	char *key;
+
+	// Only side-effect free requests can be shared
+	if(http->payload || (strcasecmp(http->method, "GET") && strcasecmp(http->method, "HEAD")))
+		return HTTP_CACHE_MISS;
+
+	key = http_cache_key(http);
+
+	if((entry = dict_find(cache_entries, key)))
+	{
+		if(entry->expires > now)
+		{
+			debug("HTTP Request %s served from cache (%s)", http->id, key);
+			http_cache_entry_fill(entry, http);
+			*event = entry->failed ? H_EV_TIMEOUT : H_EV_HANGUP;
+
+			// Move to the front of the LRU list
+			if(entry->prev)
+			{
+				entry->prev->next = entry->next;
+				if(entry->next)
+					entry->next->prev = entry->prev;
+				else
+					cache_lru.tail = entry->prev;
+				entry->prev = NULL;
+				entry->next = cache_lru.head;
+				cache_lru.head->prev = entry;
+				cache_lru.head = entry;
+			}
+
+			free(key);
+			return HTTP_CACHE_HIT;
+		}
+
+		http_cache_remove(entry);
+	}
+
+	if((flight = dict_find(cache_flights, key)))
+	{
+		debug("HTTP Request %s joined in-flight request %s", http->id, flight->leader->id);
+		ptrlist_add(flight->followers, 0, http);
+		http->flight = flight;
+		free(key);
+		return HTTP_CACHE_JOINED;
+	}
+
+	flight = malloc(sizeof(struct http_cache_flight));
+	memset(flight, 0, sizeof(struct http_cache_flight));
+	flight->key = key;
+	flight->ttl = http->cache_ttl;
+	flight->leader = http;
+	flight->followers = ptrlist_create();
+	dict_insert(cache_flights, flight->key, flight);
+
+	http->flight = flight;
+	http->cache_body = stringbuffer_create();
+	return HTTP_CACHE_MISS;
+}
+
+struct http_cache_flight *http_cache_complete(struct HTTPRequest *http, enum HTTPRequest_event event)
+{
+	struct http_cache_flight *flight = http->flight;
+	struct http_cache_entry *entry;
+	unsigned int ttl;
+
+	dict_delete(cache_flights, flight->key);
+	http->flight = NULL;
+	flight->leader = NULL;
+
+	if(event == H_EV_TIMEOUT)
+		entry = http_cache_entry_create(flight->key, 0, 1, NULL, NULL, 0);
+	else
+		entry = http_cache_entry_create(flight->key, http->status, 0, http->response_headers, http->cache_body->string, http->cache_body->len);
+
+	stringbuffer_free(http->cache_body);
+	http->cache_body = NULL;
+
+	// Failures and server errors are only remembered briefly so a flapping
+	// upstream is not hammered by every channel at once
+	ttl = (entry->failed || entry->status >= 500) ? http_cache_conf.negative_ttl : flight->ttl;
+	entry->expires = now + ttl;
+	if(ttl && entry->size <= http_cache_conf.max_size)
+		http_cache_insert(entry);
+
+	if(!flight->followers->count)
+	{
+		http_cache_entry_put(entry);
+		http_cache_flight_free(flight);
+		return NULL;
+	}
+
+	flight->result = entry;
+	return flight;
+}
+
+struct HTTPRequest *http_cache_flight_next(struct http_cache_flight *flight, enum HTTPRequest_event *event)
+{
+	struct HTTPRequest *http;
+
+	if(!flight->followers->count)
+	{
+		http_cache_entry_put(flight->result);
+		http_cache_flight_free(flight);
+		return NULL;
+	}
+
+	http = flight->followers->data[0]->ptr;
+	ptrlist_del(flight->followers, 0, NULL);
+	http->flight = NULL;
+
+	http_cache_entry_fill(flight->result, http);
+	*event = flight->result->failed ? H_EV_TIMEOUT : H_EV_HANGUP;
+	return http;
+}
+
+struct HTTPRequest *http_cache_forget(struct HTTPRequest *http)
+{
+	struct http_cache_flight *flight = http->flight;
+	struct HTTPRequest *leader;
+
+	http->flight = NULL;
+	if(flight->leader != http)
+	{
+		ptrlist_del_ptr(flight->followers, http);
+		return NULL;
+	}
+
+	if(!flight->followers->count)
+	{
+		dict_delete(cache_flights, flight->key);
+		http_cache_flight_free(flight);
+		return NULL;
+	}
+
+	// The leader was cancelled; hand the upstream request to a follower
+	leader = flight->followers->data[0]->ptr;
+	ptrlist_del(flight->followers, 0, NULL);
+	leader->cache_body = stringbuffer_create();
+	flight->leader = leader;
+	return leader;
+}
+
+static char *http_cache_key(struct HTTPRequest *http)
+{
+	struct stringbuffer *sbuf = stringbuffer_create();
+	char *key;
+
+	stringbuffer_append_printf(sbuf, "%s %s://%s:%u/%s", http->method, (http->host->ssl ? "https" : "http"),
+		http->host->host, http->host->port, (http->host->path ? http->host->path : ""));
+
+	// Different request headers (e.g. a language) may yield a different response
+	dict_iter(node, http->request_headers)
+	{
+		if(!strcasecmp(node->key, "Host"))
+			continue;
+		stringbuffer_append_printf(sbuf, "\n%s: %s", node->key, (char *)node->data);
+	}
+
+	key = strdup(sbuf->string);
+	stringbuffer_free(sbuf);
+	return key;
+}
+
+static struct http_cache_entry *http_cache_entry_create(const char *key, int status, unsigned char failed, struct dict *headers, const char *body, size_t body_len)
+{
+	struct http_cache_entry *entry = malloc(sizeof(struct http_cache_entry));
+	memset(entry, 0, sizeof(struct http_cache_entry));
+
+	entry->key = strdup(key);
+	entry->refcount = 1;
+	entry->status = status;
+	entry->failed = failed;
+	entry->headers = dict_create();
+	dict_set_free_funcs(entry->headers, free, free);
+	entry->body = stringbuffer_create();
+	entry->size = sizeof(struct http_cache_entry) + strlen(key) + body_len;
+
+	if(headers)
+	{
+		// dict_insert() prepends, so walk backwards to keep the original order
+		dict_iter_rev(node, headers)
+		{
+			dict_insert(entry->headers, strdup(node->key), strdup(node->data));
+			entry->size += strlen(node->key) + strlen(node->data) + 2;
+		}
+	}
+
+	if(body_len)
+		stringbuffer_append_string_n(entry->body, body, body_len);
+
+	return entry;
+}
+
+static void http_cache_entry_put(struct http_cache_entry *entry)
+{
+	if(--entry->refcount)
+		return;
+
+	dict_free(entry->headers);
+	stringbuffer_free(entry->body);
+	free(entry->key);
+	free(entry);
+}
+
+static void http_cache_entry_fill(struct http_cache_entry *entry, struct HTTPRequest *http)
+{
+	http->status = entry->status;
+	http->in_headers = 0;
+
+	dict_clear(http->response_headers);
+	dict_iter_rev(node, entry->headers)
+		dict_insert(http->response_headers, strdup(node->key), strdup(node->data));
+
+	stringbuffer_flush(http->buf);
+	stringbuffer_append_string_n(http->buf, entry->body->string, entry->body->len);
+}
+
+static void http_cache_insert(struct http_cache_entry *entry)
+{
+	struct http_cache_entry *old;
+
+	if((old = dict_find(cache_entries, entry->key)))
+		http_cache_remove(old);
+
+	http_cache_evict(entry->size);
+
+	entry->refcount++;
+	entry->prev = NULL;
+	entry->next = cache_lru.head;
+	if(cache_lru.head)
+		cache_lru.head->prev = entry;
+	else
+		cache_lru.tail = entry;
+	cache_lru.head = entry;
+	cache_lru.size += entry->size;
+	dict_insert(cache_entries, entry->key, entry);
+}
+
+static void http_cache_remove(struct http_cache_entry *entry)
+{
+	if(entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache_lru.head = entry->next;
+	if(entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache_lru.tail = entry->prev;
+
+	cache_lru.size -= entry->size;
+	dict_delete(cache_entries, entry->key);
+	http_cache_entry_put(entry);
+}
+
+// Drops expired and least recently used entries until `needed` more bytes fit
+static void http_cache_evict(size_t needed)
+{
+	struct http_cache_entry *entry, *prev;
+
+	if(cache_lru.size + needed <= http_cache_conf.max_size)
+		return;
+
+	for(entry = cache_lru.tail; entry; entry = prev)
+	{
+		prev = entry->prev;
+		if(entry->expires <= now)
+			http_cache_remove(entry);
+	}
+
+	while(cache_lru.tail && cache_lru.size + needed > http_cache_conf.max_size)
+		http_cache_remove(cache_lru.tail);
+}
+
+static void http_cache_flight_free(struct http_cache_flight *flight)
+{
+	ptrlist_free(flight->followers);
+	free(flight->key);
+	free(flight);
+}
+
+static void http_cache_load(const char *filename)
+{
+	struct ptrlist *entries;
+	FILE *fp;
+	char line[128];
+	unsigned int count = 0;
+
+	if(!(fp = fopen(filename, "r")))
+		return;
+
+	if(!fgets(line, sizeof(line), fp) || strncmp(line, HTTP_CACHE_FILE_MAGIC "\n", sizeof(line)))
+	{
+		log_append(LOG_WARNING, "Ignoring HTTP cache file %s: unknown format", filename);
+		fclose(fp);
+		return;
+	}
+
+	// Nothing is inserted before the whole file has been read; a short read means the offsets of all following entries are off
+	entries = ptrlist_create();
+	ptrlist_set_free_func(entries, (ptrlist_free_f *)http_cache_entry_put);
+	while(fgets(line, sizeof(line), fp))
+	{
+		struct http_cache_entry *entry;
+
+		if(!(entry = http_cache_read_entry(fp, line)))
+		{
+			log_append(LOG_WARNING, "Ignoring HTTP cache file %s: truncated or corrupt entry", filename);
+			ptrlist_free(entries);
+			fclose(fp);
+			return;
+		}
+
+		ptrlist_add(entries, 0, entry);
+	}
+	fclose(fp);
+
+	for(unsigned int i = 0; i < entries->count; i++)
+	{
+		struct http_cache_entry *entry = entries->data[i]->ptr;
+		if(entry->expires > now && cache_lru.size + entry->size <= http_cache_conf.max_size)
+		{
+			http_cache_insert(entry);
+			count++;
+		}
+	}
+
+	ptrlist_free(entries);
+	debug("Loaded %u HTTP cache entries from %s", count, filename);
+}
+
+// Reads the entry described by the header line from fp; returns NULL if it is incomplete
+static struct http_cache_entry *http_cache_read_entry(FILE *fp, const char *line)
+{
+	struct http_cache_entry *entry;
+	long expires;
+	int status, failed;
+	unsigned int num_headers;
+	size_t key_len, body_len;
+	char *key, *body;
+
+	if(!strchr(line, '\n') || sscanf(line, "%ld %d %d %u %zu %zu", &expires, &status, &failed, &num_headers, &key_len, &body_len) != 6)
+		return NULL;
+	if(key_len > http_cache_conf.max_size || body_len > http_cache_conf.max_size)
+		return NULL;
+
+	key = malloc(key_len + 1);
+	if(fread(key, 1, key_len + 1, fp) != key_len + 1 || key[key_len] != '\n')
+	{
+		free(key);
+		return NULL;
+	}
+	key[key_len] = '\0';
+
+	entry = http_cache_entry_create(key, status, failed, NULL, NULL, 0);
+	entry->expires = expires;
+	free(key);
+
+	for(unsigned int i = 0; i < num_headers; i++)
+	{
+		char *str = NULL, *value;
+		size_t len = 0;
+		ssize_t read_len;
+
+		if((read_len = getline(&str, &len, fp)) <= 0 || str[read_len - 1] != '\n' || !(value = strstr(str, ": ")))
+		{
+			free(str);
+			http_cache_entry_put(entry);
+			return NULL;
+		}
+
+		str[read_len - 1] = '\0';
+		*value = '\0';
+		value += 2;
+		// Headers were written first to last and dict_insert() prepends, restoring the original order
+		dict_insert(entry->headers, strdup(str), strdup(value));
+		entry->size += strlen(str) + strlen(value) + 2;
+		free(str);
+	}
+
+	body = malloc(body_len + 1);
+	if(fread(body, 1, body_len + 1, fp) != body_len + 1 || body[body_len] != '\n')
+	{
+		free(body);
+		http_cache_entry_put(entry);
+		return NULL;
+	}
+	stringbuffer_append_string_n(entry->body, body, body_len);
+	entry->size += body_len;
+	free(body);
+	return entry;
+}
+
+static void http_cache_save(const char *filename)
+{
+	FILE *fp;
+
+	if(!(fp = fopen(filename, "w")))
+	{
+		log_append(LOG_WARNING, "Could not write HTTP cache file %s: %s", filename, strerror(errno));
+		return;
+	}
+
+	fputs(HTTP_CACHE_FILE_MAGIC "\n", fp);
+
+	// Oldest first so loading rebuilds the same LRU order
+	for(struct http_cache_entry *entry = cache_lru.tail; entry; entry = entry->prev)
+	{
+		if(entry->expires <= now || entry->failed)
+			continue;
+
+		fprintf(fp, "%ld %d %d %u %zu %zu\n", (long)entry->expires, entry->status, entry->failed,
+			entry->headers->count, strlen(entry->key), (size_t)entry->body->len);
+		fwrite(entry->key, 1, strlen(entry->key), fp);
+		fputc('\n', fp);
+		dict_iter_rev(node, entry->headers)
+			fprintf(fp, "%s: %s\n", node->key, (char *)node->data);
+		fwrite(entry->body->string, 1, entry->body->len, fp);
+		fputc('\n', fp);
+	}
+
+	fclose(fp);
+}
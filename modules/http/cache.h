@@ -0,0 +1,23 @@
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+struct HTTPRequest;
+struct http_cache_flight;
+enum HTTPRequest_event;
+
+enum http_cache_result
+{
+	HTTP_CACHE_MISS, // request has to go to the server
+	HTTP_CACHE_JOINED, // an identical request is in flight, the response will be shared
+	HTTP_CACHE_HIT // response was filled in from the cache
+};
+
+void http_cache_init();
+void http_cache_fini();
+
+enum http_cache_result http_cache_lookup(struct HTTPRequest *http, enum HTTPRequest_event *event);
+struct http_cache_flight *http_cache_complete(struct HTTPRequest *http, enum HTTPRequest_event event);
+struct HTTPRequest *http_cache_flight_next(struct http_cache_flight *flight, enum HTTPRequest_event *event);
+struct HTTPRequest *http_cache_forget(struct HTTPRequest *http);
+
+#endif
@@ -5,33 +5,150 @@
 #include "irc.h"
 #include "tools.h"
 #include "http.h" // Prototypes
+#include "cache.h"
 #include "sock.h"
 #include "log.h"
+#include "conf.h"
+#include "timer.h"
 
-//Todo: Implement timer of maybe 20 seconds for timeout (or provide it as argument?)
+#define MAX_REDIRECTS	10
 
 MODULE_DEPENDS(NULL);
 
+enum http_body_framing
+{
+	BODY_UNTIL_CLOSE, // neither Content-Length nor chunked: body ends when the server hangs up
+	BODY_LENGTH,
+	BODY_CHUNKED,
+	BODY_NONE // HEAD request or a status that never has a body
+};
+
+enum http_chunk_state
+{
+	CHUNK_SIZE,
+	CHUNK_DATA,
+	CHUNK_DATA_END,
+	CHUNK_TRAILER
+};
+
+// A (possibly idle) connection to a host; owned by the pool for that host
+struct http_conn
+{
+	struct sock *sock;
+	struct http_pool *pool;
+	struct HTTPRequest *http; // request currently using this connection, NULL if idle
+
+	time_t timeout; // connect/read deadline while busy, idle deadline otherwise
+	unsigned int requests; // number of requests served on this connection
+	unsigned int connected : 1;
+	unsigned int keepalive : 1;
+
+	// response parser state
+	struct stringbuffer *rbuf; // raw data not yet parsed
+	unsigned int received : 1;
+	unsigned int in_headers : 1;
+	enum http_body_framing framing;
+	unsigned long content_left;
+	enum http_chunk_state chunk_state;
+};
+
+struct http_pool
+{
+	char *key;
+	struct ptrlist *conns;
+	struct HTTPRequest *queue_head;
+	struct HTTPRequest *queue_tail;
+};
+
+static struct {
+	unsigned int pooling : 1;
+	unsigned int max_per_host;
+	unsigned int connect_timeout;
+	unsigned int read_timeout;
+	unsigned int idle_timeout;
+} http_conf;
+
+static struct module *this;
 static struct dict *requests;
+static struct dict *pools;
+static struct ptrlist *cache_hits; // requests answered from the cache, delivered by a timer
+static unsigned int timeout_timer_active = 0;
 
+static void http_conf_reload();
 static void http_sock_event(struct sock *, enum sock_event, int err);
 static void http_sock_read(struct sock *, char *buf, size_t len);
 static void HTTPRequest_event(struct HTTPRequest *, enum HTTPRequest_event);
-static struct HTTPRequest *http_find_sock(struct sock *);
+static void HTTPRequest_finish(struct HTTPRequest *, enum HTTPRequest_event);
+static void HTTPRequest_send(struct HTTPRequest *);
+static void HTTPRequest_deliver(struct HTTPRequest *, unsigned char final);
+static void http_body_append(struct HTTPRequest *, const char *data, size_t len);
 static struct HTTPHost *parse_host(const char *);
 static void HTTPRequest_set_host(struct HTTPRequest *, const char *);
+static struct http_pool *http_pool_get(struct HTTPHost *host);
+static void http_pool_free(struct http_pool *pool);
+static void http_pool_enqueue(struct http_pool *pool, struct HTTPRequest *http, unsigned char front);
+static void http_pool_unqueue(struct http_pool *pool, struct HTTPRequest *http);
+static void http_pool_dispatch(struct http_pool *pool);
+static struct http_conn *http_conn_create(struct http_pool *pool, struct HTTPHost *host);
+static void http_conn_attach(struct http_conn *conn, struct HTTPRequest *http);
+static void http_conn_release(struct http_conn *conn);
+static void http_conn_destroy(struct http_conn *conn);
+static int http_conn_parse_header(struct http_conn *conn, char *line);
+static int http_conn_parse_body(struct http_conn *conn);
+static void http_timeout_timer_schedule();
+static void http_timeout_tmr(void *bound, void *data);
+static void http_cache_hits_tmr(void *bound, void *data);
+#ifdef HTTP_TEST
+static void run_test();
+static void test_fini();
+#endif
 
 static unsigned long next_id = 0;
 
 MODULE_INIT
 {
+	this = self;
 	requests = dict_create();
 	dict_set_free_funcs(requests, free, (dict_free_f*)HTTPRequest_free);
+	pools = dict_create();
+	dict_set_free_funcs(pools, NULL, (dict_free_f*)http_pool_free);
+	cache_hits = ptrlist_create();
+
+	reg_conf_reload_func(http_conf_reload);
+	http_conf_reload();
+	http_cache_init();
+
+#ifdef HTTP_TEST
+	run_test();
+#endif
 }
 
 MODULE_FINI
 {
+#ifdef HTTP_TEST
+	test_fini();
+#endif
+	unreg_conf_reload_func(http_conf_reload);
+	timer_del_boundname(this, "http_timeouts");
+	timer_del_boundname(this, "http_cache_hits");
+	http_cache_fini();
 	dict_free(requests);
+	ptrlist_free(cache_hits);
+	dict_free(pools);
+}
+
+static void http_conf_reload()
+{
+	char *str;
+
+	http_conf.pooling		= ((str = conf_get("http/pooling", DB_STRING)) ? true_string(str) : 1);
+	http_conf.max_per_host		= ((str = conf_get("http/max_connections_per_host", DB_STRING)) ? atoi(str) : 4);
+	http_conf.connect_timeout	= ((str = conf_get("http/connect_timeout", DB_STRING)) ? atoi(str) : 15);
+	http_conf.read_timeout		= ((str = conf_get("http/read_timeout", DB_STRING)) ? atoi(str) : 30);
+	http_conf.idle_timeout		= ((str = conf_get("http/idle_timeout", DB_STRING)) ? atoi(str) : 30);
+
+	if(!http_conf.max_per_host)
+		http_conf.max_per_host = 1;
 }
 
 struct HTTPRequest *HTTPRequest_create(const char *host, http_event_f *event_func, http_read_f *read_func)
@@ -74,7 +191,6 @@ struct HTTPRequest *HTTPRequest_create(const char *host, http_event_f *event_fun
 		ptrlist_add(http->event_funcs, 0, event_func);
 
 	HTTPRequest_add_header(http, "Host", http->host->host);
-	HTTPRequest_add_header(http, "Connection", "Close");
 
 	dict_insert(requests, http->id, http);
 
@@ -86,11 +202,36 @@ void HTTPRequest_free(struct HTTPRequest *http)
 	if(http)
 	{
 		debug("Freeing HTTP Request %s", http->id);
-		if(http->sock)
-			sock_close(http->sock);
+		if(http->flight)
+		{
+			// If this request was fetching the response for others, one of them has to take over
+			struct HTTPRequest *leader = http_cache_forget(http);
+			if(leader)
+				HTTPRequest_connect(leader);
+		}
+
+		if(http->conn)
+		{
+			// The response was not read completely so the connection cannot be reused
+			struct http_conn *conn = http->conn;
+			http_conn_destroy(conn);
+		}
+		else if(http->queued)
+		{
+			struct http_pool *pool = http_pool_get(http->host);
+			http_pool_unqueue(pool, http);
+		}
+		else
+		{
+			int pos = ptrlist_find(cache_hits, http);
+			if(pos >= 0)
+				ptrlist_del(cache_hits, pos, NULL);
+		}
 
 		if(http->buf)
 			stringbuffer_free(http->buf);
+		if(http->cache_body)
+			stringbuffer_free(http->cache_body);
 
 		dict_free(http->request_headers);
 		dict_free(http->response_headers);
@@ -136,77 +277,103 @@ void HTTPRequest_del_header(struct HTTPRequest *http, const char *name)
 
 void HTTPRequest_connect(struct HTTPRequest *http)
 {
-	assert(!http->sock);
-	unsigned short sockflags = sock_resolve_64(http->host->host);
-	if(!sockflags)
-		sockflags = SOCK_IPV4; // so we get an error later. i know it's ugly!
-	sockflags |= SOCK_QUIET;
-	if(http->host->ssl)
-		sockflags |= SOCK_SSL;
+	assert(!http->conn && !http->queued);
+	struct http_pool *pool;
+
+	// Redirects of a request that is already fetching for the cache go straight to the pool
+	if(http->cache_ttl && !http->flight)
+	{
+		enum HTTPRequest_event event;
+		switch(http_cache_lookup(http, &event))
+		{
+			case HTTP_CACHE_HIT:
+				// Callers expect the response asynchronously, just like a real one
+				ptrlist_add(cache_hits, event, http);
+				if(cache_hits->count == 1)
+					timer_add(this, "http_cache_hits", now, http_cache_hits_tmr, NULL, 0, 0);
+				return;
+			case HTTP_CACHE_JOINED:
+				return;
+			case HTTP_CACHE_MISS:
+				break;
+		}
+	}
 
-	http->sock = sock_create(sockflags, http_sock_event, http_sock_read);
-	debug("Connecting HTTP Request %s [0x%x] => %s:%u", http->id, sockflags, http->host->host, http->host->port);
-	sock_connect(http->sock, http->host->host, http->host->port);
+	pool = http_pool_get(http->host);
+	http_pool_enqueue(pool, http, 0);
+	http_pool_dispatch(pool);
 }
 
 void HTTPRequest_disconnect(struct HTTPRequest *http)
 {
-	sock_close(http->sock);
-	http->sock = NULL;
+	if(http->conn)
+		http_conn_destroy(http->conn);
+	else if(http->queued)
+		http_pool_unqueue(http_pool_get(http->host), http);
 
 	dict_clear(http->response_headers);
 	stringbuffer_flush(http->buf);
+	if(http->cache_body)
+		stringbuffer_flush(http->cache_body);
 	http->in_headers = 1;
+	http->status = 0;
 }
 
 static void http_sock_event(struct sock *sock, enum sock_event event, int err)
 {
+	struct http_conn *conn = sock->ctx;
 	struct HTTPRequest *http;
-	assert((http = http_find_sock(sock)));
+	assert(conn);
 
+	http = conn->http;
 	switch(event)
 	{
-		case EV_HANGUP:
-		{
-			/* Socket was closed by remote side = reached end of http content
-			 * -> Dump (remaining) read buffer to socket-read-functions
-			 */
-			for(unsigned int i = 0; i < http->read_funcs->count; i++)
-				((http_read_f*)http->read_funcs->data[i]->ptr)(http, http->buf->string, (unsigned int)http->buf->len);
-
-			stringbuffer_free(http->buf);
-			http->buf = NULL;
-
-			// Fall through
-		}
-		case EV_ERROR:
-		{
-			http->sock = NULL;
-			HTTPRequest_event(http, (event == EV_ERROR ? H_EV_TIMEOUT : H_EV_HANGUP));
-			dict_delete(requests, http->id);
+		case EV_CONNECT:
+			conn->connected = 1;
+			if(http)
+			{
+				conn->timeout = now + http_conf.read_timeout;
+				HTTPRequest_send(http);
+			}
+			else
+				http_conn_release(conn);
 			break;
-		}
 
-		case EV_CONNECT:
-		{
-			sock_write_fmt(sock, "%s /%s HTTP/1.0\r\n", http->method, (http->host->path ? http->host->path : ""));
-			dict_iter(node, http->request_headers)
+		case EV_HANGUP:
+		case EV_ERROR:
+			conn->sock = NULL; // closed by the socket code after we return
+			if(!http)
 			{
-				sock_write_fmt(sock, "%s: %s\r\n", node->key, (char*)node->data);
+				// idle connection closed by the server
+				http_conn_destroy(conn);
+				break;
 			}
-			if(http->payload)
+
+			if(event == EV_HANGUP && !conn->in_headers && conn->framing == BODY_UNTIL_CLOSE)
 			{
-				sock_write_fmt(sock, "Content-length: %lu\r\n", strlen(http->payload));
-				sock_write_fmt(sock, "Content-type: %s\r\n", http->payload_type);
+				conn->keepalive = 0;
+				HTTPRequest_finish(http, H_EV_HANGUP);
+				break;
 			}
-			// Empty line to signalise end of headers
-			sock_write(sock, "\r\n", 2);
-			if(http->payload)
+
+			// A server may close an idle keep-alive connection just as we send
+			// a new request on it; try again once on a fresh connection.
+			if(conn->requests > 1 && !conn->received && !http->retried &&
+			   (!strcasecmp(http->method, "GET") || !strcasecmp(http->method, "HEAD")))
 			{
-				sock_write(sock, http->payload, strlen(http->payload));
+				struct http_pool *pool = conn->pool;
+				debug("Retrying HTTP Request %s on a new connection", http->id);
+				http->retried = 1;
+				http_conn_destroy(conn);
+				http_pool_enqueue(pool, http, 1);
+				http_pool_dispatch(pool);
+				break;
 			}
+
+			conn->keepalive = 0;
+			HTTPRequest_finish(http, (event == EV_ERROR ? H_EV_TIMEOUT : H_EV_HANGUP));
 			break;
-		}
+
 		default:
 			break;
 	}
@@ -214,86 +381,324 @@ static void http_sock_event(struct sock *sock, enum sock_event event, int err)
 
 static void http_sock_read(struct sock *sock, char *buf, size_t len)
 {
-	char *str, *tmp;
-	struct HTTPRequest *http = http_find_sock(sock);
-	assert(http);
-	stringbuffer_append_string_n(http->buf, buf, len);
+	struct http_conn *conn = sock->ctx;
+	struct HTTPRequest *http;
+	char *str;
+	assert(conn);
 
-	if(!http->in_headers && !http->read_linewise)
+	if(!(http = conn->http))
+	{
+		// Nothing should arrive on an idle connection; don't trust it anymore
+		http_conn_destroy(conn);
 		return;
+	}
 
-	while((str = stringbuffer_shift(http->buf, "\n", 1)))
+	conn->received = 1;
+	conn->timeout = now + http_conf.read_timeout;
+	stringbuffer_append_string_n(conn->rbuf, buf, len);
+
+	while(conn->in_headers && (str = stringbuffer_shift(conn->rbuf, "\n", 1)))
 	{
-		len = strlen(str);
-		// Do we have \r\n aka windows-type line endings?
-		if(len && str[len - 1] == '\r')
-			str[--len] = '\0';
+		int ret = http_conn_parse_header(conn, str);
+		free(str);
+		if(ret < 0) // request failed or was redirected; conn is gone
+			return;
+	}
+
+	if(conn->in_headers)
+		return;
+
+	if(http_conn_parse_body(conn))
+	{
+		HTTPRequest_finish(http, H_EV_HANGUP);
+		return;
+	}
 
-		if(!http->in_headers)
+	if(http->read_linewise)
+		HTTPRequest_deliver(http, 0);
+}
+
+// Returns -1 if the connection was dropped, 0 otherwise
+static int http_conn_parse_header(struct http_conn *conn, char *str)
+{
+	struct HTTPRequest *http = conn->http;
+	size_t len = strlen(str);
+	char *tmp;
+
+	// Do we have \r\n aka windows-type line endings?
+	if(len && str[len - 1] == '\r')
+		str[--len] = '\0';
+
+	// Empty line... as in end of headers?
+	if(!len)
+	{
+		if(http->status >= 100 && http->status < 200)
 		{
-			for(unsigned int i = 0; i < http->read_funcs->count; i++)
-			{
-				http_read_f *read_f = http->read_funcs->data[i]->ptr;
-				read_f(http, str, len);
-			}
-			continue;
+			// Interim response; the real one follows
+			dict_clear(http->response_headers);
+			http->status = 0;
+			return 0;
 		}
 
-		// Empty line... as in end of headers?
-		if(!len)
-		{
-			http->in_headers = 0;
-			free(str);
+		conn->in_headers = 0;
+		http->in_headers = 0;
+		if(!strcasecmp(http->method, "HEAD") || http->status == 204 || http->status == 304)
+			conn->framing = BODY_NONE;
+		if(conn->framing == BODY_UNTIL_CLOSE)
+			conn->keepalive = 0;
+		return 0;
+	}
 
-			if(http->read_linewise)
-				continue;
-			break;
+	// So apparently, this is a header, let's find a colon
+	if(!http->status)
+	{
+		// This must be the first line of headers in the form "HTTP/1.0 302 Found"
+		char *tmp2;
+		if(strncasecmp(str, "HTTP/", 5) || !(tmp2 = strchr(str, ' ')) || !(http->status = atoi(tmp2)))
+		{
+			log_append(LOG_ERROR, "(HTTP Request %s) Invalid HTTP header format: %s", http->id, str);
+			conn->keepalive = 0;
+			HTTPRequest_finish(http, H_EV_TIMEOUT);
+			return -1;
 		}
 
-		// So apparently, this is a header, let's find a colon
-		if(!(tmp = strchr(str, ':')))
-		{
-			// No colon, this must be the first line of headers in the form "HTTP/1.0 302 Found"
-			char *tmp2;
-			if(!(tmp2 = strchr(str, ' ')) || !(http->status = atoi(tmp2)))
-			{
-				log_append(LOG_ERROR, "(HTTP Request %s) Invalid HTTP header format: %s", http->id, str);
-				// Send timeout event and free request
-				HTTPRequest_event(http, H_EV_TIMEOUT);
-				sock_close(sock); // Will trigger a socket event deleting the HTTP Request
+		// HTTP/1.0 servers close the connection unless told otherwise
+		if(!strncasecmp(str, "HTTP/1.0", 8))
+			conn->keepalive = 0;
+		return 0;
+	}
 
-				free(str);
-				return;
-			}
+	if(!(tmp = strchr(str, ':')))
+		return 0;
+
+	// Not the first line of headers, in the format "Name: Content"
+	*tmp++ = '\0';
+	while(*tmp == ' ' || *tmp == '\t')
+		tmp++;
+	dict_insert(http->response_headers, strdup(str), strdup(tmp));
+
+	if(!strcasecmp(str, "Content-Length"))
+	{
+		if(conn->framing != BODY_CHUNKED)
+		{
+			conn->framing = BODY_LENGTH;
+			conn->content_left = strtoul(tmp, NULL, 10);
 		}
-		else
+	}
+	else if(!strcasecmp(str, "Transfer-Encoding"))
+	{
+		if(strcasestr(tmp, "chunked"))
+		{
+			conn->framing = BODY_CHUNKED;
+			conn->chunk_state = CHUNK_SIZE;
+		}
+	}
+	else if(!strcasecmp(str, "Connection"))
+	{
+		if(strcasestr(tmp, "close"))
+			conn->keepalive = 0;
+	}
+	// In case we got a Location-header, we need to redirect the query
+	else if(!strcasecmp(str, "Location") && http->forward_request && http->redirects < MAX_REDIRECTS)
+	{
+		struct HTTPHost *host = parse_host(tmp);
+		unsigned int same_host = !strcasecmp(http->host->host, host->host);
+		free(host->host);
+		MyFree(host->path);
+		free(host);
+
+		if(http->forward_request_foreign || same_host)
 		{
-			// Not the first line of headers, in the format "Name: Content"
-			str[tmp - str] = '\0';
-			tmp += 2;
-			dict_insert(http->response_headers, strdup(str), strdup(tmp));
+			char *location = strdup(tmp);
+			debug("Redirecting HTTP Request %s to %s", http->id, location);
+			http->redirects++;
+			HTTPRequest_disconnect(http);
+			HTTPRequest_set_host(http, location);
+			HTTPRequest_connect(http);
+			free(location);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Moves body data from the raw buffer to the request buffer. Returns non-zero when the body is complete.
+static int http_conn_parse_body(struct http_conn *conn)
+{
+	struct HTTPRequest *http = conn->http;
+	struct stringbuffer *rbuf = conn->rbuf;
+	unsigned int used = 0;
+	int done = 0;
+
+	switch(conn->framing)
+	{
+		case BODY_NONE:
+			done = 1;
+			break;
+
+		case BODY_UNTIL_CLOSE:
+			http_body_append(http, rbuf->string, rbuf->len);
+			used = rbuf->len;
+			break;
 
-			// In case we got a Location-header, we need to redirect the query
-			if(!strcasecmp(str, "Location"))
+		case BODY_LENGTH:
+			used = (rbuf->len < conn->content_left) ? rbuf->len : conn->content_left;
+			http_body_append(http, rbuf->string, used);
+			conn->content_left -= used;
+			done = (conn->content_left == 0);
+			break;
+
+		case BODY_CHUNKED:
+			while(!done && used < rbuf->len)
 			{
-				if(http->forward_request)
+				char *eol;
+
+				if(conn->chunk_state == CHUNK_DATA)
 				{
-					struct HTTPHost *host = parse_host(tmp);
-					if(http->forward_request_foreign || !strcasecmp(http->host->host, host->host))
-					{
-						debug("Redirecting HTTP Request %s to %s", http->id, tmp);
-						HTTPRequest_disconnect(http);
-						HTTPRequest_set_host(http, tmp);
-						HTTPRequest_connect(http);
-					}
+					unsigned int n = rbuf->len - used;
+					if(n > conn->content_left)
+						n = conn->content_left;
+					http_body_append(http, rbuf->string + used, n);
+					used += n;
+					if(!(conn->content_left -= n))
+						conn->chunk_state = CHUNK_DATA_END;
+					continue;
 				}
-				free(str);
-				return;
+
+				// All other states consume a complete line
+				if(!(eol = memchr(rbuf->string + used, '\n', rbuf->len - used)))
+					break;
+
+				if(conn->chunk_state == CHUNK_SIZE)
+				{
+					conn->content_left = strtoul(rbuf->string + used, NULL, 16);
+					conn->chunk_state = conn->content_left ? CHUNK_DATA : CHUNK_TRAILER;
+				}
+				else if(conn->chunk_state == CHUNK_DATA_END)
+					conn->chunk_state = CHUNK_SIZE;
+				else if(conn->chunk_state == CHUNK_TRAILER)
+				{
+					// an empty line ends the trailer and thus the body
+					const char *line = rbuf->string + used;
+					if(eol == line || (eol == line + 1 && *line == '\r'))
+						done = 1;
+				}
+
+				used = eol - rbuf->string + 1;
 			}
+			break;
+	}
+
+	if(used)
+		stringbuffer_erase(rbuf, 0, used);
+	return done;
+}
+
+static void http_body_append(struct HTTPRequest *http, const char *data, size_t len)
+{
+	stringbuffer_append_string_n(http->buf, data, len);
+	if(http->cache_body)
+		stringbuffer_append_string_n(http->cache_body, data, len);
+}
+
+static void HTTPRequest_deliver(struct HTTPRequest *http, unsigned char final)
+{
+	char *str;
+
+	if(!http->read_linewise)
+	{
+		if(final)
+		{
+			for(unsigned int i = 0; i < http->read_funcs->count; i++)
+				((http_read_f*)http->read_funcs->data[i]->ptr)(http, http->buf->string, (unsigned int)http->buf->len);
 		}
+		return;
+	}
+
+	while((str = stringbuffer_shift(http->buf, "\n", 1)))
+	{
+		size_t len = strlen(str);
+		if(len && str[len - 1] == '\r')
+			str[--len] = '\0';
 
+		for(unsigned int i = 0; i < http->read_funcs->count; i++)
+			((http_read_f*)http->read_funcs->data[i]->ptr)(http, str, len);
 		free(str);
 	}
+
+	// Dump the remaining partial line
+	if(final)
+	{
+		for(unsigned int i = 0; i < http->read_funcs->count; i++)
+			((http_read_f*)http->read_funcs->data[i]->ptr)(http, http->buf->string, (unsigned int)http->buf->len);
+	}
+}
+
+static void HTTPRequest_finish(struct HTTPRequest *http, enum HTTPRequest_event event)
+{
+	struct http_conn *conn = http->conn;
+	struct http_pool *pool = conn ? conn->pool : NULL;
+	struct http_cache_flight *flight = NULL;
+
+	if(http->flight)
+		flight = http_cache_complete(http, event);
+
+	if(event == H_EV_HANGUP)
+		HTTPRequest_deliver(http, 1);
+
+	if(conn)
+	{
+		if(conn->keepalive && !conn->in_headers && conn->sock)
+			http_conn_release(conn);
+		else
+			http_conn_destroy(conn);
+	}
+
+	HTTPRequest_event(http, event);
+	dict_delete(requests, http->id);
+
+	if(pool)
+		http_pool_dispatch(pool);
+
+	// Hand the response to everyone who asked for the same thing meanwhile
+	if(flight)
+	{
+		struct HTTPRequest *follower;
+		enum HTTPRequest_event follower_event;
+		while((follower = http_cache_flight_next(flight, &follower_event)))
+			HTTPRequest_finish(follower, follower_event);
+	}
+}
+
+static void HTTPRequest_send(struct HTTPRequest *http)
+{
+	struct http_conn *conn = http->conn;
+	struct sock *sock = conn->sock;
+
+	// Without pooling we behave like a HTTP/1.0 client and let the server close the connection
+	if(conn->keepalive)
+		sock_write_fmt(sock, "%s /%s HTTP/1.1\r\n", http->method, (http->host->path ? http->host->path : ""));
+	else
+		sock_write_fmt(sock, "%s /%s HTTP/1.0\r\n", http->method, (http->host->path ? http->host->path : ""));
+	dict_iter(node, http->request_headers)
+	{
+		if(!strcasecmp(node->key, "Connection"))
+			continue;
+		sock_write_fmt(sock, "%s: %s\r\n", node->key, (char*)node->data);
+	}
+	sock_write_fmt(sock, "Connection: %s\r\n", (conn->keepalive ? "keep-alive" : "close"));
+	if(http->payload)
+	{
+		sock_write_fmt(sock, "Content-length: %lu\r\n", strlen(http->payload));
+		sock_write_fmt(sock, "Content-type: %s\r\n", http->payload_type);
+	}
+	// Empty line to signalise end of headers
+	sock_write(sock, "\r\n", 2);
+	if(http->payload)
+	{
+		sock_write(sock, http->payload, strlen(http->payload));
+	}
 }
 
 static void HTTPRequest_event(struct HTTPRequest *http, enum HTTPRequest_event event)
@@ -303,15 +708,264 @@ static void HTTPRequest_event(struct HTTPRequest *http, enum HTTPRequest_event e
 		((http_event_f*)http->event_funcs->data[i]->ptr)(http, event);
 }
 
-static struct HTTPRequest *http_find_sock(struct sock *sock)
+static struct http_pool *http_pool_get(struct HTTPHost *host)
+{
+	struct http_pool *pool;
+	char key[512];
+
+	snprintf(key, sizeof(key), "%s:%u%s", host->host, host->port, (host->ssl ? ":ssl" : ""));
+	if((pool = dict_find(pools, key)))
+		return pool;
+
+	pool = malloc(sizeof(struct http_pool));
+	memset(pool, 0, sizeof(struct http_pool));
+	pool->key = strdup(key);
+	pool->conns = ptrlist_create();
+	dict_insert(pools, pool->key, pool);
+	return pool;
+}
+
+static void http_pool_free(struct http_pool *pool)
+{
+	while(pool->conns->count)
+		http_conn_destroy(pool->conns->data[0]->ptr);
+	ptrlist_free(pool->conns);
+	free(pool->key);
+	free(pool);
+}
+
+static void http_pool_enqueue(struct http_pool *pool, struct HTTPRequest *http, unsigned char front)
+{
+	http->queued = now;
+	if(front)
+	{
+		http->queue_next = pool->queue_head;
+		pool->queue_head = http;
+		if(!pool->queue_tail)
+			pool->queue_tail = http;
+	}
+	else
+	{
+		http->queue_next = NULL;
+		if(pool->queue_tail)
+			pool->queue_tail->queue_next = http;
+		else
+			pool->queue_head = http;
+		pool->queue_tail = http;
+	}
+
+	http_timeout_timer_schedule();
+}
+
+static void http_pool_unqueue(struct http_pool *pool, struct HTTPRequest *http)
+{
+	struct HTTPRequest *prev = NULL;
+
+	for(struct HTTPRequest *cur = pool->queue_head; cur; prev = cur, cur = cur->queue_next)
+	{
+		if(cur != http)
+			continue;
+
+		if(prev)
+			prev->queue_next = cur->queue_next;
+		else
+			pool->queue_head = cur->queue_next;
+		if(pool->queue_tail == cur)
+			pool->queue_tail = prev;
+		break;
+	}
+
+	http->queue_next = NULL;
+	http->queued = 0;
+}
+
+static void http_pool_dispatch(struct http_pool *pool)
+{
+	struct HTTPRequest *http;
+
+	while((http = pool->queue_head))
+	{
+		struct http_conn *conn = NULL;
+
+		// Reuse an idle connection if there is one
+		for(unsigned int i = pool->conns->count; i > 0; i--)
+		{
+			struct http_conn *cur = pool->conns->data[i - 1]->ptr;
+			if(!cur->http && cur->connected && cur->keepalive)
+			{
+				conn = cur;
+				break;
+			}
+		}
+
+		if(!conn)
+		{
+			unsigned int limit = http_conf.pooling ? http_conf.max_per_host : UINT_MAX;
+			if(pool->conns->count >= limit)
+				return; // stays queued until a connection becomes available
+			conn = http_conn_create(pool, http->host);
+		}
+
+		http_pool_unqueue(pool, http);
+		http_conn_attach(conn, http);
+	}
+}
+
+static struct http_conn *http_conn_create(struct http_pool *pool, struct HTTPHost *host)
+{
+	struct http_conn *conn;
+	unsigned short sockflags = sock_resolve_64(host->host);
+	if(!sockflags)
+		sockflags = SOCK_IPV4; // so we get an error later. i know it's ugly!
+	sockflags |= SOCK_QUIET;
+	if(host->ssl)
+		sockflags |= SOCK_SSL;
+
+	conn = malloc(sizeof(struct http_conn));
+	memset(conn, 0, sizeof(struct http_conn));
+	conn->pool = pool;
+	conn->rbuf = stringbuffer_create();
+	conn->keepalive = http_conf.pooling;
+	conn->timeout = now + http_conf.connect_timeout;
+	conn->sock = sock_create(sockflags, http_sock_event, http_sock_read);
+	conn->sock->ctx = conn;
+	ptrlist_add(pool->conns, 0, conn);
+
+	debug("Connecting to %s [0x%x] => %s:%u", pool->key, sockflags, host->host, host->port);
+	// A synchronous failure does not trigger a socket event; let the timeout handle it
+	if(sock_connect(conn->sock, host->host, host->port) != 0)
+		conn->timeout = now;
+	http_timeout_timer_schedule();
+	return conn;
+}
+
+static void http_conn_attach(struct http_conn *conn, struct HTTPRequest *http)
+{
+	conn->http = http;
+	conn->requests++;
+	conn->received = 0;
+	conn->in_headers = 1;
+	conn->framing = BODY_UNTIL_CLOSE;
+	conn->content_left = 0;
+	stringbuffer_empty(conn->rbuf);
+	http->conn = conn;
+	http->sock = conn->sock;
+
+	if(conn->connected)
+	{
+		debug("Sending HTTP Request %s on connection to %s (request #%u)", http->id, conn->pool->key, conn->requests);
+		conn->timeout = now + http_conf.read_timeout;
+		HTTPRequest_send(http);
+	}
+}
+
+static void http_conn_release(struct http_conn *conn)
+{
+	if(conn->http)
+	{
+		conn->http->conn = NULL;
+		conn->http->sock = NULL;
+		conn->http = NULL;
+	}
+
+	if(!conn->keepalive || !conn->sock)
+	{
+		http_conn_destroy(conn);
+		return;
+	}
+
+	conn->timeout = now + http_conf.idle_timeout;
+	http_timeout_timer_schedule();
+}
+
+static void http_conn_destroy(struct http_conn *conn)
+{
+	if(conn->http)
+	{
+		conn->http->conn = NULL;
+		conn->http->sock = NULL;
+	}
+
+	if(conn->sock)
+	{
+		conn->sock->ctx = NULL;
+		sock_close(conn->sock);
+	}
+
+	ptrlist_del_ptr(conn->pool->conns, conn);
+	stringbuffer_free(conn->rbuf);
+	free(conn);
+}
+
+static void http_timeout_timer_schedule()
 {
-	dict_iter(node, requests)
+	if(timeout_timer_active)
+		return;
+
+	timer_add(this, "http_timeouts", now + 1, http_timeout_tmr, NULL, 0, 0);
+	timeout_timer_active = 1;
+}
+
+static void http_timeout_tmr(void *bound, void *data)
+{
+	struct ptrlist *expired = ptrlist_create();
+	unsigned int pending = 0;
+
+	timeout_timer_active = 0;
+	dict_iter(node, pools)
 	{
-		if(((struct HTTPRequest *)node->data)->sock == sock)
-			return node->data;
+		struct http_pool *pool = node->data;
+
+		// Finishing a request runs its callback which may start or destroy other connections
+		for(unsigned int i = 0; i < pool->conns->count; i++)
+		{
+			struct http_conn *conn = pool->conns->data[i]->ptr;
+			if(conn->timeout <= now)
+				ptrlist_add(expired, 0, conn);
+		}
+
+		for(unsigned int i = 0; i < expired->count; i++)
+		{
+			struct http_conn *conn = expired->data[i]->ptr;
+			if(ptrlist_find(pool->conns, conn) == -1 || conn->timeout > now)
+				continue;
+
+			if(conn->http)
+			{
+				log_append(LOG_WARNING, "HTTP Request %s to %s timed out", conn->http->id, pool->key);
+				conn->keepalive = 0;
+				HTTPRequest_finish(conn->http, H_EV_TIMEOUT);
+			}
+			else
+				http_conn_destroy(conn);
+		}
+		ptrlist_clear(expired);
+
+		while(pool->queue_head && pool->queue_head->queued + (time_t)(http_conf.connect_timeout + http_conf.read_timeout) <= now)
+		{
+			struct HTTPRequest *http = pool->queue_head;
+			log_append(LOG_WARNING, "HTTP Request %s to %s timed out waiting for a connection", http->id, pool->key);
+			http_pool_unqueue(pool, http);
+			HTTPRequest_finish(http, H_EV_TIMEOUT);
+		}
+
+		pending += pool->conns->count + (pool->queue_head ? 1 : 0);
 	}
 
-	return NULL;
+	ptrlist_free(expired);
+	if(pending)
+		http_timeout_timer_schedule();
+}
+
+static void http_cache_hits_tmr(void *bound, void *data)
+{
+	while(cache_hits->count)
+	{
+		struct HTTPRequest *http = cache_hits->data[0]->ptr;
+		enum HTTPRequest_event event = cache_hits->data[0]->type;
+		ptrlist_del(cache_hits, 0, NULL);
+		HTTPRequest_finish(http, event);
+	}
 }
 
 static struct HTTPHost *parse_host(const char *host)
@@ -373,3 +1027,168 @@ static void HTTPRequest_set_host(struct HTTPRequest *http, const char *new_host)
 	HTTPRequest_add_header(http, "Host", http->host->host);
 }
 
+
+/* testing */
+#ifdef HTTP_TEST
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// Requests per round; TEST_PARALLEL of them are in flight at any time
+#define TEST_REQUESTS	5000
+#define TEST_PARALLEL	4
+#define TEST_BODY	"hello, world"
+
+static struct sock *test_listener;
+static unsigned int test_port;
+static unsigned int test_round; // 0 = pooled, 1 = one connection per request
+static unsigned int test_started, test_done, test_failed, test_accepted, test_served;
+static struct timeval test_start;
+static struct rusage test_usage;
+
+static void test_start_request();
+
+// Server side: answers alternately with Content-Length and chunked framing, or reads until close for HTTP/1.0
+static void test_client_read(struct sock *sock, char *buf, size_t len)
+{
+	struct stringbuffer *rbuf = sock->ctx;
+	char *end, *hangup;
+
+	stringbuffer_append_string_n(rbuf, buf, len);
+	while((end = strstr(rbuf->string, "\r\n\r\n")))
+	{
+		hangup = strstr(rbuf->string, "Connection: close");
+		if(hangup > end)
+			hangup = NULL;
+
+		stringbuffer_erase(rbuf, 0, end + 4 - rbuf->string);
+		if(hangup)
+		{
+			// Closed once the response has been written
+			sock_write_fmt(sock, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n%s", TEST_BODY);
+			stringbuffer_free(rbuf);
+			sock->ctx = NULL;
+			return;
+		}
+		else if(test_served++ % 2)
+			sock_write_fmt(sock, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n%x\r\n%s\r\n0\r\n\r\n", (unsigned int)strlen(TEST_BODY) - 5, TEST_BODY + 5);
+		else
+			sock_write_fmt(sock, "HTTP/1.1 200 OK\r\nContent-Length: %u\r\n\r\n%s", (unsigned int)strlen(TEST_BODY), TEST_BODY);
+	}
+}
+
+static void test_client_event(struct sock *sock, enum sock_event event, int err)
+{
+	if(event == EV_WRITE && !sock->ctx)
+		sock_close(sock);
+	else if((event == EV_HANGUP || event == EV_ERROR) && sock->ctx)
+	{
+		stringbuffer_free(sock->ctx);
+		sock->ctx = NULL;
+	}
+}
+
+static void test_listener_event(struct sock *sock, enum sock_event event, int err)
+{
+	struct sock *client;
+
+	if(event != EV_ACCEPT || !(client = sock_accept(sock, test_client_event, test_client_read)))
+		return;
+	client->flags |= SOCK_QUIET;
+	client->ctx = stringbuffer_create();
+	test_accepted++;
+}
+
+// Client side
+static void test_read(struct HTTPRequest *http, const char *buf, unsigned int len)
+{
+	if(http->status != 200 || len != strlen(TEST_BODY) || memcmp(buf, TEST_BODY, len))
+	{
+		log_append(LOG_ERROR, "http test: request %s got status %d and a body of %u bytes", http->id, http->status, len);
+		test_failed++;
+	}
+}
+
+static void test_event(struct HTTPRequest *http, enum HTTPRequest_event event)
+{
+	struct timeval tv;
+	struct rusage usage;
+	double msecs, cpu_msecs;
+
+	if(event != H_EV_HANGUP)
+		test_failed++;
+
+	if(test_started < TEST_REQUESTS)
+	{
+		test_start_request();
+		return;
+	}
+
+	if(++test_done < TEST_PARALLEL)
+		return;
+
+	gettimeofday(&tv, NULL);
+	getrusage(RUSAGE_SELF, &usage);
+	msecs = (tv.tv_sec - test_start.tv_sec) * 1000.0 + (tv.tv_usec - test_start.tv_usec) / 1000.0;
+	cpu_msecs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec - test_usage.ru_utime.tv_sec - test_usage.ru_stime.tv_sec) * 1000.0 +
+		    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec - test_usage.ru_utime.tv_usec - test_usage.ru_stime.tv_usec) / 1000.0;
+	debug("HTTP TEST %s: %u requests in %.0f ms (%.0f/s, %.0f ms cpu) over %u connections, %u failed",
+	      (test_round ? "without pooling" : "with pooling"), TEST_REQUESTS, msecs, TEST_REQUESTS * 1000.0 / msecs, cpu_msecs, test_accepted, test_failed);
+
+	if(test_round++)
+	{
+		http_conf_reload();
+		debug("HTTP TEST END");
+		return;
+	}
+
+	// Idle connections of the first round must not be reused by the second one
+	timer_add(this, "http_test_round", now, (timer_f *)run_test, NULL, 0, 0);
+}
+
+static void test_start_request()
+{
+	char url[64];
+	struct HTTPRequest *http;
+
+	snprintf(url, sizeof(url), "127.0.0.1:%u/test", test_port);
+	http = HTTPRequest_create(url, test_event, test_read);
+	test_started++;
+	HTTPRequest_connect(http);
+}
+
+static void run_test()
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	if(!test_listener)
+	{
+		test_listener = sock_create(SOCK_IPV4 | SOCK_QUIET, test_listener_event, NULL);
+		if(sock_bind(test_listener, "127.0.0.1", 0) || sock_listen(test_listener, NULL) ||
+		   getsockname(test_listener->fd, (struct sockaddr *)&sin, &len))
+		{
+			log_append(LOG_ERROR, "http test: could not create the test server");
+			test_listener = NULL;
+			return;
+		}
+		test_port = ntohs(sin.sin_port);
+	}
+
+	dict_clear(pools);
+	http_conf.pooling = !test_round;
+	test_started = test_done = test_failed = test_accepted = test_served = 0;
+
+	debug("HTTP TEST");
+	gettimeofday(&test_start, NULL);
+	getrusage(RUSAGE_SELF, &test_usage);
+	for(unsigned int i = 0; i < TEST_PARALLEL; i++)
+		test_start_request();
+}
+
+static void test_fini()
+{
+	timer_del_boundname(this, "http_test_round");
+	if(test_listener)
+		sock_close(test_listener);
+}
+#endif
@@ -10,6 +10,8 @@
 #define HTTPRequest_get_request_header(HTTP, NAME) (dict_find((HTTP)->request_headers, NAME))
 
 struct HTTPRequest;
+struct http_conn;
+struct http_cache_flight;
 enum HTTPRequest_event;
 
 typedef void (http_read_f)(struct HTTPRequest *, const char *buf, unsigned int len);
@@ -28,7 +30,14 @@ struct HTTPRequest
 	char *id;
 
 	struct HTTPHost *host;
-	struct sock *sock;
+	struct sock *sock; // socket of the pooled connection serving this request
+	struct http_conn *conn;
+	struct HTTPRequest *queue_next; // next request waiting for a connection to the same host
+	time_t queued;
+	unsigned char retried; // resent once after a reused connection was closed by the server
+	unsigned char redirects;
+	struct http_cache_flight *flight; // identical requests sharing one upstream response
+	struct stringbuffer *cache_body; // copy of the body for the cache since read_linewise consumes buf
 	int status;
 
 	struct dict *request_headers;
@@ -56,6 +65,8 @@ struct HTTPRequest
 	const char *method; // GET, POST, ...
 	const char *payload_type; // content type (application/json, application/x-www-form-urlencoded)
 	char *payload; // POST body; free'd after request has been sent
+	// Share/cache the response for this many seconds (set by HTTPRequest_create_cached)
+	unsigned int cache_ttl;
 };
 
 enum HTTPRequest_event
@@ -67,6 +78,8 @@ enum HTTPRequest_event
 
 // The host is meant to contain the port or assume 80 by default
 struct HTTPRequest *HTTPRequest_create(const char *host, http_event_f *, http_read_f *);
+// Identical GET requests share a single upstream request and the response is cached for ttl seconds (0 = default)
+struct HTTPRequest *HTTPRequest_create_cached(const char *host, http_event_f *, http_read_f *, unsigned int ttl);
 void HTTPRequest_free(struct HTTPRequest *);
 void HTTPRequest_cancel(struct HTTPRequest *);
 
@@ -0,0 +1,302 @@
+#include "global.h"
+#include "conf.h"
+#include "stringbuffer.h"
+#include "http.h"
+#include "compress.h"
+#include <zlib.h>
+
+#define COMPRESS_MIN_SIZE	256
+
+struct compress_stream
+{
+	z_stream strm;
+	int level;
+};
+
+static struct {
+	unsigned int enabled : 1;
+	int level;
+	unsigned int min_size;
+} compress_conf;
+
+// Content types which are already compressed or would not benefit from compression
+static const char *uncompressible_types[] = {
+	"image/",
+	"audio/",
+	"video/",
+	"application/zip",
+	"application/gzip",
+	"application/x-gzip",
+	"application/x-bzip2",
+	"application/octet-stream",
+	"application/pdf",
+	NULL
+};
+
+static const char *encoding_names[HTTP_ENC_COUNT] = {
+	"identity",
+	"gzip",
+	"deflate"
+};
+
+static void http_compress_conf_reload();
+static struct compress_stream *compress_stream_get(enum http_encoding encoding);
+static void compress_stream_free(struct compress_stream *stream);
+static const char *response_header_get(struct stringbuffer *hbuf, const char *name, size_t *value_len);
+static int content_type_compressible(const char *type, size_t len);
+static struct stringbuffer *compress_buffer(enum http_encoding encoding, const char *data, size_t len);
+
+// Each thread gets its own set of deflate contexts. They are reset after
+// every response so we only pay for deflateInit2() once per thread.
+static __thread struct compress_stream *compress_streams[HTTP_ENC_COUNT];
+
+void http_compress_init()
+{
+	reg_conf_reload_func(http_compress_conf_reload);
+	http_compress_conf_reload();
+}
+
+void http_compress_fini()
+{
+	unreg_conf_reload_func(http_compress_conf_reload);
+	for(unsigned int i = 0; i < HTTP_ENC_COUNT; i++)
+	{
+		if(compress_streams[i])
+		{
+			compress_stream_free(compress_streams[i]);
+			compress_streams[i] = NULL;
+		}
+	}
+}
+
+static void http_compress_conf_reload()
+{
+	char *str;
+
+	compress_conf.enabled	= ((str = conf_get("httpd/compress", DB_STRING)) ? true_string(str) : 1);
+	compress_conf.level	= ((str = conf_get("httpd/compress_level", DB_STRING)) ? atoi(str) : Z_DEFAULT_COMPRESSION);
+	compress_conf.min_size	= ((str = conf_get("httpd/compress_min_size", DB_STRING)) ? (unsigned int)atoi(str) : COMPRESS_MIN_SIZE);
+
+	if(compress_conf.level != Z_DEFAULT_COMPRESSION && (compress_conf.level < Z_NO_COMPRESSION || compress_conf.level > Z_BEST_COMPRESSION))
+	{
+		log_append(LOG_WARNING, "/httpd/compress_level must be between %d and %d", Z_NO_COMPRESSION, Z_BEST_COMPRESSION);
+		compress_conf.level = Z_DEFAULT_COMPRESSION;
+	}
+}
+
+enum http_encoding http_compress_negotiate(const char *accept_encoding)
+{
+	double q[HTTP_ENC_COUNT] = { 0.0, -1.0, -1.0 };
+	double any_q = -1.0;
+	char *str, *orig_str, *token, *saveptr;
+
+	if(!accept_encoding || !*accept_encoding)
+		return HTTP_ENC_IDENTITY;
+
+	orig_str = str = strdup(accept_encoding);
+	while((token = strtok_r(str, ",", &saveptr)))
+	{
+		char *params;
+		double value = 1.0;
+		size_t len;
+
+		str = NULL;
+		while(*token == ' ' || *token == '\t')
+			token++;
+
+		if((params = strchr(token, ';')))
+		{
+			char *qval;
+			*params++ = '\0';
+			if((qval = strstr(params, "q=")))
+				value = strtod(qval + 2, NULL);
+		}
+
+		len = strcspn(token, " \t");
+		token[len] = '\0';
+
+		if(!strcasecmp(token, "*"))
+			any_q = value;
+		else
+		{
+			for(unsigned int i = HTTP_ENC_GZIP; i < HTTP_ENC_COUNT; i++)
+			{
+				if(!strcasecmp(token, encoding_names[i]) || (i == HTTP_ENC_GZIP && !strcasecmp(token, "x-gzip")))
+					q[i] = value;
+			}
+		}
+	}
+	free(orig_str);
+
+	// Encodings not mentioned explicitly inherit the q-value of "*"
+	for(unsigned int i = HTTP_ENC_GZIP; i < HTTP_ENC_COUNT; i++)
+	{
+		if(q[i] < 0.0)
+			q[i] = any_q;
+	}
+
+	// gzip wins ties since some clients botch raw/zlib deflate
+	if(q[HTTP_ENC_GZIP] > 0.0 && q[HTTP_ENC_GZIP] >= q[HTTP_ENC_DEFLATE])
+		return HTTP_ENC_GZIP;
+	if(q[HTTP_ENC_DEFLATE] > 0.0)
+		return HTTP_ENC_DEFLATE;
+	return HTTP_ENC_IDENTITY;
+}
+
+int http_compress_response(struct http_client *client)
+{
+	struct stringbuffer *out;
+	enum http_encoding encoding;
+	const char *type;
+	size_t type_len;
+	int code;
+
+	if(!compress_conf.enabled || client->wbuf->len < compress_conf.min_size)
+		return 0;
+
+	// Handlers which set their own Content-Length or Content-Encoding
+	// already committed to the body they wrote.
+	if(response_header_get(client->hbuf, "Content-Length", NULL) || response_header_get(client->hbuf, "Content-Encoding", NULL))
+		return 0;
+
+	if(sscanf(client->hbuf->string, "HTTP/1.%*d %d", &code) != 1 || code < 200 || code == 204 || code == 304)
+		return 0;
+
+	if((type = response_header_get(client->hbuf, "Content-Type", &type_len)) && !content_type_compressible(type, type_len))
+		return 0;
+
+	if((encoding = http_compress_negotiate(http_header_get(client, "Accept-Encoding"))) == HTTP_ENC_IDENTITY)
+		return 0;
+
+	if(!(out = compress_buffer(encoding, client->wbuf->string, client->wbuf->len)))
+		return 0;
+
+	// Not worth it if deflate did not shrink the body
+	if(out->len >= client->wbuf->len)
+	{
+		stringbuffer_free(out);
+		return 0;
+	}
+
+	stringbuffer_free(client->wbuf);
+	client->wbuf = out;
+	http_write_header(client, "Content-Encoding", "%s", encoding_names[encoding]);
+	http_write_header(client, "Vary", "Accept-Encoding");
+	return 1;
+}
+
+static struct compress_stream *compress_stream_get(enum http_encoding encoding)
+{
+	struct compress_stream *stream = compress_streams[encoding];
+
+	if(stream && stream->level != compress_conf.level)
+	{
+		compress_stream_free(stream);
+		stream = compress_streams[encoding] = NULL;
+	}
+
+	if(!stream)
+	{
+		// windowBits+16 makes zlib write a gzip wrapper instead of a zlib one
+		int window_bits = (encoding == HTTP_ENC_GZIP) ? (MAX_WBITS + 16) : MAX_WBITS;
+
+		stream = malloc(sizeof(struct compress_stream));
+		memset(stream, 0, sizeof(struct compress_stream));
+		stream->level = compress_conf.level;
+		if(deflateInit2(&stream->strm, stream->level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			log_append(LOG_ERROR, "deflateInit2() failed: %s", stream->strm.msg ? stream->strm.msg : "unknown error");
+			free(stream);
+			return NULL;
+		}
+
+		compress_streams[encoding] = stream;
+	}
+
+	return stream;
+}
+
+static void compress_stream_free(struct compress_stream *stream)
+{
+	deflateEnd(&stream->strm);
+	free(stream);
+}
+
+static const char *response_header_get(struct stringbuffer *hbuf, const char *name, size_t *value_len)
+{
+	size_t name_len = strlen(name);
+	const char *line = strstr(hbuf->string, "\r\n");
+
+	while(line && *(line += 2))
+	{
+		const char *eol = strstr(line, "\r\n");
+		if(!eol)
+			break;
+
+		if(!strncasecmp(line, name, name_len) && line[name_len] == ':')
+		{
+			const char *value = line + name_len + 1;
+			while(*value == ' ')
+				value++;
+			if(value_len)
+				*value_len = eol - value;
+			return value;
+		}
+
+		line = eol;
+	}
+
+	return NULL;
+}
+
+static int content_type_compressible(const char *type, size_t len)
+{
+	if(len >= 13 && !strncasecmp(type, "image/svg+xml", 13))
+		return 1;
+
+	for(const char **prefix = uncompressible_types; *prefix; prefix++)
+	{
+		size_t prefix_len = strlen(*prefix);
+		if(len >= prefix_len && !strncasecmp(type, *prefix, prefix_len))
+			return 0;
+	}
+
+	return 1;
+}
+
+static struct stringbuffer *compress_buffer(enum http_encoding encoding, const char *data, size_t len)
+{
+	struct compress_stream *stream;
+	struct stringbuffer *out;
+	uLong bound;
+	int ret;
+
+	if(!(stream = compress_stream_get(encoding)))
+		return NULL;
+
+	bound = deflateBound(&stream->strm, len);
+	out = stringbuffer_create();
+	out->size = bound;
+	out->string = realloc(out->string, out->size + 1);
+
+	stream->strm.next_in = (Bytef *)data;
+	stream->strm.avail_in = len;
+	stream->strm.next_out = (Bytef *)out->string;
+	stream->strm.avail_out = out->size;
+
+	// The output buffer is large enough for the whole stream so a single
+	// Z_FINISH call must complete it.
+	ret = deflate(&stream->strm, Z_FINISH);
+	if(ret != Z_STREAM_END)
+	{
+		log_append(LOG_WARNING, "deflate() failed: %d (%s)", ret, stream->strm.msg ? stream->strm.msg : "unknown error");
+		deflateReset(&stream->strm);
+		stringbuffer_free(out);
+		return NULL;
+	}
+
+	out->len = stream->strm.total_out;
+	out->string[out->len] = '\0';
+	deflateReset(&stream->strm);
+	return out;
+}
@@ -0,0 +1,20 @@
+#ifndef HTTP_COMPRESS_H
+#define HTTP_COMPRESS_H
+
+struct http_client;
+
+enum http_encoding
+{
+	HTTP_ENC_IDENTITY,
+	HTTP_ENC_GZIP,
+	HTTP_ENC_DEFLATE,
+	HTTP_ENC_COUNT
+};
+
+void http_compress_init();
+void http_compress_fini();
+
+enum http_encoding http_compress_negotiate(const char *accept_encoding);
+int http_compress_response(struct http_client *client);
+
+#endif
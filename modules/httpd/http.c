@@ -9,6 +9,7 @@
 #include "main.h"
 #endif
 #include "http.h"
+#include "compress.h"
 #ifdef HTTP_THREADS
 #include <pthread.h>
 #endif
@@ -32,8 +33,9 @@ IMPLEMENT_LIST(client_list, struct http_client *)
 struct http_header;
 DECLARE_LIST(header_list, struct http_header *)
 IMPLEMENT_LIST(header_list, struct http_header *)
-DECLARE_LIST(handler_list, struct http_handler *)
-IMPLEMENT_LIST(handler_list, struct http_handler *)
+struct http_handler_entry;
+DECLARE_LIST(handler_list, struct http_handler_entry *)
+IMPLEMENT_LIST(handler_list, struct http_handler_entry *)
 
 static unsigned long requests_served = 0;
 
@@ -75,6 +77,12 @@ struct http_method_map
 	{ "POST ", 5, HTTP_POST }
 };
 
+struct http_handler_entry
+{
+	struct http_handler handler;
+	struct http_handler_stats stats;
+};
+
 struct http_header
 {
 	const char *key;
@@ -113,8 +121,8 @@ static void http_writesock(struct http_client *client);
 static struct http_client *http_client_accept(struct sock *listen_sock);
 static void http_client_del(struct http_client *client, unsigned char close_sock);
 static struct http_client *http_client_bysock(struct sock *sock);
-static http_handler_f *http_handler_find(const char *uri);
-static void http_handler_del_handler(struct http_handler *handler);
+static struct http_handler_entry *http_handler_find(const char *uri);
+static void http_handler_del_handler(struct http_handler_entry *entry);
 
 static struct client_list *clients;
 static struct client_list *detached_clients;
@@ -132,6 +140,7 @@ MODULE_INIT
 
 	reg_conf_reload_func(http_conf_reload);
 	http_conf_reload();
+	http_compress_init();
 
 	clients = client_list_create();
 	detached_clients = client_list_create();
@@ -155,6 +164,7 @@ MODULE_FINI
 	while(handlers->count)
 		http_handler_del_handler(handlers->data[handlers->count - 1]);
 	handler_list_free(handlers);
+	http_compress_fini();
 	unreg_conf_reload_func(http_conf_reload);
 }
 
@@ -426,43 +436,54 @@ static void http_handler_404(struct http_client *client, char *uri, int argc, ch
 	http_write_header(client, "Content-Type", "text/html");
 }
 
-static http_handler_f *http_handler_find(const char *uri)
+static struct http_handler_entry *http_handler_find(const char *uri)
 {
-	struct http_handler *found = NULL;
+	struct http_handler_entry *found = NULL;
 	size_t found_len = 0;
 
 	// we search for all matching handlers and take the one with the longest
 	// mask assuming it contains less wildcarded parts then the others
 	for(unsigned int i = 0; i < handlers->count; i++)
 	{
-		struct http_handler *handler = handlers->data[i];
+		struct http_handler *handler = &handlers->data[i]->handler;
 		if(match(handler->uri, uri) == 0 && strlen(handler->uri) > found_len)
 		{
-			found = handler;
+			found = handlers->data[i];
 			found_len = strlen(handler->uri);
 		}
 	}
 
-	return (found ? found->func : NULL);
+	return found;
+}
+
+const struct http_handler_stats *http_handler_stats(const char *uri)
+{
+	for(unsigned int i = 0; i < handlers->count; i++)
+	{
+		if(!strcmp(handlers->data[i]->handler.uri, uri))
+			return &handlers->data[i]->stats;
+	}
+
+	return NULL;
 }
 
 void http_handler_add(const char *uri, http_handler_f *func)
 {
-	struct http_handler *handler = malloc(sizeof(struct http_handler));
-	memset(handler, 0, sizeof(struct http_handler));
-	handler->uri = strdup(uri);
-	handler->func = func;
-	handler_list_add(handlers, handler);
+	struct http_handler_entry *entry = malloc(sizeof(struct http_handler_entry));
+	memset(entry, 0, sizeof(struct http_handler_entry));
+	entry->handler.uri = strdup(uri);
+	entry->handler.func = func;
+	handler_list_add(handlers, entry);
 }
 
 void http_handler_del(const char *uri)
 {
 	for(unsigned int i = 0; i < handlers->count; i++)
 	{
-		struct http_handler *handler = handlers->data[i];
-		if(!strcmp(handler->uri, uri))
+		struct http_handler_entry *entry = handlers->data[i];
+		if(!strcmp(entry->handler.uri, uri))
 		{
-			http_handler_del_handler(handler);
+			http_handler_del_handler(entry);
 			return;
 		}
 	}
@@ -486,11 +507,18 @@ void http_handler_del_list(const struct http_handler *handlers)
 	}
 }
 
-void http_handler_del_handler(struct http_handler *handler)
+void http_handler_del_handler(struct http_handler_entry *entry)
 {
-	handler_list_del(handlers, handler);
-	free(handler->uri);
-	free(handler);
+	// detached clients may still be served after their handler is gone
+	for(unsigned int i = 0; i < clients->count; i++)
+	{
+		if(clients->data[i]->handler_stats == &entry->stats)
+			clients->data[i]->handler_stats = NULL;
+	}
+
+	handler_list_del(handlers, entry);
+	free(entry->handler.uri);
+	free(entry);
 }
 
 static int http_parse_request_line(struct http_client *client, const char *line, unsigned int len)
@@ -537,9 +565,9 @@ static int http_parse_request_line(struct http_client *client, const char *line,
 	client->uri = urldecode(client->uri);
 
 	/* Map the URI to a handler. */
-	client->handler = http_handler_find(client->uri);
-	if(!client->handler)
-		client->handler = http_handler_404;
+	struct http_handler_entry *entry = http_handler_find(client->uri);
+	client->handler = entry ? entry->handler.func : http_handler_404;
+	client->handler_stats = entry ? &entry->stats : NULL;
 
 	/* Extract the request's HTTP minor version. */
 	client->version_minor = atoi(&line[ii + 8]);
@@ -773,8 +801,19 @@ static void http_process_request(struct http_client *client)
 
 void http_request_finalize(struct http_client *client)
 {
+	unsigned int uncompressed_len;
+
 	//debug("Finalizing client %p %s?%s", client, client->uri, client->query_string);
 	client->delay = 0;
+	uncompressed_len = client->wbuf->len;
+	http_compress_response(client);
+	if(client->handler_stats)
+	{
+		client->handler_stats->requests++;
+		client->handler_stats->bytes_in += uncompressed_len;
+		client->handler_stats->bytes_out += client->wbuf->len;
+	}
+
 	http_write_header_default(client);
 	http_writesock(client);
 }
@@ -828,6 +867,7 @@ static void http_request_complete(struct http_client *client)
 
 	MyFree(client->uri);
 	MyFree(client->query_string);
+	client->handler_stats = NULL;
 	http_headers_flush(client->headers);
 	stringbuffer_flush(client->hbuf);
 	stringbuffer_flush(client->wbuf);
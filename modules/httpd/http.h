@@ -28,6 +28,13 @@ struct http_handler
 	http_handler_f *func;
 };
 
+struct http_handler_stats
+{
+	unsigned long requests;
+	uint64_t bytes_in; // body size before compression
+	uint64_t bytes_out; // body size sent to the client
+};
+
 enum http_method
 {
 	HTTP_NONE,
@@ -57,6 +64,7 @@ struct http_client
 	time_t if_modified_since;
 
 	http_handler_f *handler;
+	struct http_handler_stats *handler_stats; // NULL for the builtin 404 handler
 	http_dead_f *dead_callback;
 
 	unsigned char delay;
@@ -86,6 +94,7 @@ void http_handler_add(const char *uri, http_handler_f *func);
 void http_handler_del(const char *uri);
 void http_handler_add_list(const struct http_handler *handlers);
 void http_handler_del_list(const struct http_handler *handlers);
+const struct http_handler_stats *http_handler_stats(const char *uri);
 void http_write_header_redirect(struct http_client *client, const char *fmt, ...) PRINTF_LIKE(2, 3);
 void http_write_header_status(struct http_client *client, int code);
 void http_write_header(struct http_client *client, const char *name, const char *fmt, ...) PRINTF_LIKE(3, 4);
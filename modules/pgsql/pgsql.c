@@ -1,45 +1,109 @@
 #include "global.h"
 #include "module.h"
 #include "stringlist.h"
+#include "sock.h"
 #include "pgsql.h"
+#include "pool.h"
 
 #include <libpq-fe.h>
 
 MODULE_DEPENDS(NULL);
 
-MODULE_INIT
+struct pgsql_pending
 {
+	pgsql_result_f *func;
+	void *ctx;
+	PGresult *res;
+	unsigned int received : 1;
+	unsigned int sync : 1; // followed by a pipeline sync point
+	// Queries issued while connecting are kept until they can be sent
+	unsigned int unsent : 1;
+	char *query;
+	int nparams;
+	Oid *types;
+	char **values;
+	int *lengths;
+	int *formats;
+	int result_format;
+	struct pgsql_pending *next;
+};
+
+// Synchronous callers give up on a connection attempt after this many seconds
+#define PGSQL_CONNECT_WAIT 10
+
+static int pgsql_check_connection(struct pgsql *conn);
+static void pgsql_param_formats(struct stringlist *params, uint32_t binary_flags, int **lengths, int **formats);
+static int pgsql_connect_poll(struct pgsql *conn);
+static int pgsql_connect_wait(struct pgsql *conn);
+static void pgsql_connect_done(struct pgsql *conn);
+static int pgsql_send(struct pgsql *conn, struct pgsql_pending *pending, const char *query, int nparams, const Oid *types, const char *const *values, const int *lengths, const int *formats, int result_format);
+static void pgsql_pending_store(struct pgsql_pending *pending, const char *query, int nparams, const Oid *types, const char *const *values, const int *lengths, const int *formats, int result_format);
+static void pgsql_pending_unstore(struct pgsql_pending *pending);
+static void pgsql_sock_event(struct sock *sock, enum sock_event event, int err);
+static void pgsql_sock_watch(struct pgsql *conn);
+static void pgsql_sock_release(struct pgsql *conn);
+static void pgsql_flush(struct pgsql *conn);
+static int pgsql_process_results(struct pgsql *conn, int block);
+static void pgsql_pending_complete(struct pgsql *conn, struct pgsql_pending *pending);
+static void pgsql_fail_pending(struct pgsql *conn);
 
+MODULE_INIT
+{
+	pgsql_pool_init(self);
 }
 
 MODULE_FINI
 {
-
+	pgsql_pool_fini();
 }
 
 
+// Connections come from a pool shared by all modules using the same connection string
 struct pgsql *pgsql_init(const char *conn_info)
 {
-	struct pgsql *conn;
-	PGconn *pg_conn = PQconnectdb(conn_info);
-	if(PQstatus(pg_conn) != CONNECTION_OK)
-	{
-		log_append(LOG_WARNING, "connection to database failed: %s", PQerrorMessage(pg_conn));
-		PQfinish(pg_conn);
-		return NULL;
-	}
+	struct pgsql *conn = pgsql_pool_checkout(conn_info);
 
-	conn = malloc(sizeof(struct pgsql));
-	conn->conn = pg_conn;
-	conn->conn_info = strdup(conn_info);
+	// A new connection is established by the main loop until somebody needs it right away
+	if(conn && conn->connecting && pgsql_pool_main_thread())
+		pgsql_sock_watch(conn);
 	return conn;
 }
 
 void pgsql_fini(struct pgsql *conn)
 {
-	free(conn->conn_info);
-	PQfinish(conn->conn);
-	free(conn);
+	// Don't lose queued inserts/updates
+	pgsql_wait(conn);
+	pgsql_sock_release(conn);
+	pgsql_pool_checkin(conn);
+}
+
+// Returns the libpq connection for synchronous use. A connection attempt is finished first,
+// async queries are waited for and a broken connection is replaced. NULL if there is none.
+PGconn *pgsql_conn(struct pgsql *conn)
+{
+	pgsql_wait(conn);
+
+	if(pgsql_check_connection(conn) || (conn->connecting && pgsql_connect_wait(conn)))
+		return NULL;
+
+	return (PQstatus(conn->conn) == CONNECTION_OK) ? conn->conn : NULL;
+}
+
+// Calls func once the connection attempt running in the background has finished.
+// Returns 0 without calling func if the connection can be used right away and -1 if there is none.
+// Only meant for connections without async queries which are then used with libpq directly.
+int pgsql_when_ready(struct pgsql *conn, pgsql_ready_f *func, void *ctx)
+{
+	if(pgsql_check_connection(conn))
+		return -1;
+
+	if(!conn->connecting)
+		return 0;
+
+	conn->ready_func = func;
+	conn->ready_ctx = ctx;
+	pgsql_sock_watch(conn);
+	return 1;
 }
 
 void pgsql_free(PGresult *res)
@@ -111,53 +175,33 @@ PGresult *pgsql_query_bin(struct pgsql *conn, const char *query, int want_result
 	PGresult *res = NULL;
 	int *paramLengths, *paramFormats;
 
-	if(PQstatus(conn->conn) == CONNECTION_BAD)
+	// Results of earlier async queries have to be read before we can send anything synchronously
+	if(!pgsql_conn(conn))
 	{
-		debug("reconnecting to database");
-		PQfinish(conn->conn);
-		conn->conn = PQconnectdb(conn->conn_info);
-
-		if(PQstatus(conn->conn) != CONNECTION_OK)
-		{
-			log_append(LOG_WARNING, "connection to database failed: %s", PQerrorMessage(conn->conn));
-			return NULL;
-		}
+		if(params)
+			stringlist_free(params);
+		return NULL;
 	}
 
-	if(!binary_flags || !params)
-		paramLengths = paramFormats = NULL;
-	else
-	{
-		paramLengths = calloc(params->count, sizeof(int));
-		paramFormats = calloc(params->count, sizeof(int));
-
-		for(unsigned int i = 0; i < params->count; i++)
-		{
-			paramLengths[i] = params->data[i] ? strlen(params->data[i]) : 0;
-			paramFormats[i] = (binary_flags >> i) ? 1 : 0;
-		}
-	}
+	pgsql_param_formats(params, binary_flags, &paramLengths, &paramFormats);
 
 	res = PQexecParams(conn->conn, query, params ? params->count : 0, NULL, params ? (const char*const*)params->data : NULL, paramLengths, paramFormats, 0);
 
 	// If the connection is bad now, our query was most likely not processed -> reconnect and retry
 	if(PQstatus(conn->conn) == CONNECTION_BAD)
 	{
-		debug("reconnecting to database");
 		if(res)
 			PQclear(res);
-		PQfinish(conn->conn);
-		conn->conn = PQconnectdb(conn->conn_info);
-
-		if(PQstatus(conn->conn) != CONNECTION_OK)
+		if(!pgsql_conn(conn))
 		{
-			log_append(LOG_WARNING, "connection to database failed: %s", PQerrorMessage(conn->conn));
 			MyFree(paramLengths);
 			MyFree(paramFormats);
+			if(params)
+				stringlist_free(params);
 			return NULL;
 		}
 
-		res = PQexecParams(conn->conn, query, params ? params->count : 0, NULL, params ? (const char*const*)params->data : NULL, NULL, NULL, 0);
+		res = PQexecParams(conn->conn, query, params ? params->count : 0, NULL, params ? (const char*const*)params->data : NULL, paramLengths, paramFormats, 0);
 	}
 
 	MyFree(paramLengths);
@@ -225,6 +269,521 @@ char *pgsql_query_str(struct pgsql *conn, const char *query, struct stringlist *
 	return buf;
 }
 
+int pgsql_query_async(struct pgsql *conn, const char *query, struct stringlist *params, pgsql_result_f *func, void *ctx)
+{
+	return pgsql_query_async_bin(conn, query, params, 0, func, ctx);
+}
+
+int pgsql_query_async_bin(struct pgsql *conn, const char *query, struct stringlist *params, uint32_t binary_flags, pgsql_result_f *func, void *ctx)
+{
+	int *paramLengths, *paramFormats;
+	int ret;
+
+	pgsql_param_formats(params, binary_flags, &paramLengths, &paramFormats);
+	ret = pgsql_query_async_params(conn, query, params ? params->count : 0, NULL, params ? (const char*const*)params->data : NULL, paramLengths, paramFormats, 0, func, ctx);
+	MyFree(paramLengths);
+	MyFree(paramFormats);
+	if(params)
+		stringlist_free(params);
+	return ret;
+}
+
+// Like PQsendQueryParams(); the parameters are copied if they cannot be sent right away
+int pgsql_query_async_params(struct pgsql *conn, const char *query, int nparams, const Oid *types, const char *const *values,
+			     const int *lengths, const int *formats, int result_format, pgsql_result_f *func, void *ctx)
+{
+	struct pgsql_pending *pending;
+
+	if(!conn->connecting && !conn->pending_head && !conn->syncs && pgsql_check_connection(conn))
+		return -1;
+
+	pending = malloc(sizeof(struct pgsql_pending));
+	memset(pending, 0, sizeof(struct pgsql_pending));
+	pending->func = func;
+	pending->ctx = ctx;
+	// Inside a batch all queries share the sync point sent by pgsql_batch_end()
+	pending->sync = !conn->batch;
+
+	if(conn->connecting)
+		pgsql_pending_store(pending, query, nparams, types, values, lengths, formats, result_format);
+	else if(pgsql_send(conn, pending, query, nparams, types, values, lengths, formats, result_format))
+	{
+		free(pending);
+		return -1;
+	}
+
+	if(conn->pending_tail)
+		conn->pending_tail->next = pending;
+	else
+		conn->pending_head = pending;
+	conn->pending_tail = pending;
+
+	pgsql_sock_watch(conn);
+	if(!conn->connecting)
+		pgsql_flush(conn);
+	return 0;
+}
+
+void pgsql_batch_begin(struct pgsql *conn)
+{
+	conn->batch++;
+}
+
+void pgsql_batch_end(struct pgsql *conn)
+{
+	assert(conn->batch);
+	if(--conn->batch || !conn->pending_head)
+		return;
+
+	// Nothing has been sent yet; the sync point goes out after the last query
+	if(conn->connecting)
+	{
+		conn->pending_tail->sync = 1;
+		return;
+	}
+
+	PQpipelineSync(conn->conn);
+	conn->syncs++;
+	pgsql_flush(conn);
+}
+
+// Blocks until all async queries have been answered and their callbacks were called
+void pgsql_wait(struct pgsql *conn)
+{
+	if(!conn->pending_head && !conn->syncs)
+		return;
+
+	if(conn->connecting && pgsql_connect_wait(conn))
+	{
+		pgsql_fail_pending(conn);
+		return;
+	}
+
+	if(!conn->pending_head && !conn->syncs)
+		return;
+
+	if(conn->batch && conn->pending_tail && PQpipelineStatus(conn->conn) != PQ_PIPELINE_OFF)
+	{
+		PQpipelineSync(conn->conn);
+		conn->syncs++;
+	}
+
+	PQsetnonblocking(conn->conn, 0);
+	if(PQflush(conn->conn) != 0 || pgsql_process_results(conn, 1))
+		pgsql_fail_pending(conn);
+}
+
+// Starts replacing a broken connection; returns non-zero if that is not possible right now
+static int pgsql_check_connection(struct pgsql *conn)
+{
+	if(conn->connecting || PQstatus(conn->conn) != CONNECTION_BAD)
+		return 0;
+
+	debug("reconnecting to database");
+	pgsql_sock_release(conn);
+	return pgsql_pool_reconnect(conn);
+}
+
+// Advances the connection attempt; returns non-zero once it has finished, successfully or not
+static int pgsql_connect_poll(struct pgsql *conn)
+{
+	conn->connect_poll = conn->resetting ? PQresetPoll(conn->conn) : PQconnectPoll(conn->conn);
+	if(conn->connect_poll == PGRES_POLLING_READING || conn->connect_poll == PGRES_POLLING_WRITING)
+		return 0;
+
+	conn->connecting = 0;
+	conn->resetting = 0;
+	return 1;
+}
+
+// Finishes the connection attempt in the calling thread.
+// Returns non-zero if it did not finish within PGSQL_CONNECT_WAIT seconds.
+static int pgsql_connect_wait(struct pgsql *conn)
+{
+	time_t deadline = time(NULL) + PGSQL_CONNECT_WAIT;
+
+	while(conn->connecting)
+	{
+		struct pollfd pfd;
+		time_t left = deadline - time(NULL);
+		int ret;
+
+		if(left <= 0)
+		{
+			log_append(LOG_WARNING, "connection to database did not complete within %u seconds", PGSQL_CONNECT_WAIT);
+			// Keep watching the attempt if it was running in the background
+			if(conn->sock)
+				pgsql_sock_watch(conn);
+			return -1;
+		}
+
+		pfd.fd = PQsocket(conn->conn);
+		pfd.events = (conn->connect_poll == PGRES_POLLING_READING) ? POLLIN : POLLOUT;
+		pfd.revents = 0;
+		if((ret = poll(&pfd, 1, left * 1000)) > 0 && pgsql_connect_poll(conn))
+			pgsql_connect_done(conn);
+		else if(ret < 0 && errno != EINTR)
+		{
+			log_append(LOG_ERROR, "poll() failed: %s (%d)", strerror(errno), errno);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Sends the queries which were issued while the connection was being established
+static void pgsql_connect_done(struct pgsql *conn)
+{
+	struct pgsql_pending *pending;
+	pgsql_ready_f *ready_func = conn->ready_func;
+	int ok = (PQstatus(conn->conn) == CONNECTION_OK);
+
+	conn->ready_func = NULL;
+	pgsql_pool_connected(conn, ok);
+
+	if(!ok)
+		pgsql_fail_pending(conn);
+	else
+	{
+		for(pending = conn->pending_head; pending; pending = pending->next)
+		{
+			int ret = pgsql_send(conn, pending, pending->query, pending->nparams, pending->types, (const char *const *)pending->values,
+					     pending->lengths, pending->formats, pending->result_format);
+
+			pgsql_pending_unstore(pending);
+			if(ret)
+			{
+				pgsql_fail_pending(conn);
+				break;
+			}
+		}
+
+		if(conn->pending_head)
+			pgsql_flush(conn);
+		else
+			pgsql_sock_release(conn);
+	}
+
+	if(ready_func)
+		ready_func(conn, ok, conn->ready_ctx);
+}
+
+// Returns non-zero if the query could not be sent
+static int pgsql_send(struct pgsql *conn, struct pgsql_pending *pending, const char *query, int nparams, const Oid *types, const char *const *values, const int *lengths, const int *formats, int result_format)
+{
+	if(PQpipelineStatus(conn->conn) == PQ_PIPELINE_OFF)
+	{
+		// Pipeline mode lets us send queries without waiting for the previous result
+		PQsetnonblocking(conn->conn, 1);
+		if(!PQenterPipelineMode(conn->conn))
+		{
+			log_append(LOG_WARNING, "could not enter pipeline mode: %s", PQerrorMessage(conn->conn));
+			return -1;
+		}
+	}
+
+	if(!PQsendQueryParams(conn->conn, query, nparams, types, values, lengths, formats, result_format))
+	{
+		log_append(LOG_WARNING, "pgsql query failed: %s", PQerrorMessage(conn->conn));
+		return -1;
+	}
+
+	if(pending->sync)
+	{
+		PQpipelineSync(conn->conn);
+		conn->syncs++;
+	}
+
+	return 0;
+}
+
+static void pgsql_pending_store(struct pgsql_pending *pending, const char *query, int nparams, const Oid *types, const char *const *values, const int *lengths, const int *formats, int result_format)
+{
+	pending->unsent = 1;
+	pending->query = strdup(query);
+	pending->nparams = nparams;
+	pending->result_format = result_format;
+	if(!nparams)
+		return;
+
+	if(types)
+	{
+		pending->types = malloc(nparams * sizeof(Oid));
+		memcpy(pending->types, types, nparams * sizeof(Oid));
+	}
+
+	if(lengths)
+	{
+		pending->lengths = malloc(nparams * sizeof(int));
+		memcpy(pending->lengths, lengths, nparams * sizeof(int));
+	}
+
+	if(formats)
+	{
+		pending->formats = malloc(nparams * sizeof(int));
+		memcpy(pending->formats, formats, nparams * sizeof(int));
+	}
+
+	pending->values = calloc(nparams, sizeof(char *));
+	for(int i = 0; i < nparams; i++)
+	{
+		if(!values[i])
+			continue;
+
+		// Binary values are not NUL-terminated and may contain NUL bytes
+		if(formats && formats[i])
+		{
+			pending->values[i] = malloc(lengths[i] ? lengths[i] : 1);
+			memcpy(pending->values[i], values[i], lengths[i]);
+		}
+		else
+			pending->values[i] = strdup(values[i]);
+	}
+}
+
+static void pgsql_pending_unstore(struct pgsql_pending *pending)
+{
+	if(pending->values)
+	{
+		for(int i = 0; i < pending->nparams; i++)
+			MyFree(pending->values[i]);
+		MyFree(pending->values);
+	}
+
+	MyFree(pending->query);
+	MyFree(pending->types);
+	MyFree(pending->lengths);
+	MyFree(pending->formats);
+	pending->unsent = 0;
+}
+
+static void pgsql_param_formats(struct stringlist *params, uint32_t binary_flags, int **lengths, int **formats)
+{
+	if(!binary_flags || !params)
+	{
+		*lengths = *formats = NULL;
+		return;
+	}
+
+	*lengths = calloc(params->count, sizeof(int));
+	*formats = calloc(params->count, sizeof(int));
+
+	for(unsigned int i = 0; i < params->count; i++)
+	{
+		(*lengths)[i] = params->data[i] ? strlen(params->data[i]) : 0;
+		(*formats)[i] = (binary_flags >> i) ? 1 : 0;
+	}
+}
+
+static void pgsql_sock_event(struct sock *sock, enum sock_event event, int err)
+{
+	struct pgsql *conn = sock->ctx;
+
+	// Until the connection is established both directions just advance the attempt
+	if(conn->connecting)
+	{
+		if(pgsql_connect_poll(conn))
+			pgsql_connect_done(conn);
+		else
+			pgsql_sock_watch(conn);
+		return;
+	}
+
+	switch(event)
+	{
+		case EV_WRITE:
+			pgsql_flush(conn);
+			break;
+
+		case EV_READ:
+			if(!PQconsumeInput(conn->conn))
+			{
+				log_append(LOG_ERROR, "PQconsumeInput failed: %s", PQerrorMessage(conn->conn));
+				pgsql_fail_pending(conn);
+				break;
+			}
+
+			if(pgsql_process_results(conn, 0))
+				pgsql_fail_pending(conn);
+			break;
+
+		default:
+			break;
+	}
+}
+
+// Watches the connection's fd from the main loop; libpq may switch to another fd while connecting
+static void pgsql_sock_watch(struct pgsql *conn)
+{
+	if(conn->sock && conn->sock->fd != PQsocket(conn->conn))
+		pgsql_sock_release(conn);
+
+	if(!conn->sock)
+	{
+		if(PQsocket(conn->conn) < 0)
+			return;
+
+		conn->sock = sock_create(SOCK_NOSOCK|SOCK_QUIET, pgsql_sock_event, NULL);
+		conn->sock->config_poll = 1;
+		conn->sock->ctx = conn;
+		sock_set_fd(conn->sock, PQsocket(conn->conn));
+	}
+
+	if(conn->connecting)
+	{
+		conn->sock->want_read = (conn->connect_poll == PGRES_POLLING_READING);
+		conn->sock->want_write = (conn->connect_poll == PGRES_POLLING_WRITING);
+	}
+}
+
+static void pgsql_sock_release(struct pgsql *conn)
+{
+	if(!conn->sock)
+		return;
+
+	// The fd belongs to libpq, so keep the socket code from closing it
+	conn->sock->fd = -1;
+	sock_close(conn->sock);
+	conn->sock = NULL;
+}
+
+static void pgsql_flush(struct pgsql *conn)
+{
+	int ret = PQflush(conn->conn);
+	if(ret == -1)
+	{
+		log_append(LOG_ERROR, "PQflush failed: %s", PQerrorMessage(conn->conn));
+		pgsql_fail_pending(conn);
+		return;
+	}
+
+	if(conn->sock)
+	{
+		conn->sock->want_write = (ret == 1);
+		conn->sock->want_read = 1;
+	}
+}
+
+// Returns non-zero if the connection broke
+static int pgsql_process_results(struct pgsql *conn, int block)
+{
+	while(conn->pending_head || conn->syncs)
+	{
+		struct pgsql_pending *pending = conn->pending_head;
+		PGresult *res;
+
+		if(!block && PQisBusy(conn->conn))
+			return 0;
+
+		if(!(res = PQgetResult(conn->conn)))
+		{
+			// NULL terminates the results of the current query
+			if(!pending || !pending->received)
+				return (block || PQstatus(conn->conn) == CONNECTION_BAD);
+
+			conn->pending_head = pending->next;
+			if(!conn->pending_head)
+				conn->pending_tail = NULL;
+			pgsql_pending_complete(conn, pending);
+			continue;
+		}
+
+		if(PQresultStatus(res) == PGRES_PIPELINE_SYNC)
+		{
+			PQclear(res);
+			conn->syncs--;
+			continue;
+		}
+
+		if(!pending)
+		{
+			PQclear(res);
+			continue;
+		}
+
+		if(pending->res)
+			PQclear(pending->res);
+		pending->res = res;
+		pending->received = 1;
+	}
+
+	PQexitPipelineMode(conn->conn);
+	if(conn->sock)
+		conn->sock->want_read = conn->sock->want_write = 0;
+	return 0;
+}
+
+static void pgsql_pending_complete(struct pgsql *conn, struct pgsql_pending *pending)
+{
+	PGresult *res = pending->res;
+
+	switch(res ? PQresultStatus(res) : PGRES_FATAL_ERROR)
+	{
+		case PGRES_COMMAND_OK:
+		case PGRES_TUPLES_OK:
+			break;
+
+		case PGRES_PIPELINE_ABORTED:
+			log_append(LOG_WARNING, "pgsql query skipped since an earlier query in the batch failed");
+			res = NULL;
+			break;
+
+		default:
+			log_append(LOG_WARNING, "pgsql query failed (%s): %s", (res ? PQresStatus(PQresultStatus(res)) : "no result"),
+				(res ? PQresultErrorMessage(res) : PQerrorMessage(conn->conn)));
+			res = NULL;
+			break;
+	}
+
+	if(pending->func)
+		pending->func(conn, res, pending->ctx);
+
+	if(pending->res)
+		PQclear(pending->res);
+	pgsql_pending_unstore(pending);
+	free(pending);
+}
+
+static void pgsql_fail_pending(struct pgsql *conn)
+{
+	struct pgsql_pending *pending;
+
+	while((pending = conn->pending_head))
+	{
+		conn->pending_head = pending->next;
+		if(pending->res)
+			PQclear(pending->res);
+		pending->res = NULL;
+		pgsql_pending_complete(conn, pending);
+	}
+
+	conn->pending_tail = NULL;
+	conn->syncs = 0;
+
+	// An attempt which is still running keeps its socket
+	if(conn->connecting)
+		return;
+
+	pgsql_sock_release(conn);
+
+	// Get rid of the broken pipeline without blocking the main loop; queries issued meanwhile
+	// are sent once the new session is up. The next query reconnects if the connection is gone.
+	if(PQstatus(conn->conn) != CONNECTION_BAD)
+	{
+		if(!PQresetStart(conn->conn))
+		{
+			log_append(LOG_WARNING, "connection to database failed: %s", PQerrorMessage(conn->conn));
+			return;
+		}
+
+		conn->connecting = 1;
+		conn->resetting = 1;
+		conn->connect_poll = PGRES_POLLING_WRITING;
+		pgsql_sock_watch(conn);
+	}
+}
+
 void pgsql_begin(struct pgsql *conn)
 {
 	pgsql_query(conn, "BEGIN TRANSACTION", 0, NULL);
@@ -4,15 +4,59 @@
 #include <libpq-fe.h>
 
 struct stringlist;
+struct sock;
+struct pgsql;
+struct pgsql_pool;
+struct pgsql_pending;
+
+// res is NULL if the query failed; it is cleared after the callback returns
+typedef void (pgsql_result_f)(struct pgsql *conn, PGresult *res, void *ctx);
+// ok is zero if the connection could not be established
+typedef void (pgsql_ready_f)(struct pgsql *conn, int ok, void *ctx);
 
 struct pgsql
 {
 	PGconn *conn;
 	char *conn_info;
+
+	// Set while the connection is (re-)established in the background
+	unsigned int connecting : 1;
+	unsigned int resetting : 1; // PQresetStart() was used instead of PQconnectStart()
+	PostgresPollingStatusType connect_poll;
+	unsigned int generation; // changes with every new session or user of the connection, e.g. for prepared statements
+	pgsql_ready_f *ready_func;
+	void *ready_ctx;
+
+	// Asynchronous queries which have been sent and wait for their results
+	struct sock *sock;
+	struct pgsql_pending *pending_head; // queries issued while connecting are sent once we are connected
+	struct pgsql_pending *pending_tail;
+	unsigned int syncs; // pipeline sync points not yet acknowledged by the server
+	unsigned int batch; // nesting level of pgsql_batch_begin()
+
+	struct pgsql_pool *pool;
+	time_t idle_since;
+};
+
+struct pgsql_pool_stats
+{
+	unsigned int open;
+	unsigned int idle;
+	unsigned int in_use;
+	unsigned int peak_in_use;
+	unsigned long checkouts;
+	unsigned long waits; // checkouts which had to wait for a connection to be returned
+	unsigned long timeouts; // checkouts which gave up waiting
+	unsigned long failures; // failed connection attempts
+	unsigned long wait_msec_total;
+	unsigned long wait_msec_max;
 };
 
 struct pgsql *pgsql_init(const char *conn_info);
 void pgsql_fini(struct pgsql *conn);
+PGconn *pgsql_conn(struct pgsql *conn);
+int pgsql_when_ready(struct pgsql *conn, pgsql_ready_f *func, void *ctx);
+int pgsql_pool_stats(const char *conn_info, struct pgsql_pool_stats *stats);
 
 void pgsql_free(PGresult *res);
 int pgsql_num_rows(PGresult *res);
@@ -25,6 +69,13 @@ PGresult *pgsql_query_bin(struct pgsql *conn, const char *query, int want_result
 int pgsql_query_int(struct pgsql *conn, const char *query, struct stringlist *params);
 int pgsql_query_bool(struct pgsql *conn, const char *query, struct stringlist *params);
 char *pgsql_query_str(struct pgsql *conn, const char *query, struct stringlist *params);
+int pgsql_query_async(struct pgsql *conn, const char *query, struct stringlist *params, pgsql_result_f *func, void *ctx);
+int pgsql_query_async_bin(struct pgsql *conn, const char *query, struct stringlist *params, uint32_t binary_flags, pgsql_result_f *func, void *ctx);
+int pgsql_query_async_params(struct pgsql *conn, const char *query, int nparams, const Oid *types, const char *const *values,
+			     const int *lengths, const int *formats, int result_format, pgsql_result_f *func, void *ctx);
+void pgsql_batch_begin(struct pgsql *conn);
+void pgsql_batch_end(struct pgsql *conn);
+void pgsql_wait(struct pgsql *conn);
 void pgsql_begin(struct pgsql *conn);
 void pgsql_commit(struct pgsql *conn);
 void pgsql_rollback(struct pgsql *conn);
@@ -0,0 +1,519 @@
+#include "global.h"
+#include "conf.h"
+#include "timer.h"
+#include "ptrlist.h"
+#include "pgsql.h"
+#include "pool.h"
+
+#include <libpq-fe.h>
+#include <pthread.h>
+
+// Connections to one database, shared by all users of the same connection string
+struct pgsql_pool
+{
+	char *conn_info;
+	struct ptrlist *idle;
+	unsigned int open; // idle, checked out and being established
+	unsigned int in_use;
+	PGconn *connecting; // started in the background to keep pool_min connections open
+	PostgresPollingStatusType connect_poll;
+	time_t retry_at; // no connection attempts before this time
+	unsigned int backoff;
+	pthread_cond_t cond;
+	struct pgsql_pool_stats stats;
+};
+
+static struct {
+	unsigned int min;
+	unsigned int max;
+	unsigned int wait_timeout;
+	unsigned int idle_timeout;
+	unsigned int check_interval;
+	unsigned int backoff_max;
+} pool_conf;
+
+static void pgsql_pool_conf_reload();
+static struct pgsql_pool *pool_get(const char *conn_info);
+static void pool_free(struct pgsql_pool *pool);
+static struct pgsql *pool_conn_create(struct pgsql_pool *pool, PGconn *pg_conn);
+static void pool_conn_close(struct pgsql *conn);
+static struct pgsql *pool_take_idle(struct pgsql_pool *pool);
+static void pool_connect_ok(struct pgsql_pool *pool);
+static void pool_connect_failed(struct pgsql_pool *pool, const char *error);
+static void pool_poll_connect(struct pgsql_pool *pool);
+static void pool_check_idle(struct pgsql_pool *pool);
+static void pool_check_tmr(void *bound, void *data);
+
+// All pool state is protected by pools_mutex since connections are checked out from worker threads
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t main_thread;
+static struct module *this;
+static struct dict *pools;
+static time_t last_check;
+static unsigned int generation;
+
+void pgsql_pool_init(struct module *self)
+{
+	this = self;
+	main_thread = pthread_self();
+	pools = dict_create();
+	dict_set_free_funcs(pools, NULL, (dict_free_f *)pool_free);
+
+	reg_conf_reload_func(pgsql_pool_conf_reload);
+	pgsql_pool_conf_reload();
+
+	last_check = now;
+	timer_add(this, "pgsql_pool_check", now + 1, pool_check_tmr, NULL, 0, 0);
+}
+
+void pgsql_pool_fini()
+{
+	timer_del_boundname(this, "pgsql_pool_check");
+	unreg_conf_reload_func(pgsql_pool_conf_reload);
+
+	pthread_mutex_lock(&pools_mutex);
+	dict_free(pools);
+	pools = NULL;
+	pthread_mutex_unlock(&pools_mutex);
+}
+
+static void pgsql_pool_conf_reload()
+{
+	char *str;
+
+	str = conf_get("pgsql/pool_min", DB_STRING);
+	pool_conf.min = str ? (unsigned int)atoi(str) : 1;
+
+	str = conf_get("pgsql/pool_max", DB_STRING);
+	pool_conf.max = str ? (unsigned int)atoi(str) : 8;
+
+	str = conf_get("pgsql/pool_wait", DB_STRING);
+	pool_conf.wait_timeout = str ? (unsigned int)atoi(str) : 10;
+
+	str = conf_get("pgsql/pool_idle_timeout", DB_STRING);
+	pool_conf.idle_timeout = str ? (unsigned int)atoi(str) : 300;
+
+	str = conf_get("pgsql/pool_check_interval", DB_STRING);
+	pool_conf.check_interval = str ? (unsigned int)atoi(str) : 30;
+
+	str = conf_get("pgsql/pool_backoff_max", DB_STRING);
+	pool_conf.backoff_max = str ? (unsigned int)atoi(str) : 60;
+
+	if(!pool_conf.max)
+		pool_conf.max = 1;
+	if(pool_conf.min > pool_conf.max)
+	{
+		log_append(LOG_WARNING, "/pgsql/pool_min must not be greater than /pgsql/pool_max");
+		pool_conf.min = pool_conf.max;
+	}
+}
+
+// Takes a connection from the pool, starting a new one if there is room for it; such a
+// connection is still being established when it is returned (see pgsql_init()).
+// Worker threads wait up to pgsql/pool_wait seconds if all connections are in use;
+// the main thread never blocks on other users of the pool.
+struct pgsql *pgsql_pool_checkout(const char *conn_info)
+{
+	struct pgsql_pool *pool;
+	struct pgsql *conn = NULL;
+	struct timespec start, deadline;
+	unsigned int waited = 0, timed_out = 0;
+
+	pthread_mutex_lock(&pools_mutex);
+	pool = pool_get(conn_info);
+	while(!(conn = pool_take_idle(pool)))
+	{
+		if(pool->open < pool_conf.max)
+		{
+			PGconn *pg_conn;
+
+			if(time(NULL) < pool->retry_at)
+			{
+				debug("not connecting to database, backing off for %u seconds", pool->backoff);
+				break;
+			}
+
+			pg_conn = PQconnectStart(conn_info);
+			if(!pg_conn || PQstatus(pg_conn) == CONNECTION_BAD)
+			{
+				pool_connect_failed(pool, (pg_conn ? PQerrorMessage(pg_conn) : "out of memory"));
+				if(pg_conn)
+					PQfinish(pg_conn);
+				break;
+			}
+
+			pool->open++;
+			conn = pool_conn_create(pool, pg_conn);
+			conn->connecting = 1;
+			conn->connect_poll = PGRES_POLLING_WRITING;
+			break;
+		}
+
+		if(timed_out || pthread_equal(pthread_self(), main_thread))
+		{
+			log_append(LOG_WARNING, "all %u database connections are in use", pool->open);
+			break;
+		}
+
+		if(!waited)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += pool_conf.wait_timeout;
+			pool->stats.waits++;
+			waited = 1;
+		}
+
+		if(pthread_cond_timedwait(&pool->cond, &pools_mutex, &deadline) == ETIMEDOUT)
+		{
+			pool->stats.timeouts++;
+			timed_out = 1;
+		}
+	}
+
+	if(waited)
+	{
+		struct timespec end;
+		unsigned long msec;
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		msec = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+		pool->stats.wait_msec_total += msec;
+		if(msec > pool->stats.wait_msec_max)
+			pool->stats.wait_msec_max = msec;
+	}
+
+	if(conn)
+	{
+		pool->stats.checkouts++;
+		if(++pool->in_use > pool->stats.peak_in_use)
+			pool->stats.peak_in_use = pool->in_use;
+	}
+
+	pthread_mutex_unlock(&pools_mutex);
+	return conn;
+}
+
+void pgsql_pool_checkin(struct pgsql *conn)
+{
+	struct pgsql_pool *pool = conn->pool;
+	PGTransactionStatusType status;
+	int reusable;
+
+	// The next user must not see the state the last one left the connection in
+	conn->syncs = 0;
+	conn->batch = 0;
+	conn->ready_func = NULL;
+	conn->ready_ctx = NULL;
+
+	// An unfinished connection attempt or unread results make a connection useless for others
+	reusable = (!conn->connecting && !conn->pending_head && PQstatus(conn->conn) == CONNECTION_OK);
+	if(reusable && PQpipelineStatus(conn->conn) != PQ_PIPELINE_OFF)
+		reusable = PQexitPipelineMode(conn->conn);
+
+	if(reusable)
+	{
+		PQsetnonblocking(conn->conn, 0);
+
+		// Never hand out a connection with an open transaction. Rolling it back would
+		// block the caller, usually the main loop, so the connection is closed instead.
+		status = PQtransactionStatus(conn->conn);
+		if(status == PQTRANS_INTRANS || status == PQTRANS_INERROR)
+			log_append(LOG_WARNING, "database connection returned to the pool inside a transaction; closing it");
+
+		reusable = (status == PQTRANS_IDLE);
+	}
+
+	pthread_mutex_lock(&pools_mutex);
+	pool->in_use--;
+	if(!reusable)
+	{
+		pool->open--;
+		pool_conn_close(conn);
+	}
+	else
+	{
+		// Users drop their prepared statements before returning a connection; the next one prepares its own again
+		conn->generation = ++generation;
+		conn->idle_since = time(NULL);
+		ptrlist_add(pool->idle, 0, conn);
+	}
+
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pools_mutex);
+}
+
+// Replaces the broken connection of a checked out connection. A healthy idle
+// connection is taken over if possible; otherwise a new one is started unless we
+// are backing off after failed attempts. It is established like the ones started
+// by pgsql_pool_checkout().
+int pgsql_pool_reconnect(struct pgsql *conn)
+{
+	struct pgsql_pool *pool = conn->pool;
+	struct pgsql *idle;
+	PGconn *pg_conn;
+
+	pthread_mutex_lock(&pools_mutex);
+	if((idle = pool_take_idle(pool)))
+	{
+		pg_conn = conn->conn;
+		conn->conn = idle->conn;
+		conn->generation = ++generation;
+		idle->conn = pg_conn;
+		pool->open--;
+		pool_conn_close(idle);
+		pthread_mutex_unlock(&pools_mutex);
+		return 0;
+	}
+
+	if(time(NULL) < pool->retry_at)
+	{
+		pthread_mutex_unlock(&pools_mutex);
+		log_append(LOG_WARNING, "connection to database failed; retrying in %u seconds", pool->backoff);
+		return -1;
+	}
+	pthread_mutex_unlock(&pools_mutex);
+
+	pg_conn = PQconnectStart(conn->conn_info);
+	if(!pg_conn || PQstatus(pg_conn) == CONNECTION_BAD)
+	{
+		pthread_mutex_lock(&pools_mutex);
+		pool_connect_failed(pool, (pg_conn ? PQerrorMessage(pg_conn) : "out of memory"));
+		pthread_mutex_unlock(&pools_mutex);
+		if(pg_conn)
+			PQfinish(pg_conn);
+		return -1;
+	}
+
+	PQfinish(conn->conn);
+	conn->conn = pg_conn;
+	conn->connecting = 1;
+	conn->resetting = 0;
+	conn->connect_poll = PGRES_POLLING_WRITING;
+	return 0;
+}
+
+// Called when the connection attempt of a checked out connection has finished
+void pgsql_pool_connected(struct pgsql *conn, int ok)
+{
+	pthread_mutex_lock(&pools_mutex);
+	if(ok)
+	{
+		pool_connect_ok(conn->pool);
+		conn->generation = ++generation;
+	}
+	else
+		pool_connect_failed(conn->pool, PQerrorMessage(conn->conn));
+	pthread_mutex_unlock(&pools_mutex);
+}
+
+int pgsql_pool_main_thread()
+{
+	return pthread_equal(pthread_self(), main_thread);
+}
+
+int pgsql_pool_stats(const char *conn_info, struct pgsql_pool_stats *stats)
+{
+	struct pgsql_pool *pool;
+
+	pthread_mutex_lock(&pools_mutex);
+	if(!pools || !(pool = dict_find(pools, conn_info)))
+	{
+		pthread_mutex_unlock(&pools_mutex);
+		return -1;
+	}
+
+	*stats = pool->stats;
+	stats->open = pool->open;
+	stats->idle = pool->idle->count;
+	stats->in_use = pool->in_use;
+	pthread_mutex_unlock(&pools_mutex);
+	return 0;
+}
+
+static struct pgsql_pool *pool_get(const char *conn_info)
+{
+	struct pgsql_pool *pool;
+
+	if((pool = dict_find(pools, conn_info)))
+		return pool;
+
+	pool = malloc(sizeof(struct pgsql_pool));
+	memset(pool, 0, sizeof(struct pgsql_pool));
+	pool->conn_info = strdup(conn_info);
+	pool->idle = ptrlist_create();
+	pool->connect_poll = PGRES_POLLING_WRITING;
+	pthread_cond_init(&pool->cond, NULL);
+	dict_insert(pools, pool->conn_info, pool);
+	return pool;
+}
+
+static void pool_free(struct pgsql_pool *pool)
+{
+	debug("database pool: %lu checkouts, %lu waits (%lu ms total, %lu ms max), %lu timeouts, %lu failed connects, %u connections at peak",
+		pool->stats.checkouts, pool->stats.waits, pool->stats.wait_msec_total, pool->stats.wait_msec_max,
+		pool->stats.timeouts, pool->stats.failures, pool->stats.peak_in_use);
+
+	if(pool->in_use)
+		log_append(LOG_WARNING, "database pool destroyed with %u connections still in use", pool->in_use);
+
+	for(unsigned int i = 0; i < pool->idle->count; i++)
+		pool_conn_close(pool->idle->data[i]->ptr);
+	ptrlist_free(pool->idle);
+
+	if(pool->connecting)
+		PQfinish(pool->connecting);
+
+	pthread_cond_destroy(&pool->cond);
+	free(pool->conn_info);
+	free(pool);
+}
+
+static struct pgsql *pool_conn_create(struct pgsql_pool *pool, PGconn *pg_conn)
+{
+	struct pgsql *conn = malloc(sizeof(struct pgsql));
+	memset(conn, 0, sizeof(struct pgsql));
+	conn->conn = pg_conn;
+	conn->conn_info = strdup(pool->conn_info);
+	conn->pool = pool;
+	conn->generation = ++generation;
+	return conn;
+}
+
+static void pool_conn_close(struct pgsql *conn)
+{
+	PQfinish(conn->conn);
+	free(conn->conn_info);
+	free(conn);
+}
+
+static struct pgsql *pool_take_idle(struct pgsql_pool *pool)
+{
+	while(pool->idle->count)
+	{
+		// Most recently used first; it is least likely to have been dropped by the server
+		struct pgsql *conn = pool->idle->data[pool->idle->count - 1]->ptr;
+		ptrlist_del(pool->idle, pool->idle->count - 1, NULL);
+
+		if(PQstatus(conn->conn) == CONNECTION_OK)
+			return conn;
+
+		pool->open--;
+		pool_conn_close(conn);
+	}
+
+	return NULL;
+}
+
+static void pool_connect_ok(struct pgsql_pool *pool)
+{
+	pool->backoff = 0;
+	pool->retry_at = 0;
+}
+
+static void pool_connect_failed(struct pgsql_pool *pool, const char *error)
+{
+	pool->stats.failures++;
+	pool->backoff = pool->backoff ? pool->backoff * 2 : 1;
+	if(pool->backoff > pool_conf.backoff_max)
+		pool->backoff = pool_conf.backoff_max;
+	pool->retry_at = time(NULL) + pool->backoff;
+
+	log_append(LOG_WARNING, "connection to database failed: %s", error);
+}
+
+// Advances a background connection attempt without blocking
+static void pool_poll_connect(struct pgsql_pool *pool)
+{
+	struct pollfd pfd;
+
+	if(!pool->connecting)
+	{
+		if(pool->open >= pool_conf.min || now < pool->retry_at)
+			return;
+
+		pool->connecting = PQconnectStart(pool->conn_info);
+		if(!pool->connecting || PQstatus(pool->connecting) == CONNECTION_BAD)
+		{
+			pool_connect_failed(pool, (pool->connecting ? PQerrorMessage(pool->connecting) : "out of memory"));
+			if(pool->connecting)
+				PQfinish(pool->connecting);
+			pool->connecting = NULL;
+			return;
+		}
+
+		pool->connect_poll = PGRES_POLLING_WRITING;
+		pool->open++;
+	}
+
+	pfd.fd = PQsocket(pool->connecting);
+	pfd.events = (pool->connect_poll == PGRES_POLLING_READING) ? POLLIN : POLLOUT;
+	pfd.revents = 0;
+	if(poll(&pfd, 1, 0) <= 0)
+		return;
+
+	switch((pool->connect_poll = PQconnectPoll(pool->connecting)))
+	{
+		case PGRES_POLLING_OK: {
+			struct pgsql *conn = pool_conn_create(pool, pool->connecting);
+			pool->connecting = NULL;
+			pool_connect_ok(pool);
+			conn->idle_since = now;
+			ptrlist_add(pool->idle, 0, conn);
+			pthread_cond_signal(&pool->cond);
+			break;
+		}
+
+		case PGRES_POLLING_FAILED:
+			pool->open--;
+			pool_connect_failed(pool, PQerrorMessage(pool->connecting));
+			PQfinish(pool->connecting);
+			pool->connecting = NULL;
+			break;
+
+		default:
+			break;
+	}
+}
+
+// Drops idle connections which were closed by the server or are not needed anymore
+static void pool_check_idle(struct pgsql_pool *pool)
+{
+	for(unsigned int i = 0; i < pool->idle->count; )
+	{
+		struct pgsql *conn = pool->idle->data[i]->ptr;
+
+		// Reading pending input notices a connection closed by the server without a round-trip
+		if(PQconsumeInput(conn->conn) && PQstatus(conn->conn) == CONNECTION_OK &&
+		   (pool->open <= pool_conf.min || now - conn->idle_since < (time_t)pool_conf.idle_timeout))
+		{
+			i++;
+			continue;
+		}
+
+		ptrlist_del(pool->idle, i, NULL);
+		pool->open--;
+		pool_conn_close(conn);
+	}
+}
+
+static void pool_check_tmr(UNUSED_ARG(void *bound), UNUSED_ARG(void *data))
+{
+	unsigned int check_idle = (now - last_check >= (time_t)pool_conf.check_interval);
+
+	if(check_idle)
+		last_check = now;
+
+	pthread_mutex_lock(&pools_mutex);
+	dict_iter(node, pools)
+	{
+		struct pgsql_pool *pool = node->data;
+
+		if(check_idle)
+			pool_check_idle(pool);
+		pool_poll_connect(pool);
+	}
+	pthread_mutex_unlock(&pools_mutex);
+
+	timer_add(this, "pgsql_pool_check", now + 1, pool_check_tmr, NULL, 0, 0);
+}
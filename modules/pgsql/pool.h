@@ -0,0 +1,16 @@
+#ifndef PGSQL_POOL_H
+#define PGSQL_POOL_H
+
+struct pgsql;
+struct module;
+
+void pgsql_pool_init(struct module *self);
+void pgsql_pool_fini();
+
+struct pgsql *pgsql_pool_checkout(const char *conn_info);
+void pgsql_pool_checkin(struct pgsql *conn);
+int pgsql_pool_reconnect(struct pgsql *conn);
+void pgsql_pool_connected(struct pgsql *conn, int ok);
+int pgsql_pool_main_thread();
+
+#endif
@@ -0,0 +1,555 @@
+#include "global.h"
+#include "icyrewrite.h"
+
+#include <linux/ip.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define TITLE_PARAM	"&song="
+#define REQUEST_END	"&url=http%3A%2F%2F HTTP/1.0\r\nUser-Agent: Mozilla/3.0 (compatible)\r\n\r\n"
+
+static size_t urldecode(const unsigned char *src, size_t len, char *dest, size_t size);
+static size_t urlencode_len(const char *str);
+static unsigned char *urlencode(const char *str, unsigned char *dest);
+static uint32_t csum_partial(const unsigned char *buf, size_t len);
+static uint16_t csum_update(uint16_t check, uint32_t old_sum, uint32_t new_sum);
+
+static const char hexchars[] = "0123456789ABCDEF";
+
+
+int icy_rewrite(unsigned char *pkt, size_t len, size_t size, const char *title, char *old_title, size_t old_title_size)
+{
+	struct iphdr *ip = (struct iphdr *)pkt;
+	struct tcphdr *tcp;
+	unsigned char *payload, *title_start, *title_end, *pos;
+	size_t ip_len, offset, new_len, csum_start;
+	uint32_t old_sum, new_sum;
+
+	if(len < sizeof(struct iphdr) || ip->version != 4 || ip->protocol != IPPROTO_TCP)
+		return 0;
+
+	ip_len = ip->ihl << 2;
+	if(ntohs(ip->tot_len) < len)
+		len = ntohs(ip->tot_len);
+	if(ip_len < sizeof(struct iphdr) || len < ip_len + sizeof(struct tcphdr))
+		return 0;
+
+	tcp = (struct tcphdr *)(pkt + ip_len);
+	offset = ip_len + (tcp->doff << 2);
+	if(offset > len)
+		return 0;
+
+	payload = pkt + offset;
+	if(!(title_start = memmem(payload, len - offset, TITLE_PARAM, strlen(TITLE_PARAM))))
+		return 0;
+
+	title_start += strlen(TITLE_PARAM);
+	if(!(title_end = memmem(title_start, pkt + len - title_start, "&url=", 5)) &&
+	   !(title_end = memmem(title_start, pkt + len - title_start, " HTTP/", 6)))
+		return 0;
+
+	new_len = (title_start - pkt) + urlencode_len(title) + strlen(REQUEST_END);
+	if(new_len > size || new_len > 0xffff)
+		return -1;
+
+	urldecode(title_start, title_end - title_start, old_title, old_title_size);
+
+	// Everything after the old title is replaced. Only that part of the segment is summed,
+	// starting at an even offset so the 16 bit words line up with the original checksum.
+	csum_start = ((title_start - pkt - ip_len) & ~1) + ip_len;
+	old_sum = csum_partial(pkt + csum_start, len - csum_start) + (uint16_t)(len - ip_len);
+
+	pos = urlencode(title, title_start);
+	memcpy(pos, REQUEST_END, strlen(REQUEST_END));
+
+	new_sum = csum_partial(pkt + csum_start, new_len - csum_start) + (uint16_t)(new_len - ip_len);
+
+	// RFC 1624: the tcp length is part of the pseudo header, the ip header only changes in tot_len
+	tcp->check = htons(csum_update(ntohs(tcp->check), old_sum, new_sum));
+	ip->check = htons(csum_update(ntohs(ip->check), ntohs(ip->tot_len), new_len));
+	ip->tot_len = htons(new_len);
+
+	return new_len;
+}
+
+static size_t urldecode(const unsigned char *src, size_t len, char *dest, size_t size)
+{
+	size_t i, j;
+
+	for(i = 0, j = 0; i < len && j + 1 < size; i++, j++)
+	{
+		if(src[i] == '+')
+			dest[j] = ' ';
+		else if(src[i] == '%' && i + 2 < len && isxdigit(src[i + 1]) && isxdigit(src[i + 2]))
+		{
+			dest[j] = ((isdigit(src[i + 1]) ? src[i + 1] - '0' : (tolower(src[i + 1]) - 'a' + 10)) << 4) |
+				   (isdigit(src[i + 2]) ? src[i + 2] - '0' : (tolower(src[i + 2]) - 'a' + 10));
+			i += 2;
+		}
+		else
+			dest[j] = src[i];
+	}
+
+	if(size)
+		dest[j] = '\0';
+	return j;
+}
+
+static inline int urlencode_keep(unsigned char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '-' || c == '.' || c == '_';
+}
+
+static size_t urlencode_len(const char *str)
+{
+	size_t len = 0;
+
+	for(; *str; str++)
+		len += urlencode_keep(*str) ? 1 : 3;
+
+	return len;
+}
+
+// Returns a pointer to the end of the encoded string; no terminating null byte is written
+static unsigned char *urlencode(const char *str, unsigned char *dest)
+{
+	for(; *str; str++)
+	{
+		unsigned char c = *str;
+
+		if(urlencode_keep(c))
+			*dest++ = c;
+		else
+		{
+			*dest++ = '%';
+			*dest++ = hexchars[c >> 4];
+			*dest++ = hexchars[c & 15];
+		}
+	}
+
+	return dest;
+}
+
+// Unfolded one's complement sum of buf as big endian 16 bit words
+static uint32_t csum_partial(const unsigned char *buf, size_t len)
+{
+	uint32_t sum = 0;
+
+	for(; len > 1; buf += 2, len -= 2)
+		sum += (buf[0] << 8) | buf[1];
+	if(len)
+		sum += buf[0] << 8;
+
+	return sum;
+}
+
+static inline uint16_t csum_fold(uint32_t sum)
+{
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+// HC' = ~(~HC + ~m + m')
+static uint16_t csum_update(uint16_t check, uint32_t old_sum, uint32_t new_sum)
+{
+	uint32_t sum = (uint16_t)~check;
+
+	sum += (uint16_t)~csum_fold(old_sum);
+	sum += csum_fold(new_sum);
+	return ~csum_fold(sum);
+}
+
+
+/* testing */
+#ifdef ICY_TEST
+#include <byteswap.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define TEST_PCAP		"icy_test.pcap"	// replayed instead of a generated capture if it exists, e.g. from tcpdump -w
+#define TEST_TITLE		"Artist - Title (Live) & more: 100% \xc3\xa4"
+#define TEST_PACKETS		1000		// generated packets; one in ten updates the title
+#define TEST_ROUNDS		1000
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		101
+#define LINKTYPE_LINUX_SLL	113
+
+struct pcap_header
+{
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record
+{
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct test_packet
+{
+	unsigned char *data;
+	size_t len;
+	uint8_t title;		// icy_rewrite() rewrote it
+	uint8_t checksums;	// the captured checksums are valid; they are not with checksum offloading
+};
+
+// Title updates as sent by the radio server; the title starts at odd and even offsets
+static const char *test_requests[] = {
+	"GET /admin.cgi?pass=secret&mode=updinfo&song=Foo+Bar%20%C3%A4&url=http%3A%2F%2F HTTP/1.0\r\nUser-Agent: Mozilla/3.0 (compatible)\r\n\r\n",
+	"GET /admin.cgi?pass=secrets&mode=updinfo&song=A HTTP/1.0\r\n\r\n",
+	"GET /admin.cgi?pass=secret&mode=updinfo&song=&url= HTTP/1.0\r\n\r\n",
+	"GET /admin.cgi?pass=secrets&mode=updinfo&song=Some+Very+Long+Artist+Name+feat.+Another+Artist+-+An+Even+Longer+Song+Title"
+		"+%28Extended+Club+Mix+2026+Remaster%29&url=http%3A%2F%2F HTTP/1.0\r\nUser-Agent: Mozilla/3.0 (compatible)\r\n\r\n",
+	"GET /index.html HTTP/1.0\r\n\r\n"
+};
+
+static struct test_packet *test_packets;
+static unsigned int test_packet_count, test_failures;
+
+// Folded sum of a TCP segment and its pseudo header; 0xffff if the checksum is valid
+static uint16_t test_tcp_sum(const unsigned char *pkt)
+{
+	const struct iphdr *ip = (const struct iphdr *)pkt;
+	size_t ip_len = ip->ihl << 2, tcp_len = ntohs(ip->tot_len) - ip_len;
+
+	return csum_fold(csum_partial(pkt + 12, 8) + IPPROTO_TCP + tcp_len + csum_partial(pkt + ip_len, tcp_len));
+}
+
+static int test_checksums_valid(const unsigned char *pkt)
+{
+	return csum_fold(csum_partial(pkt, ((const struct iphdr *)pkt)->ihl << 2)) == 0xffff && test_tcp_sum(pkt) == 0xffff;
+}
+
+// Builds an ethernet frame; options & 1 adds IP options, options & 2 TCP timestamps
+static size_t test_build_frame(unsigned char *frame, const void *payload, size_t payload_len, uint8_t protocol, uint8_t options, uint32_t seq)
+{
+	static uint32_t buf[0xffff / 4 + 1]; // the headers are aligned here, unlike behind the ethernet header
+	unsigned char *pkt = (unsigned char *)buf;
+	struct iphdr *ip = (struct iphdr *)pkt;
+	struct tcphdr *tcp;
+	size_t ip_len = (options & 1) ? 24 : 20, tcp_len = (options & 2) ? 32 : 20;
+
+	memset(pkt, 0, ip_len + tcp_len);
+	ip->version = 4;
+	ip->ihl = ip_len >> 2;
+	ip->tot_len = htons(ip_len + tcp_len + payload_len);
+	ip->id = htons(seq);
+	ip->ttl = 64;
+	ip->protocol = protocol;
+	ip->saddr = htonl(0xc0a80002);
+	ip->daddr = htonl(0xc0a80001);
+	if(options & 1)
+		memcpy(pkt + 20, "\x01\x01\x01\x00", 4);
+
+	tcp = (struct tcphdr *)(pkt + ip_len);
+	tcp->source = htons(40000 + (seq & 0xff));
+	tcp->dest = htons(8000);
+	tcp->seq = htonl(seq * 1448);
+	tcp->ack_seq = htonl(1);
+	tcp->doff = tcp_len >> 2;
+	tcp->psh = 1;
+	tcp->ack = 1;
+	tcp->window = htons(65535);
+	if(options & 2)
+		memcpy(pkt + ip_len + 20, "\x01\x01\x08\x0a\x00\x00\x00\x01\x00\x00\x00\x02", 12);
+
+	memcpy(pkt + ip_len + tcp_len, payload, payload_len);
+	ip->check = htons(~csum_fold(csum_partial(pkt, ip_len)));
+	if(protocol == IPPROTO_TCP)
+		tcp->check = htons(~test_tcp_sum(pkt));
+
+	memcpy(frame, "\x00\x16\x3e\x00\x00\x01\x00\x16\x3e\x00\x00\x02\x08\x00", 14);
+	memcpy(frame + 14, pkt, ip_len + tcp_len + payload_len);
+	return 14 + ip_len + tcp_len + payload_len;
+}
+
+// Mostly stream data with a title update every ten packets and a few UDP packets in between
+static int test_write_capture()
+{
+	struct pcap_header header = { PCAP_MAGIC, 2, 4, 0, 0, 65535, LINKTYPE_ETHERNET };
+	unsigned char *data, payload[1448];
+	size_t len, size;
+	int fd, ret = 0;
+
+	size = sizeof(header) + TEST_PACKETS * (sizeof(struct pcap_record) + 14 + 24 + 32 + sizeof(payload));
+	data = malloc(size);
+	memcpy(data, &header, sizeof(header));
+	len = sizeof(header);
+
+	for(unsigned int i = 0; i < TEST_PACKETS; i++)
+	{
+		struct pcap_record record = { now, i, 0, 0 };
+		unsigned char *frame = data + len + sizeof(record);
+
+		if(i % 10 == 0)
+		{
+			const char *request = test_requests[(i / 10) % ArraySize(test_requests)];
+			record.incl_len = test_build_frame(frame, request, strlen(request), IPPROTO_TCP, (i / 50) % 4, i);
+		}
+		else
+		{
+			for(unsigned int j = 0; j < sizeof(payload); j++)
+				payload[j] = (i * 131 + j * 7) & 0xff;
+			record.incl_len = test_build_frame(frame, payload, sizeof(payload), (i % 100 == 55 ? IPPROTO_UDP : IPPROTO_TCP), i % 4, i);
+		}
+
+		record.orig_len = record.incl_len;
+		memcpy(data + len, &record, sizeof(record));
+		len += sizeof(record) + record.incl_len;
+	}
+
+	if((fd = open(TEST_PCAP, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || write(fd, data, len) != (ssize_t)len)
+	{
+		log_append(LOG_ERROR, "icy test: could not write " TEST_PCAP ": %s", strerror(errno));
+		ret = -1;
+	}
+	if(fd != -1)
+		close(fd);
+	free(data);
+	return ret;
+}
+
+// Reads the IPv4 packets of a capture; truncated packets cannot be rewritten and are skipped
+static int test_read_capture(unsigned int *skipped)
+{
+	struct pcap_header header;
+	struct stat sb;
+	unsigned char *capture = NULL;
+	size_t pos, link_len;
+	uint32_t linktype;
+	uint8_t swapped;
+	int fd, ret = -1;
+
+	if((fd = open(TEST_PCAP, O_RDONLY)) == -1 || fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(header) ||
+	   !(capture = malloc(sb.st_size)) || read(fd, capture, sb.st_size) != sb.st_size)
+	{
+		log_append(LOG_ERROR, "icy test: could not read " TEST_PCAP);
+		goto out;
+	}
+
+	memcpy(&header, capture, sizeof(header));
+	swapped = (header.magic == bswap_32(PCAP_MAGIC) || header.magic == bswap_32(PCAP_MAGIC_NSEC));
+	linktype = swapped ? bswap_32(header.linktype) : header.linktype;
+	if(!swapped && header.magic != PCAP_MAGIC && header.magic != PCAP_MAGIC_NSEC)
+	{
+		log_append(LOG_ERROR, "icy test: " TEST_PCAP " is not a pcap file");
+		goto out;
+	}
+
+	if(linktype == LINKTYPE_ETHERNET)
+		link_len = 14;
+	else if(linktype == LINKTYPE_LINUX_SLL)
+		link_len = 16;
+	else if(linktype == LINKTYPE_RAW)
+		link_len = 0;
+	else
+	{
+		log_append(LOG_ERROR, "icy test: unsupported link type %"PRIu32" in " TEST_PCAP, linktype);
+		goto out;
+	}
+
+	test_packets = malloc((sb.st_size / (sizeof(struct pcap_record) + link_len + 20) + 1) * sizeof(struct test_packet));
+	for(pos = sizeof(header); pos + sizeof(struct pcap_record) <= (size_t)sb.st_size; )
+	{
+		struct pcap_record record;
+		const unsigned char *frame = capture + pos + sizeof(record);
+		struct test_packet *packet;
+
+		memcpy(&record, capture + pos, sizeof(record));
+		if(swapped)
+		{
+			record.incl_len = bswap_32(record.incl_len);
+			record.orig_len = bswap_32(record.orig_len);
+		}
+		if(pos + sizeof(record) + record.incl_len > (size_t)sb.st_size)
+			break;
+		pos += sizeof(record) + record.incl_len;
+
+		// The ethertype ends the ethernet and the cooked header
+		if(record.incl_len < record.orig_len || record.incl_len < link_len + sizeof(struct iphdr) ||
+		   (link_len && (frame[link_len - 2] != 0x08 || frame[link_len - 1] != 0x00)))
+		{
+			(*skipped)++;
+			continue;
+		}
+
+		// Copied so the headers are aligned as they are in a netlink message
+		packet = &test_packets[test_packet_count++];
+		memset(packet, 0, sizeof(struct test_packet));
+		packet->len = record.incl_len - link_len;
+		packet->data = malloc(packet->len);
+		memcpy(packet->data, frame + link_len, packet->len);
+	}
+	ret = 0;
+
+out:
+	if(fd != -1)
+		close(fd);
+	MyFree(capture);
+	return ret;
+}
+
+static void test_check_packet(struct test_packet *packet)
+{
+	static unsigned char buf[0xffff], again[0xffff];
+	char old_title[256], title[256];
+	int len;
+
+	memcpy(buf, packet->data, packet->len);
+	if((len = icy_rewrite(buf, packet->len, sizeof(buf), TEST_TITLE, old_title, sizeof(old_title))) <= 0)
+	{
+		if(len < 0 || memcmp(buf, packet->data, packet->len))
+		{
+			log_append(LOG_ERROR, "icy test: packet without a title was modified");
+			test_failures++;
+		}
+		return;
+	}
+
+	packet->title = 1;
+	packet->checksums = test_checksums_valid(packet->data);
+	if(packet->checksums && !test_checksums_valid(buf))
+	{
+		log_append(LOG_ERROR, "icy test: incrementally updated checksums differ from a full recompute (old title '%s')", old_title);
+		test_failures++;
+	}
+
+	// Rewriting the result again changes nothing and decodes to the new title
+	memcpy(again, buf, len);
+	if(icy_rewrite(again, len, sizeof(again), TEST_TITLE, title, sizeof(title)) != len || memcmp(again, buf, len) || strcmp(title, TEST_TITLE))
+	{
+		log_append(LOG_ERROR, "icy test: rewritten packet decodes to '%s'", title);
+		test_failures++;
+	}
+
+	// In place, without room to grow, the packet is left alone
+	if((size_t)len > packet->len)
+	{
+		memcpy(again, packet->data, packet->len);
+		if(icy_rewrite(again, packet->len, packet->len, TEST_TITLE, title, sizeof(title)) != -1 || memcmp(again, packet->data, packet->len))
+		{
+			log_append(LOG_ERROR, "icy test: packet was rewritten beyond its buffer");
+			test_failures++;
+		}
+	}
+}
+
+// Microseconds per packet with (title = 1) or without a title, including copying the packet
+static double test_time(uint8_t title)
+{
+	static unsigned char buf[0xffff];
+	struct timeval start, end;
+	char old_title[256];
+	unsigned int count = 0, rewritten = 0;
+
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < TEST_ROUNDS; i++)
+	{
+		for(unsigned int j = 0; j < test_packet_count; j++)
+		{
+			if(test_packets[j].title != title)
+				continue;
+			memcpy(buf, test_packets[j].data, test_packets[j].len);
+			rewritten += icy_rewrite(buf, test_packets[j].len, sizeof(buf), TEST_TITLE, old_title, sizeof(old_title)) > 0;
+			count++;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	if(rewritten != (title ? count : 0))
+		test_failures++;
+	return count ? ((end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec)) / count : 0;
+}
+
+// What checksumming a title update in full costs, as the packet was handled before
+static double test_time_full_checksum()
+{
+	struct timeval start, end;
+	unsigned int count = 0, valid = 0;
+
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < TEST_ROUNDS; i++)
+	{
+		for(unsigned int j = 0; j < test_packet_count; j++)
+		{
+			if(!test_packets[j].title)
+				continue;
+			valid += test_checksums_valid(test_packets[j].data);
+			count++;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	if(valid > count)
+		test_failures++;
+	return count ? ((end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec)) / count : 0;
+}
+
+// Replays a capture through icy_rewrite(), comparing the updated checksums with a full recompute
+void icy_run_test()
+{
+	unsigned int skipped = 0, titles = 0, offloaded = 0;
+	uint8_t generated = 0;
+	struct stat sb;
+	double rewrite_us, pass_us, full_us;
+
+	debug("ICY TEST");
+	if(stat(TEST_PCAP, &sb) == -1)
+	{
+		if(test_write_capture())
+		{
+			test_failures++;
+			goto out;
+		}
+		generated = 1;
+	}
+
+	if(test_read_capture(&skipped))
+	{
+		test_failures++;
+		goto out;
+	}
+
+	for(unsigned int i = 0; i < test_packet_count; i++)
+	{
+		test_check_packet(&test_packets[i]);
+		titles += test_packets[i].title;
+		offloaded += test_packets[i].title && !test_packets[i].checksums;
+	}
+	debug("icy test: %u packets from %s " TEST_PCAP ", %u with a title (%u with offloaded checksums), %u skipped",
+	      test_packet_count, (generated ? "generated" : "captured"), titles, offloaded, skipped);
+	if(generated && titles != TEST_PACKETS / 10 * (ArraySize(test_requests) - 1) / ArraySize(test_requests))
+	{
+		log_append(LOG_ERROR, "icy test: %u of the generated title updates were found", titles);
+		test_failures++;
+	}
+
+	rewrite_us = test_time(1);
+	pass_us = test_time(0);
+	full_us = test_time_full_checksum();
+	debug("benchmark: %.3f us per title update, %.3f us per other packet; checksumming a title update in full takes %.3f us",
+	      rewrite_us, pass_us, full_us);
+
+out:
+	if(generated)
+		unlink(TEST_PCAP);
+	for(unsigned int i = 0; i < test_packet_count; i++)
+		free(test_packets[i].data);
+	MyFree(test_packets);
+	test_packet_count = 0;
+	debug("ICY TEST END: %u failures", test_failures);
+}
+#endif
@@ -0,0 +1,15 @@
+#ifndef ICYREWRITE_H
+#define ICYREWRITE_H
+
+// Replaces the song title of a shoutcast metadata update request ("...&song=<title>&url=...")
+// in an IPv4/TCP packet. The packet is rewritten in place and its checksums are updated
+// incrementally; size is the capacity of the pkt buffer. The old title is decoded into old_title.
+// Returns the new packet length, 0 if the packet contains no title and -1 if the rewritten
+// packet would not fit into size bytes. The packet is not modified unless a length > 0 is returned.
+int icy_rewrite(unsigned char *pkt, size_t len, size_t size, const char *title, char *old_title, size_t old_title_size);
+
+#ifdef ICY_TEST
+void icy_run_test();
+#endif
+
+#endif
@@ -0,0 +1,614 @@
+#include "global.h"
+#include "module.h"
+#include "sock.h"
+#include "timer.h"
+#include "dict.h"
+#include "ptrlist.h"
+#include "stringbuffer.h"
+#include "memcache.h"
+
+#define MEMCACHE_DEFAULT_PORT	11211
+#define MEMCACHE_TIMEOUT	5
+#define MEMCACHE_MAX_BACKOFF	60
+#define MEMCACHE_MAX_PENDING	128
+#define MEMCACHE_MAX_VALUE	1024
+
+struct mc_update
+{
+	char *key;
+	char *value; // NULL to delete the key
+	time_t ttl;
+};
+
+static struct mc_update *mc_update_create(const char *key, const char *value, time_t ttl);
+static void mc_update_free(struct mc_update *update);
+static void mc_queue(struct mc_update *update);
+static void mc_schedule_flush();
+static void mc_flush_tmr(void *bound, void *data);
+static void mc_flush();
+static void mc_connect();
+static void mc_disconnect();
+static void mc_batch_done();
+static void mc_fail(const char *error);
+static void mc_reconnect_tmr(void *bound, void *data);
+static void mc_timeout_tmr(void *bound, void *data);
+static void mc_sock_event(struct sock *sock, enum sock_event event, int err);
+static void mc_sock_read(struct sock *sock, char *buf, size_t len);
+#ifdef MEMCACHE_TEST
+static void test_fini();
+#endif
+
+static struct
+{
+	struct module *module;
+	char *host;
+	unsigned int port;
+
+	struct sock *sock;
+	unsigned int connected : 1;
+	unsigned int flush_scheduled : 1;
+	unsigned int backoff;
+
+	struct dict *pending; // key -> struct mc_update, not sent yet
+	struct ptrlist *sent; // updates of the current batch, in the order they were sent
+	unsigned int replies; // number of replies received for the current batch
+	unsigned long dropped;
+} mc;
+
+
+void memcache_init(struct module *module)
+{
+	memset(&mc, 0, sizeof(mc));
+	mc.module = module;
+	mc.pending = dict_create();
+	dict_set_free_funcs(mc.pending, NULL, (dict_free_f *)mc_update_free);
+	mc.sent = ptrlist_create();
+}
+
+void memcache_fini()
+{
+#ifdef MEMCACHE_TEST
+	test_fini();
+#endif
+	mc_disconnect();
+	if(dict_size(mc.pending))
+		log_append(LOG_INFO, "Dropping %u unpublished memcached updates", dict_size(mc.pending));
+
+	timer_del_boundname(mc.module, "memcache_flush");
+	timer_del_boundname(mc.module, "memcache_reconnect");
+	dict_free(mc.pending);
+	ptrlist_free(mc.sent);
+	MyFree(mc.host);
+}
+
+void memcache_configure(const char *server)
+{
+	const char *str;
+	char *host;
+	unsigned int port = MEMCACHE_DEFAULT_PORT;
+
+	if(server && (str = strstr(server, "--SERVER=")))
+		server = str + 9;
+
+	host = server ? strndup(server, strcspn(server, " ")) : NULL;
+	if(host && (str = strrchr(host, ':')))
+	{
+		port = atoi(str + 1);
+		host[str - host] = '\0';
+	}
+
+	if(host && !*host)
+		MyFree(host);
+
+	if(host && mc.host && !strcmp(host, mc.host) && port == mc.port)
+	{
+		free(host);
+		return;
+	}
+
+	mc_disconnect();
+	timer_del_boundname(mc.module, "memcache_reconnect");
+	MyFree(mc.host);
+	mc.host = host;
+	mc.port = port;
+	mc.backoff = 0;
+
+	if(!mc.host)
+	{
+		dict_clear(mc.pending);
+		return;
+	}
+
+	mc_connect();
+}
+
+void memcache_set(const char *key, time_t ttl, const char *format, ...)
+{
+	va_list args;
+	char buf[MEMCACHE_MAX_VALUE];
+
+	if(!mc.host)
+		return;
+
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	mc_queue(mc_update_create(key, buf, ttl));
+}
+
+void memcache_delete(const char *key)
+{
+	if(!mc.host)
+		return;
+
+	mc_queue(mc_update_create(key, NULL, 0));
+}
+
+unsigned long memcache_dropped()
+{
+	return mc.dropped;
+}
+
+static struct mc_update *mc_update_create(const char *key, const char *value, time_t ttl)
+{
+	struct mc_update *update = malloc(sizeof(struct mc_update));
+	update->key = strdup(key);
+	update->value = value ? strdup(value) : NULL;
+	update->ttl = ttl;
+	return update;
+}
+
+static void mc_update_free(struct mc_update *update)
+{
+	free(update->key);
+	MyFree(update->value);
+	free(update);
+}
+
+// Takes ownership of update; a pending update for the same key is replaced
+static void mc_queue(struct mc_update *update)
+{
+	struct dict_node *node;
+
+	if((node = dict_find_node(mc.pending, update->key)))
+	{
+		mc_update_free(node->data);
+		node->data = update;
+		node->key = update->key;
+	}
+	else if(dict_size(mc.pending) >= MEMCACHE_MAX_PENDING)
+	{
+		mc.dropped++;
+		mc_update_free(update);
+		return;
+	}
+	else
+		dict_insert(mc.pending, update->key, update);
+
+	mc_schedule_flush();
+}
+
+// Updates queued while handling the same event are sent together
+static void mc_schedule_flush()
+{
+	if(mc.flush_scheduled || !mc.connected || mc.sent->count)
+		return;
+
+	mc.flush_scheduled = 1;
+	timer_add(mc.module, "memcache_flush", now, mc_flush_tmr, NULL, 0, 0);
+}
+
+static void mc_flush_tmr(void *bound, void *data)
+{
+	mc.flush_scheduled = 0;
+	mc_flush();
+}
+
+// Pipelines all pending updates; the next batch is sent when every reply arrived
+static void mc_flush()
+{
+	if(!mc.connected || mc.sent->count || !dict_size(mc.pending))
+		return;
+
+	dict_iter_rev(node, mc.pending)
+	{
+		struct mc_update *update = node->data;
+
+		if(update->value)
+		{
+			sock_write_fmt(mc.sock, "set %s 0 %lu %lu\r\n", update->key, (unsigned long)update->ttl, (unsigned long)strlen(update->value));
+			sock_write(mc.sock, update->value, strlen(update->value));
+			sock_write(mc.sock, "\r\n", 2);
+		}
+		else
+			sock_write_fmt(mc.sock, "delete %s\r\n", update->key);
+
+		ptrlist_add(mc.sent, 0, update);
+	}
+
+	// the updates are owned by mc.sent now
+	dict_set_free_funcs(mc.pending, NULL, NULL);
+	dict_clear(mc.pending);
+	dict_set_free_funcs(mc.pending, NULL, (dict_free_f *)mc_update_free);
+
+	timer_add(mc.module, "memcache_timeout", now + MEMCACHE_TIMEOUT, mc_timeout_tmr, NULL, 0, 0);
+}
+
+static void mc_connect()
+{
+	mc.sock = sock_create(SOCK_IPV4 | SOCK_QUIET, mc_sock_event, mc_sock_read);
+	assert(mc.sock);
+
+	if(sock_connect(mc.sock, mc.host, mc.port) != 0)
+	{
+		mc.sock = NULL;
+		mc_fail("connect() failed");
+		return;
+	}
+
+	sock_set_readbuf(mc.sock, 512, "\r\n");
+	timer_add(mc.module, "memcache_timeout", now + MEMCACHE_TIMEOUT, mc_timeout_tmr, NULL, 0, 0);
+}
+
+static void mc_disconnect()
+{
+	timer_del_boundname(mc.module, "memcache_timeout");
+
+	if(mc.sock)
+		sock_close(mc.sock);
+	mc.sock = NULL;
+	mc.connected = 0;
+
+	// Unanswered updates are sent again unless there is a newer value
+	for(unsigned int i = mc.replies; i < mc.sent->count; i++)
+	{
+		struct mc_update *update = mc.sent->data[i]->ptr;
+
+		if(dict_find(mc.pending, update->key))
+			continue;
+		if(dict_size(mc.pending) >= MEMCACHE_MAX_PENDING)
+		{
+			mc.dropped++;
+			continue;
+		}
+
+		dict_insert(mc.pending, update->key, update);
+		mc.sent->data[i]->ptr = NULL;
+	}
+
+	mc_batch_done();
+}
+
+static void mc_batch_done()
+{
+	for(unsigned int i = 0; i < mc.sent->count; i++)
+	{
+		if(mc.sent->data[i]->ptr)
+			mc_update_free(mc.sent->data[i]->ptr);
+	}
+
+	ptrlist_clear(mc.sent);
+	mc.replies = 0;
+}
+
+static void mc_fail(const char *error)
+{
+	mc_disconnect();
+
+	mc.backoff = mc.backoff ? min(mc.backoff * 2, MEMCACHE_MAX_BACKOFF) : 1;
+	log_append(LOG_WARNING, "memcached server %s:%u: %s; reconnecting in %us (%lu updates dropped so far)", mc.host, mc.port, error, mc.backoff, mc.dropped);
+	timer_add(mc.module, "memcache_reconnect", now + mc.backoff, mc_reconnect_tmr, NULL, 0, 0);
+}
+
+static void mc_reconnect_tmr(void *bound, void *data)
+{
+	mc_connect();
+}
+
+static void mc_timeout_tmr(void *bound, void *data)
+{
+	mc_fail("timeout");
+}
+
+static void mc_sock_event(struct sock *sock, enum sock_event event, int err)
+{
+	if(sock != mc.sock)
+		return;
+
+	if(event == EV_CONNECT)
+	{
+		timer_del_boundname(mc.module, "memcache_timeout");
+		if(mc.backoff)
+			log_append(LOG_INFO, "Reconnected to memcached server %s:%u", mc.host, mc.port);
+		mc.connected = 1;
+		mc_flush();
+	}
+	else if(event == EV_ERROR)
+	{
+		mc.sock = NULL;
+		mc_fail(strerror(err));
+	}
+	else if(event == EV_HANGUP)
+	{
+		mc.sock = NULL;
+		mc_fail("connection closed");
+	}
+}
+
+static void mc_sock_read(struct sock *sock, char *buf, size_t len)
+{
+	struct mc_update *update;
+
+	if(sock != mc.sock)
+		return;
+
+	if(mc.replies == mc.sent->count)
+	{
+		mc_fail("unexpected reply");
+		return;
+	}
+
+	update = mc.sent->data[mc.replies++]->ptr;
+	if(strcmp(buf, "STORED") && strcmp(buf, "DELETED") && strcmp(buf, "NOT_FOUND"))
+	{
+		// The server rejected the request; sending it again would not help
+		log_append(LOG_WARNING, "memcached %s %s failed: %s", (update->value ? "set" : "delete"), update->key, buf);
+		mc.dropped++;
+	}
+
+	if(mc.replies < mc.sent->count)
+		return;
+
+	timer_del_boundname(mc.module, "memcache_timeout");
+	mc.backoff = 0;
+	mc_batch_done();
+	mc_flush();
+}
+
+
+/* testing */
+#ifdef MEMCACHE_TEST
+#include <sys/time.h>
+
+#define TEST_KEYS	10
+#define TEST_UPDATES	1000
+#define TEST_FLOOD	200	// distinct keys queued while the server does not answer
+
+static struct sock *test_listener, *test_client;
+static struct dict *test_values; // what the stub server has stored
+static char *test_saved_server;
+static unsigned int test_commands, test_mute, test_failures;
+static unsigned long test_calls, test_dropped;
+static double test_call_usecs, test_call_max;
+
+// Stub server: stores sets, answers in order and stays silent while muted
+static void test_client_read(struct sock *sock, char *buf, size_t len)
+{
+	struct stringbuffer *rbuf = sock->ctx;
+	char key[251], *end;
+	unsigned long ttl, bytes;
+	unsigned int flags;
+
+	stringbuffer_append_string_n(rbuf, buf, len);
+	while(!test_mute && (end = strstr(rbuf->string, "\r\n")))
+	{
+		size_t header = end + 2 - rbuf->string;
+
+		if(sscanf(rbuf->string, "set %250s %u %lu %lu", key, &flags, &ttl, &bytes) == 4)
+		{
+			if(rbuf->len < header + bytes + 2)
+				break;
+			dict_delete(test_values, key);
+			dict_insert(test_values, strdup(key), strndup(rbuf->string + header, bytes));
+			stringbuffer_erase(rbuf, 0, header + bytes + 2);
+			sock_write(sock, "STORED\r\n", 8);
+		}
+		else if(sscanf(rbuf->string, "delete %250s", key) == 1)
+		{
+			sock_write_fmt(sock, "%s\r\n", (dict_delete(test_values, key) ? "DELETED" : "NOT_FOUND"));
+			stringbuffer_erase(rbuf, 0, header);
+		}
+		else
+		{
+			sock_write(sock, "ERROR\r\n", 7);
+			stringbuffer_erase(rbuf, 0, header);
+		}
+		test_commands++;
+	}
+}
+
+static void test_client_event(struct sock *sock, enum sock_event event, int err)
+{
+	if(event == EV_HANGUP || event == EV_ERROR)
+	{
+		stringbuffer_free(sock->ctx);
+		if(sock == test_client)
+			test_client = NULL;
+	}
+}
+
+static void test_listener_event(struct sock *sock, enum sock_event event, int err)
+{
+	struct sock *client;
+
+	if(event != EV_ACCEPT || !(client = sock_accept(sock, test_client_event, test_client_read)))
+		return;
+	client->flags |= SOCK_QUIET;
+	client->ctx = stringbuffer_create();
+	if(test_client)
+	{
+		stringbuffer_free(test_client->ctx);
+		sock_close(test_client);
+	}
+	test_client = client;
+}
+
+// Publishing must never wait for the server; remembers how long each call took
+static void test_set(const char *key, const char *value)
+{
+	struct timeval start, end;
+	double usecs;
+
+	gettimeofday(&start, NULL);
+	if(value)
+		memcache_set(key, 0, "%s", value);
+	else
+		memcache_delete(key);
+	gettimeofday(&end, NULL);
+
+	usecs = (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec);
+	test_call_usecs += usecs;
+	test_call_max = max(test_call_max, usecs);
+	test_calls++;
+}
+
+static void test_check(int ok, const char *what)
+{
+	if(ok)
+		return;
+	log_append(LOG_ERROR, "memcache test: %s", what);
+	test_failures++;
+}
+
+static void test_phase(void *bound, void *data)
+{
+	unsigned long phase = (unsigned long)data, stored = 0;
+	char key[32], value[32];
+
+	switch(phase)
+	{
+		case 0:
+			// Only the last value of each key is sent, all of them in one pipelined batch
+			test_set("test.deleted", "x");
+			for(unsigned int i = 0; i < TEST_UPDATES; i++)
+			{
+				snprintf(key, sizeof(key), "test.key%u", i % TEST_KEYS);
+				snprintf(value, sizeof(value), "%u", i);
+				test_set(key, value);
+			}
+			test_set("test.deleted", NULL);
+			break;
+
+		case 1:
+			for(unsigned int i = 0; i < TEST_KEYS; i++)
+			{
+				const char *str;
+				snprintf(key, sizeof(key), "test.key%u", i);
+				snprintf(value, sizeof(value), "%u", TEST_UPDATES - TEST_KEYS + i);
+				stored += ((str = dict_find(test_values, key)) && !strcmp(str, value));
+			}
+			debug("memcache test: %u updates of %u keys became %u commands", TEST_UPDATES + 2, TEST_KEYS + 1, test_commands);
+			test_check(stored == TEST_KEYS && !dict_find(test_values, "test.deleted") && test_commands == TEST_KEYS + 1, "coalesced updates were not stored");
+
+			// A server which does not answer: the first batch stays unanswered, the rest queues up until the map is full
+			test_mute = 1;
+			test_set("test.first", "1");
+			break;
+
+		case 2:
+			test_dropped = memcache_dropped();
+			for(unsigned int i = 0; i < TEST_FLOOD; i++)
+			{
+				snprintf(key, sizeof(key), "test.flood%u", i);
+				test_set(key, "1");
+			}
+			debug("memcache test: %lu updates dropped while the server did not answer", memcache_dropped() - test_dropped);
+			test_check(memcache_dropped() - test_dropped == TEST_FLOOD - MEMCACHE_MAX_PENDING, "updates beyond the pending limit were not dropped");
+
+			// The batch times out; the reconnect after the backoff must deliver the queued updates
+			test_mute = 0;
+			timer_add(mc.module, "memcache_test", now + MEMCACHE_TIMEOUT + 3, test_phase, (void *)3, 0, 0);
+			return;
+
+		case 3:
+			for(unsigned int i = 0; i < TEST_FLOOD; i++)
+			{
+				snprintf(key, sizeof(key), "test.flood%u", i);
+				stored += !!dict_find(test_values, key);
+			}
+			// The unanswered update found the map full
+			debug("memcache test: %lu flood updates stored after the timeout, %lu dropped in total", stored, memcache_dropped() - test_dropped);
+			test_check(stored == MEMCACHE_MAX_PENDING && !dict_find(test_values, "test.first") && memcache_dropped() - test_dropped == TEST_FLOOD - MEMCACHE_MAX_PENDING + 1,
+				   "queued updates were not delivered after reconnecting");
+
+			// The server goes away; updates keep queueing while the reconnects back off
+			sock_close(test_listener);
+			test_listener = NULL;
+			if(test_client)
+			{
+				stringbuffer_free(test_client->ctx);
+				sock_close(test_client);
+				test_client = NULL;
+			}
+			for(unsigned int i = 0; i < TEST_UPDATES; i++)
+			{
+				snprintf(value, sizeof(value), "%u", i);
+				test_set("test.down", value);
+			}
+			timer_add(mc.module, "memcache_test", now + 8, test_phase, (void *)4, 0, 0);
+			return;
+
+		case 4:
+			debug("memcache test: backoff is %us after the server went down", mc.backoff);
+			test_check(mc.backoff >= 4 && dict_find(mc.pending, "test.down"), "reconnects did not back off");
+
+			debug("MEMCACHE TEST END: %u failures; %lu calls took %.1f us on average and %.0f us at most",
+			      test_failures, test_calls, test_call_usecs / test_calls, test_call_max);
+			memcache_configure(test_saved_server);
+			MyFree(test_saved_server);
+			dict_free(test_values);
+			test_values = NULL;
+			return;
+	}
+
+	// Timers only have a resolution of one second; two make sure the server has answered
+	timer_add(mc.module, "memcache_test", now + 2, test_phase, (void *)(phase + 1), 0, 0);
+}
+
+// Runs against a stub server in the event loop and restores the configured server afterwards
+void memcache_run_test()
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	char server[32];
+
+	debug("MEMCACHE TEST");
+	test_listener = sock_create(SOCK_IPV4 | SOCK_QUIET, test_listener_event, NULL);
+	if(sock_bind(test_listener, "127.0.0.1", 0) || sock_listen(test_listener, NULL) ||
+	   getsockname(test_listener->fd, (struct sockaddr *)&sin, &len))
+	{
+		log_append(LOG_ERROR, "memcache test: could not create the stub server");
+		sock_close(test_listener);
+		test_listener = NULL;
+		return;
+	}
+
+	if(mc.host)
+	{
+		snprintf(server, sizeof(server), "%s:%u", mc.host, mc.port);
+		test_saved_server = strdup(server);
+	}
+
+	test_values = dict_create();
+	dict_set_free_funcs(test_values, free, free);
+	snprintf(server, sizeof(server), "127.0.0.1:%u", ntohs(sin.sin_port));
+	memcache_configure(server);
+	timer_add(mc.module, "memcache_test", now + 2, test_phase, (void *)0, 0, 0);
+}
+
+static void test_fini()
+{
+	timer_del_boundname(mc.module, "memcache_test");
+	if(test_client)
+	{
+		stringbuffer_free(test_client->ctx);
+		sock_close(test_client);
+	}
+	if(test_listener)
+		sock_close(test_listener);
+	if(test_values)
+		dict_free(test_values);
+	MyFree(test_saved_server);
+}
+#endif
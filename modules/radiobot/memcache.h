@@ -0,0 +1,19 @@
+#ifndef RADIOBOT_MEMCACHE_H
+#define RADIOBOT_MEMCACHE_H
+
+struct module;
+
+void memcache_init(struct module *module);
+void memcache_fini();
+// server is "host[:port]"; the libmemcached style "--SERVER=host:port" is accepted, too.
+// NULL disables publishing.
+void memcache_configure(const char *server);
+// Updates are queued and sent in batches; only the last value of a key is sent
+void memcache_set(const char *key, time_t ttl, const char *format, ...) PRINTF_LIKE(3, 4);
+void memcache_delete(const char *key);
+unsigned long memcache_dropped();
+#ifdef MEMCACHE_TEST
+void memcache_run_test();
+#endif
+
+#endif
@@ -1,14 +1,18 @@
 #include "global.h"
 #include "module.h"
 #include "radiobot.h"
+#include "memcache.h"
+#include "icyrewrite.h"
 #include "modules/commands/commands.h"
 #include "modules/commands/command_rule.h"
 #include "modules/help/help.h"
 #include "modules/httpd/http.h"
 #include "modules/http/http.h"
 #include "modules/sharedmem/sharedmem.h"
+#include "modules/streamstats/streamstats.h"
 #include "modules/tools/tools.h"
 #include "modules/radioapi/radioapi.h"
+#include "modules/rrd/rrd.h"
 #include "chanuser.h"
 #include "irc.h"
 #include "irc_handler.h"
@@ -23,12 +27,8 @@
 #include "versioning.h"
 
 #include <libxml/parser.h>
-#include <libxml/tree.h>
 #include <json/json.h>
 #include <sys/capability.h>
-#include <libmemcached/memcached.h>
-
-#define RRD_DEFAULT_COLORS "-c BACK#FFFFFF -c CANVAS#F3F3F3 -c SHADEA#C8C8C8 -c SHADEB#969696 -c GRID#8C8C8C -c MGRID#821E1E -c FONT#000000 -c FRAME#000000 -c ARROW#FF0000"
 
 // %s: DJ
 // %s: Show title
@@ -41,7 +41,7 @@
 // duration after which a polling ajax request is finished
 #define HTTP_POLL_DURATION 1800
 
-MODULE_DEPENDS("commands", "help", "http", "httpd", "sharedmem", "tools", "radioapi", NULL);
+MODULE_DEPENDS("commands", "help", "http", "httpd", "sharedmem", "tools", "radioapi", "rrd", "streamstats", NULL);
 
 static struct
 {
@@ -74,12 +74,30 @@ struct rb_http_client
 		char *version;
 		char *url;
 	} update;
+	time_t timeout;
+
+	struct rb_http_client *prev;
+	struct rb_http_client *next;
+};
+
+// A rendered /stream-status response body; it is copied into the write buffer of every client receiving the same variant
+struct status_payload
+{
+	size_t len;
+	char data[];
+};
+
+enum status_update_variant
+{
+	STATUS_UPDATE_NONE, // client does not support updates
+	STATUS_UPDATE_NULL, // client is up to date
+	STATUS_UPDATE_GLOBAL, // client should update to the configured gadget version
+	STATUS_UPDATE_CLIENT, // client got a custom update via send_update; never cached
+	STATUS_UPDATE_COUNT = STATUS_UPDATE_CLIENT
 };
 
 DECLARE_LIST(cmd_client_list, struct cmd_client *)
 IMPLEMENT_LIST(cmd_client_list, struct cmd_client *)
-DECLARE_LIST(rb_http_client_list, struct rb_http_client *)
-IMPLEMENT_LIST(rb_http_client_list, struct rb_http_client *)
 
 HTTP_HANDLER(http_root);
 HTTP_HANDLER(http_stream_info);
@@ -120,50 +138,67 @@ static void kicksrc_sock_connect();
 static void kicksrc_sock_event(struct sock *sock, enum sock_event event, int err);
 static void kicksrc_sock_read(struct sock *sock, char *buf, size_t len);
 static void kicksrc_sock_timeout(void *bound, void *data);
-static void stats_sock_connect();
-static void stats_sock_event(struct sock *sock, enum sock_event event, int err);
-static void stats_sock_read(struct sock *sock, char *buf, size_t len);
-static void stats_sock_timeout(void *bound, void *data);
+static void stats_request();
 static void stats_update_tmr(void *bound, void *data);
+static void stats_value(enum streamstats_key key, const char *value);
+static void stats_done(const char *error);
 static void stats_received();
-static void iterate_stats_elements(xmlNode *a_node);
-static void stats_parse_row(const char *key, const char *value);
 static void send_status(const char *nick);
 static void send_showinfo(struct cmd_client *client);
 static void show_updated();
 static void show_updated_readonly();
 static void rb_http_client_free(struct rb_http_client *client);
-static void rb_http_client_list_del_client(struct rb_http_client_list *list, struct http_client *client);
+static void rb_http_client_link(struct rb_http_client *rb_client);
+static void rb_http_client_unlink(struct rb_http_client *rb_client);
 static struct rb_http_client *rb_http_client_by_uuid(const char *uuid);
-static struct rb_http_client *rb_http_client_by_httpclient(struct http_client *client);
 static int rb_http_client_outdated(struct rb_http_client *rb_client);
-static void http_stream_status_send(struct http_client *client, int timeout);
+static void rb_http_client_notify(struct rb_http_client *rb_client, int timeout);
+static void http_poll_timer_schedule();
+static void http_status_refresh();
+static void http_status_cache_clear();
+static struct status_payload *http_status_render(int timeout, enum status_update_variant variant, struct rb_http_client *rb_client);
+static void http_stream_status_send(struct http_client *client, struct rb_http_client *rb_client, int timeout);
+static void http_stream_status_broadcast();
 void set_current_title(const char *title);
 const char *get_streamtitle();
 static void shared_memory_changed(struct module *module, const char *key, void *old, void *new);
-static void memcache_set(const char *key, time_t ttl, const char *format, ...);
-static void memcache_delete(const char *key);
 static time_t check_queue_full();
 static time_t check_wishgreet_blocked();
 static int in_wish_greet_channel(struct irc_user *user);
 static const char *sanitize_nick(const char *raw_nick);
 static void radiobot_radioapi_cb(const char *api, json_object *payload);
-static unsigned int rrd_exists(const char *name);
-static void rrd_update();
-static void rrd_graph();
+static void listeners_rrd_update();
 
 extern void nfqueue_init();
 extern void nfqueue_fini();
 
 static struct module *this;
+static struct streamstats *streamstats;
 static struct radiobot_conf radiobot_conf;
 static struct database *radiobot_db = NULL;
 static struct sock *kicksrc_sock = NULL;
-static struct sock *stats_sock = NULL;
 static struct sock *cmd_sock = NULL;
 static struct cmd_client_list *cmd_clients;
-static struct rb_http_client_list *http_clients;
-static struct stringbuffer *stats_data;
+// long-polling /stream-status clients, ordered by timeout
+static struct
+{
+	struct rb_http_client *head;
+	struct rb_http_client *tail;
+	unsigned int count;
+} http_clients;
+// snapshot of the data the cached /stream-status payloads were rendered from
+static struct
+{
+	char *mod;
+	char *mod2;
+	char *show;
+	char *song;
+	unsigned int listeners;
+	unsigned int bitrate;
+	struct status_payload *cache[2][STATUS_UPDATE_COUNT];
+} http_status;
+static unsigned int http_poll_timer_active = 0;
+static unsigned int stats_listeners_changed = 0;
 static char *current_mod = NULL;
 static char *current_mod_2 = NULL;
 static char *current_playlist = NULL;
@@ -183,7 +218,54 @@ static time_t wishgreet_blocked_until = 0;
 static char *wishgreet_blocked_reason = NULL;
 static radiobot_notify_func *notify_func = NULL;
 static int nfqueue_available = 0;
-static memcached_st *mc = NULL;
+static struct rrd *listeners_rrd = NULL;
+
+static const struct rrd_ds_def listeners_rrd_ds[] = {
+	{ "listeners", 600 },
+	{ "unique_listeners", 600 }
+};
+
+static const struct rrd_rra_def listeners_rrd_rra[] = {
+	{ RRD_AVERAGE, 1, 7200 },
+	{ RRD_AVERAGE, 5, 4800 },
+	{ RRD_AVERAGE, 10, 7200 },
+	{ RRD_AVERAGE, 60, 6000 },
+	{ RRD_AVERAGE, 180, 48000 },
+	{ RRD_MAX, 1, 7200 },
+	{ RRD_MAX, 5, 4800 },
+	{ RRD_MAX, 10, 7200 },
+	{ RRD_MAX, 60, 6000 },
+	{ RRD_MAX, 180, 48000 }
+};
+
+static const struct rrd_def listeners_rrd_def = {
+	15, listeners_rrd_ds, ArraySize(listeners_rrd_ds), listeners_rrd_rra, ArraySize(listeners_rrd_rra)
+};
+
+static const struct rrd_graph_series listeners_graph_series[] = {
+	{ "listeners", RRD_GRAPH_AREA, 0xFF0000, "Listeners" },
+	{ "unique_listeners", RRD_GRAPH_LINE, 0x0000FF, "Unique Listeners" }
+};
+
+// Served by the rrd module as /graphs/listeners-<name>.png
+static const struct
+{
+	const char *name;
+	const char *title;
+	time_t span;
+} listeners_graphs[] = {
+	{ "hour", "Listeners (1 hour)", 3600 },
+	{ "3hour", "Listeners (3 hours)", 3 * 3600 },
+	{ "day", "Listeners (1 day)", 86400 },
+	{ "week", "Listeners (1 week)", 7 * 86400 },
+	{ "month", "Listeners (1 month)", 31 * 86400 },
+	{ "year", "Listeners (1 year)", 365 * 86400 }
+};
+
+static const struct streamstats_handler stats_handler = {
+	stats_value,
+	stats_done
+};
 
 static struct http_handler handlers[] = {
 	{ "/", http_root },
@@ -203,13 +285,21 @@ MODULE_INIT
 
 	LIBXML_TEST_VERSION
 
-	stats_data = stringbuffer_create();
 	cmd_clients = cmd_client_list_create();
-	http_clients = rb_http_client_list_create();
+	memset(&http_clients, 0, sizeof(http_clients));
+	memset(&http_status, 0, sizeof(http_status));
 
+	memcache_init(this);
 	reg_conf_reload_func(radiobot_conf_reload);
 	radiobot_conf_reload();
-	stats_sock_connect();
+#ifdef MEMCACHE_TEST
+	memcache_run_test();
+#endif
+#ifdef ICY_TEST
+	icy_run_test();
+#endif
+	streamstats = streamstats_create(this, &stats_handler);
+	stats_request();
 
 	radiobot_db = database_create("radiobot", radiobot_db_read, radiobot_db_write);
 	database_read(radiobot_db, 1);
@@ -287,18 +377,17 @@ MODULE_FINI
 		nfqueue_fini();
 
 	unreg_conf_reload_func(radiobot_conf_reload);
-	if(mc)
-		memcached_free(mc);
+	memcache_fini();
+	if(listeners_rrd)
+		rrd_close(listeners_rrd);
 
 	timer_del_boundname(this, "kicksrc_timeout");
-	timer_del_boundname(this, "stats_timeout");
 	timer_del_boundname(this, "update_stats");
 	timer_del_boundname(this, "http_poll_timeout");
 
 	if(kicksrc_sock)
 		sock_close(kicksrc_sock);
-	if(stats_sock)
-		sock_close(stats_sock);
+	streamstats_free(streamstats);
 	if(cmd_sock)
 		sock_close(cmd_sock);
 
@@ -309,15 +398,15 @@ MODULE_FINI
 		free(client);
 	}
 
-	while(http_clients->count)
-	{
-		struct rb_http_client *client = http_clients->data[http_clients->count - 1];
-		http_stream_status_send(client->client, 0);
-	}
+	while(http_clients.head)
+		rb_http_client_notify(http_clients.head, 0);
+	http_status_cache_clear();
+	MyFree(http_status.mod);
+	MyFree(http_status.mod2);
+	MyFree(http_status.show);
+	MyFree(http_status.song);
 
 	cmd_client_list_free(cmd_clients);
-	rb_http_client_list_free(http_clients);
-	stringbuffer_free(stats_data);
 
 	MyFree(current_mod);
 	MyFree(current_mod_2);
@@ -409,25 +498,21 @@ static void radiobot_conf_reload()
 		radiobot_conf.cmd_sock_read_pass = NULL;
 
 
-	// rrdtool options
+	// listener statistics
 	str = conf_get("radiobot/rrd_enabled", DB_STRING);
 	radiobot_conf.rrd_enabled = str ? true_string(str) : 0;
 
-	str = conf_get("radiobot/rrdtool_path", DB_STRING);
-	radiobot_conf.rrdtool_path = str ? str : "/usr/bin/rrdtool";
-
 	str = conf_get("radiobot/rrd_dir", DB_STRING);
 	radiobot_conf.rrd_dir = str ? str : ".";
 
-	str = conf_get("radiobot/graph_dir", DB_STRING);
-	radiobot_conf.graph_dir = str ? str : ".";
-
 	// sidebar update
 	str = conf_get("radiobot/gadget_update_url", DB_STRING);
 	radiobot_conf.gadget_update_url = (str && *str) ? str : NULL;
 
 	str = conf_get("radiobot/gadget_current_version", DB_STRING);
 	radiobot_conf.gadget_current_version = (str && *str) ? str : NULL;
+	// cached /stream-status payloads may contain the old update info
+	http_status_cache_clear();
 
 	// memcached
 	str = conf_get("radiobot/memcached_config", DB_STRING);
@@ -463,14 +548,7 @@ static void radiobot_conf_reload()
 		}
 	}
 
-	if(mc)
-	{
-		memcached_free(mc);
-		mc = NULL;
-	}
-
-	if(radiobot_conf.memcached_config)
-		mc = memcached(radiobot_conf.memcached_config, strlen(radiobot_conf.memcached_config));
+	memcache_configure(radiobot_conf.memcached_config);
 }
 
 static void radiobot_db_read(struct database *db)
@@ -575,40 +653,6 @@ static void shared_memory_changed(struct module *module, const char *key, void *
 	show_updated();
 }
 
-static void memcache_set(const char *key, time_t ttl, const char *format, ...)
-{
-	va_list args;
-	char buf[1024];
-	memcached_return_t rc;
-
-	if(!mc)
-		return;
-
-	va_start(args, format);
-	vsnprintf(buf, sizeof(buf), format, args);
-	va_end(args);
-
-	rc = memcached_set(mc, key, strlen(key), buf, strlen(buf), ttl, 0);
-	if(rc != MEMCACHED_SUCCESS)
-		rc = memcached_set(mc, key, strlen(key), buf, strlen(buf), ttl, 0); // retry
-	if(rc != MEMCACHED_SUCCESS)
-		log_append(LOG_WARNING, "memcached_set() failed: %s", memcached_strerror(mc, rc));
-}
-
-static void memcache_delete(const char *key)
-{
-	memcached_return_t rc;
-
-	if(!mc)
-		return;
-
-	rc = memcached_delete(mc, key, strlen(key), 0);
-	if(rc != MEMCACHED_SUCCESS)
-		rc = memcached_delete(mc, key, strlen(key), 0); // retry
-	if(rc != MEMCACHED_SUCCESS)
-		log_append(LOG_WARNING, "memcached_delete() failed: %s", memcached_strerror(mc, rc));
-}
-
 static time_t check_queue_full()
 {
 	if(now > queue_full)
@@ -708,18 +752,35 @@ static void rb_http_client_free(struct rb_http_client *client)
 	free(client);
 }
 
-static void rb_http_client_list_del_client(struct rb_http_client_list *list, struct http_client *client)
+static void rb_http_client_link(struct rb_http_client *rb_client)
 {
-	for(unsigned int i = 0; i < list->count; i++)
-	{
-		struct rb_http_client *rb_client = list->data[i];
-		if(rb_client->client == client)
-		{
-			rb_http_client_list_del(list, rb_client);
-			rb_http_client_free(rb_client);
-			break;
-		}
-	}
+	rb_client->timeout = now + HTTP_POLL_DURATION;
+	rb_client->prev = http_clients.tail;
+	rb_client->next = NULL;
+	if(http_clients.tail)
+		http_clients.tail->next = rb_client;
+	else
+		http_clients.head = rb_client;
+	http_clients.tail = rb_client;
+	http_clients.count++;
+	rb_client->client->custom = rb_client;
+	http_poll_timer_schedule();
+}
+
+static void rb_http_client_unlink(struct rb_http_client *rb_client)
+{
+	if(rb_client->prev)
+		rb_client->prev->next = rb_client->next;
+	else
+		http_clients.head = rb_client->next;
+	if(rb_client->next)
+		rb_client->next->prev = rb_client->prev;
+	else
+		http_clients.tail = rb_client->prev;
+	rb_client->prev = rb_client->next = NULL;
+	http_clients.count--;
+	rb_client->client->custom = NULL;
+	rb_client->client->dead_callback = NULL;
 }
 
 static struct rb_http_client *rb_http_client_by_uuid(const char *uuid)
@@ -727,9 +788,8 @@ static struct rb_http_client *rb_http_client_by_uuid(const char *uuid)
 	if(!uuid || !*uuid)
 		return NULL;
 
-	for(unsigned int i = 0; i < http_clients->count; i++)
+	for(struct rb_http_client *rb_client = http_clients.head; rb_client; rb_client = rb_client->next)
 	{
-		struct rb_http_client *rb_client = http_clients->data[i];
 		if(!strcmp(rb_client->uuid, uuid))
 			return rb_client;
 	}
@@ -737,35 +797,83 @@ static struct rb_http_client *rb_http_client_by_uuid(const char *uuid)
 	return NULL;
 }
 
-static struct rb_http_client *rb_http_client_by_httpclient(struct http_client *client)
+static int rb_http_client_outdated(struct rb_http_client *rb_client)
 {
-	if(!client)
-		return NULL;
+	if(!radiobot_conf.gadget_current_version && !rb_client->update.version)
+		return 0;
+	return version_compare(rb_client->clientver, rb_client->update.version ? rb_client->update.version : radiobot_conf.gadget_current_version) == -1;
+}
 
-	for(unsigned int i = 0; i < http_clients->count; i++)
-	{
-		struct rb_http_client *rb_client = http_clients->data[i];
-		if(rb_client->client == client)
-			return rb_client;
-	}
+static void rb_http_client_notify(struct rb_http_client *rb_client, int timeout)
+{
+	rb_http_client_unlink(rb_client);
+	http_stream_status_send(rb_client->client, rb_client, timeout);
+	rb_http_client_free(rb_client);
+}
 
-	return NULL;
+static void http_poll_timeout_tmr(void *bound, void *data)
+{
+	struct rb_http_client *rb_client;
+
+	http_poll_timer_active = 0;
+	while((rb_client = http_clients.head) && rb_client->timeout <= now)
+		rb_http_client_notify(rb_client, 1);
+	http_poll_timer_schedule();
 }
 
-static int rb_http_client_outdated(struct rb_http_client *rb_client)
+static void http_poll_timer_schedule()
 {
-	if(!radiobot_conf.gadget_current_version && !rb_client->update.version)
-		return 0;
-	return version_compare(rb_client->clientver, rb_client->update.version ? rb_client->update.version : radiobot_conf.gadget_current_version) == -1;
+	// Clients are appended with a fixed timeout so the list head always
+	// expires first; a single timer covers all of them.
+	if(http_poll_timer_active || !http_clients.head)
+		return;
+
+	timer_add(this, "http_poll_timeout", http_clients.head->timeout, http_poll_timeout_tmr, NULL, 0, 0);
+	http_poll_timer_active = 1;
+}
+
+static int strcmp_null(const char *a, const char *b)
+{
+	if(!a || !b)
+		return a != b;
+	return strcmp(a, b);
 }
 
-static void http_stream_status_send(struct http_client *client, int timeout)
+static void http_status_refresh()
 {
-	struct rb_http_client *rb_client = rb_http_client_by_httpclient(client);
-	client->dead_callback = NULL;
-	if(rb_client)
-		rb_http_client_list_del(http_clients, rb_client);
-	timer_del(this, "http_poll_timeout", 0, NULL, client, TIMER_IGNORE_TIME | TIMER_IGNORE_FUNC);
+	if(!strcmp_null(http_status.mod, current_mod) &&
+	   !strcmp_null(http_status.mod2, current_mod_2) &&
+	   !strcmp_null(http_status.show, current_show) &&
+	   !strcmp_null(http_status.song, current_title) &&
+	   http_status.listeners == stream_stats.listeners_current &&
+	   http_status.bitrate == stream_stats.bitrate)
+		return;
+
+	http_status_cache_clear();
+	MyFree(http_status.mod);
+	MyFree(http_status.mod2);
+	MyFree(http_status.show);
+	MyFree(http_status.song);
+	http_status.mod = current_mod ? strdup(current_mod) : NULL;
+	http_status.mod2 = current_mod_2 ? strdup(current_mod_2) : NULL;
+	http_status.show = current_show ? strdup(current_show) : NULL;
+	http_status.song = current_title ? strdup(current_title) : NULL;
+	http_status.listeners = stream_stats.listeners_current;
+	http_status.bitrate = stream_stats.bitrate;
+}
+
+static void http_status_cache_clear()
+{
+	for(unsigned int i = 0; i < 2; i++)
+		for(unsigned int j = 0; j < STATUS_UPDATE_COUNT; j++)
+			MyFree(http_status.cache[i][j]);
+}
+
+static struct status_payload *http_status_render(int timeout, enum status_update_variant variant, struct rb_http_client *rb_client)
+{
+	struct status_payload *payload;
+	const char *json;
+	size_t len;
 
 	struct json_object *response = json_object_new_object();
 	json_object_object_add(response, "timeout_seconds", json_object_new_int(HTTP_POLL_DURATION));
@@ -776,25 +884,56 @@ static void http_stream_status_send(struct http_client *client, int timeout)
 	json_object_object_add(response, "song", current_title ? json_object_new_string(to_utf8(current_title)) : NULL);
 	json_object_object_add(response, "listeners", json_object_new_int(stream_stats.listeners_current));
 	json_object_object_add(response, "bitrate", json_object_new_int(stream_stats.bitrate));
-	if(rb_client && rb_client->clientname && !strcmp(rb_client->clientname, "windows-sidebar") && rb_client->clientver)
+	if(variant == STATUS_UPDATE_NULL)
+		json_object_object_add(response, "update", NULL);
+	else if(variant == STATUS_UPDATE_GLOBAL || variant == STATUS_UPDATE_CLIENT)
 	{
-		if(!rb_http_client_outdated(rb_client))
-			json_object_object_add(response, "update", NULL);
+		struct json_object *update = json_object_new_object();
+		if(variant == STATUS_UPDATE_CLIENT)
+		{
+			json_object_object_add(update, "version", json_object_new_string(rb_client->update.version));
+			json_object_object_add(update, "url", json_object_new_string(rb_client->update.url));
+		}
 		else
 		{
-			struct json_object *update = json_object_new_object();
-			if(rb_client->update.version && rb_client->update.url)
-			{
-				json_object_object_add(update, "version", json_object_new_string(rb_client->update.version));
-				json_object_object_add(update, "url", json_object_new_string(rb_client->update.url));
-			}
-			else
-			{
-				json_object_object_add(update, "version", json_object_new_string(radiobot_conf.gadget_current_version));
-				json_object_object_add(update, "url", json_object_new_string(radiobot_conf.gadget_update_url));
-			}
-			json_object_object_add(response, "update", update);
+			json_object_object_add(update, "version", json_object_new_string(radiobot_conf.gadget_current_version));
+			json_object_object_add(update, "url", json_object_new_string(radiobot_conf.gadget_update_url));
 		}
+		json_object_object_add(response, "update", update);
+	}
+
+	json = json_object_to_json_string(response);
+	len = strlen(json);
+	payload = malloc(sizeof(struct status_payload) + len + 1);
+	payload->len = len;
+	memcpy(payload->data, json, len + 1);
+	json_object_put(response);
+	return payload;
+}
+
+static void http_stream_status_send(struct http_client *client, struct rb_http_client *rb_client, int timeout)
+{
+	enum status_update_variant variant = STATUS_UPDATE_NONE;
+	struct status_payload *payload;
+
+	if(rb_client && rb_client->clientname && !strcmp(rb_client->clientname, "windows-sidebar") && rb_client->clientver)
+	{
+		if(!rb_http_client_outdated(rb_client))
+			variant = STATUS_UPDATE_NULL;
+		else if(rb_client->update.version && rb_client->update.url)
+			variant = STATUS_UPDATE_CLIENT;
+		else
+			variant = STATUS_UPDATE_GLOBAL;
+	}
+
+	if(variant == STATUS_UPDATE_CLIENT)
+		payload = http_status_render(timeout, variant, rb_client);
+	else
+	{
+		http_status_refresh();
+		if(!http_status.cache[timeout][variant])
+			http_status.cache[timeout][variant] = http_status_render(timeout, variant, NULL);
+		payload = http_status.cache[timeout][variant];
 	}
 
 	http_reply_header("Content-Type", "application/json; charset=utf-8");
@@ -802,23 +941,35 @@ static void http_stream_status_send(struct http_client *client, int timeout)
         http_reply_header("Cache-Control", "must-revalidate");
         http_reply_header("Pragma", "no-cache");
 	http_reply_header("Access-Control-Allow-Origin", "*");
-	http_reply("%s", json_object_to_json_string(response));
-	json_object_put(response);
+	stringbuffer_append_string_n(client->wbuf, payload->data, payload->len);
+	if(variant == STATUS_UPDATE_CLIENT)
+		free(payload);
 	if(client->delay)
 		http_request_finalize(client);
-	if(rb_client)
-		rb_http_client_free(rb_client);
 }
 
-static void http_stream_status_timeout(void *bound, struct http_client *client)
+static void http_stream_status_broadcast()
 {
-	http_stream_status_send(client, 1);
+	struct rb_http_client *rb_client, *next;
+
+	// Everything linked right now is answered; clients reconnecting while
+	// we are iterating are appended and must not be notified again.
+	struct rb_http_client *last = http_clients.tail;
+	for(rb_client = http_clients.head; rb_client; rb_client = next)
+	{
+		next = (rb_client == last) ? NULL : rb_client->next;
+		rb_http_client_notify(rb_client, 0);
+	}
 }
 
 static void http_stream_status_dead(struct http_client *client)
 {
-	rb_http_client_list_del_client(http_clients, client);
-	timer_del(this, "http_poll_timeout", 0, NULL, client, TIMER_IGNORE_TIME | TIMER_IGNORE_FUNC);
+	struct rb_http_client *rb_client = client->custom;
+	if(!rb_client)
+		return;
+
+	rb_http_client_unlink(rb_client);
+	rb_http_client_free(rb_client);
 }
 
 HTTP_HANDLER(http_stream_status)
@@ -829,14 +980,13 @@ HTTP_HANDLER(http_stream_status)
 	int wait = true_string(dict_find(get_vars, "wait"));
 	if(!wait)
 	{
-		http_stream_status_send(client, 0);
+		http_stream_status_send(client, NULL, 0);
 		dict_free(get_vars);
 		return;
 	}
 
 	http_request_detach(client, NULL);
 	client->dead_callback = http_stream_status_dead;
-	timer_add(this, "http_poll_timeout", now + HTTP_POLL_DURATION, (timer_f *)http_stream_status_timeout, client, 0, 0);
 
 	rb_client = malloc(sizeof(struct rb_http_client));
 	memset(rb_client, 0, sizeof(struct rb_http_client));
@@ -852,7 +1002,7 @@ HTTP_HANDLER(http_stream_status)
 	if((str = dict_find(get_vars, "uuid")) && !strpbrk(str, "\r\n"))
 		strlcpy(rb_client->uuid, str, sizeof(rb_client->uuid));
 	//debug("Client connected: %p %s %s", rb_client, rb_client->uuid, rb_client->nick);
-	rb_http_client_list_add(http_clients, rb_client);
+	rb_http_client_link(rb_client);
 	dict_free(get_vars);
 }
 
@@ -960,20 +1110,20 @@ COMMAND(stats_clients)
 {
 	struct table *table;
 
-	if(!http_clients->count)
+	if(!http_clients.count)
 	{
 		reply("Derzeit sind keine HTTP-Clients verbunden.");
 		return 1;
 	}
 
-	table = table_create(7, http_clients->count);
+	table = table_create(7, http_clients.count);
 	table_set_header(table, "IP", "UUID", "Nick", "Volume", "Playing", "Client", "Version");
 	table->col_flags[3] |= TABLE_CELL_FREE | TABLE_CELL_ALIGN_RIGHT;
 	table->col_flags[4] |= TABLE_CELL_FREE;
 
-	for(unsigned int i = 0; i < http_clients->count; i++)
+	unsigned int i = 0;
+	for(struct rb_http_client *client = http_clients.head; client; client = client->next, i++)
 	{
-		struct rb_http_client *client = http_clients->data[i];
 		uint8_t playing = ((client->playerState >> 0) & 0x1);
 		uint8_t muted = ((client->playerState >> 1) & 0x1);
 		uint8_t volume = (client->playerState >> 2) & 0xff;
@@ -1014,17 +1164,16 @@ COMMAND(notify)
 	else if(match("????????""-????""-????""-????""-????????????", argv[1]) == 0) // UUID
 	{
 		int found = 0;
-		for(unsigned int i = 0; i < http_clients->count; i++)
+		struct rb_http_client *rb_client, *next;
+		for(rb_client = http_clients.head; rb_client; rb_client = next)
 		{
-			struct rb_http_client *rb_client = http_clients->data[i];
-
+			next = rb_client->next;
 			if(strcmp(rb_client->uuid, argv[1]))
 				continue;
 
 			reply("Notifying client %s %s %s", rb_client->uuid, rb_client->nick, rb_client->client->ip);
 			debug("Notifying client %p %s %s", rb_client, rb_client->uuid, rb_client->nick);
-			http_stream_status_send(rb_client->client, 0);
-			i--;
+			rb_http_client_notify(rb_client, 0);
 			found++;
 		}
 
@@ -1042,10 +1191,10 @@ COMMAND(send_update)
 	if(match("????????""-????""-????""-????""-????????????", argv[1]) == 0) // UUID
 	{
 		int found = 0;
-		for(unsigned int i = 0; i < http_clients->count; i++)
+		struct rb_http_client *rb_client, *next;
+		for(rb_client = http_clients.head; rb_client; rb_client = next)
 		{
-			struct rb_http_client *rb_client = http_clients->data[i];
-
+			next = rb_client->next;
 			if(strcmp(rb_client->uuid, argv[1]))
 				continue;
 
@@ -1055,8 +1204,7 @@ COMMAND(send_update)
 			rb_client->update.url = strdup(argv[3]);
 			reply("Offering update for client %s %s %s", rb_client->uuid, rb_client->nick, rb_client->client->ip);
 			debug("Offering update for client %p %s %s", rb_client, rb_client->uuid, rb_client->nick);
-			http_stream_status_send(rb_client->client, 0);
-			i--;
+			rb_http_client_notify(rb_client, 0);
 			found++;
 		}
 
@@ -1444,7 +1592,7 @@ COMMAND(status)
 	{
 		MyFree(status_nick);
 		status_nick = strdup(src->nick);
-		stats_sock_connect();
+		stats_request();
 		reply("Updating status...");
 		return 1;
 	}
@@ -1459,7 +1607,7 @@ COMMAND(listener)
 	{
 		MyFree(listener_nick);
 		listener_nick = strdup(src->nick);
-		stats_sock_connect();
+		stats_request();
 		reply("Updating status...");
 		return 1;
 	}
@@ -1478,7 +1626,7 @@ COMMAND(status)
 
 	MyFree(status_nick);
 	status_nick = strdup(src->nick);
-	stats_sock_connect();
+	stats_request();
 	return 1;
 }
 
@@ -1492,7 +1640,7 @@ COMMAND(listener)
 
 	MyFree(listener_nick);
 	listener_nick = strdup(src->nick);
-	stats_sock_connect();
+	stats_request();
 	return 1;
 }
 #endif
@@ -1875,21 +2023,15 @@ static void show_updated_readonly()
 		send_showinfo(client);
 	}
 
-	for(unsigned int i = 0; i < http_clients->count; i++)
-	{
-		struct rb_http_client *client = http_clients->data[i];
-		//debug("Notifying client %p %s %s", client, client->uuid, client->nick);
-		http_stream_status_send(client->client, 0);
-		i--;
-	}
+	http_stream_status_broadcast();
 
 	memcache_set("radiobot.mod", 0, "%s", (current_mod ? sanitize_nick(current_mod) : ""));
 	memcache_set("radiobot.mod2", 0, "%s", (current_mod_2 ? sanitize_nick(current_mod_2) : ""));
 	memcache_set("radiobot.show", 0, "%s", (current_show ? to_utf8(current_show) : "Playlist"));
 	memcache_set("radiobot.song", 0, "%s", (current_title ? to_utf8(current_title) : ""));
 	memcache_set("radiobot.listeners", 0, "%u", stream_stats.listeners_current);
-	memcache_set("radiobot.playlist.user", 0, current_playlist_user ? to_utf8(current_playlist_user) : "");
-	memcache_set("radiobot.playlist.name", 0, current_playlist_name ? to_utf8(current_playlist_name) : "");
+	memcache_set("radiobot.playlist.user", 0, "%s", current_playlist_user ? to_utf8(current_playlist_user) : "");
+	memcache_set("radiobot.playlist.name", 0, "%s", current_playlist_name ? to_utf8(current_playlist_name) : "");
 }
 
 static void cmdsock_drop_client_tmr(void *bound, struct sock *sock)
@@ -1969,133 +2111,46 @@ static void kicksrc_sock_timeout(void *bound, void *data)
 }
 
 // stats stuff
-static void stats_sock_connect()
+static void stats_request()
 {
-	if(stats_sock)
-	{
-		sock_close(stats_sock);
-		timer_del_boundname(this, "stats_timeout");
-		timer_del_boundname(this, "update_stats");
-	}
-
-	stats_sock = sock_create(SOCK_IPV4 | SOCK_QUIET, stats_sock_event, stats_sock_read);
-	assert(stats_sock);
-
-	stringbuffer_flush(stats_data);
-	if(sock_connect(stats_sock, radiobot_conf.stream_ip_stats, radiobot_conf.stream_port_stats) != 0)
-	{
-		log_append(LOG_WARNING, "connect() to stream server (%s:%d) failed.", radiobot_conf.stream_ip_stats, radiobot_conf.stream_port_stats);
-		stats_sock = NULL;
-		timer_add(this, "stats_timeout", now + 60, stats_sock_timeout, NULL, 0, 0);
-		return;
-	}
-
-	timer_add(this, "stats_timeout", now + 15, stats_sock_timeout, NULL, 0, 0);
+	timer_del_boundname(this, "update_stats");
+	streamstats_request(streamstats, radiobot_conf.stream_ip_stats, radiobot_conf.stream_port_stats, radiobot_conf.stream_pass_stats);
 }
 
-static void stats_sock_event(struct sock *sock, enum sock_event event, int err)
+static void stats_update_tmr(void *bound, void *data)
 {
-	if(event == EV_ERROR)
-	{
-		log_append(LOG_WARNING, "Socket error on stats socket: %s (%d)", strerror(err), err);
-		timer_del_boundname(this, "stats_timeout");
-		stats_sock = NULL;
-		timer_add(this, "update_stats", now + 60, stats_update_tmr, NULL, 0, 0);
-
-		if(status_nick)
-		{
-			irc_send_msg(status_nick, "NOTICE", "Fehler beim Statusabruf: %s", strerror(err));
-			MyFree(status_nick);
-		}
+	stats_request();
+}
 
-		if(listener_nick)
-		{
-			irc_send_msg(listener_nick, "NOTICE", "Fehler beim Statusabruf: %s", strerror(err));
-			MyFree(listener_nick);
-		}
-	}
-	else if(event == EV_HANGUP)
+static void stats_done(const char *error)
+{
+	if(!error)
 	{
-		//debug("Stats socket hung up");
-		stats_sock = NULL;
 		stats_received();
-		stringbuffer_flush(stats_data);
 		timer_add(this, "update_stats", now + STATS_DELAY, stats_update_tmr, NULL, 0, 0);
+		return;
 	}
-	else if(event == EV_CONNECT)
-	{
-		timer_del_boundname(this, "stats_timeout");
-		sock_write_fmt(sock, "GET /admin.cgi?pass=%s&mode=viewxml&page=0 HTTP/1.0\r\n", radiobot_conf.stream_pass_stats);
-		sock_write_fmt(sock, "User-agent: Mozilla compatible\r\n");
-		sock_write_fmt(sock, "Host: %s\r\n", radiobot_conf.stream_ip_stats);
-		sock_write_fmt(sock, "Connection: close\r\n\r\n");
-	}
-}
-
-static void stats_sock_read(struct sock *sock, char *buf, size_t len)
-{
-	stringbuffer_append_string(stats_data, buf);
-}
 
-static void stats_sock_timeout(void *bound, void *data)
-{
-	log_append(LOG_WARNING, "Could not connect to stream server (timeout)");
 	if(status_nick)
 	{
-		irc_send_msg(status_nick, "NOTICE", "Fehler beim Statusabruf: Timeout");
+		irc_send_msg(status_nick, "NOTICE", "Fehler beim Statusabruf: %s", error);
 		MyFree(status_nick);
 	}
 
 	if(listener_nick)
 	{
-		irc_send_msg(listener_nick, "NOTICE", "Fehler beim Statusabruf: Timeout");
+		irc_send_msg(listener_nick, "NOTICE", "Fehler beim Statusabruf: %s", error);
 		MyFree(listener_nick);
 	}
 
-	if(stats_sock)
-		sock_close(stats_sock);
-	stats_sock = NULL;
-
-	timer_add(this, "update_stats", now + 120, stats_update_tmr, NULL, 0, 0);
+	timer_add(this, "update_stats", now + 60, stats_update_tmr, NULL, 0, 0);
 }
 
-static void stats_update_tmr(void *bound, void *data)
-{
-	stats_sock_connect();
-}
-
-#define HEADER_END "\r\n\r\n"
 static void stats_received()
 {
-	unsigned int send_update = 0;
-
-	// remove http headers
-	char *data = strstr(stats_data->string, HEADER_END);
-	if(data)
-	{
-		data += strlen(HEADER_END);
-		if(*data == '\0')
-			return;
-	}
+	unsigned int send_update = stats_listeners_changed;
 
-	// here the actual parsing starts
-	xmlDocPtr doc;
-	doc = xmlReadMemory(data, strlen(data), "stats.xml", "iso-8859-15", 0);
-	if(!doc)
-	{
-		log_append(LOG_WARNING, "Could not parse xml stats");
-		MyFree(status_nick);
-		MyFree(listener_nick);
-		return;
-	}
-
-	unsigned int listeners = stream_stats.listeners_current;
-	xmlNode *root_element = xmlDocGetRootElement(doc);
-	iterate_stats_elements(root_element);
-	xmlFreeDoc(doc);
-
-	if(listeners != stream_stats.listeners_current)
-		send_update = 1;
+	stats_listeners_changed = 0;
 
 	if(status_nick)
 	{
@@ -2126,144 +2181,73 @@ static void stats_received()
 		show_updated_readonly();
 
 	if(radiobot_conf.rrd_enabled)
-	{
-		rrd_update();
-		rrd_graph();
-	}
+		listeners_rrd_update();
 }
 
-static void iterate_stats_elements(xmlNode *a_node)
+static void stats_value(enum streamstats_key key, const char *value)
 {
-	xmlNode *cur_node = NULL;
-
-	for(cur_node = a_node; cur_node; cur_node = cur_node->next)
+	switch(key)
 	{
-		if(cur_node->type == XML_ELEMENT_NODE)
-		{
-			if(cur_node->children && cur_node->children->type == XML_TEXT_NODE)
-				stats_parse_row((const char *)cur_node->name, (const char *)cur_node->children->content);
-			else
-				stats_parse_row((const char *)cur_node->name, NULL);
-		}
-
-		if(cur_node->type != XML_TEXT_NODE)
-		{
-			iterate_stats_elements(cur_node->children);
-		}
-
+		case STATS_CURRENTLISTENERS:
+			if(stream_stats.listeners_current != (unsigned int)atoi(value))
+				stats_listeners_changed = 1;
+			stream_stats.listeners_current = atoi(value);
+			shared_memory_set(this, "listeners", strdup(value), free);
+			break;
+		case STATS_PEAKLISTENERS:
+			stream_stats.listeners_peak = atoi(value);
+			break;
+		case STATS_MAXLISTENERS:
+			stream_stats.listeners_max = atoi(value);
+			break;
+		case STATS_REPORTEDLISTENERS:
+			stream_stats.listeners_unique = atoi(value);
+			break;
+		case STATS_BITRATE:
+			stream_stats.bitrate = 192; // atoi(value);
+			break;
+		case STATS_SONGTITLE:
+			MyFree(stream_stats.title);
+			stream_stats.title = strdup(value);
+			break;
 	}
 }
 
-static void stats_parse_row(const char *key, const char *value)
+// listener statistics
+static void listeners_rrd_update()
 {
-	if(!value)
-		value = "";
+	double values[2];
 
-	if(!strcasecmp(key, "CURRENTLISTENERS"))
-	{
-		stream_stats.listeners_current = atoi(value);
-		shared_memory_set(this, "listeners", strdup(value), free);
-	}
-	else if(!strcasecmp(key, "PEAKLISTENERS"))
-		stream_stats.listeners_peak = atoi(value);
-	else if(!strcasecmp(key, "MAXLISTENERS"))
-		stream_stats.listeners_max = atoi(value);
-	else if(!strcasecmp(key, "REPORTEDLISTENERS"))
-		stream_stats.listeners_unique = atoi(value);
-	else if(!strcasecmp(key, "BITRATE"))
-		stream_stats.bitrate = 192; // atoi(value);
-	else if(!strcasecmp(key, "SONGTITLE"))
+	if(!listeners_rrd)
 	{
-		MyFree(stream_stats.title);
-		stream_stats.title = strdup(value);
-	}
-}
-
-// rrdtool stuff
-static unsigned int rrd_exists(const char *name)
-{
-	char path[MAXLEN];
-	FILE *fp;
+		char path[PATH_MAX];
 
-	snprintf(path, sizeof(path), "%s/%s.rrd", radiobot_conf.rrd_dir, name);
-	if(!(fp = fopen(path, "r")))
-		return 0;
-
-	fclose(fp);
-	return 1;
-}
+		// An existing listeners.rrd can be imported by saving `rrdtool dump listeners.rrd` as listeners.xml
+		snprintf(path, sizeof(path), "%s/listeners.rrdb", radiobot_conf.rrd_dir);
+		if(!(listeners_rrd = rrd_open(path, &listeners_rrd_def)))
+			return;
 
-static void rrd_update()
-{
-	char str[MAXLEN];
-
-	if(!rrd_exists("listeners"))
-	{
-		debug("Creating RRD for stream %s:%d", radiobot_conf.stream_ip_stats, radiobot_conf.stream_port_stats);
-		snprintf(str, sizeof(str), "%s create %s/listeners.rrd --step 15"
-				           "DS:listeners:GAUGE:600:U:U "
-					   "DS:unique_listeners:GAUGE:600:U:U "
-					   "RRA:AVERAGE:0.5:1:7200 "
-					   "RRA:AVERAGE:0.5:5:4800 "
-					   "RRA:AVERAGE:0.5:10:7200 "
-					   "RRA:AVERAGE:0.5:60:6000 "
-					   "RRA:AVERAGE:0.5:180:48000 "
-					   "RRA:MAX:0.5:1:7200 "
-					   "RRA:MAX:0.5:5:4800 "
-					   "RRA:MAX:0.5:10:7200 "
-					   "RRA:MAX:0.5:60:6000 "
-					   "RRA:MAX:0.5:180:48000",
-					   radiobot_conf.rrdtool_path, radiobot_conf.rrd_dir);
-		system(str);
-	}
-
-	snprintf(str, sizeof(str), "%s update %s/listeners.rrd N:%u:%u", radiobot_conf.rrdtool_path, radiobot_conf.rrd_dir, stream_stats.listeners_current, stream_stats.listeners_unique);
-	system(str);
-}
-
-static void rrd_graph_draw(const char *title, const char *file_suffix, const char *start)
-{
-	char str[4096];
-
-	snprintf(str, sizeof(str),
-		 "%1$s graph %2$s/listeners-%3$s.png" \
-		 " %4$s" \
-		 " -a PNG" \
-		 " -h 200" \
-		 " -s %5$s" \
-		 " -v 'Listeners'" \
-		 " -t '%6$s'" \
-		 " DEF:listeners=%7$s/listeners.rrd:listeners:AVERAGE" \
-		 " DEF:unique_listeners=%7$s/listeners.rrd:unique_listeners:AVERAGE" \
-		 " AREA:listeners#FF0000:'Listeners'" \
-		 " LINE2:unique_listeners#0000FF:'Unique Listeners'" \
-		 " DEF:maxlisteners=%7$s/listeners.rrd:listeners:MAX" \
-		 " DEF:maxunique_listeners=%7$s/listeners.rrd:unique_listeners:MAX" \
-		 " COMMENT:'\\n'" \
-		 " GPRINT:maxlisteners:MAX:'Listeners\\t\\t Max\\: %%.lf'" \
-		 " GPRINT:listeners:AVERAGE:'   Average\\: %%.lf'" \
-		 " GPRINT:listeners:LAST:'   Current\\: %%.lf\\l'" \
-		 " COMMENT:'\\n'" \
-		 " GPRINT:maxunique_listeners:MAX:'Unique Listeners\\t Max\\: %%.lf'" \
-		 " GPRINT:unique_listeners:AVERAGE:'   Average\\: %%.lf'" \
-		 " GPRINT:unique_listeners:LAST:'   Current\\: %%.lf\\l'" \
-		 " > /dev/null",
-		 radiobot_conf.rrdtool_path, radiobot_conf.graph_dir, file_suffix, RRD_DEFAULT_COLORS, start, title, radiobot_conf.rrd_dir);
-
-	system(str);
-}
-
-static void rrd_graph()
-{
-	if(!rrd_exists("listeners"))
-		return;
+		for(unsigned int i = 0; i < ArraySize(listeners_graphs); i++)
+		{
+			struct rrd_graph graph;
+			char name[32];
+
+			memset(&graph, 0, sizeof(graph));
+			graph.title = listeners_graphs[i].title;
+			graph.vlabel = "Listeners";
+			graph.height = 200;
+			graph.span = listeners_graphs[i].span;
+			graph.series = listeners_graph_series;
+			graph.series_count = ArraySize(listeners_graph_series);
+
+			snprintf(name, sizeof(name), "listeners-%s", listeners_graphs[i].name);
+			rrd_graph_add(name, listeners_rrd, &graph);
+		}
+	}
 
-	rrd_graph_draw("Listeners (1 hour)", "hour", "-1hour");
-	rrd_graph_draw("Listeners (3 hours)", "3hour", "-3hours");
-	rrd_graph_draw("Listeners (1 day)", "day", "-1day");
-	rrd_graph_draw("Listeners (1 week)", "week", "-1week");
-	rrd_graph_draw("Listeners (1 month)", "month", "-1month");
-	rrd_graph_draw("Listeners (1 year)", "year", "-1year");
+	values[0] = stream_stats.listeners_current;
+	values[1] = stream_stats.listeners_unique;
+	rrd_update(listeners_rrd, now, values);
 }
 
 void radiobot_set_notify_func(radiobot_notify_func *func)
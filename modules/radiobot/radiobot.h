@@ -25,9 +25,7 @@ struct radiobot_conf
 	const char *cmd_sock_pass;
 	const char *cmd_sock_read_pass;
 	unsigned int rrd_enabled;
-	const char *rrdtool_path;
 	const char *rrd_dir;
-	const char *graph_dir;
 	const char *gadget_update_url;
 	const char *gadget_current_version;
 	const char *memcached_config;
@@ -1,6 +1,7 @@
 #include "global.h"
 #include "module.h"
 #include "modules/commands/commands.h"
+#include "modules/streamstats/streamstats.h"
 #include "irc.h"
 #include "irc_handler.h"
 #include "timer.h"
@@ -11,7 +12,6 @@
 #include "database.h"
 
 #include <libxml/parser.h>
-#include <libxml/tree.h>
 
 // %s: DJ
 // %s: Show title
@@ -21,7 +21,7 @@
 // #define CACHE_STATS
 #define CMDSOCK_MAXLEN 10240
 
-MODULE_DEPENDS("commands", NULL);
+MODULE_DEPENDS("commands", "streamstats", NULL);
 
 static struct
 {
@@ -58,10 +58,9 @@ COMMAND(peak);
 COMMAND(wish);
 COMMAND(greet);
 static void radiobotremote_conf_reload();
-static void stats_sock_connect();
-static void stats_sock_event(struct sock *sock, enum sock_event event, int err);
-static void stats_sock_read(struct sock *sock, char *buf, size_t len);
-static void stats_sock_timeout(void *bound, void *data);
+static void stats_request();
+static void stats_value(enum streamstats_key key, const char *value);
+static void stats_done(const char *error);
 #ifdef CACHE_STATS
 static void stats_update_tmr(void *bound, void *data);
 #endif
@@ -72,14 +71,11 @@ static void cmd_client_timeout(void *bound, void *data);
 static void cmd_client_schedule_reconnect(unsigned int wait);
 static void cmd_client_reconnect_tmr(void *bound, void *data);
 static void stats_received();
-static void iterate_stats_elements(xmlNode *a_node);
-static void stats_parse_row(const char *key, const char *value);
 static void send_status(const char *nick);
 
 static struct module *this;
-static struct sock *stats_sock = NULL;
+static struct streamstats *streamstats;
 static struct sock *cmd_sock = NULL;
-static struct stringbuffer *stats_data;
 static char *current_mod = NULL;
 static char *current_playlist = NULL;
 static char *current_streamtitle = NULL;
@@ -92,6 +88,11 @@ static time_t last_peak_time;
 static char *last_peak_mod = NULL;
 static time_t queue_full = 0;
 
+static const struct streamstats_handler stats_handler = {
+	stats_value,
+	stats_done
+};
+
 
 MODULE_INIT
 {
@@ -99,11 +100,10 @@ MODULE_INIT
 
 	LIBXML_TEST_VERSION
 
-	stats_data = stringbuffer_create();
-
 	reg_conf_reload_func(radiobotremote_conf_reload);
 	radiobotremote_conf_reload();
-	stats_sock_connect();
+	streamstats = streamstats_create(this, &stats_handler);
+	stats_request();
 
 	reg_irc_handler("JOIN", join);
 
@@ -124,20 +124,16 @@ MODULE_FINI
 	unreg_irc_handler("JOIN", join);
 	unreg_conf_reload_func(radiobotremote_conf_reload);
 
-	timer_del_boundname(this, "stats_timeout");
 #ifdef CACHE_STATS
 	timer_del_boundname(this, "update_stats");
 #endif
 	timer_del_boundname(this, "cmd_client_reconnect");
 	timer_del_boundname(this, "cmd_client_connect_timeout");
 
-	if(stats_sock)
-		sock_close(stats_sock);
+	streamstats_free(streamstats);
 	if(cmd_sock)
 		sock_close(cmd_sock);
 
-	stringbuffer_free(stats_data);
-
 	MyFree(current_mod);
 	MyFree(current_playlist);
 	MyFree(current_streamtitle);
@@ -251,7 +247,7 @@ COMMAND(status)
 	{
 		MyFree(status_nick);
 		status_nick = strdup(src->nick);
-		stats_sock_connect();
+		stats_request();
 		reply("Updating status...");
 		return 1;
 	}
@@ -266,7 +262,7 @@ COMMAND(listener)
 	{
 		MyFree(listener_nick);
 		listener_nick = strdup(src->nick);
-		stats_sock_connect();
+		stats_request();
 		reply("Updating status...");
 		return 1;
 	}
@@ -285,7 +281,7 @@ COMMAND(status)
 
 	MyFree(status_nick);
 	status_nick = strdup(src->nick);
-	stats_sock_connect();
+	stats_request();
 	return 1;
 }
 
@@ -299,7 +295,7 @@ COMMAND(listener)
 
 	MyFree(listener_nick);
 	listener_nick = strdup(src->nick);
-	stats_sock_connect();
+	stats_request();
 	return 1;
 }
 #endif
@@ -521,134 +517,51 @@ static void cmd_client_reconnect_tmr(void *bound, void *data)
 
 
 // stats stuff
-static void stats_sock_connect()
+static void stats_request()
 {
-	if(stats_sock)
-	{
-		sock_close(stats_sock);
-		timer_del_boundname(this, "stats_timeout");
 #ifdef CACHE_STATS
-		timer_del_boundname(this, "update_stats");
+	timer_del_boundname(this, "update_stats");
 #endif
-	}
-
-	stats_sock = sock_create(SOCK_IPV4, stats_sock_event, stats_sock_read);
-	assert(stats_sock);
-
-	stringbuffer_flush(stats_data);
-	if(sock_connect(stats_sock, radiobotremote_conf.stream_ip_stats, radiobotremote_conf.stream_port_stats) != 0)
-	{
-		log_append(LOG_WARNING, "connect() to stream server (%s:%d) failed.", radiobotremote_conf.stream_ip_stats, radiobotremote_conf.stream_port_stats);
-		stats_sock = NULL;
-		return;
-	}
-
-	timer_add(this, "stats_timeout", now + 15, stats_sock_timeout, NULL, 0, 0);
+	streamstats_request(streamstats, radiobotremote_conf.stream_ip_stats, radiobotremote_conf.stream_port_stats, radiobotremote_conf.stream_pass_stats);
 }
 
-static void stats_sock_event(struct sock *sock, enum sock_event event, int err)
+static void stats_done(const char *error)
 {
-	if(event == EV_ERROR)
-	{
-		log_append(LOG_WARNING, "Socket error on stats socket: %s (%d)", strerror(err), err);
-		timer_del_boundname(this, "stats_timeout");
-		stats_sock = NULL;
-#ifdef CACHE_STATS
-		timer_add(this, "update_stats", now + 60, stats_update_tmr, NULL, 0, 1);
-#endif
-		if(status_nick)
-		{
-			irc_send_msg(status_nick, "NOTICE", "Fehler beim Statusabruf: %s", strerror(err));
-			MyFree(status_nick);
-		}
-
-		if(listener_nick)
-		{
-			irc_send_msg(listener_nick, "NOTICE", "Fehler beim Statusabruf: %s", strerror(err));
-			MyFree(listener_nick);
-		}
-	}
-	else if(event == EV_HANGUP)
+	if(!error)
 	{
-		debug("Stats socket hung up");
-		stats_sock = NULL;
 		stats_received();
-		stringbuffer_flush(stats_data);
 #ifdef CACHE_STATS
 		timer_add(this, "update_stats", now + STATS_DELAY, stats_update_tmr, NULL, 0, 1);
 #endif
+		return;
 	}
-	else if(event == EV_CONNECT)
-	{
-		timer_del_boundname(this, "stats_timeout");
-		sock_write_fmt(sock, "GET /admin.cgi?pass=%s&mode=viewxml&page=0 HTTP/1.0\r\n", radiobotremote_conf.stream_pass_stats);
-		sock_write_fmt(sock, "User-agent: Mozilla compatible\r\n");
-		sock_write_fmt(sock, "Host: %s\r\n", radiobotremote_conf.stream_ip_stats);
-		sock_write_fmt(sock, "Connection: close\r\n\r\n");
-	}
-}
 
-static void stats_sock_read(struct sock *sock, char *buf, size_t len)
-{
-	stringbuffer_append_string(stats_data, buf);
-}
-
-static void stats_sock_timeout(void *bound, void *data)
-{
-	log_append(LOG_WARNING, "Could not connect to stream server (timeout)");
 	if(status_nick)
 	{
-		irc_send_msg(status_nick, "NOTICE", "Fehler beim Statusabruf: Timeout");
+		irc_send_msg(status_nick, "NOTICE", "Fehler beim Statusabruf: %s", error);
 		MyFree(status_nick);
 	}
 
 	if(listener_nick)
 	{
-		irc_send_msg(listener_nick, "NOTICE", "Fehler beim Statusabruf: Timeout");
+		irc_send_msg(listener_nick, "NOTICE", "Fehler beim Statusabruf: %s", error);
 		MyFree(listener_nick);
 	}
 
-	if(stats_sock)
-		sock_close(stats_sock);
-	stats_sock = NULL;
-
 #ifdef CACHE_STATS
-		timer_add(this, "update_stats", now + 120, stats_update_tmr, NULL, 0, 1);
+	timer_add(this, "update_stats", now + 60, stats_update_tmr, NULL, 0, 1);
 #endif
 }
 
 #ifdef CACHE_STATS
 static void stats_update_tmr(void *bound, void *data)
 {
-	stats_sock_connect();
+	stats_request();
 }
 #endif
 
-#define HEADER_END "\r\n\r\n"
 static void stats_received()
 {
-	// remove http headers
-	char *data = strstr(stats_data->string, HEADER_END);
-	if(data)
-	{
-		data += strlen(HEADER_END);
-		if(*data == '\0')
-			return;
-	}
-
-	// here the actual parsing starts
-	xmlDocPtr doc;
-	doc = xmlReadMemory(data, strlen(data), "stats.xml", NULL, 0);
-	if(!doc)
-	{
-		log_append(LOG_WARNING, "Could not parse xml stats");
-		return;
-	}
-
-	xmlNode *root_element = xmlDocGetRootElement(doc);
-	iterate_stats_elements(root_element);
-	xmlFreeDoc(doc);
-
 	if(status_nick)
 	{
 		send_status(status_nick);
@@ -662,47 +575,29 @@ static void stats_received()
 	}
 }
 
-static void iterate_stats_elements(xmlNode *a_node)
-{
-	xmlNode *cur_node = NULL;
-
-	for(cur_node = a_node; cur_node; cur_node = cur_node->next)
-	{
-		if(cur_node->type == XML_ELEMENT_NODE)
-		{
-			if(cur_node->children && cur_node->children->type == XML_TEXT_NODE)
-				stats_parse_row((const char *)cur_node->name, (const char *)cur_node->children->content);
-			else
-				stats_parse_row((const char *)cur_node->name, NULL);
-		}
-
-		if(cur_node->type != XML_TEXT_NODE)
-		{
-			iterate_stats_elements(cur_node->children);
-		}
-
-	}
-}
-
-static void stats_parse_row(const char *key, const char *value)
-{
-	if(!value)
-		value = "";
-
-	if(!strcasecmp(key, "CURRENTLISTENERS"))
-		stream_stats.listeners_current = atoi(value);
-	else if(!strcasecmp(key, "PEAKLISTENERS"))
-		stream_stats.listeners_peak = atoi(value);
-	else if(!strcasecmp(key, "MAXLISTENERS"))
-		stream_stats.listeners_max = atoi(value);
-	else if(!strcasecmp(key, "REPORTEDLISTENERS"))
-		stream_stats.listeners_unique = atoi(value);
-	else if(!strcasecmp(key, "BITRATE"))
-		stream_stats.bitrate = atoi(value);
-	else if(!strcasecmp(key, "SONGTITLE"))
-	{
-		MyFree(stream_stats.title);
-		stream_stats.title = strdup(value);
+static void stats_value(enum streamstats_key key, const char *value)
+{
+	switch(key)
+	{
+		case STATS_CURRENTLISTENERS:
+			stream_stats.listeners_current = atoi(value);
+			break;
+		case STATS_PEAKLISTENERS:
+			stream_stats.listeners_peak = atoi(value);
+			break;
+		case STATS_MAXLISTENERS:
+			stream_stats.listeners_max = atoi(value);
+			break;
+		case STATS_REPORTEDLISTENERS:
+			stream_stats.listeners_unique = atoi(value);
+			break;
+		case STATS_BITRATE:
+			stream_stats.bitrate = atoi(value);
+			break;
+		case STATS_SONGTITLE:
+			MyFree(stream_stats.title);
+			stream_stats.title = strdup(value);
+			break;
 	}
 }
 
@@ -77,8 +77,9 @@ static void shared_memory_changed(struct module *module, const char *key, void *
 	debug("Radiostatus: %s | %s | %s | %s", listeners, mod, artist, title);
 	if(listeners && pg_conn)
 	{
-		pgsql_query(pg_conn, "INSERT INTO title_history (artist, title, mod, listeners) VALUES ($1, $2, $3, $4)", 0,
-				stringlist_build_n(4, artist, title, mod, listeners));
+		// Nobody waits for the result so there is no reason to block the bot on it
+		pgsql_query_async(pg_conn, "INSERT INTO title_history (artist, title, mod, listeners) VALUES ($1, $2, $3, $4)",
+				stringlist_build_n(4, artist, title, mod, listeners), NULL, NULL);
 	}
 	free(artist);
 	free(title);
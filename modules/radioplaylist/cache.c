@@ -0,0 +1,435 @@
+#include "global.h"
+#include "cache.h"
+#include "pcm.h"
+#include "ptrlist.h"
+#include "stringlist.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <lame/lame.h>
+#include <mad.h>
+
+#define CACHE_QUEUE_MAX		32
+
+struct cache_entry
+{
+	char *name;
+	off_t size;
+	time_t used;
+};
+
+static void *cache_worker_main(void *arg);
+static void cache_encode(const char *file);
+static int cache_encode_file(const unsigned char *data, size_t len, int fd);
+static void cache_make_name(char *buf, size_t size, const struct stat *sb);
+static void cache_load_index();
+static void cache_add_entry(const char *name, off_t size, time_t used);
+static void cache_evict();
+static struct cache_entry *cache_find_entry(const char *name);
+static void cache_entry_free(struct cache_entry *entry);
+
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t worker;
+	uint8_t running;
+	uint8_t terminate;
+
+	char *dir;
+	uint64_t max_size;
+	uint16_t bitrate;
+	uint16_t samplerate;
+	uint8_t quality;
+
+	struct ptrlist *entries;
+	uint64_t total_size;
+	struct stringlist *queue;
+	cache_skip_f *skip_func;
+} cache;
+
+
+void cache_init(cache_skip_f *skip_func)
+{
+	memset(&cache, 0, sizeof(cache));
+	pthread_mutex_init(&cache.mutex, NULL);
+	pthread_cond_init(&cache.cond, NULL);
+	cache.entries = ptrlist_create();
+	ptrlist_set_free_func(cache.entries, (ptrlist_free_f *)cache_entry_free);
+	cache.queue = stringlist_create();
+	cache.skip_func = skip_func;
+
+	pthread_create(&cache.worker, NULL, cache_worker_main, NULL);
+	cache.running = 1;
+}
+
+void cache_fini()
+{
+	if(!cache.running)
+		return;
+
+	pthread_mutex_lock(&cache.mutex);
+	cache.terminate = 1;
+	pthread_cond_signal(&cache.cond);
+	pthread_mutex_unlock(&cache.mutex);
+	pthread_join(cache.worker, NULL);
+	cache.running = 0;
+
+	stringlist_free(cache.queue);
+	ptrlist_free(cache.entries);
+	MyFree(cache.dir);
+	pthread_cond_destroy(&cache.cond);
+	pthread_mutex_destroy(&cache.mutex);
+}
+
+// A NULL or empty directory disables the cache
+void cache_configure(const struct cache_params *params)
+{
+	uint8_t reload;
+
+	pthread_mutex_lock(&cache.mutex);
+	reload = (!cache.dir != !params->dir) || (cache.dir && params->dir && strcmp(cache.dir, params->dir));
+	MyFree(cache.dir);
+	cache.dir = (params->dir && *params->dir) ? strdup(params->dir) : NULL;
+	cache.max_size = params->max_size;
+	cache.bitrate = params->bitrate;
+	cache.samplerate = params->samplerate;
+	cache.quality = params->quality;
+
+	if(reload)
+	{
+		ptrlist_clear(cache.entries);
+		cache.total_size = 0;
+		if(cache.dir)
+			cache_load_index();
+	}
+	cache_evict();
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+// Returns an fd of the encoded version of the file described by sb or -1 if it is not cached
+int cache_open(const struct stat *sb, off_t *size)
+{
+	struct cache_entry *entry;
+	char name[128], path[PATH_MAX];
+	struct stat cache_sb;
+	int fd = -1;
+
+	pthread_mutex_lock(&cache.mutex);
+	if(!cache.dir)
+	{
+		pthread_mutex_unlock(&cache.mutex);
+		return -1;
+	}
+
+	cache_make_name(name, sizeof(name), sb);
+	if((entry = cache_find_entry(name)))
+	{
+		snprintf(path, sizeof(path), "%s/%s", cache.dir, name);
+		if((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &cache_sb) == -1)
+		{
+			log_append(LOG_WARNING, "could not open cached file %s: %s", path, strerror(errno));
+			if(fd != -1)
+				close(fd);
+			fd = -1;
+			cache.total_size -= entry->size;
+			ptrlist_del_ptr(cache.entries, entry);
+		}
+		else
+		{
+			// The mtime of a cached file is its last use; it survives restarts
+			entry->used = now;
+			futimens(fd, NULL);
+			*size = cache_sb.st_size;
+		}
+	}
+	pthread_mutex_unlock(&cache.mutex);
+
+	return fd;
+}
+
+// Queues a file to be encoded in the background
+void cache_request(const char *file)
+{
+	pthread_mutex_lock(&cache.mutex);
+	if(cache.dir && cache.queue->count < CACHE_QUEUE_MAX && stringlist_find(cache.queue, file) == -1)
+	{
+		stringlist_add(cache.queue, strdup(file));
+		pthread_cond_signal(&cache.cond);
+	}
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+static void *cache_worker_main(void *arg)
+{
+	char *file;
+
+	// Encoding ahead of time must never take CPU time from the stream
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	pthread_mutex_lock(&cache.mutex);
+	while(!cache.terminate)
+	{
+		if(!cache.queue->count)
+		{
+			pthread_cond_wait(&cache.cond, &cache.mutex);
+			continue;
+		}
+
+		file = stringlist_shift(cache.queue);
+		pthread_mutex_unlock(&cache.mutex);
+		cache_encode(file);
+		free(file);
+		pthread_mutex_lock(&cache.mutex);
+	}
+	pthread_mutex_unlock(&cache.mutex);
+
+	return NULL;
+}
+
+static void cache_encode(const char *file)
+{
+	char name[128], path[PATH_MAX], tmppath[PATH_MAX];
+	struct stat sb;
+	void *data;
+	int fd, out;
+
+	if((fd = open(file, O_RDONLY)) == -1)
+		return;
+
+	if(fstat(fd, &sb) == -1 || !sb.st_size)
+	{
+		close(fd);
+		return;
+	}
+
+	pthread_mutex_lock(&cache.mutex);
+	cache_make_name(name, sizeof(name), &sb);
+	if(!cache.dir || cache_find_entry(name))
+	{
+		pthread_mutex_unlock(&cache.mutex);
+		close(fd);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%s", cache.dir, name);
+	pthread_mutex_unlock(&cache.mutex);
+
+	if((data = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		log_append(LOG_WARNING, "mmap() failed: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	if(cache.skip_func && cache.skip_func(data, sb.st_size))
+	{
+		munmap(data, sb.st_size);
+		close(fd);
+		return;
+	}
+
+	// Write to a temporary file so a half-written file is never used
+	if(snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int)sizeof(tmppath))
+	{
+		log_append(LOG_WARNING, "cache path %s is too long", path);
+		munmap(data, sb.st_size);
+		close(fd);
+		return;
+	}
+
+	if((out = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+	{
+		log_append(LOG_WARNING, "could not create %s: %s", tmppath, strerror(errno));
+		munmap(data, sb.st_size);
+		close(fd);
+		return;
+	}
+
+	debug("encoding %s for the cache", file);
+	if(cache_encode_file(data, sb.st_size, out) == 0 && close(out) == 0 && rename(tmppath, path) == 0)
+	{
+		struct stat out_sb;
+		if(stat(path, &out_sb) == 0)
+		{
+			pthread_mutex_lock(&cache.mutex);
+			cache_add_entry(name, out_sb.st_size, now);
+			cache_evict();
+			pthread_mutex_unlock(&cache.mutex);
+		}
+	}
+	else
+	{
+		log_append(LOG_WARNING, "could not encode %s for the cache", file);
+		close(out);
+		unlink(tmppath);
+	}
+
+	munmap(data, sb.st_size);
+	close(fd);
+}
+
+// Encodes a file with the same settings as the stream
+static int cache_encode_file(const unsigned char *data, size_t len, int fd)
+{
+	struct mad_stream stream;
+	struct mad_frame frame;
+	struct mad_synth synth;
+	lame_t lame = NULL;
+	unsigned char mp3buf[1152 * 5 / 4 + 7200];
+	float pcm_data[2][1152];
+	int olen, rc = 0;
+
+	mad_stream_init(&stream);
+	mad_frame_init(&frame);
+	mad_synth_init(&synth);
+	mad_stream_buffer(&stream, data, len);
+
+	while(rc == 0 && !cache.terminate)
+	{
+		struct mad_pcm *pcm = &synth.pcm;
+
+		if(mad_frame_decode(&frame, &stream) == -1)
+		{
+			if(MAD_RECOVERABLE(stream.error))
+				continue;
+			break;
+		}
+
+		mad_synth_frame(&synth, &frame);
+		if(!lame)
+		{
+			lame = lame_init();
+			pthread_mutex_lock(&cache.mutex);
+			lame_set_out_samplerate(lame, cache.samplerate);
+			lame_set_brate(lame, cache.bitrate);
+			lame_set_quality(lame, cache.quality);
+			pthread_mutex_unlock(&cache.mutex);
+			lame_set_in_samplerate(lame, pcm->samplerate);
+			// The file is streamed like a passthrough file; a Xing frame would be silence
+			lame_set_bWriteVbrTag(lame, 0);
+			lame_init_params(lame);
+		}
+
+		for(unsigned int i = 0; i < pcm->channels && i < 2; i++)
+			pcm_fixed_to_float(pcm_data[i], pcm->samples[i], pcm->length);
+
+		olen = lame_encode_buffer_float(lame, pcm_data[0], pcm_data[pcm->channels > 1 ? 1 : 0], pcm->length, mp3buf, sizeof(mp3buf));
+		if(olen < 0 || write(fd, mp3buf, olen) != olen)
+			rc = -1;
+	}
+
+	if(!lame || cache.terminate)
+		rc = -1;
+	else if(rc == 0)
+	{
+		olen = lame_encode_flush(lame, mp3buf, sizeof(mp3buf));
+		if(olen < 0 || write(fd, mp3buf, olen) != olen)
+			rc = -1;
+	}
+
+	if(lame)
+		lame_close(lame);
+	mad_synth_finish(&synth);
+	mad_frame_finish(&frame);
+	mad_stream_finish(&stream);
+	return rc;
+}
+
+// The name contains everything that changes the encoded file
+static void cache_make_name(char *buf, size_t size, const struct stat *sb)
+{
+	snprintf(buf, size, "%lx-%lx-%lx-%u-%u-%u.mp3",
+		 (unsigned long)sb->st_ino, (unsigned long)sb->st_mtime, (unsigned long)sb->st_size,
+		 cache.bitrate, cache.samplerate, cache.quality);
+}
+
+static void cache_load_index()
+{
+	DIR *dir;
+	struct dirent *dirent;
+	struct stat sb;
+
+	if(!(dir = opendir(cache.dir)))
+	{
+		log_append(LOG_WARNING, "could not open cache directory %s: %s", cache.dir, strerror(errno));
+		return;
+	}
+
+	while((dirent = readdir(dir)))
+	{
+		const char *ext = strrchr(dirent->d_name, '.');
+
+		if(fstatat(dirfd(dir), dirent->d_name, &sb, 0) == -1 || !S_ISREG(sb.st_mode))
+			continue;
+
+		// Leftovers of an interrupted encoder
+		if(ext && !strcmp(ext, ".tmp"))
+		{
+			unlinkat(dirfd(dir), dirent->d_name, 0);
+			continue;
+		}
+
+		if(ext && !strcmp(ext, ".mp3"))
+			cache_add_entry(dirent->d_name, sb.st_size, sb.st_mtime);
+	}
+
+	closedir(dir);
+	debug("cache contains %u files with %"PRIu64" bytes", cache.entries->count, cache.total_size);
+}
+
+static void cache_add_entry(const char *name, off_t size, time_t used)
+{
+	struct cache_entry *entry = malloc(sizeof(struct cache_entry));
+	entry->name = strdup(name);
+	entry->size = size;
+	entry->used = used;
+	ptrlist_add(cache.entries, 0, entry);
+	cache.total_size += size;
+}
+
+// Removes the least recently used files until the cache fits into its limit
+static void cache_evict()
+{
+	while(cache.total_size > cache.max_size && cache.entries->count)
+	{
+		unsigned int oldest = 0;
+		struct cache_entry *entry;
+		char path[PATH_MAX];
+
+		for(unsigned int i = 1; i < cache.entries->count; i++)
+		{
+			if(((struct cache_entry *)cache.entries->data[i]->ptr)->used < ((struct cache_entry *)cache.entries->data[oldest]->ptr)->used)
+				oldest = i;
+		}
+
+		entry = cache.entries->data[oldest]->ptr;
+		if(cache.dir)
+		{
+			snprintf(path, sizeof(path), "%s/%s", cache.dir, entry->name);
+			unlink(path);
+		}
+		cache.total_size -= entry->size;
+		ptrlist_del(cache.entries, oldest, NULL);
+	}
+}
+
+static struct cache_entry *cache_find_entry(const char *name)
+{
+	for(unsigned int i = 0; i < cache.entries->count; i++)
+	{
+		struct cache_entry *entry = cache.entries->data[i]->ptr;
+		if(!strcmp(entry->name, name))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void cache_entry_free(struct cache_entry *entry)
+{
+	free(entry->name);
+	free(entry);
+}
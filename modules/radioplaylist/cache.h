@@ -0,0 +1,25 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+struct stat;
+
+// Returns non-zero for files that do not need to be cached (e.g. because they can be passed through)
+typedef int (cache_skip_f)(const unsigned char *data, size_t len);
+
+struct cache_params
+{
+	const char *dir;
+	uint64_t max_size;
+	uint16_t bitrate;
+	uint16_t samplerate;
+	uint8_t quality;
+};
+
+void cache_init(cache_skip_f *skip_func);
+void cache_fini();
+void cache_configure(const struct cache_params *params);
+
+int cache_open(const struct stat *sb, off_t *size);
+void cache_request(const char *file);
+
+#endif
@@ -0,0 +1,318 @@
+#include "global.h"
+#include "history.h"
+#include "playlist.h"
+#include "stringlist.h"
+#include "modules/pgsql/pgsql.h"
+
+#include <ctype.h>
+
+#define HISTORY_SIZE		4096	// plays kept in memory; older plays are forgotten
+#define HISTORY_MAP_SIZE	(HISTORY_SIZE * 4)
+
+struct history_entry
+{
+	uint32_t song_id;
+	time_t ts;
+	char *artist;
+	char *album;
+};
+
+// Open addressing hash table; string keys are owned by the map
+struct history_slot
+{
+	uint32_t hash;
+	uint32_t song_id;
+	char *key;
+	time_t ts;
+};
+
+struct history_map
+{
+	unsigned int count;
+	struct history_slot *slots;
+};
+
+static void history_clear();
+static void history_rebuild();
+static void history_map_clear(struct history_map *map);
+static void history_map_set(struct history_map *map, uint32_t hash, uint32_t song_id, const char *key, time_t ts);
+static struct history_slot *history_map_find(struct history_map *map, uint32_t hash, uint32_t song_id, const char *key);
+
+static struct
+{
+	struct history_entry entries[HISTORY_SIZE];
+	unsigned int head;	// next entry to be written
+	unsigned int count;
+	unsigned int added;	// entries added since the maps were rebuilt
+
+	struct history_map songs;
+	struct history_map artists;
+	struct history_map albums;
+} history;
+
+
+void history_init()
+{
+	memset(&history, 0, sizeof(history));
+	history.songs.slots = calloc(HISTORY_MAP_SIZE, sizeof(struct history_slot));
+	history.artists.slots = calloc(HISTORY_MAP_SIZE, sizeof(struct history_slot));
+	history.albums.slots = calloc(HISTORY_MAP_SIZE, sizeof(struct history_slot));
+}
+
+void history_fini()
+{
+	history_clear();
+	free(history.songs.slots);
+	free(history.artists.slots);
+	free(history.albums.slots);
+}
+
+// Replaces the in-memory history with the plays of the last max_age seconds
+int history_load(struct pgsql *conn, time_t max_age)
+{
+	char agebuf[16];
+	PGresult *res;
+	int rows;
+
+	snprintf(agebuf, sizeof(agebuf), "%lu", (unsigned long)max_age);
+	res = pgsql_query(conn, "\
+		SELECT h.song_id, extract(epoch from h.ts)::bigint AS ts, s.artist, s.album \
+		FROM playlist_history h \
+		JOIN playlist_songs s ON (s.id = h.song_id) \
+		WHERE h.ts >= (now() at time zone 'UTC') - ($1 || ' seconds')::interval \
+		ORDER BY h.ts", 1, stringlist_build_n(1, agebuf));
+	if(!res)
+		return -1;
+
+	history_clear();
+	rows = pgsql_num_rows(res);
+	for(int i = 0; i < rows; i++)
+	{
+		history_add(strtoul(pgsql_nvalue(res, i, "song_id"), NULL, 10),
+			    pgsql_nvalue(res, i, "artist"),
+			    pgsql_nvalue(res, i, "album"),
+			    strtoll(pgsql_nvalue(res, i, "ts"), NULL, 10));
+	}
+	pgsql_free(res);
+
+	debug("loaded %u plays from the playlist history", history.count);
+	return 0;
+}
+
+void history_add(uint32_t song_id, const char *artist, const char *album, time_t ts)
+{
+	struct history_entry *entry = &history.entries[history.head];
+
+	if(history.count == HISTORY_SIZE)
+	{
+		MyFree(entry->artist);
+		MyFree(entry->album);
+	}
+	else
+		history.count++;
+
+	entry->song_id = song_id;
+	entry->ts = ts;
+	entry->artist = artist ? strdup(artist) : NULL;
+	entry->album = album ? strdup(album) : NULL;
+	history.head = (history.head + 1) % HISTORY_SIZE;
+
+	// The maps never delete anything; rebuilding them from the ring drops the forgotten plays
+	if(++history.added >= HISTORY_SIZE)
+	{
+		history_rebuild();
+		return;
+	}
+
+	history_map_set(&history.songs, playlist_hash_int(song_id), song_id, NULL, ts);
+	if(artist)
+		history_map_set(&history.artists, playlist_hash_str(artist), 0, artist, ts);
+	if(album)
+		history_map_set(&history.albums, playlist_hash_str(album), 0, album, ts);
+}
+
+time_t history_song_played(uint32_t song_id)
+{
+	struct history_slot *slot = history_map_find(&history.songs, playlist_hash_int(song_id), song_id, NULL);
+	return slot ? slot->ts : 0;
+}
+
+time_t history_artist_played(const char *artist)
+{
+	struct history_slot *slot;
+
+	// Like in SQL, NULL never equals anything
+	if(!artist)
+		return 0;
+	slot = history_map_find(&history.artists, playlist_hash_str(artist), 0, artist);
+	return slot ? slot->ts : 0;
+}
+
+time_t history_album_played(const char *album)
+{
+	struct history_slot *slot;
+
+	if(!album)
+		return 0;
+	slot = history_map_find(&history.albums, playlist_hash_str(album), 0, album);
+	return slot ? slot->ts : 0;
+}
+
+uint8_t history_filter(uint32_t song_id, const char *artist, const char *album, void *ctx)
+{
+	const struct history_filter *filter = ctx;
+
+	if(filter->song_since && history_song_played(song_id) >= filter->song_since)
+		return 0;
+	if(filter->artist_since && history_artist_played(artist) >= filter->artist_since)
+		return 0;
+	if(filter->album_since && history_album_played(album) >= filter->album_since)
+		return 0;
+	return 1;
+}
+
+time_t history_parse_interval(const char *str, time_t fallback)
+{
+	static const struct {
+		const char *name;
+		time_t seconds;
+	} units[] = {
+		{ "second", 1 },
+		{ "sec", 1 },
+		{ "minute", 60 },
+		{ "min", 60 },
+		{ "hour", 3600 },
+		{ "day", 86400 },
+		{ "week", 604800 },
+		{ NULL, 0 }
+	};
+	const char *orig = str;
+	time_t total = 0;
+
+	if(!str)
+		return fallback;
+
+	while(*str)
+	{
+		unsigned long value;
+		char *end;
+		size_t len;
+		int i;
+
+		while(isspace(*str))
+			str++;
+		if(!*str)
+			break;
+
+		value = strtoul(str, &end, 10);
+		if(end == str)
+			goto invalid;
+		for(str = end; isspace(*str); str++)
+			;
+
+		for(len = 0; isalpha(str[len]); len++)
+			;
+		// Allow plurals ("2 hours")
+		if(len > 1 && str[len - 1] == 's')
+			len--;
+		for(i = 0; units[i].name; i++)
+		{
+			if(strlen(units[i].name) == len && !strncasecmp(str, units[i].name, len))
+				break;
+		}
+		if(!units[i].name)
+			goto invalid;
+
+		total += value * units[i].seconds;
+		while(isalpha(*str))
+			str++;
+	}
+
+	return total;
+
+invalid:
+	log_append(LOG_WARNING, "invalid interval: %s", orig);
+	return fallback;
+}
+
+static void history_clear()
+{
+	for(unsigned int i = 0; i < history.count; i++)
+	{
+		MyFree(history.entries[i].artist);
+		MyFree(history.entries[i].album);
+	}
+
+	history.head = 0;
+	history.count = 0;
+	history.added = 0;
+	history_map_clear(&history.songs);
+	history_map_clear(&history.artists);
+	history_map_clear(&history.albums);
+}
+
+static void history_rebuild()
+{
+	history_map_clear(&history.songs);
+	history_map_clear(&history.artists);
+	history_map_clear(&history.albums);
+	history.added = 0;
+
+	// Oldest first so the latest play of each key wins
+	for(unsigned int i = 0; i < history.count; i++)
+	{
+		struct history_entry *entry = &history.entries[(history.head + HISTORY_SIZE - history.count + i) % HISTORY_SIZE];
+
+		history_map_set(&history.songs, playlist_hash_int(entry->song_id), entry->song_id, NULL, entry->ts);
+		if(entry->artist)
+			history_map_set(&history.artists, playlist_hash_str(entry->artist), 0, entry->artist, entry->ts);
+		if(entry->album)
+			history_map_set(&history.albums, playlist_hash_str(entry->album), 0, entry->album, entry->ts);
+	}
+}
+
+static void history_map_clear(struct history_map *map)
+{
+	for(unsigned int i = 0; i < HISTORY_MAP_SIZE; i++)
+		free(map->slots[i].key);
+	memset(map->slots, 0, HISTORY_MAP_SIZE * sizeof(struct history_slot));
+	map->count = 0;
+}
+
+// Between two rebuilds at most 2 * HISTORY_SIZE keys are added so the map never gets full
+static void history_map_set(struct history_map *map, uint32_t hash, uint32_t song_id, const char *key, time_t ts)
+{
+	struct history_slot *slot;
+	uint32_t pos;
+
+	if((slot = history_map_find(map, hash, song_id, key)))
+	{
+		if(ts > slot->ts)
+			slot->ts = ts;
+		return;
+	}
+
+	for(pos = hash % HISTORY_MAP_SIZE; map->slots[pos].ts; pos = (pos + 1) % HISTORY_MAP_SIZE)
+		;
+
+	slot = &map->slots[pos];
+	slot->hash = hash;
+	slot->song_id = song_id;
+	slot->key = key ? strdup(key) : NULL;
+	slot->ts = ts;
+	map->count++;
+}
+
+static struct history_slot *history_map_find(struct history_map *map, uint32_t hash, uint32_t song_id, const char *key)
+{
+	for(uint32_t pos = hash % HISTORY_MAP_SIZE; map->slots[pos].ts; pos = (pos + 1) % HISTORY_MAP_SIZE)
+	{
+		struct history_slot *slot = &map->slots[pos];
+		if(slot->hash != hash)
+			continue;
+		if(key ? (slot->key && !strcmp(slot->key, key)) : (slot->song_id == song_id))
+			return slot;
+	}
+
+	return NULL;
+}
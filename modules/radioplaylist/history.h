@@ -0,0 +1,30 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+struct pgsql;
+
+// Songs, artists or albums played at or after these times are not eligible; 0 disables a check
+struct history_filter
+{
+	time_t song_since;
+	time_t artist_since;
+	time_t album_since;
+};
+
+void history_init();
+void history_fini();
+int history_load(struct pgsql *conn, time_t max_age);
+void history_add(uint32_t song_id, const char *artist, const char *album, time_t ts);
+
+// Return the time of the last play or 0 if there was none
+time_t history_song_played(uint32_t song_id);
+time_t history_artist_played(const char *artist);
+time_t history_album_played(const char *album);
+
+// Can be used as a playlist_filter_f with a struct history_filter as ctx
+uint8_t history_filter(uint32_t song_id, const char *artist, const char *album, void *ctx);
+
+// Parses intervals like "1 day" or "1 hour 30 minutes"
+time_t history_parse_interval(const char *str, time_t fallback);
+
+#endif
@@ -0,0 +1,576 @@
+#include "global.h"
+#include "mp3info.h"
+
+#include <fcntl.h>
+#include <mad.h>
+
+#define MP3_PROBE_SIZE		8192	// enough for the first frame including its Xing/VBRI tag
+#define MP3_WALK_BUFSIZE	65536
+#define MP3_CBR_CHECK_FRAMES	3	// consecutive frames that must have the same bitrate
+
+static off_t mp3_skip_id3v2(int fd, off_t size);
+static off_t mp3_audio_end(int fd, off_t size);
+static int mp3_probe(int fd, off_t start, off_t end, mad_timer_t *duration);
+static int mp3_probe_tag(const unsigned char *frame, size_t len, const struct mad_header *header, mad_timer_t *duration);
+static unsigned long mp3_probe_bitrate(int fd, off_t offset, off_t end);
+static int mp3_walk(int fd, off_t start, off_t end, mad_timer_t *duration);
+static const unsigned char *mp3_xing_tag(const unsigned char *frame, size_t len, const struct mad_header *header);
+static uint32_t read_be32(const unsigned char *data);
+
+
+int mp3_duration(const char *file, const struct stat *sb, mad_timer_t *duration)
+{
+	struct stat sb_;
+	off_t start, end;
+	int fd, rc;
+
+	*duration = mad_timer_zero;
+
+	if((fd = open(file, O_RDONLY)) == -1)
+	{
+		log_append(LOG_WARNING, "open(%s) failed: %s", file, strerror(errno));
+		return -1;
+	}
+
+	if(!sb)
+	{
+		sb = &sb_;
+		if(fstat(fd, &sb_) == -1)
+		{
+			log_append(LOG_ERROR, "fstat() failed: %s", strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	if(sb->st_size == 0)
+	{
+		log_append(LOG_WARNING, "file %s is empty", file);
+		close(fd);
+		return -1;
+	}
+
+	start = mp3_skip_id3v2(fd, sb->st_size);
+	end = mp3_audio_end(fd, sb->st_size);
+
+	// Only files with neither a usable tag nor a constant bitrate need every frame header
+	if((rc = mp3_probe(fd, start, end, duration)) > 0)
+	{
+		debug("no vbr tag and no constant bitrate in %s; reading all frame headers", file);
+		rc = mp3_walk(fd, start, end, duration);
+	}
+
+	close(fd);
+	return rc;
+}
+
+// Returns the offset of the first byte after any ID3v2 tags
+static off_t mp3_skip_id3v2(int fd, off_t size)
+{
+	unsigned char buf[10];
+	off_t offset = 0;
+
+	while(offset + 10 <= size && pread(fd, buf, sizeof(buf), offset) == sizeof(buf))
+	{
+		size_t tagsize = mp3_id3v2_length(buf, sizeof(buf));
+		if(!tagsize)
+			break;
+		offset += tagsize;
+	}
+
+	return min(offset, size);
+}
+
+size_t mp3_id3v2_length(const unsigned char *data, size_t len)
+{
+	if(len < 10 || memcmp(data, "ID3", 3) || ((data[6] | data[7] | data[8] | data[9]) & 0x80))
+		return 0;
+
+	// The size is a syncsafe integer and does not include the header and the footer
+	return 10 + (((size_t)data[6] << 21) | (data[7] << 14) | (data[8] << 7) | data[9]) + ((data[5] & 0x10) ? 10 : 0);
+}
+
+int mp3_is_tag_frame(const unsigned char *frame, size_t len, const struct mad_header *header)
+{
+	if(header->layer != MAD_LAYER_III)
+		return 0;
+	return mp3_xing_tag(frame, len, header) || (4 + 32 + 18 <= len && !memcmp(frame + 4 + 32, "VBRI", 4));
+}
+
+// Returns the offset of the ID3v1 tag or the file size if there is none
+static off_t mp3_audio_end(int fd, off_t size)
+{
+	unsigned char buf[3];
+
+	if(size >= 128 && pread(fd, buf, sizeof(buf), size - 128) == sizeof(buf) && !memcmp(buf, "TAG", 3))
+		return size - 128;
+	return size;
+}
+
+// Returns 0 if the duration is known, >0 if all frames have to be read and <0 on errors
+static int mp3_probe(int fd, off_t start, off_t end, mad_timer_t *duration)
+{
+	unsigned char buf[MP3_PROBE_SIZE + MAD_BUFFER_GUARD];
+	struct mad_stream stream;
+	struct mad_header header, next_header;
+	const unsigned char *frame;
+	unsigned long bitrate;
+	ssize_t len;
+	int rc = 1;
+
+	if((len = pread(fd, buf, min(MP3_PROBE_SIZE, end - start), start)) <= 0)
+	{
+		if(len < 0)
+			log_append(LOG_WARNING, "pread() failed: %s", strerror(errno));
+		return -1;
+	}
+	memset(buf + len, 0, MAD_BUFFER_GUARD);
+
+	mad_stream_init(&stream);
+	mad_header_init(&header);
+	mad_header_init(&next_header);
+	mad_stream_buffer(&stream, buf, len + ((start + len >= end) ? MAD_BUFFER_GUARD : 0));
+
+	while(mad_header_decode(&header, &stream) == -1)
+	{
+		if(!MAD_RECOVERABLE(stream.error))
+			goto out;
+	}
+
+	frame = stream.this_frame;
+	if(header.layer == MAD_LAYER_III && mp3_probe_tag(frame, stream.next_frame - frame, &header, duration) == 0)
+	{
+		rc = 0;
+		goto out;
+	}
+
+	// Without a tag the file may still be CBR; the next frames and a frame from the middle must agree
+	bitrate = header.bitrate;
+	for(int i = 1; i < MP3_CBR_CHECK_FRAMES; i++)
+	{
+		if(mad_header_decode(&next_header, &stream) == -1 || next_header.bitrate != bitrate)
+			goto out;
+	}
+
+	if(mp3_probe_bitrate(fd, start + (end - start) / 2, end) != bitrate)
+		goto out;
+
+	// Leading garbage before the first frame is not audio
+	start += frame - buf;
+	mad_timer_set(duration, 0, (unsigned long)(end - start) * 8, bitrate);
+	rc = 0;
+
+out:
+	mad_header_finish(&next_header);
+	mad_header_finish(&header);
+	mad_stream_finish(&stream);
+	return rc;
+}
+
+// Reads the frame count (and the gapless info if present) from a Xing/Info/VBRI tag
+static int mp3_probe_tag(const unsigned char *frame, size_t len, const struct mad_header *header, mad_timer_t *duration)
+{
+	const unsigned char *tag;
+	uint32_t frames = 0, flags;
+	uint16_t delay = 0, padding = 0;
+
+	if((tag = mp3_xing_tag(frame, len, header)))
+	{
+		const unsigned char *pos = tag + 8;
+
+		flags = read_be32(tag + 4);
+		if(flags & 0x01)
+		{
+			if(pos + 4 > frame + len)
+				return -1;
+			frames = read_be32(pos);
+			pos += 4;
+		}
+		if(flags & 0x02)
+			pos += 4; // bytes
+		if(flags & 0x04)
+			pos += 100; // toc
+		if(flags & 0x08)
+			pos += 4; // quality
+
+		// The LAME extension stores the encoder delay and padding in 2x12 bits
+		if(pos + 24 <= frame + len && (!memcmp(pos, "LAME", 4) || !memcmp(pos, "Lavf", 4) || !memcmp(pos, "Lavc", 4)))
+		{
+			delay = (pos[21] << 4) | (pos[22] >> 4);
+			padding = ((pos[22] & 0x0f) << 8) | pos[23];
+		}
+	}
+	else if(4 + 32 + 18 <= len && !memcmp(frame + 4 + 32, "VBRI", 4))
+	{
+		// The VBRI tag has a fixed position
+		frames = read_be32(frame + 4 + 32 + 14);
+	}
+
+	if(!frames)
+		return -1;
+
+	*duration = header->duration;
+	mad_timer_multiply(duration, frames);
+
+	if(delay || padding)
+	{
+		mad_timer_t gap;
+		mad_timer_set(&gap, 0, delay + padding, header->samplerate);
+		if(mad_timer_compare(*duration, gap) > 0)
+		{
+			mad_timer_negate(&gap);
+			mad_timer_add(duration, gap);
+		}
+	}
+
+	return 0;
+}
+
+// Returns the bitrate of the first frame found at or after offset
+static unsigned long mp3_probe_bitrate(int fd, off_t offset, off_t end)
+{
+	unsigned char buf[MP3_PROBE_SIZE + MAD_BUFFER_GUARD];
+	struct mad_stream stream;
+	struct mad_header header;
+	unsigned long bitrate = 0;
+	ssize_t len;
+
+	if(offset >= end || (len = pread(fd, buf, min(MP3_PROBE_SIZE, end - offset), offset)) <= 0)
+		return 0;
+	memset(buf + len, 0, MAD_BUFFER_GUARD);
+
+	mad_stream_init(&stream);
+	mad_header_init(&header);
+	mad_stream_buffer(&stream, buf, len);
+
+	while(1)
+	{
+		if(mad_header_decode(&header, &stream) == 0)
+		{
+			bitrate = header.bitrate;
+			break;
+		}
+		else if(!MAD_RECOVERABLE(stream.error))
+			break;
+	}
+
+	mad_header_finish(&header);
+	mad_stream_finish(&stream);
+	return bitrate;
+}
+
+// Sums up the durations of all frame headers, reading the file in chunks
+static int mp3_walk(int fd, off_t start, off_t end, mad_timer_t *duration)
+{
+	unsigned char *buf = malloc(MP3_WALK_BUFSIZE + MAD_BUFFER_GUARD);
+	struct mad_stream stream;
+	struct mad_header header;
+	off_t offset = start;
+	uint8_t refill = 1, eof = 0;
+	int rc = 0;
+
+	*duration = mad_timer_zero;
+	posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+
+	mad_stream_init(&stream);
+	mad_header_init(&header);
+
+	while(1)
+	{
+		if(refill)
+		{
+			size_t remaining = 0;
+			ssize_t len;
+
+			if(eof)
+				break;
+
+			// Keep the incomplete frame at the end of the buffer
+			if(stream.next_frame)
+			{
+				remaining = stream.bufend - stream.next_frame;
+				if(remaining >= MP3_WALK_BUFSIZE)
+					remaining = 0;
+				memmove(buf, stream.next_frame, remaining);
+			}
+
+			if((len = pread(fd, buf + remaining, min(MP3_WALK_BUFSIZE - remaining, end - offset), offset)) < 0)
+			{
+				log_append(LOG_WARNING, "pread() failed: %s", strerror(errno));
+				rc = -1;
+				break;
+			}
+
+			offset += len;
+			if(!len || offset >= end)
+			{
+				memset(buf + remaining + len, 0, MAD_BUFFER_GUARD);
+				len += MAD_BUFFER_GUARD;
+				eof = 1;
+			}
+
+			mad_stream_buffer(&stream, buf, remaining + len);
+			refill = 0;
+		}
+
+		if(mad_header_decode(&header, &stream) == -1)
+		{
+			if(stream.error == MAD_ERROR_BUFLEN)
+				refill = 1;
+			else if(!MAD_RECOVERABLE(stream.error))
+				break;
+			continue;
+		}
+
+		mad_timer_add(duration, header.duration);
+	}
+
+	mad_header_finish(&header);
+	mad_stream_finish(&stream);
+	free(buf);
+	return rc;
+}
+
+// Returns a pointer to the Xing/Info tag if the frame has one
+static const unsigned char *mp3_xing_tag(const unsigned char *frame, size_t len, const struct mad_header *header)
+{
+	uint8_t mono = (header->mode == MAD_MODE_SINGLE_CHANNEL);
+	size_t side_info;
+
+	// The Xing tag is stored right after the side info
+	if(header->flags & MAD_FLAG_LSF_EXT)
+		side_info = mono ? 9 : 17;
+	else
+		side_info = mono ? 17 : 32;
+
+	if(4 + side_info + 8 > len)
+		return NULL;
+	if(memcmp(frame + 4 + side_info, "Xing", 4) && memcmp(frame + 4 + side_info, "Info", 4))
+		return NULL;
+	return frame + 4 + side_info;
+}
+
+static uint32_t read_be32(const unsigned char *data)
+{
+	return ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+
+/* testing */
+#ifdef PLAYLIST_TEST
+#include <sys/time.h>
+
+#define TEST_MP3_FILE	"mp3info_test.mp3"
+#define TEST_MP3_RUNS	20
+
+enum test_mp3_tag
+{
+	TEST_TAG_NONE,
+	TEST_TAG_XING,
+	TEST_TAG_VBRI
+};
+
+struct test_mp3
+{
+	const char *name;
+	uint8_t lsf;			// MPEG-2 with 576 samples per frame
+	unsigned int samplerate;
+	unsigned int frames;		// audio frames, not counting a tag frame
+	const unsigned short *bitrates;	// kbps, used in turn; a single one makes a CBR file
+	unsigned int bitrate_count;
+	enum test_mp3_tag tag;
+	uint16_t delay, padding;	// gapless info in the LAME extension
+	uint8_t id3;			// ID3v2 tag before and ID3v1 tag after the audio
+};
+
+static const unsigned short test_cbr128[] = { 128 };
+static const unsigned short test_cbr192[] = { 192 };
+static const unsigned short test_vbr[] = { 128, 160, 96, 192, 256, 112, 320, 128, 224 };
+static const unsigned short test_vbr_lsf[] = { 64, 48, 80, 32, 96, 56 };
+
+// About five minutes each, so the full walk has to read a realistically sized file
+static const struct test_mp3 test_mp3s[] = {
+	{ "cbr 128k 48kHz",		0, 48000, 12500, test_cbr128, 1, TEST_TAG_NONE, 0, 0, 0 },
+	{ "cbr 192k 44.1kHz, id3",	0, 44100, 11484, test_cbr192, 1, TEST_TAG_NONE, 0, 0, 1 },
+	{ "cbr 128k, info+lame",	0, 44100, 11484, test_cbr128, 1, TEST_TAG_XING, 576, 1337, 0 },
+	{ "vbr, xing+lame, id3",	0, 44100, 11484, test_vbr, ArraySize(test_vbr), TEST_TAG_XING, 576, 1000, 1 },
+	{ "vbr, vbri",			0, 44100, 11484, test_vbr, ArraySize(test_vbr), TEST_TAG_VBRI, 0, 0, 0 },
+	{ "vbr mpeg-2 22.05kHz, xing",	1, 22050, 11484, test_vbr_lsf, ArraySize(test_vbr_lsf), TEST_TAG_XING, 0, 0, 0 },
+	{ "vbr, no tag",		0, 44100, 11484, test_vbr, ArraySize(test_vbr), TEST_TAG_NONE, 0, 0, 0 }
+};
+
+// Layer III bitrates in kbps by index for MPEG-1 and MPEG-2
+static const unsigned short test_bitrate_table[2][15] = {
+	{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+	{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+};
+
+static unsigned int test_mp3_failures;
+
+static void test_put_be32(unsigned char *data, uint32_t value)
+{
+	data[0] = value >> 24;
+	data[1] = value >> 16;
+	data[2] = value >> 8;
+	data[3] = value;
+}
+
+// Writes a stereo layer III frame header with empty side info and audio data; returns the frame length
+static size_t test_mp3_frame(unsigned char *frame, const struct test_mp3 *mp3, unsigned int kbps, unsigned int *remainder)
+{
+	unsigned int slots = mp3->lsf ? 72000 : 144000;
+	unsigned int bitrate_index = 0, samplerate_index;
+	uint8_t padding;
+
+	while(test_bitrate_table[mp3->lsf][bitrate_index] != kbps)
+		bitrate_index++;
+	samplerate_index = (mp3->samplerate == 48000 || mp3->samplerate == 24000) ? 1 : ((mp3->samplerate == 32000 || mp3->samplerate == 16000) ? 2 : 0);
+
+	// Encoders pad a frame whenever the fractional slots add up to a whole byte
+	*remainder += (slots * kbps) % mp3->samplerate;
+	if((padding = (*remainder >= mp3->samplerate)))
+		*remainder -= mp3->samplerate;
+
+	frame[0] = 0xff;
+	frame[1] = mp3->lsf ? 0xf3 : 0xfb;
+	frame[2] = (bitrate_index << 4) | (samplerate_index << 2) | (padding << 1);
+	frame[3] = 0x00;
+	return slots * kbps / mp3->samplerate + padding;
+}
+
+// Builds the file in memory and writes it at once; returns its size or 0 on errors
+static size_t test_mp3_write(const struct test_mp3 *mp3)
+{
+	size_t size, len = 0, tag_len;
+	unsigned char *data;
+	unsigned int remainder = 0;
+	int fd;
+
+	// The largest frames are 1441 bytes
+	size = (mp3->frames + 1) * 1500 + 4096 + 128;
+	data = calloc(1, size);
+
+	if(mp3->id3)
+	{
+		// 4096 bytes in total; the size is a syncsafe integer without the header
+		memcpy(data, "ID3\x04\x00\x00", 6);
+		data[8] = (4096 - 10) >> 7;
+		data[9] = (4096 - 10) & 0x7f;
+		len = 4096;
+	}
+
+	if(mp3->tag != TEST_TAG_NONE)
+	{
+		unsigned char *frame = data + len;
+		unsigned char *tag = frame + 4 + (mp3->lsf ? 17 : 32);
+
+		tag_len = test_mp3_frame(frame, mp3, mp3->bitrates[0], &remainder);
+		if(mp3->tag == TEST_TAG_VBRI)
+		{
+			memcpy(frame + 4 + 32, "VBRI", 4);
+			test_put_be32(frame + 4 + 32 + 14, mp3->frames);
+		}
+		else
+		{
+			memcpy(tag, (mp3->bitrate_count == 1 ? "Info" : "Xing"), 4);
+			test_put_be32(tag + 4, 0x01); // frame count only
+			test_put_be32(tag + 8, mp3->frames);
+			memcpy(tag + 12, "LAME3.100", 9);
+			tag[12 + 21] = mp3->delay >> 4;
+			tag[12 + 22] = ((mp3->delay & 0x0f) << 4) | (mp3->padding >> 8);
+			tag[12 + 23] = mp3->padding & 0xff;
+		}
+		len += tag_len;
+	}
+
+	for(unsigned int i = 0; i < mp3->frames; i++)
+		len += test_mp3_frame(data + len, mp3, mp3->bitrates[i % mp3->bitrate_count], &remainder);
+
+	if(mp3->id3)
+	{
+		memcpy(data + len, "TAG", 3);
+		len += 128;
+	}
+
+	if((fd = open(TEST_MP3_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || write(fd, data, len) != (ssize_t)len)
+	{
+		log_append(LOG_ERROR, "mp3 test: could not write " TEST_MP3_FILE ": %s", strerror(errno));
+		len = 0;
+	}
+	if(fd != -1)
+		close(fd);
+	free(data);
+	return len;
+}
+
+// Microseconds per run of mp3_duration() (walk = 0) or the full frame walk (walk = 1); stores the duration in ms
+static double test_mp3_time(uint8_t walk, long *ms)
+{
+	struct timeval start, end;
+	mad_timer_t duration;
+	struct stat sb;
+	int fd;
+
+	if((fd = open(TEST_MP3_FILE, O_RDONLY)) == -1 || fstat(fd, &sb) == -1)
+	{
+		if(fd != -1)
+			close(fd);
+		*ms = -1;
+		return 0;
+	}
+
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < TEST_MP3_RUNS; i++)
+	{
+		if(!walk)
+			mp3_duration(TEST_MP3_FILE, &sb, &duration);
+		else if(mp3_walk(fd, mp3_skip_id3v2(fd, sb.st_size), mp3_audio_end(fd, sb.st_size), &duration))
+			duration = mad_timer_zero;
+	}
+	gettimeofday(&end, NULL);
+	close(fd);
+
+	*ms = mad_timer_count(duration, MAD_UNITS_MILLISECONDS);
+	return ((end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec)) / TEST_MP3_RUNS;
+}
+
+// Compares the probed and the walked duration of generated files with the duration they were built with
+void mp3_run_test()
+{
+	debug("MP3 TEST");
+	for(unsigned int i = 0; i < ArraySize(test_mp3s); i++)
+	{
+		const struct test_mp3 *mp3 = &test_mp3s[i];
+		unsigned int samples = mp3->lsf ? 576 : 1152;
+		long expected, expected_walk, probed, walked;
+		double probe_us, walk_us;
+		size_t size;
+
+		if(!(size = test_mp3_write(mp3)))
+		{
+			test_mp3_failures++;
+			continue;
+		}
+
+		// The tag frame carries no audio but the walk counts it; gapless info is only known from the tag
+		expected = (long)(((double)mp3->frames * samples - mp3->delay - mp3->padding) * 1000 / mp3->samplerate);
+		expected_walk = (long)((double)(mp3->frames + (mp3->tag != TEST_TAG_NONE)) * samples * 1000 / mp3->samplerate);
+
+		probe_us = test_mp3_time(0, &probed);
+		walk_us = test_mp3_time(1, &walked);
+
+		// A CBR duration is computed from the file size, so padding may make it a byte off
+		if(labs(probed - expected) > ((mp3->tag == TEST_TAG_NONE && mp3->bitrate_count == 1) ? 2 : 1) || labs(walked - expected_walk) > 1)
+		{
+			log_append(LOG_ERROR, "mp3 test %s: probed %ld ms, walked %ld ms, expected %ld / %ld ms", mp3->name, probed, walked, expected, expected_walk);
+			test_mp3_failures++;
+		}
+
+		debug("benchmark: %s, %zu bytes: probe %ld ms in %.0f us, walk %ld ms in %.0f us",
+		      mp3->name, size, probed, probe_us, walked, walk_us);
+	}
+
+	unlink(TEST_MP3_FILE);
+	debug("MP3 TEST END: %u failures", test_mp3_failures);
+}
+#endif
@@ -0,0 +1,17 @@
+#ifndef MP3INFO_H
+#define MP3INFO_H
+
+#include <mad.h>
+
+struct stat;
+
+int mp3_duration(const char *file, const struct stat *sb, mad_timer_t *duration);
+// Length of the ID3v2 tag at data or 0 if there is none
+size_t mp3_id3v2_length(const unsigned char *data, size_t len);
+// Returns non-zero for a Xing/Info/VBRI frame, which does not contain audio
+int mp3_is_tag_frame(const unsigned char *frame, size_t len, const struct mad_header *header);
+#ifdef PLAYLIST_TEST
+void mp3_run_test();
+#endif
+
+#endif
@@ -0,0 +1,78 @@
+#include "global.h"
+#include "pcm.h"
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#define PCM_X86
+#endif
+
+#define PCM_SCALE	(32767.0f / (float)(1L << MAD_F_FRACBITS))
+
+static void pcm_convert_scalar(float *dst, const mad_fixed_t *src, unsigned int count);
+#ifdef PCM_X86
+static void pcm_convert_sse2(float *dst, const mad_fixed_t *src, unsigned int count);
+static void pcm_convert_avx2(float *dst, const mad_fixed_t *src, unsigned int count);
+#endif
+
+static void (*pcm_convert)(float *dst, const mad_fixed_t *src, unsigned int count) = pcm_convert_scalar;
+
+
+void pcm_init()
+{
+#ifdef PCM_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		debug("using avx2 pcm conversion");
+		pcm_convert = pcm_convert_avx2;
+	}
+	else if(__builtin_cpu_supports("sse2"))
+	{
+		debug("using sse2 pcm conversion");
+		pcm_convert = pcm_convert_sse2;
+	}
+#endif
+}
+
+void pcm_fixed_to_float(float *dst, const mad_fixed_t *src, unsigned int count)
+{
+	pcm_convert(dst, src, count);
+}
+
+static void pcm_convert_scalar(float *dst, const mad_fixed_t *src, unsigned int count)
+{
+	for(unsigned int i = 0; i < count; i++)
+		dst[i] = (float)src[i] * PCM_SCALE;
+}
+
+#ifdef PCM_X86
+__attribute__((target("sse2")))
+static void pcm_convert_sse2(float *dst, const mad_fixed_t *src, unsigned int count)
+{
+	const __m128 scale = _mm_set1_ps(PCM_SCALE);
+	unsigned int i = 0;
+
+	for(; i + 4 <= count; i += 4)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(in), scale));
+	}
+
+	pcm_convert_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void pcm_convert_avx2(float *dst, const mad_fixed_t *src, unsigned int count)
+{
+	const __m256 scale = _mm256_set1_ps(PCM_SCALE);
+	unsigned int i = 0;
+
+	for(; i + 8 <= count; i += 8)
+	{
+		__m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(in), scale));
+	}
+
+	pcm_convert_scalar(dst + i, src + i, count - i);
+}
+#endif
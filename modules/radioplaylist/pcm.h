@@ -0,0 +1,10 @@
+#ifndef PCM_H
+#define PCM_H
+
+#include <mad.h>
+
+void pcm_init();
+// Converts libmad's fixed point samples to floats in the range lame expects (+-32767)
+void pcm_fixed_to_float(float *dst, const mad_fixed_t *src, unsigned int count);
+
+#endif
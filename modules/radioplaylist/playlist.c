@@ -1,20 +1,77 @@
 #include "global.h"
 #include "playlist.h"
+#include "mp3info.h"
+#include "mtrand.h"
 #include "stringlist.h"
+#include "stringbuffer.h"
 #include "modules/pgsql/pgsql.h"
 
+#include <dirent.h>
 #include <libgen.h>
+#include <fcntl.h>
 #include <math.h>
-#include <sys/mman.h>
+#include <pthread.h>
 
 #include <libpq-fe.h>
 #include <mad.h>
 #include <id3tag.h>
 
-static int8_t playlist_load_db(struct playlist *playlist, uint8_t genre_id, uint8_t flags);
-static void playlist_add(struct playlist *playlist, struct playlist_node *node);
+#define SCAN_QUEUE_LIMIT	256
+#define SCAN_BATCH_SIZE		500
+#define PLAYLIST_LIBRARY_MAX_AGE	3600	// seconds until playlist_load() reads the songs again
+
+// Moves have to be written before anything else, so they come first
+enum scan_job_type
+{
+	SCAN_JOB_MOVE,
+	SCAN_JOB_UPDATE,
+	SCAN_JOB_INSERT,
+	SCAN_JOB_TYPES
+};
+
+struct scan_job
+{
+	enum scan_job_type type;
+	uint32_t id;
+	char *file;
+	struct stat sb;
+
+	char *artist;
+	char *album;
+	char *title;
+	uint8_t track;
+	uint16_t duration;
+
+	struct scan_job *next;
+};
+
+struct scan_queue
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct scan_job *head;
+	struct scan_job *tail;
+	unsigned int count;
+	unsigned int limit;
+	uint8_t closed;
+};
+
+struct scanner
+{
+	struct pgsql *conn;
+	struct playlist_library *library;
+	uint64_t *moved; // library rows which have already been moved to a new path
+	uint8_t mode;
+	struct scan_queue parse_queue;
+	struct scan_queue write_queue;
+	struct playlist_scan_progress *progress;
+	volatile uint8_t failed;
+};
+
+static int8_t playlist_load_library(struct playlist *playlist, uint8_t genre_id, uint8_t flags);
+static void playlist_shuffle(uint32_t *rows, uint32_t count);
 static struct playlist_node *playlist_next(struct playlist *playlist);
-static struct playlist_node *playlist_find_file(struct playlist *playlist, const char *file);
 static int8_t playlist_blacklist(struct playlist *playlist, uint32_t id, struct playlist_node *node);
 static int8_t playlist_blacklist_id(struct playlist *playlist, uint32_t id);
 static int8_t playlist_blacklist_node(struct playlist *playlist, struct playlist_node *node);
@@ -23,33 +80,85 @@ static struct playlist_node *playlist_get_node(struct playlist *playlist, uint32
 static void playlist_enqueue_head(struct playlist *playlist, struct playlist_node *node);
 static void playlist_enqueue_tail(struct playlist *playlist, struct playlist_node *node);
 static void playlist_prepare(struct playlist *playlist, struct playlist_node *node);
+static unsigned int playlist_upcoming(struct playlist *playlist, const char **files, unsigned int count);
+static unsigned int playlist_pick(struct playlist *playlist, const struct playlist_pick *pick, uint32_t *ids, unsigned int count);
+static void playlist_set_last_vote(struct playlist *playlist, uint32_t id, int32_t ts);
 static struct playlist *playlist_create();
 static void playlist_free(struct playlist *playlist);
 
+static struct playlist_library *library_get(struct pgsql *conn, uint8_t reload);
+static struct playlist_library *library_load(struct pgsql *conn);
+static int8_t library_load_genres(struct playlist_library *library, struct pgsql *conn);
+static void library_release(struct playlist_library *library);
+static void library_free(struct playlist_library *library);
+static uint32_t library_add_row(struct playlist_library *library);
+static uint32_t library_add_string(struct playlist_library *library, const char *str);
+static void library_build_index(struct playlist_library *library, enum playlist_index_type type);
+static void library_group_artists(struct playlist_library *library);
+static uint32_t library_row_hash(const struct playlist_library *library, enum playlist_index_type type, uint32_t row);
+static uint32_t library_find_file(const struct playlist_library *library, const char *file);
+static uint32_t library_find_id(const struct playlist_library *library, uint32_t id);
+static uint32_t library_find_stat(const struct playlist_library *library, const struct stat *sb);
+static void library_fill_node(const struct playlist_library *library, uint32_t row, struct playlist_node *node);
+static struct playlist_node *library_make_node(const struct playlist_library *library, uint32_t row);
+
 static struct playlist_node *playlist_node_create(uint32_t id, const char *file);
 static void playlist_node_free(struct playlist_node *node);
 
-static int8_t playlist_scan_dir(const char *path, struct pgsql *conn, struct playlist *playlist, uint8_t depth, uint32_t *new_count, uint32_t *updated_count);
-static int8_t playlist_scan_file(struct pgsql *conn, const char *file, struct stat *sb, struct playlist *playlist, uint32_t *new_count, uint32_t *updated_count);
-static const mad_timer_t *get_mp3_duration(const char *file, struct stat *sb);
+static int8_t playlist_scan_tree(const char *path, struct pgsql *conn, struct playlist_library *lib, uint8_t mode, uint8_t threads, struct playlist_scan_progress *progress);
+static int8_t scan_walk(struct scanner *scanner, int fd, char *path, size_t len);
+static void scan_queue_file(struct scanner *scanner, const char *file, struct stat *sb);
+static void *scan_worker_main(void *arg);
+static void *scan_writer_main(void *arg);
+static int8_t scan_write_batch(struct scanner *scanner, enum scan_job_type type, struct scan_job *jobs, unsigned int count);
+static int8_t scan_read_file(struct scan_job *job);
+static int8_t scan_write(struct pgsql *conn, enum scan_job_type type, struct scan_job *jobs);
+static void scan_array_append(struct stringbuffer *sbuf, const char *value, int bytea);
+static struct scan_job *scan_job_create(enum scan_job_type type, uint32_t id, const char *file, struct stat *sb);
+static void scan_job_free(struct scan_job *job);
+static void scan_queue_init(struct scan_queue *queue, unsigned int limit);
+static void scan_queue_destroy(struct scan_queue *queue);
+static void scan_queue_push(struct scan_queue *queue, struct scan_job *job);
+static struct scan_job *scan_queue_pop(struct scan_queue *queue);
+static void scan_queue_close(struct scan_queue *queue);
 static char *get_id3_entry(const struct id3_tag *tag, const char *id);
 static const char *make_absolute_path(const char *relative);
 
+#define BIT_SET(set, bit)	((set)[(bit) / 64] |= (1ULL << ((bit) % 64)))
+// For bitsets of a library which is already shared; playlists in other threads may set bits in the same word
+#define BIT_SET_ATOMIC(set, bit)	__sync_fetch_and_or(&(set)[(bit) / 64], 1ULL << ((bit) % 64))
+#define BIT_TEST(set, bit)	(((set)[(bit) / 64] >> ((bit) % 64)) & 1)
+#define BITSET_WORDS(bits)	(((bits) + 63) / 64)
+#define LIBRARY_STRING(library, offset)	((offset) == PL_NO_STRING ? NULL : (library)->arena + (offset))
+
+static struct playlist_library *library;
+static pthread_mutex_t library_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 
 struct playlist *playlist_load(struct pgsql *conn, uint8_t genre_id, uint8_t flags)
 {
 	struct playlist *playlist = playlist_create();
 	playlist->conn = conn;
-	playlist_load_db(playlist, genre_id, flags);
+	playlist_load_library(playlist, genre_id, flags);
 	return playlist;
 }
 
-static int8_t playlist_load_db(struct playlist *playlist, uint8_t genre_id, uint8_t flags)
+// Makes the next playlist_load() read the songs from the database again
+void playlist_library_invalidate()
 {
-	char query[256] = "SELECT * FROM playlist_songs";
-	int has_where = 0;
-	PGresult *res;
-	int rows;
+	pthread_mutex_lock(&library_mutex);
+	if(library)
+	{
+		library_release(library);
+		library = NULL;
+	}
+	pthread_mutex_unlock(&library_mutex);
+}
+
+static int8_t playlist_load_library(struct playlist *playlist, uint8_t genre_id, uint8_t flags)
+{
+	struct playlist_library *lib;
+	const uint64_t *genre_bits = NULL;
 
 	if((flags & PL_L_RANDOMGENRE))
 	{
@@ -73,87 +182,55 @@ static int8_t playlist_load_db(struct playlist *playlist, uint8_t genre_id, uint
 		pgsql_free(genre_res);
 	}
 
-	if(genre_id)
-		strcat(query, " JOIN playlist_song_genres s ON (s.song_id = playlist_songs.id)");
-
-	if(!(flags & PL_L_ALL))
-	{
-		strcat(query, " WHERE blacklist = false");
-		has_where = 1;
-	}
-
-	if(genre_id)
-	{
-		if(has_where)
-			sprintf(query + strlen(query), " AND s.genre_id = %u", genre_id);
-		else
-			sprintf(query + strlen(query), " WHERE s.genre_id = %u", genre_id);
-	}
-
-
-	if(flags & PL_L_RANDOMIZE)
-		strcat(query, " ORDER BY random()");
-
 	debug("loading playlist (randomize: %s, blacklisted songs: %s, rnd genre: %s, genre: %"PRIu8")",
 		((flags & PL_L_RANDOMIZE) ? "yes" : "no"),
 		((flags & PL_L_ALL) ? "yes" : "no"),
 		((flags & PL_L_RANDOMGENRE) ? "yes" : "no"),
 		genre_id);
 
-	if(!(res = pgsql_query(playlist->conn, query, 1, NULL)))
+	if(!(lib = library_get(playlist->conn, (flags & PL_L_RELOAD))))
 		return -1;
 
+	playlist->library = lib;
 	playlist->load_flags = flags;
 	playlist->genre_id = genre_id;
 
-	rows = pgsql_num_rows(res);
-	for(int i = 0; i < rows; i++)
+	// A genre without songs has no bitset; the playlist stays empty
+	if(genre_id && !(genre_bits = lib->genres[genre_id]))
+		return 0;
+
+	playlist->order = malloc(max(lib->count, 1) * sizeof(uint32_t));
+	for(uint32_t row = 0; row < lib->count; row++)
 	{
-		const char *tmp;
-		char *file = pgsql_nvalue_bytea(res, i, "file");
-		uint32_t id = strtoul(pgsql_nvalue(res, i, "id"), NULL, 10);
-		struct playlist_node *node = playlist_node_create(id, file);
-		free(file);
-		if((tmp = pgsql_nvalue(res, i, "artist")))
-			node->artist = strdup(tmp);
-		if((tmp = pgsql_nvalue(res, i, "album")))
-			node->album = strdup(tmp);
-		if((tmp = pgsql_nvalue(res, i, "track")))
-			node->track = atoi(tmp);
-		if((tmp = pgsql_nvalue(res, i, "title")))
-			node->title = strdup(tmp);
-		node->duration = atoi(pgsql_nvalue(res, i, "duration"));
-		node->blacklist = !strcmp(pgsql_nvalue(res, i, "blacklist"), "t");
-		node->jingle = !strcmp(pgsql_nvalue(res, i, "jingle"), "t");
-		node->inode = strtoul(pgsql_nvalue(res, i, "st_inode"), NULL, 10);
-		node->size = strtol(pgsql_nvalue(res, i, "st_size"), NULL, 10);
-		node->mtime = strtol(pgsql_nvalue(res, i, "st_mtime"), NULL, 10);
-		playlist_add(playlist, node);
+		if(!(flags & PL_L_ALL) && BIT_TEST(lib->blacklist, row))
+			continue;
+		if(genre_bits && !BIT_TEST(genre_bits, row))
+			continue;
+		playlist->order[playlist->count++] = row;
 	}
 
-	pgsql_free(res);
+	if(flags & PL_L_RANDOMIZE)
+		playlist_shuffle(playlist->order, playlist->count);
+
 	return 0;
 }
 
-static void playlist_add(struct playlist *playlist, struct playlist_node *node)
+// Fisher-Yates
+static void playlist_shuffle(uint32_t *rows, uint32_t count)
 {
-	if(playlist->tail)
+	for(uint32_t i = count; i > 1; i--)
 	{
-		node->prev = playlist->tail;
-		node->prev->next = node;
+		uint32_t j = mt_rand(0, i - 1);
+		uint32_t tmp = rows[i - 1];
+		rows[i - 1] = rows[j];
+		rows[j] = tmp;
 	}
-
-	playlist->tail = node;
-
-	if(!playlist->head)
-		playlist->head = node;
-
-	playlist->count++;
 }
 
 static struct playlist_node *playlist_next(struct playlist *playlist)
 {
 	struct playlist_node *node = NULL;
+	struct playlist_library *lib = playlist->library;
 
 	// If we have an old (not-so-)random item, free it now
 	if(playlist->next_random_cur)
@@ -190,46 +267,29 @@ static struct playlist_node *playlist_next(struct playlist *playlist)
 		return node;
 	}
 
-	node = playlist->cur;
-
-	// If we are at the last node, start from beginning
-	if(node && !node->next)
+	// Continue after the current song, starting from the beginning after the last one.
+	// Songs blacklisted after loading the playlist are skipped.
+	for(uint32_t i = 0; i < playlist->count; i++)
 	{
-		debug("reached end of playlist, starting at head");
-		assert_return(node == playlist->tail, NULL);
-		node = NULL;
-	}
+		uint32_t row;
 
-	// If we have no current node, start with HEAD
-	if(!node)
-	{
-		node = playlist->head;
-		if(!node)
-			return NULL;
-		// If this node is not blacklisted or blacklisted nodes are fine, return it
-		if(!node->blacklist || (playlist->load_flags & PL_L_ALL))
+		if(!playlist->started || playlist->pos + 1 >= playlist->count)
 		{
-			playlist->cur = node;
-			return node;
+			if(playlist->started)
+				debug("reached end of playlist, starting at head");
+			playlist->pos = 0;
+			playlist->started = 1;
 		}
-	}
-
-	// Iterate over playlist until we find the next valid node
-	do
-	{
-		node = node->next;
-	} while(node->blacklist && !(playlist->load_flags & PL_L_ALL));
-
-	playlist->cur = node;
-	return node;
-}
+		else
+			playlist->pos++;
 
-static struct playlist_node *playlist_find_file(struct playlist *playlist, const char *file)
-{
-	for(struct playlist_node *node = playlist->head; node; node = node->next)
-	{
-		if(!strcmp(node->file, file))
-			return node;
+		row = playlist->order[playlist->pos];
+		if(!BIT_TEST(lib->blacklist, row) || (playlist->load_flags & PL_L_ALL))
+		{
+			library_fill_node(lib, row, &playlist->cur_node);
+			playlist->cur = &playlist->cur_node;
+			return playlist->cur;
+		}
 	}
 
 	return NULL;
@@ -237,8 +297,10 @@ static struct playlist_node *playlist_find_file(struct playlist *playlist, const
 
 static int8_t playlist_blacklist(struct playlist *playlist, uint32_t id, struct playlist_node *node)
 {
+	struct playlist_library *lib = playlist->library;
 	char idbuf[16];
 	PGresult *res;
+	uint32_t row;
 	int affected;
 
 	assert_return(!node || node->id == id, -1);
@@ -260,57 +322,14 @@ static int8_t playlist_blacklist(struct playlist *playlist, uint32_t id, struct
 		return 1;
 
 	if(node)
-	{
-		debug("blacklisted %s - %s (#%"PRIu32") [node]", node->artist, node->title, id);
 		node->blacklist = 1;
-		return 0;
-	}
-
-	if(playlist->cur)
-	{
-		// Be efficient, most blacklist requests will hit previosly played songs
-		node = playlist->cur;
-		while(node)
-		{
-			if(node->id == id)
-			{
-				debug("blacklisted %s - %s (#%"PRIu32") [<=cur]", node->artist, node->title, id);
-				node->blacklist = 1;
-				return 0;
-			}
-
-			node = node->prev;
-		}
-
-		// Node wasn't found in the previous songs, check remaining playlist
-		node = playlist->cur->next;
-		while(node)
-		{
-			if(node->id == id)
-			{
-				debug("blacklisted %s - %s (#%"PRIu32") [>cur]", node->artist, node->title, id);
-				node->blacklist = 1;
-				return 0;
-			}
 
-			node = node->next;
-		}
-	}
-	else
+	// The bit is shared by all playlists using this library
+	if(lib && (row = library_find_id(lib, id)) != PL_NO_ROW)
 	{
-		// No current node -> we have to scan the whole playlist
-		node = playlist->head;
-		while(node)
-		{
-			if(node->id == id)
-			{
-				debug("blacklisted %s - %s (#%"PRIu32")", node->artist, node->title, id);
-				node->blacklist = 1;
-				return 0;
-			}
-
-			node = node->next;
-		}
+		debug("blacklisted %s - %s (#%"PRIu32")", LIBRARY_STRING(lib, lib->artists[row]), LIBRARY_STRING(lib, lib->titles[row]), id);
+		BIT_SET_ATOMIC(lib->blacklist, row);
+		return 0;
 	}
 
 	// Very unlikely to happen
@@ -334,51 +353,52 @@ static int8_t playlist_blacklist_node(struct playlist *playlist, struct playlist
 
 static struct playlist_node *playlist_make_node(struct playlist *playlist, const char *file)
 {
+	struct playlist_library *lib = playlist->library;
 	const char *real_file;
 	struct id3_file *i3f;
-	struct playlist_node *node, *existing;
-	const mad_timer_t *duration;
-	uint16_t duration_secs;
+	struct playlist_node *node;
+	mad_timer_t duration;
+	uint32_t row = PL_NO_ROW;
 
-	if(!(existing = playlist_find_file(playlist, file)) && *file != '/')
+	if(lib && (row = library_find_file(lib, file)) == PL_NO_ROW && *file != '/')
 	{
 		// Try using the absolute path of the file
 		real_file = make_absolute_path(file);
 		if(strcmp(file, real_file))
-			existing = playlist_find_file(playlist, real_file);
+			row = library_find_file(lib, real_file);
 	}
 
-	if(existing)
+	if(row != PL_NO_ROW)
 	{
 		debug("creating node for %s; using metadata from existing entry", file);
-		node = playlist_node_create(existing->id, existing->file);
-		node->duration = existing->duration;
-		node->artist = existing->artist ? strdup(existing->artist) : NULL;
-		node->album = existing->album ? strdup(existing->album) : NULL;
-		node->title = existing->title ? strdup(existing->title) : NULL;
-		node->track = existing->track;
+		node = library_make_node(lib, row);
+		node->blacklist = 0;
+		node->jingle = 0;
 	}
 	else
 	{
 		debug("creating node for %s", file);
-		duration = get_mp3_duration(file, NULL);
-		if(!duration)
+		if(mp3_duration(file, NULL, &duration) != 0)
 		{
 			log_append(LOG_WARNING, "file %s has no duration, skipping", file);
 			return NULL;
 		}
 
 		node = playlist_node_create(0, file);
-		node->duration = (uint16_t)round(mad_timer_count(*duration, MAD_UNITS_MILLISECONDS) / 1000.0);
+		node->duration = (uint16_t)round(mad_timer_count(duration, MAD_UNITS_MILLISECONDS) / 1000.0);
 
 		if((i3f = id3_file_open(file, ID3_FILE_MODE_READONLY)))
 		{
 			const struct id3_tag *tag = id3_file_tag(i3f);
-			const char *tmp;
+			char *tmp;
 			node->artist = get_id3_entry(tag, ID3_FRAME_ARTIST);
 			node->title = get_id3_entry(tag, ID3_FRAME_TITLE);
 			node->album = get_id3_entry(tag, ID3_FRAME_ALBUM);
-			node->track = (tmp = get_id3_entry(tag, ID3_FRAME_TRACK)) ? atoi(tmp) : 0;
+			if((tmp = get_id3_entry(tag, ID3_FRAME_TRACK)))
+			{
+				node->track = atoi(tmp);
+				free(tmp);
+			}
 			id3_file_close(i3f);
 		}
 	}
@@ -388,28 +408,14 @@ static struct playlist_node *playlist_make_node(struct playlist *playlist, const
 
 static struct playlist_node *playlist_get_node(struct playlist *playlist, uint32_t id)
 {
-	struct playlist_node *node, *existing = NULL;
-
-	for(struct playlist_node *tmp = playlist->head; tmp; tmp = tmp->next)
-	{
-		if(tmp->id == id)
-		{
-			existing = tmp;
-			break;
-		}
-	}
+	struct playlist_library *lib = playlist->library;
+	struct playlist_node *node = NULL;
+	uint32_t row;
 
-	if(existing)
+	if(lib && (row = library_find_id(lib, id)) != PL_NO_ROW)
 	{
-		debug("cloning node with id %"PRIu32" (%s)", existing->id, existing->file);
-		node = playlist_node_create(existing->id, existing->file);
-		node->duration = existing->duration;
-		node->artist = existing->artist ? strdup(existing->artist) : NULL;
-		node->album = existing->album ? strdup(existing->album) : NULL;
-		node->title = existing->title ? strdup(existing->title) : NULL;
-		node->track = existing->track;
-		node->blacklist = existing->blacklist;
-		node->jingle = existing->jingle;
+		debug("cloning node with id %"PRIu32" (%s)", id, lib->arena + lib->files[row]);
+		node = library_make_node(lib, row);
 	}
 	else if(playlist->conn)
 	{
@@ -443,6 +449,7 @@ static struct playlist_node *playlist_get_node(struct playlist *playlist, uint32
 		node->inode = strtoul(pgsql_nvalue(res, 0, "st_inode"), NULL, 10);
 		node->size = strtol(pgsql_nvalue(res, 0, "st_size"), NULL, 10);
 		node->mtime = strtol(pgsql_nvalue(res, 0, "st_mtime"), NULL, 10);
+		pgsql_free(res);
 	}
 
 	return node;
@@ -478,6 +485,112 @@ static void playlist_prepare(struct playlist *playlist, struct playlist_node *no
 	playlist->next_random = node;
 }
 
+// Returns the files next() will most likely return, without changing the playlist
+static unsigned int playlist_upcoming(struct playlist *playlist, const char **files, unsigned int count)
+{
+	struct playlist_library *lib = playlist->library;
+	unsigned int found = 0;
+	uint32_t pos = playlist->pos;
+
+	for(struct playlist_node *node = playlist->queue; node && found < count; node = node->next)
+		files[found++] = node->file;
+
+	if(playlist->next_random && found < count)
+		files[found++] = playlist->next_random->file;
+
+	// Continue after the current song, wrapping around at most once
+	for(uint32_t i = 0; i < playlist->count && found < count; i++)
+	{
+		uint32_t row;
+
+		pos = (!playlist->started && !i) ? 0 : (pos + 1) % playlist->count;
+		row = playlist->order[pos];
+		if(!BIT_TEST(lib->blacklist, row) || (playlist->load_flags & PL_L_ALL))
+			files[found++] = lib->arena + lib->files[row];
+	}
+
+	return found;
+}
+
+static unsigned int playlist_pick(struct playlist *playlist, const struct playlist_pick *pick, uint32_t *ids, unsigned int count)
+{
+	struct playlist_library *lib = playlist->library;
+	const uint64_t *genre_bits = NULL;
+	uint32_t *rows, *artist_slots = NULL, *artist_seen = NULL;
+	uint32_t found = 0;
+
+	if(!lib || !count)
+		return 0;
+
+	if((pick->flags & PL_P_GENRE) && !(genre_bits = lib->genres[playlist->genre_id]))
+		return 0;
+
+	if(pick->flags & PL_P_DISTINCT_ARTIST)
+	{
+		rows = malloc(max(lib->artist_count, 1) * sizeof(uint32_t));
+		artist_slots = malloc(max(lib->artist_count, 1) * sizeof(uint32_t));
+		artist_seen = calloc(max(lib->artist_count, 1), sizeof(uint32_t));
+	}
+	else
+		rows = malloc(max(lib->count, 1) * sizeof(uint32_t));
+
+	for(uint32_t row = 0; row < lib->count; row++)
+	{
+		if(BIT_TEST(lib->blacklist, row))
+			continue;
+		if(genre_bits && !BIT_TEST(genre_bits, row))
+			continue;
+		if(((pick->flags & PL_P_PROMO) && !lib->promos[row]) || ((pick->flags & PL_P_JINGLE) && !lib->jingles[row]))
+			continue;
+		if(lib->nightonly[row] && !(pick->flags & PL_P_NIGHT))
+			continue;
+		if(pick->last_vote_before && lib->last_votes[row] >= pick->last_vote_before)
+			continue;
+		if(pick->filter && !pick->filter(lib->ids[row], LIBRARY_STRING(lib, lib->artists[row]), LIBRARY_STRING(lib, lib->albums[row]), pick->ctx))
+			continue;
+
+		if(!artist_seen)
+			rows[found++] = row;
+		else
+		{
+			// Keep a random song of each artist (reservoir sampling)
+			uint32_t artist = lib->artist_ids[row];
+			if(artist_seen[artist]++ == 0)
+			{
+				artist_slots[artist] = found;
+				rows[found++] = row;
+			}
+			else if(mt_rand(0, artist_seen[artist] - 1) == 0)
+				rows[artist_slots[artist]] = row;
+		}
+	}
+
+	// Partial Fisher-Yates
+	count = min(count, found);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint32_t j = mt_rand(i, found - 1);
+		uint32_t tmp = rows[i];
+		rows[i] = rows[j];
+		rows[j] = tmp;
+		ids[i] = lib->ids[rows[i]];
+	}
+
+	free(rows);
+	MyFree(artist_slots);
+	MyFree(artist_seen);
+	return count;
+}
+
+// Only updates the library; the caller stores the new value in the database
+static void playlist_set_last_vote(struct playlist *playlist, uint32_t id, int32_t ts)
+{
+	uint32_t row;
+
+	if(playlist->library && (row = library_find_id(playlist->library, id)) != PL_NO_ROW)
+		playlist->library->last_votes[row] = ts;
+}
+
 static struct playlist *playlist_create()
 {
 	struct playlist *playlist = malloc(sizeof(struct playlist));
@@ -493,6 +606,9 @@ static struct playlist *playlist_create()
 	playlist->enqueue = playlist_enqueue_tail;
 	playlist->enqueue_first = playlist_enqueue_head;
 	playlist->prepare = playlist_prepare;
+	playlist->upcoming = playlist_upcoming;
+	playlist->pick = playlist_pick;
+	playlist->set_last_vote = playlist_set_last_vote;
 
 	return playlist;
 }
@@ -506,373 +622,981 @@ static void playlist_free(struct playlist *playlist)
 	if(playlist->queue_cur)
 		playlist_node_free(playlist->queue_cur);
 
-	// Move queue after playlist so it gets free'd, too
-	if(playlist->tail)
-		playlist->tail->next = playlist->queue;
-
-	for(struct playlist_node *node = playlist->head; node; )
+	for(struct playlist_node *node = playlist->queue; node; )
 	{
 		struct playlist_node *next = node->next;
 		playlist_node_free(node);
 		node = next;
 	}
 
+	if(playlist->library)
+	{
+		pthread_mutex_lock(&library_mutex);
+		library_release(playlist->library);
+		pthread_mutex_unlock(&library_mutex);
+	}
+
+	MyFree(playlist->order);
 	free(playlist);
 }
 
-/* playlist node management */
-static struct playlist_node *playlist_node_create(uint32_t id, const char *file)
+/* song library */
+// Returns a new reference to the shared library, loading it if necessary
+static struct playlist_library *library_get(struct pgsql *conn, uint8_t reload)
 {
-	struct playlist_node *node = malloc(sizeof(struct playlist_node));
-	memset(node, 0, sizeof(struct playlist_node));
-	node->id = id;
-	node->file = strdup(file);
-	return node;
+	struct playlist_library *lib;
+
+	pthread_mutex_lock(&library_mutex);
+	if(library && (reload || (now - library->loaded) > PLAYLIST_LIBRARY_MAX_AGE))
+	{
+		library_release(library);
+		library = NULL;
+	}
+
+	if(!library && (library = library_load(conn)))
+		library->refcount = 1; // held by the library pointer itself
+
+	if((lib = library))
+		lib->refcount++;
+	pthread_mutex_unlock(&library_mutex);
+
+	return lib;
 }
 
-static void playlist_node_free(struct playlist_node *node)
+static struct playlist_library *library_load(struct pgsql *conn)
 {
-	free(node->file);
-	MyFree(node->artist);
-	MyFree(node->album);
-	MyFree(node->title);
-	free(node);
-}
+	struct playlist_library *lib;
+	PGresult *res;
+	int rows;
 
+	if(!(res = pgsql_query(conn, "SELECT * FROM playlist_songs", 1, NULL)))
+		return NULL;
 
-/* playlist scanning */
-int8_t playlist_scan(const char *path, struct pgsql *conn, uint8_t mode, uint32_t *new_count, uint32_t *updated_count)
-{
-	uint32_t count = 0;
-	struct playlist *playlist = NULL;
-	int8_t rc;
+	lib = malloc(sizeof(struct playlist_library));
+	memset(lib, 0, sizeof(struct playlist_library));
+	lib->loaded = now;
+
+	rows = pgsql_num_rows(res);
+	for(int i = 0; i < rows; i++)
+	{
+		const char *tmp;
+		char *file = pgsql_nvalue_bytea(res, i, "file");
+		uint32_t row = library_add_row(lib);
+
+		lib->ids[row] = strtoul(pgsql_nvalue(res, i, "id"), NULL, 10);
+		lib->files[row] = library_add_string(lib, file);
+		free(file);
+		lib->artists[row] = library_add_string(lib, pgsql_nvalue(res, i, "artist"));
+		lib->albums[row] = library_add_string(lib, pgsql_nvalue(res, i, "album"));
+		lib->titles[row] = library_add_string(lib, pgsql_nvalue(res, i, "title"));
+		lib->tracks[row] = (tmp = pgsql_nvalue(res, i, "track")) ? atoi(tmp) : 0;
+		lib->durations[row] = atoi(pgsql_nvalue(res, i, "duration"));
+		lib->jingles[row] = !strcmp(pgsql_nvalue(res, i, "jingle"), "t");
+		lib->promos[row] = !strcmp(pgsql_nvalue(res, i, "promo"), "t");
+		lib->nightonly[row] = !strcmp(pgsql_nvalue(res, i, "nightonly"), "t");
+		lib->last_votes[row] = strtol(pgsql_nvalue(res, i, "last_vote"), NULL, 10);
+		lib->inodes[row] = strtoul(pgsql_nvalue(res, i, "st_inode"), NULL, 10);
+		lib->sizes[row] = strtol(pgsql_nvalue(res, i, "st_size"), NULL, 10);
+		lib->mtimes[row] = strtol(pgsql_nvalue(res, i, "st_mtime"), NULL, 10);
+	}
+	pgsql_free(res);
 
-	if(new_count)
-		*new_count = 0;
-	if(updated_count)
-		*updated_count = 0;
+	lib->blacklist = calloc(BITSET_WORDS(max(lib->count, 1)), sizeof(uint64_t));
+	for(int type = 0; type < PL_IDX_COUNT; type++)
+		library_build_index(lib, type);
+	library_group_artists(lib);
 
-	if((mode & PL_S_REMOVE_MISSING) && mode != PL_S_REMOVE_MISSING)
+	// The blacklist flag is read separately so the row loop above does not depend on it
+	if(!(res = pgsql_query(conn, "SELECT id FROM playlist_songs WHERE blacklist = true", 1, NULL)))
 	{
-		log_append(LOG_ERROR, "PL_S_REMOVE_MISSING cannot be combined with other flags");
-		return -1;
+		library_free(lib);
+		return NULL;
 	}
-	else if(mode & PL_S_REMOVE_MISSING)
+	rows = pgsql_num_rows(res);
+	for(int i = 0; i < rows; i++)
 	{
-		playlist = playlist_load(conn, 0, PL_L_ALL);
-		assert_return(playlist, -1);
-		for(struct playlist_node *node = playlist->head; node; node = node->next)
-		{
-			if(access(node->file, R_OK) != 0)
-			{
-				char errbuf[64], idbuf[16];
-				log_append(LOG_INFO, "file %s is not readable: %s", node->file, strerror_r(errno, errbuf, sizeof(errbuf)));
-				snprintf(idbuf, sizeof(idbuf), "%"PRIu32, node->id);
-				pgsql_query(conn, "DELETE FROM playlist_songs WHERE id = $1", 0, stringlist_build_n(1, idbuf));
-				count++;
-			}
-		}
-		playlist_free(playlist);
-		if(updated_count)
-			*updated_count = count;
-		return 0;
+		uint32_t row = library_find_id(lib, strtoul(pgsql_nvalue(res, i, "id"), NULL, 10));
+		if(row != PL_NO_ROW)
+			BIT_SET(lib->blacklist, row);
 	}
+	pgsql_free(res);
 
-	// Truncate playlist if requested
-	if(mode & PL_S_TRUNCATE)
+	if(library_load_genres(lib, conn))
 	{
-		log_append(LOG_INFO, "truncating playlist");
-		pgsql_query(conn, "DELETE FROM playlist_songs", 0, NULL);
+		library_free(lib);
+		return NULL;
 	}
 
-	// If we have no path, exit early. If we didn't truncate the playlist return a failure code.
-	if(!path || !*path)
-		return (mode & PL_S_TRUNCATE) ? 0 : -1;
+	debug("loaded %"PRIu32" songs (%zu bytes of strings)", lib->count, lib->arena_len);
+	return lib;
+}
+
+static int8_t library_load_genres(struct playlist_library *lib, struct pgsql *conn)
+{
+	PGresult *res;
+	int rows;
+
+	if(!(res = pgsql_query(conn, "SELECT song_id, genre_id FROM playlist_song_genres", 1, NULL)))
+		return -1;
 
-	// If we didn't truncate, load the current playlist
-	if(!(mode & PL_S_TRUNCATE))
+	rows = pgsql_num_rows(res);
+	for(int i = 0; i < rows; i++)
 	{
-		playlist = playlist_load(conn, 0, PL_L_ALL);
-		playlist->scan_flags = mode;
+		uint8_t genre_id = atoi(pgsql_nvalue(res, i, "genre_id"));
+		uint32_t row = library_find_id(lib, strtoul(pgsql_nvalue(res, i, "song_id"), NULL, 10));
+
+		if(row == PL_NO_ROW)
+			continue;
+		if(!lib->genres[genre_id])
+			lib->genres[genre_id] = calloc(BITSET_WORDS(lib->count), sizeof(uint64_t));
+		BIT_SET(lib->genres[genre_id], row);
 	}
 
-	rc = playlist_scan_dir(make_absolute_path(path), conn, playlist, 0, new_count, updated_count);
+	pgsql_free(res);
+	return 0;
+}
 
-	if(playlist)
-		playlist_free(playlist);
-	return rc;
+// Must be called with library_mutex held
+static void library_release(struct playlist_library *lib)
+{
+	if(--lib->refcount == 0)
+		library_free(lib);
 }
 
-int8_t playlist_add_file(const char *file, struct pgsql *conn, struct stat *sb)
+static void library_free(struct playlist_library *lib)
 {
-	int8_t rc;
-	rc = playlist_scan_file(conn, make_absolute_path(file), sb, NULL, NULL, NULL);
-	return (rc <= 0) ? -1 : 0;
+	free(lib->ids);
+	free(lib->durations);
+	free(lib->tracks);
+	free(lib->jingles);
+	free(lib->promos);
+	free(lib->nightonly);
+	free(lib->last_votes);
+	free(lib->artist_ids);
+	free(lib->inodes);
+	free(lib->sizes);
+	free(lib->mtimes);
+	free(lib->files);
+	free(lib->artists);
+	free(lib->albums);
+	free(lib->titles);
+	free(lib->arena);
+	free(lib->blacklist);
+	for(int i = 0; i < 256; i++)
+		free(lib->genres[i]);
+	for(int type = 0; type < PL_IDX_COUNT; type++)
+		free(lib->index[type].rows);
+	free(lib);
 }
 
-static int8_t playlist_scan_dir(const char *path, struct pgsql *conn, struct playlist *playlist, uint8_t depth, uint32_t *new_count, uint32_t *updated_count)
+static uint32_t library_add_row(struct playlist_library *lib)
 {
-	DIR *dir;
-	struct dirent *dirent;
-	char new_path[PATH_MAX];
-	struct stat sb;
-	size_t len;
-	int32_t rc;
+	if(lib->count == lib->size)
+	{
+		lib->size = lib->size ? lib->size * 2 : 1024;
+		lib->ids = realloc(lib->ids, lib->size * sizeof(*lib->ids));
+		lib->durations = realloc(lib->durations, lib->size * sizeof(*lib->durations));
+		lib->tracks = realloc(lib->tracks, lib->size * sizeof(*lib->tracks));
+		lib->jingles = realloc(lib->jingles, lib->size * sizeof(*lib->jingles));
+		lib->promos = realloc(lib->promos, lib->size * sizeof(*lib->promos));
+		lib->nightonly = realloc(lib->nightonly, lib->size * sizeof(*lib->nightonly));
+		lib->last_votes = realloc(lib->last_votes, lib->size * sizeof(*lib->last_votes));
+		lib->inodes = realloc(lib->inodes, lib->size * sizeof(*lib->inodes));
+		lib->sizes = realloc(lib->sizes, lib->size * sizeof(*lib->sizes));
+		lib->mtimes = realloc(lib->mtimes, lib->size * sizeof(*lib->mtimes));
+		lib->files = realloc(lib->files, lib->size * sizeof(*lib->files));
+		lib->artists = realloc(lib->artists, lib->size * sizeof(*lib->artists));
+		lib->albums = realloc(lib->albums, lib->size * sizeof(*lib->albums));
+		lib->titles = realloc(lib->titles, lib->size * sizeof(*lib->titles));
+	}
 
-	if(!*path)
-		return -1;
+	return lib->count++;
+}
 
-	len = strlcpy(new_path, path, sizeof(new_path));
-	if(new_path[len - 1] == '/')
-		new_path[--len] = '\0';
+static uint32_t library_add_string(struct playlist_library *lib, const char *str)
+{
+	size_t len, offset;
 
-	// check for block file
-	strlcpy(new_path + len, "/.playlist-scan-ignore", sizeof(new_path) - len);
-	if(stat(new_path, &sb) != -1)
+	if(!str)
+		return PL_NO_STRING;
+
+	len = strlen(str) + 1;
+	if(lib->arena_len + len > lib->arena_size)
 	{
-		debug("block file %s found; skipping folder", new_path);
-		return 0;
+		while(lib->arena_len + len > lib->arena_size)
+			lib->arena_size = lib->arena_size ? lib->arena_size * 2 : 65536;
+		lib->arena = realloc(lib->arena, lib->arena_size);
 	}
 
-	if(!(dir = opendir(path)))
+	offset = lib->arena_len;
+	memcpy(lib->arena + offset, str, len);
+	lib->arena_len += len;
+	return offset;
+}
+
+static void library_build_index(struct playlist_library *lib, enum playlist_index_type type)
+{
+	struct playlist_index *index = &lib->index[type];
+
+	// Keep the load factor at or below 50%
+	for(index->size = 1024; index->size < lib->count * 2; index->size *= 2)
+		;
+	index->rows = calloc(index->size, sizeof(uint32_t));
+
+	for(uint32_t row = 0; row < lib->count; row++)
 	{
-		char errbuf[64];
-		log_append(LOG_WARNING, "could not opendir(%s): %s", path, strerror_r(errno, errbuf, sizeof(errbuf)));
-		return errno == EACCES ? 0 : -1;
+		uint32_t slot = library_row_hash(lib, type, row) & (index->size - 1);
+		while(index->rows[slot])
+			slot = (slot + 1) & (index->size - 1);
+		index->rows[slot] = row + 1;
 	}
+}
 
-	while((dirent = readdir(dir)))
+// Numbers the distinct artists; all songs without an artist form one group like in SQL's DISTINCT ON
+static void library_group_artists(struct playlist_library *lib)
+{
+	uint32_t size, *slots;
+
+	for(size = 1024; size < lib->count * 2; size *= 2)
+		;
+	slots = calloc(size, sizeof(uint32_t));
+	lib->artist_ids = malloc(max(lib->count, 1) * sizeof(uint32_t));
+	lib->artist_count = 0;
+
+	for(uint32_t row = 0; row < lib->count; row++)
 	{
-		if(!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
-			continue;
+		const char *artist = LIBRARY_STRING(lib, lib->artists[row]);
+		uint32_t slot = (artist ? playlist_hash_str(artist) : 0) & (size - 1);
 
-		snprintf(new_path + len, sizeof(new_path) - len, "/%s", dirent->d_name);
-		if(stat(new_path, &sb) == -1)
-			continue;
-		// Recurse into directory
-		if(S_ISDIR(sb.st_mode))
+		for(; slots[slot]; slot = (slot + 1) & (size - 1))
 		{
-			rc = playlist_scan_dir(new_path, conn, playlist, depth + 1, new_count, updated_count);
-			if(rc < 0)
-			{
-				closedir(dir);
-				return -1;
-			}
+			const char *other = LIBRARY_STRING(lib, lib->artists[slots[slot] - 1]);
+			if(artist ? (other && !strcmp(artist, other)) : !other)
+				break;
 		}
-		else if(S_ISREG(sb.st_mode))
+
+		if(slots[slot])
+			lib->artist_ids[row] = lib->artist_ids[slots[slot] - 1];
+		else
 		{
-			const char *ext = strrchr(dirent->d_name, '.');
-			if(!ext || strcasecmp(ext, ".mp3"))
-				continue;
-			rc = playlist_scan_file(conn, new_path, &sb, playlist, new_count, updated_count);
-			if(rc < 0)
+			slots[slot] = row + 1;
+			lib->artist_ids[row] = lib->artist_count++;
+		}
+	}
+
+	free(slots);
+}
+
+static uint32_t library_row_hash(const struct playlist_library *lib, enum playlist_index_type type, uint32_t row)
+{
+	switch(type)
+	{
+		case PL_IDX_FILE:
+			return playlist_hash_str(lib->arena + lib->files[row]);
+		case PL_IDX_ID:
+			return playlist_hash_int(lib->ids[row]);
+		case PL_IDX_INODE:
+			return playlist_hash_int(lib->inodes[row] ^ playlist_hash_int(lib->sizes[row] ^ playlist_hash_int(lib->mtimes[row])));
+		default:
+			return 0;
+	}
+}
+
+static uint32_t library_find_file(const struct playlist_library *lib, const char *file)
+{
+	const struct playlist_index *index = &lib->index[PL_IDX_FILE];
+
+	for(uint32_t slot = playlist_hash_str(file) & (index->size - 1); index->rows[slot]; slot = (slot + 1) & (index->size - 1))
+	{
+		uint32_t row = index->rows[slot] - 1;
+		if(!strcmp(lib->arena + lib->files[row], file))
+			return row;
+	}
+
+	return PL_NO_ROW;
+}
+
+static uint32_t library_find_id(const struct playlist_library *lib, uint32_t id)
+{
+	const struct playlist_index *index = &lib->index[PL_IDX_ID];
+
+	for(uint32_t slot = playlist_hash_int(id) & (index->size - 1); index->rows[slot]; slot = (slot + 1) & (index->size - 1))
+	{
+		uint32_t row = index->rows[slot] - 1;
+		if(lib->ids[row] == id)
+			return row;
+	}
+
+	return PL_NO_ROW;
+}
+
+// Finds a row for the same file contents, possibly stored under a different path
+static uint32_t library_find_stat(const struct playlist_library *lib, const struct stat *sb)
+{
+	const struct playlist_index *index = &lib->index[PL_IDX_INODE];
+	uint32_t inode = sb->st_ino;
+	int32_t size = sb->st_size, mtime = sb->st_mtime;
+	uint32_t hash = playlist_hash_int(inode ^ playlist_hash_int(size ^ playlist_hash_int(mtime)));
+
+	for(uint32_t slot = hash & (index->size - 1); index->rows[slot]; slot = (slot + 1) & (index->size - 1))
+	{
+		uint32_t row = index->rows[slot] - 1;
+		if(lib->inodes[row] == inode && lib->sizes[row] == size && lib->mtimes[row] == mtime)
+			return row;
+	}
+
+	return PL_NO_ROW;
+}
+
+// Fills a node whose strings point into the library
+static void library_fill_node(const struct playlist_library *lib, uint32_t row, struct playlist_node *node)
+{
+	memset(node, 0, sizeof(struct playlist_node));
+	node->id = lib->ids[row];
+	node->file = lib->arena + lib->files[row];
+	node->artist = (char *)LIBRARY_STRING(lib, lib->artists[row]);
+	node->album = (char *)LIBRARY_STRING(lib, lib->albums[row]);
+	node->title = (char *)LIBRARY_STRING(lib, lib->titles[row]);
+	node->track = lib->tracks[row];
+	node->duration = lib->durations[row];
+	node->blacklist = BIT_TEST(lib->blacklist, row);
+	node->jingle = lib->jingles[row];
+	node->inode = lib->inodes[row];
+	node->size = lib->sizes[row];
+	node->mtime = lib->mtimes[row];
+}
+
+// Creates a node with its own copies of the strings
+static struct playlist_node *library_make_node(const struct playlist_library *lib, uint32_t row)
+{
+	struct playlist_node *node = malloc(sizeof(struct playlist_node));
+
+	library_fill_node(lib, row, node);
+	node->file = strdup(node->file);
+	node->artist = node->artist ? strdup(node->artist) : NULL;
+	node->album = node->album ? strdup(node->album) : NULL;
+	node->title = node->title ? strdup(node->title) : NULL;
+	return node;
+}
+
+// FNV-1a
+uint32_t playlist_hash_str(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	for(; *str; str++)
+		hash = (hash ^ (uint8_t)*str) * 16777619u;
+	return hash;
+}
+
+uint32_t playlist_hash_int(uint32_t value)
+{
+	value ^= value >> 16;
+	value *= 0x45d9f3b;
+	value ^= value >> 16;
+	return value;
+}
+
+/* playlist node management */
+static struct playlist_node *playlist_node_create(uint32_t id, const char *file)
+{
+	struct playlist_node *node = malloc(sizeof(struct playlist_node));
+	memset(node, 0, sizeof(struct playlist_node));
+	node->id = id;
+	node->file = strdup(file);
+	return node;
+}
+
+static void playlist_node_free(struct playlist_node *node)
+{
+	free(node->file);
+	MyFree(node->artist);
+	MyFree(node->album);
+	MyFree(node->title);
+	free(node);
+}
+
+
+/* playlist scanning */
+int8_t playlist_scan(const char *path, struct pgsql *conn, uint8_t mode, uint8_t threads, struct playlist_scan_progress *progress)
+{
+	struct playlist_scan_progress progress_;
+	struct playlist_library *lib = NULL;
+	int8_t rc;
+
+	if(!progress)
+		progress = &progress_;
+	memset(progress, 0, sizeof(struct playlist_scan_progress));
+
+	if((mode & PL_S_REMOVE_MISSING) && mode != PL_S_REMOVE_MISSING)
+	{
+		log_append(LOG_ERROR, "PL_S_REMOVE_MISSING cannot be combined with other flags");
+		return -1;
+	}
+	else if(mode & PL_S_REMOVE_MISSING)
+	{
+		if(!(lib = library_load(conn)))
+			return -1;
+		for(uint32_t row = 0; row < lib->count; row++)
+		{
+			const char *file = lib->arena + lib->files[row];
+			if(access(file, R_OK) != 0)
 			{
-				closedir(dir);
-				return -1;
+				char errbuf[64], idbuf[16];
+				log_append(LOG_INFO, "file %s is not readable: %s", file, strerror_r(errno, errbuf, sizeof(errbuf)));
+				snprintf(idbuf, sizeof(idbuf), "%"PRIu32, lib->ids[row]);
+				pgsql_query(conn, "DELETE FROM playlist_songs WHERE id = $1", 0, stringlist_build_n(1, idbuf));
+				progress->updated_count++;
 			}
 		}
+		library_free(lib);
+		playlist_library_invalidate();
+		return 0;
+	}
+
+	// Truncate playlist if requested
+	if(mode & PL_S_TRUNCATE)
+	{
+		log_append(LOG_INFO, "truncating playlist");
+		pgsql_query(conn, "DELETE FROM playlist_songs", 0, NULL);
+		playlist_library_invalidate();
+	}
+
+	// If we have no path, exit early. If we didn't truncate the playlist return a failure code.
+	if(!path || !*path)
+		return (mode & PL_S_TRUNCATE) ? 0 : -1;
+
+	// If we didn't truncate, load the current songs. The scan uses a private
+	// copy so it does not race with the playlists using the shared one.
+	if(!(mode & PL_S_TRUNCATE) && !(lib = library_load(conn)))
+		return -1;
+
+	rc = playlist_scan_tree(make_absolute_path(path), conn, lib, mode, threads, progress);
+
+	if(lib)
+		library_free(lib);
+	playlist_library_invalidate();
+	return rc;
+}
+
+int8_t playlist_add_file(const char *file, struct pgsql *conn, struct stat *sb)
+{
+	struct scan_job *job = scan_job_create(SCAN_JOB_INSERT, 0, make_absolute_path(file), sb);
+	int8_t rc = -1;
+
+	if(scan_read_file(job) == 0)
+		rc = scan_write(conn, SCAN_JOB_INSERT, job);
+	scan_job_free(job);
+	if(rc == 0)
+		playlist_library_invalidate();
+	return rc;
+}
+
+// The calling thread walks the directory tree while worker threads read tags
+// and durations of the files it finds and a single writer thread stores them.
+static int8_t playlist_scan_tree(const char *path, struct pgsql *conn, struct playlist_library *lib, uint8_t mode, uint8_t threads, struct playlist_scan_progress *progress)
+{
+	struct scanner scanner;
+	pthread_t *workers, writer;
+	char buf[PATH_MAX];
+	size_t len;
+	int fd;
+
+	if(!*path)
+		return -1;
+
+	if((fd = open(path, O_RDONLY | O_DIRECTORY)) == -1)
+	{
+		char errbuf[64];
+		log_append(LOG_WARNING, "could not open(%s): %s", path, strerror_r(errno, errbuf, sizeof(errbuf)));
+		return errno == EACCES ? 0 : -1;
+	}
+
+	if(!threads)
+		threads = 1;
+
+	memset(&scanner, 0, sizeof(scanner));
+	scanner.conn = conn;
+	scanner.library = lib;
+	if(lib)
+		scanner.moved = calloc(BITSET_WORDS(max(lib->count, 1)), sizeof(uint64_t));
+	scanner.mode = mode;
+	scanner.progress = progress;
+	scan_queue_init(&scanner.parse_queue, SCAN_QUEUE_LIMIT);
+	scan_queue_init(&scanner.write_queue, SCAN_QUEUE_LIMIT);
+
+	debug("scanning %s with %"PRIu8" threads", path, threads);
+	workers = calloc(threads, sizeof(pthread_t));
+	for(uint8_t i = 0; i < threads; i++)
+		pthread_create(&workers[i], NULL, scan_worker_main, &scanner);
+	pthread_create(&writer, NULL, scan_writer_main, &scanner);
+
+	len = strlcpy(buf, path, sizeof(buf));
+	if(len > 1 && buf[len - 1] == '/')
+		buf[--len] = '\0';
+
+	if(scan_walk(&scanner, fd, buf, len) < 0)
+		scanner.failed = 1;
+
+	// Let the workers finish the queued files; then the writer stores the rest
+	scan_queue_close(&scanner.parse_queue);
+	for(uint8_t i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	scan_queue_close(&scanner.write_queue);
+	pthread_join(writer, NULL);
+
+	scan_queue_destroy(&scanner.parse_queue);
+	scan_queue_destroy(&scanner.write_queue);
+	MyFree(scanner.moved);
+	return scanner.failed ? -1 : 0;
+}
+
+// Takes ownership of fd; path is the directory's path and is restored before returning
+static int8_t scan_walk(struct scanner *scanner, int fd, char *path, size_t len)
+{
+	DIR *dir;
+	struct dirent *dirent;
+	struct stat sb;
+	int8_t rc = 0;
+
+	// check for block file
+	if(faccessat(fd, ".playlist-scan-ignore", F_OK, 0) == 0)
+	{
+		debug("block file found in %s; skipping folder", path);
+		close(fd);
+		return 0;
+	}
+
+	if(!(dir = fdopendir(fd)))
+	{
+		char errbuf[64];
+		log_append(LOG_WARNING, "could not fdopendir(%s): %s", path, strerror_r(errno, errbuf, sizeof(errbuf)));
+		close(fd);
+		return errno == EACCES ? 0 : -1;
+	}
+
+	while(!scanner->failed && (dirent = readdir(dir)))
+	{
+		const char *ext;
+
+		if(!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+			continue;
+
+		// Regular files which are not mp3s do not even need a stat() call
+		ext = strrchr(dirent->d_name, '.');
+		if(dirent->d_type == DT_REG && (!ext || strcasecmp(ext, ".mp3")))
+			continue;
+
+		if((size_t)snprintf(path + len, PATH_MAX - len, "/%s", dirent->d_name) >= PATH_MAX - len)
+		{
+			path[len] = '\0';
+			log_append(LOG_WARNING, "path too long: %s/%s", path, dirent->d_name);
+			continue;
+		}
+
+		if(fstatat(dirfd(dir), dirent->d_name, &sb, 0) == -1)
+			continue;
+
+		// Recurse into directory
+		if(S_ISDIR(sb.st_mode))
+		{
+			int subfd = openat(dirfd(dir), dirent->d_name, O_RDONLY | O_DIRECTORY);
+			if(subfd == -1)
+			{
+				char errbuf[64];
+				log_append(LOG_WARNING, "could not open(%s): %s", path, strerror_r(errno, errbuf, sizeof(errbuf)));
+				if(errno == EACCES)
+					continue;
+				rc = -1;
+				break;
+			}
+
+			if(scan_walk(scanner, subfd, path, len + 1 + strlen(dirent->d_name)) < 0)
+			{
+				rc = -1;
+				break;
+			}
+		}
+		else if(S_ISREG(sb.st_mode))
+		{
+			if(!ext || strcasecmp(ext, ".mp3"))
+				continue;
+			scan_queue_file(scanner, path, &sb);
+		}
 		else
-			log_append(LOG_WARNING, "unexpected dirent type: %s", new_path);
+			log_append(LOG_WARNING, "unexpected dirent type: %s", path);
 	}
 
 	closedir(dir);
-	return 0;
+	path[len] = '\0';
+	return rc;
 }
 
-static int8_t playlist_scan_file(struct pgsql *conn, const char *file, struct stat *sb, struct playlist *playlist, uint32_t *new_count, uint32_t *updated_count)
+// Decides what has to be done with a file; only the walker thread accesses the library
+static void scan_queue_file(struct scanner *scanner, const char *file, struct stat *sb)
 {
-	struct id3_file *i3f;
-	char *artist, *title, *album;
-	uint8_t track;
-	const mad_timer_t *duration;
-	uint16_t duration_secs;
-	char trackbuf[4], durationbuf[8], inodebuf[16], sizebuf[16], mtimebuf[16];
-	const char *trackptr;
-	PGresult *res;
-	struct playlist_node *node = NULL;
-	int8_t rc;
+	struct playlist_library *lib = scanner->library;
+	uint32_t row = PL_NO_ROW;
+
+	__sync_fetch_and_add(&scanner->progress->found, 1);
 
-	if(playlist && (node = playlist_find_file(playlist, file)))
+	// A file with a known inode, size and mtime whose old path is gone has been moved; no need to parse it again
+	if(lib && (row = library_find_file(lib, file)) == PL_NO_ROW && (row = library_find_stat(lib, sb)) != PL_NO_ROW)
 	{
-		uint8_t modified = 0;
-		char *tmp = strdup(file);
-		debug("found old record for %s", basename(tmp));
-		free(tmp);
+		const char *old_file = lib->arena + lib->files[row];
 
-		/*
-		if(node->inode != sb->st_ino)
+		if(BIT_TEST(scanner->moved, row) || access(old_file, F_OK) == 0)
+			row = PL_NO_ROW; // hard link to a file we already know
+		else
 		{
-			modified = 1;
-			debug("inode differs: %"PRIu32" -> %lu", node->inode, sb->st_ino);
+			debug("file %s was moved to %s", old_file, file);
+			BIT_SET(scanner->moved, row);
+			scan_queue_push(&scanner->write_queue, scan_job_create(SCAN_JOB_MOVE, lib->ids[row], file, sb));
 		}
-		*/
-		if(node->size != sb->st_size)
+	}
+
+	if(row != PL_NO_ROW)
+	{
+		uint8_t modified = 0;
+
+		if(lib->sizes[row] != sb->st_size)
 		{
 			modified = 1;
-			debug("size differs: %"PRIu32" -> %ld", node->size, sb->st_size);
+			debug("size of %s differs: %"PRId32" -> %ld", file, lib->sizes[row], sb->st_size);
 		}
-		if(node->mtime != sb->st_mtime)
+		if(lib->mtimes[row] != sb->st_mtime)
 		{
 			modified = 1;
-			debug("mtime differs: %"PRIu32" -> %ld", node->mtime, sb->st_mtime);
+			debug("mtime of %s differs: %"PRId32" -> %ld", file, lib->mtimes[row], sb->st_mtime);
 		}
 
-		if(!modified && !(playlist->scan_flags & PL_S_PARSE_ALL))
-			return 0;
+		if(!modified && !(scanner->mode & PL_S_PARSE_ALL))
+			return;
 	}
 
-	artist = title = album = NULL;
-	track = 0;
-	if((i3f = id3_file_open(file, ID3_FILE_MODE_READONLY)))
+	scan_queue_push(&scanner->parse_queue, scan_job_create((row != PL_NO_ROW ? SCAN_JOB_UPDATE : SCAN_JOB_INSERT), (row != PL_NO_ROW ? lib->ids[row] : 0), file, sb));
+}
+
+static void *scan_worker_main(void *arg)
+{
+	struct scanner *scanner = arg;
+	struct scan_job *job;
+
+	while((job = scan_queue_pop(&scanner->parse_queue)))
 	{
-		const struct id3_tag *tag = id3_file_tag(i3f);
-		const char *tmp;
-		artist = get_id3_entry(tag, ID3_FRAME_ARTIST);
-		title = get_id3_entry(tag, ID3_FRAME_TITLE);
-		album = get_id3_entry(tag, ID3_FRAME_ALBUM);
-		track = (tmp = get_id3_entry(tag, ID3_FRAME_TRACK)) ? atoi(tmp) : 0;
-		id3_file_close(i3f);
+		// After a failure we only drain the queue
+		if(scanner->failed || scan_read_file(job) != 0)
+		{
+			scan_job_free(job);
+			continue;
+		}
+
+		__sync_fetch_and_add(&scanner->progress->parsed, 1);
+		scan_queue_push(&scanner->write_queue, job);
 	}
 
-	duration = get_mp3_duration(file, sb);
-	if(!duration)
+	return NULL;
+}
+
+static void *scan_writer_main(void *arg)
+{
+	struct scanner *scanner = arg;
+	struct scan_job *pending[SCAN_JOB_TYPES] = { NULL }, *job;
+	unsigned int count[SCAN_JOB_TYPES] = { 0 };
+
+	while((job = scan_queue_pop(&scanner->write_queue)))
 	{
-		log_append(LOG_WARNING, "file %s has no duration, skipping", file);
-		MyFree(artist);
-		MyFree(title);
-		MyFree(album);
-		return 0;
+		if(scanner->failed)
+		{
+			scan_job_free(job);
+			continue;
+		}
+
+		job->next = pending[job->type];
+		pending[job->type] = job;
+		if(++count[job->type] < SCAN_BATCH_SIZE)
+			continue;
+
+		// Moves have to be stored first since a new file may reuse a moved file's old path
+		for(int type = 0; type <= (int)job->type; type++)
+		{
+			if(pending[type] && scan_write_batch(scanner, type, pending[type], count[type]))
+				scanner->failed = 1;
+			pending[type] = NULL;
+			count[type] = 0;
+		}
 	}
 
-	duration_secs = (uint16_t)round(mad_timer_count(*duration, MAD_UNITS_MILLISECONDS) / 1000.0);
-	if(duration_secs < 2)
+	for(int type = 0; type < SCAN_JOB_TYPES; type++)
 	{
-		log_append(LOG_WARNING, "file %s has an extremely short duration (%"PRIu16" secs), skipping", file, duration_secs);
-		MyFree(artist);
-		MyFree(title);
-		MyFree(album);
-		return 0;
+		if(pending[type] && !scanner->failed && scan_write_batch(scanner, type, pending[type], count[type]))
+			scanner->failed = 1;
+		for(struct scan_job *next; pending[type]; pending[type] = next)
+		{
+			next = pending[type]->next;
+			scan_job_free(pending[type]);
+		}
 	}
 
-	debug("new song: %s - %s - %02d - %s [%02u:%02u]", artist, album, track, title, duration_secs / 60, duration_secs % 60);
+	return NULL;
+}
+
+static int8_t scan_write_batch(struct scanner *scanner, enum scan_job_type type, struct scan_job *jobs, unsigned int count)
+{
+	struct playlist_scan_progress *progress = scanner->progress;
+	int8_t rc;
 
-	if(track)
+	rc = scan_write(scanner->conn, type, jobs);
+	if(rc == 0)
 	{
-		snprintf(trackbuf, sizeof(trackbuf), "%"PRIu8, track);
-		trackptr = trackbuf;
+		__sync_fetch_and_add(&progress->written, count);
+		if(type == SCAN_JOB_INSERT)
+			__sync_fetch_and_add(&progress->new_count, count);
+		else
+			__sync_fetch_and_add(&progress->updated_count, count);
 	}
-	else
+
+	for(struct scan_job *next; jobs; jobs = next)
 	{
-		trackptr = NULL;
+		next = jobs->next;
+		scan_job_free(jobs);
 	}
-	snprintf(durationbuf, sizeof(durationbuf), "%u", duration_secs);
-	snprintf(inodebuf, sizeof(inodebuf), "%lu", sb->st_ino);
-	snprintf(sizebuf, sizeof(sizebuf), "%ld", sb->st_size);
-	snprintf(mtimebuf, sizeof(mtimebuf), "%ld", sb->st_mtime);
 
-	if(node)
+	return rc;
+}
+
+// Reads tags and duration; returns non-zero if the file should be skipped
+static int8_t scan_read_file(struct scan_job *job)
+{
+	struct id3_file *i3f;
+	mad_timer_t duration;
+
+	if((i3f = id3_file_open(job->file, ID3_FILE_MODE_READONLY)))
 	{
-		char idbuf[16];
-		snprintf(idbuf, sizeof(idbuf), "%"PRIu32, node->id);
-		res = pgsql_query(conn, "UPDATE \
-						playlist_songs \
-					 SET \
-						artist = $2, \
-						album = $3, \
-						track = $4, \
-						title = $5, \
-						duration = $6, \
-						st_inode = $7, \
-						st_size = $8, \
-						st_mtime = $9 \
-					 WHERE \
-						id = $1",
-				  1, stringlist_build_n(9, idbuf, artist, album, trackptr, title, durationbuf, inodebuf, sizebuf, mtimebuf));
-		if(updated_count)
-			(*updated_count)++;
+		const struct id3_tag *tag = id3_file_tag(i3f);
+		char *tmp;
+		job->artist = get_id3_entry(tag, ID3_FRAME_ARTIST);
+		job->title = get_id3_entry(tag, ID3_FRAME_TITLE);
+		job->album = get_id3_entry(tag, ID3_FRAME_ALBUM);
+		if((tmp = get_id3_entry(tag, ID3_FRAME_TRACK)))
+		{
+			job->track = atoi(tmp);
+			free(tmp);
+		}
+		id3_file_close(i3f);
 	}
-	else
+
+	if(mp3_duration(job->file, &job->sb, &duration) != 0)
 	{
-		res = pgsql_query_bin(conn, "INSERT INTO playlist_songs \
-						(file, artist, album, track, title, duration, st_inode, st_size, st_mtime) \
-					     VALUES \
-						($1::bytea, $2, $3, $4, $5, $6, $7, $8, $9)",
-				  1, stringlist_build_n(9, file, artist, album, trackptr, title, durationbuf, inodebuf, sizebuf, mtimebuf), 1);
-		if(new_count)
-			(*new_count)++;
+		log_append(LOG_WARNING, "file %s has no duration, skipping", job->file);
+		return 1;
 	}
-	rc = res ? 0 : -1;
-	if(res)
-		pgsql_free(res);
-	MyFree(artist);
-	MyFree(title);
-	MyFree(album);
-	return rc;
+
+	job->duration = (uint16_t)round(mad_timer_count(duration, MAD_UNITS_MILLISECONDS) / 1000.0);
+	if(job->duration < 2)
+	{
+		log_append(LOG_WARNING, "file %s has an extremely short duration (%"PRIu16" secs), skipping", job->file, job->duration);
+		return 1;
+	}
+
+	debug("new song: %s - %s - %02d - %s [%02u:%02u]", job->artist, job->album, job->track, job->title, job->duration / 60, job->duration % 60);
+	return 0;
 }
 
-static const mad_timer_t *get_mp3_duration(const char *file, struct stat *sb)
+// Stores a list of jobs of the same type with a single statement; the columns are passed as arrays
+static int8_t scan_write(struct pgsql *conn, enum scan_job_type type, struct scan_job *jobs)
 {
-	static mad_timer_t duration;
-	int fd;
-	struct stat sb_;
-	void *filedata;
-	struct mad_stream stream;
-	struct mad_header header;
+	static const char *queries[SCAN_JOB_TYPES] = {
+		// SCAN_JOB_MOVE
+		"UPDATE playlist_songs p \
+		 SET file = u.file \
+		 FROM unnest($1::integer[], $2::bytea[]) AS u(id, file) \
+		 WHERE p.id = u.id",
+		// SCAN_JOB_UPDATE
+		"UPDATE playlist_songs p \
+		 SET artist = u.artist, album = u.album, track = u.track, title = u.title, duration = u.duration, \
+		     st_inode = u.st_inode, st_size = u.st_size, st_mtime = u.st_mtime \
+		 FROM unnest($1::integer[], $2::varchar[], $3::varchar[], $4::smallint[], $5::varchar[], $6::smallint[], \
+		             $7::integer[], $8::integer[], $9::integer[]) \
+		      AS u(id, artist, album, track, title, duration, st_inode, st_size, st_mtime) \
+		 WHERE p.id = u.id",
+		// SCAN_JOB_INSERT
+		"INSERT INTO playlist_songs \
+			(file, artist, album, track, title, duration, st_inode, st_size, st_mtime) \
+		 SELECT * FROM unnest($1::bytea[], $2::varchar[], $3::varchar[], $4::smallint[], $5::varchar[], $6::smallint[], \
+		                      $7::integer[], $8::integer[], $9::integer[])"
+	};
+	struct stringbuffer *columns[9];
+	struct stringlist *params;
+	unsigned int ncolumns = (type == SCAN_JOB_MOVE) ? 2 : 9;
+	PGresult *res;
 
-	duration = mad_timer_zero;
+	for(unsigned int i = 0; i < ncolumns; i++)
+		columns[i] = stringbuffer_create();
 
-	if((fd = open(file, O_RDONLY)) == -1)
+	for(struct scan_job *job = jobs; job; job = job->next)
 	{
-		log_append(LOG_WARNING, "open(%s) failed: %s", file, strerror(errno));
-		return NULL;
-	}
+		char buf[32];
+		unsigned int col = 0;
 
-	if(!sb)
-	{
-		sb = &sb_;
-		if(fstat(fd, sb) == -1)
+		if(type == SCAN_JOB_INSERT)
+			scan_array_append(columns[col++], job->file, 1);
+		else
 		{
-			log_append(LOG_ERROR, "fstat() failed: %s", strerror(errno));
-			return NULL;
+			snprintf(buf, sizeof(buf), "%"PRIu32, job->id);
+			scan_array_append(columns[col++], buf, 0);
 		}
+
+		if(type == SCAN_JOB_MOVE)
+		{
+			scan_array_append(columns[col++], job->file, 1);
+			continue;
+		}
+
+		scan_array_append(columns[col++], job->artist, 0);
+		scan_array_append(columns[col++], job->album, 0);
+		snprintf(buf, sizeof(buf), "%"PRIu8, job->track);
+		scan_array_append(columns[col++], (job->track ? buf : NULL), 0);
+		scan_array_append(columns[col++], job->title, 0);
+		snprintf(buf, sizeof(buf), "%"PRIu16, job->duration);
+		scan_array_append(columns[col++], buf, 0);
+		snprintf(buf, sizeof(buf), "%lu", job->sb.st_ino);
+		scan_array_append(columns[col++], buf, 0);
+		snprintf(buf, sizeof(buf), "%ld", job->sb.st_size);
+		scan_array_append(columns[col++], buf, 0);
+		snprintf(buf, sizeof(buf), "%ld", job->sb.st_mtime);
+		scan_array_append(columns[col++], buf, 0);
 	}
 
-	if(sb->st_size == 0)
+	params = stringlist_create();
+	for(unsigned int i = 0; i < ncolumns; i++)
 	{
-		log_append(LOG_WARNING, "file is empty");
-		return NULL;
+		stringbuffer_append_char(columns[i], '}');
+		stringlist_add(params, strdup(columns[i]->string));
+		stringbuffer_free(columns[i]);
 	}
 
-	if((filedata = mmap(0, sb->st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	if(!(res = pgsql_query(conn, queries[type], 1, params)))
+		return -1;
+	pgsql_free(res);
+	return 0;
+}
+
+// Appends a value to a PostgreSQL array literal; bytea values are hex-encoded
+static void scan_array_append(struct stringbuffer *sbuf, const char *value, int bytea)
+{
+	stringbuffer_append_char(sbuf, sbuf->len ? ',' : '{');
+	if(!value)
 	{
-		log_append(LOG_ERROR, "mmap() failed: %s", strerror(errno));
-		return NULL;
+		stringbuffer_append_string(sbuf, "NULL");
+		return;
 	}
 
-	mad_stream_init(&stream);
-	mad_header_init(&header);
-	mad_stream_buffer(&stream, filedata, sb->st_size);
-
-	while(1)
+	stringbuffer_append_char(sbuf, '"');
+	if(bytea)
+	{
+		stringbuffer_append_string(sbuf, "\\\\x");
+		for(const unsigned char *c = (const unsigned char *)value; *c; c++)
+			stringbuffer_append_printf(sbuf, "%02x", *c);
+	}
+	else
 	{
-		if(mad_header_decode(&header, &stream) == -1)
+		for(const char *c = value; *c; c++)
 		{
-			if(MAD_RECOVERABLE(stream.error))
-				continue;
-			else
-				break;
+			if(*c == '"' || *c == '\\')
+				stringbuffer_append_char(sbuf, '\\');
+			stringbuffer_append_char(sbuf, *c);
 		}
-
-		mad_timer_add(&duration, header.duration);
 	}
+	stringbuffer_append_char(sbuf, '"');
+}
+
+static struct scan_job *scan_job_create(enum scan_job_type type, uint32_t id, const char *file, struct stat *sb)
+{
+	struct scan_job *job = malloc(sizeof(struct scan_job));
+	memset(job, 0, sizeof(struct scan_job));
+	job->type = type;
+	job->id = id;
+	job->file = strdup(file);
+	job->sb = *sb;
+	return job;
+}
+
+static void scan_job_free(struct scan_job *job)
+{
+	free(job->file);
+	MyFree(job->artist);
+	MyFree(job->album);
+	MyFree(job->title);
+	free(job);
+}
+
+static void scan_queue_init(struct scan_queue *queue, unsigned int limit)
+{
+	memset(queue, 0, sizeof(struct scan_queue));
+	queue->limit = limit;
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+}
+
+static void scan_queue_destroy(struct scan_queue *queue)
+{
+	assert(!queue->head);
+	pthread_mutex_destroy(&queue->mutex);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+}
+
+// Blocks while the queue is full
+static void scan_queue_push(struct scan_queue *queue, struct scan_job *job)
+{
+	job->next = NULL;
+	pthread_mutex_lock(&queue->mutex);
+	while(queue->count >= queue->limit)
+		pthread_cond_wait(&queue->not_full, &queue->mutex);
+
+	if(queue->tail)
+		queue->tail->next = job;
+	else
+		queue->head = job;
+	queue->tail = job;
+	queue->count++;
 
-	mad_header_finish(&header);
-	mad_stream_finish(&stream);
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+// Blocks until a job is available; returns NULL once the queue is closed and empty
+static struct scan_job *scan_queue_pop(struct scan_queue *queue)
+{
+	struct scan_job *job;
+
+	pthread_mutex_lock(&queue->mutex);
+	while(!queue->head && !queue->closed)
+		pthread_cond_wait(&queue->not_empty, &queue->mutex);
+
+	if((job = queue->head))
+	{
+		if(!(queue->head = job->next))
+			queue->tail = NULL;
+		queue->count--;
+		job->next = NULL;
+		pthread_cond_signal(&queue->not_full);
+	}
 
-	munmap(filedata, sb->st_size);
-	close(fd);
+	pthread_mutex_unlock(&queue->mutex);
+	return job;
+}
 
-	return &duration;
+static void scan_queue_close(struct scan_queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->mutex);
 }
 
 static char *get_id3_entry(const struct id3_tag *tag, const char *id)
@@ -965,3 +1689,315 @@ static const char *make_absolute_path(const char *relative)
 	MyFree(relative_dup2);
 	return ret;
 }
+
+
+/* testing */
+#ifdef PLAYLIST_TEST
+#include <sys/time.h>
+
+#define TEST_DIR	"playlist_test"
+#define TEST_DIRS	100
+#define TEST_FILES	100000
+#define TEST_ARTISTS	5000
+#define TEST_GENRES	8
+#define TEST_PROBES	1000
+
+static unsigned int test_failures;
+
+// Milliseconds since start
+static double test_elapsed(const struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_usec - start->tv_usec) / 1000.0;
+}
+
+static void test_file_name(char *buf, size_t size, const char *root, uint32_t i)
+{
+	snprintf(buf, size, "%s/%02u/%06u.mp3", root, i / (TEST_FILES / TEST_DIRS), i);
+}
+
+// Creates TEST_FILES empty mp3 files and a library which already knows all of them
+static struct playlist_library *test_create_tree(const char *root)
+{
+	struct playlist_library *lib;
+	char path[PATH_MAX], buf[32];
+
+	lib = malloc(sizeof(struct playlist_library));
+	memset(lib, 0, sizeof(struct playlist_library));
+	lib->loaded = now;
+
+	mkdir(root, 0755);
+	for(uint32_t i = 0; i < TEST_FILES; i++)
+	{
+		struct stat sb;
+		uint32_t row;
+		int fd;
+
+		if(i % (TEST_FILES / TEST_DIRS) == 0)
+		{
+			snprintf(path, sizeof(path), "%s/%02u", root, i / (TEST_FILES / TEST_DIRS));
+			mkdir(path, 0755);
+		}
+
+		test_file_name(path, sizeof(path), root, i);
+		if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || fstat(fd, &sb) == -1)
+		{
+			log_append(LOG_ERROR, "playlist test: could not create %s: %s", path, strerror(errno));
+			if(fd != -1)
+				close(fd);
+			library_free(lib);
+			return NULL;
+		}
+		close(fd);
+
+		row = library_add_row(lib);
+		lib->ids[row] = i + 1;
+		lib->files[row] = library_add_string(lib, path);
+		snprintf(buf, sizeof(buf), "Artist %u", i % TEST_ARTISTS);
+		lib->artists[row] = library_add_string(lib, buf);
+		lib->albums[row] = PL_NO_STRING;
+		snprintf(buf, sizeof(buf), "Title %u", i);
+		lib->titles[row] = library_add_string(lib, buf);
+		lib->tracks[row] = 0;
+		lib->durations[row] = 180 + i % 120;
+		lib->jingles[row] = 0;
+		lib->promos[row] = 0;
+		lib->nightonly[row] = 0;
+		lib->last_votes[row] = 0;
+		lib->inodes[row] = sb.st_ino;
+		lib->sizes[row] = sb.st_size;
+		lib->mtimes[row] = sb.st_mtime;
+	}
+
+	lib->blacklist = calloc(BITSET_WORDS(lib->count), sizeof(uint64_t));
+	for(int type = 0; type < PL_IDX_COUNT; type++)
+		library_build_index(lib, type);
+	library_group_artists(lib);
+
+	// Genres 1 to TEST_GENRES take turns
+	for(uint32_t row = 0; row < lib->count; row++)
+	{
+		uint8_t genre_id = 1 + row % TEST_GENRES;
+		if(!lib->genres[genre_id])
+			lib->genres[genre_id] = calloc(BITSET_WORDS(lib->count), sizeof(uint64_t));
+		BIT_SET(lib->genres[genre_id], row);
+	}
+	return lib;
+}
+
+static void test_remove_tree(const char *root)
+{
+	char path[PATH_MAX];
+
+	for(uint32_t i = 0; i < TEST_FILES; i++)
+	{
+		test_file_name(path, sizeof(path), root, i);
+		unlink(path);
+	}
+
+	for(uint32_t i = 0; i < TEST_DIRS; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%02u", root, i);
+		rmdir(path);
+	}
+	rmdir(root);
+}
+
+// Rescans a tree the library already knows and times the lookups every scanned file needs
+static void test_scan(struct playlist_library *lib, const char *root)
+{
+	struct playlist_scan_progress progress;
+	struct timeval start;
+	struct stat sb;
+	uint32_t found;
+	double ms;
+
+	// Nothing has changed, so nothing may be parsed or written
+	memset(&progress, 0, sizeof(progress));
+	gettimeofday(&start, NULL);
+	if(playlist_scan_tree(root, NULL, lib, 0, 4, &progress) || progress.found != TEST_FILES || progress.parsed || progress.written)
+	{
+		log_append(LOG_ERROR, "playlist test: rescan found %"PRIu32" files, parsed %"PRIu32" and wrote %"PRIu32,
+			   progress.found, progress.parsed, progress.written);
+		test_failures++;
+	}
+	debug("benchmark: rescan of %"PRIu32" unchanged files in %.0f ms", progress.found, test_elapsed(&start));
+
+	found = 0;
+	gettimeofday(&start, NULL);
+	for(uint32_t row = 0; row < lib->count; row++)
+		found += (library_find_file(lib, lib->arena + lib->files[row]) == row);
+	ms = test_elapsed(&start);
+
+	gettimeofday(&start, NULL);
+	for(uint32_t row = 0; row < lib->count; row++)
+		found += (library_find_id(lib, lib->ids[row]) == row);
+	debug("benchmark: file index %.0f ns, id index %.0f ns per lookup", ms * 1e6 / lib->count, test_elapsed(&start) * 1e6 / lib->count);
+
+	memset(&sb, 0, sizeof(sb));
+	gettimeofday(&start, NULL);
+	for(uint32_t row = 0; row < lib->count; row++)
+	{
+		sb.st_ino = lib->inodes[row];
+		sb.st_size = lib->sizes[row];
+		sb.st_mtime = lib->mtimes[row];
+		found += (library_find_stat(lib, &sb) == row);
+	}
+	debug("benchmark: inode index %.0f ns per lookup", test_elapsed(&start) * 1e6 / lib->count);
+
+	if(found != 3 * lib->count || library_find_file(lib, "/nonexistent.mp3") != PL_NO_ROW || library_find_id(lib, TEST_FILES + 1) != PL_NO_ROW)
+	{
+		log_append(LOG_ERROR, "playlist test: %"PRIu32" of %"PRIu32" index lookups found the right row", found, 3 * lib->count);
+		test_failures++;
+	}
+
+	// Without the path index every scanned file walked all songs with strcmp()
+	found = 0;
+	gettimeofday(&start, NULL);
+	for(uint32_t i = 0; i < TEST_PROBES; i++)
+	{
+		uint32_t row = mt_rand(0, lib->count - 1), other;
+		const char *file = lib->arena + lib->files[row];
+
+		for(other = 0; other < lib->count; other++)
+		{
+			if(!strcmp(lib->arena + lib->files[other], file))
+				break;
+		}
+		found += (other == row);
+	}
+	ms = test_elapsed(&start);
+	if(found != TEST_PROBES)
+	{
+		log_append(LOG_ERROR, "playlist test: linear search found %"PRIu32" of %u rows", found, TEST_PROBES);
+		test_failures++;
+	}
+	debug("benchmark: linear search %.1f us per lookup, %.1f s for a rescan", ms * 1000 / TEST_PROBES, ms * lib->count / TEST_PROBES / 1000);
+}
+
+// Checks that a playlist holds every row matching the genre exactly once
+static void test_check_order(const struct playlist *playlist, uint8_t genre_id, const char *what)
+{
+	const struct playlist_library *lib = playlist->library;
+	uint64_t *seen = calloc(BITSET_WORDS(lib->count), sizeof(uint64_t));
+	uint32_t expected = 0, wrong = 0;
+
+	for(uint32_t row = 0; row < lib->count; row++)
+		expected += (!genre_id || BIT_TEST(lib->genres[genre_id], row));
+
+	for(uint32_t i = 0; i < playlist->count; i++)
+	{
+		uint32_t row = playlist->order[i];
+		if(BIT_TEST(seen, row) || (genre_id && !BIT_TEST(lib->genres[genre_id], row)))
+			wrong++;
+		BIT_SET(seen, row);
+	}
+
+	if(wrong || playlist->count != expected)
+	{
+		log_append(LOG_ERROR, "playlist test: %s has %"PRIu32" rows, %"PRIu32" of them wrong; expected %"PRIu32, what, playlist->count, wrong, expected);
+		test_failures++;
+	}
+	free(seen);
+}
+
+// Loads, shuffles and plays playlists over the library without touching the database
+static void test_playlists(struct playlist_library *lib)
+{
+	struct playlist *playlist, *genre;
+	struct playlist_pick pick;
+	struct playlist_node *node;
+	struct timeval start;
+	uint32_t ids[10], picked, wrong = 0, in_order = 0;
+	double ms;
+
+	// The library is now shared; playlist_library_invalidate() frees it
+	pthread_mutex_lock(&library_mutex);
+	library = lib;
+	lib->refcount = 1;
+	pthread_mutex_unlock(&library_mutex);
+
+	gettimeofday(&start, NULL);
+	playlist = playlist_load(NULL, 0, PL_L_RANDOMIZE);
+	debug("benchmark: loading and shuffling %"PRIu32" songs in %.2f ms", playlist->count, test_elapsed(&start));
+	test_check_order(playlist, 0, "shuffled playlist");
+	for(uint32_t i = 1; i < playlist->count; i++)
+		in_order += (playlist->order[i] == playlist->order[i - 1] + 1);
+	if(in_order > playlist->count / 100)
+	{
+		log_append(LOG_ERROR, "playlist test: %"PRIu32" songs still follow their predecessor after shuffling", in_order);
+		test_failures++;
+	}
+
+	gettimeofday(&start, NULL);
+	genre = playlist_load(NULL, 3, PL_L_RANDOMIZE);
+	debug("benchmark: switching to a genre with %"PRIu32" songs in %.2f ms", genre->count, test_elapsed(&start));
+	test_check_order(genre, 3, "genre playlist");
+
+	// Blacklisting is seen by every playlist and skipped by next()
+	for(uint32_t row = 0; row < lib->count; row += 10)
+		BIT_SET_ATOMIC(lib->blacklist, row);
+
+	gettimeofday(&start, NULL);
+	for(uint32_t i = 0; i < lib->count; i++)
+	{
+		if(!(node = playlist->next(playlist)) || node->blacklist || node != playlist->cur)
+			wrong++;
+	}
+	ms = test_elapsed(&start);
+	debug("benchmark: next() %.0f ns per song with 10%% blacklisted", ms * 1e6 / lib->count);
+
+	memset(&pick, 0, sizeof(pick));
+	pick.flags = PL_P_GENRE | PL_P_DISTINCT_ARTIST;
+	gettimeofday(&start, NULL);
+	picked = genre->pick(genre, &pick, ids, ArraySize(ids));
+	debug("benchmark: picking %"PRIu32" songs of distinct artists from a genre in %.2f ms", picked, test_elapsed(&start));
+
+	for(uint32_t i = 0; i < picked; i++)
+	{
+		uint32_t row = library_find_id(lib, ids[i]);
+		if(row == PL_NO_ROW || BIT_TEST(lib->blacklist, row) || !BIT_TEST(lib->genres[3], row))
+			wrong++;
+		for(uint32_t j = 0; row != PL_NO_ROW && j < i; j++)
+			wrong += (lib->artist_ids[library_find_id(lib, ids[j])] == lib->artist_ids[row]);
+	}
+
+	if(wrong || picked != ArraySize(ids))
+	{
+		log_append(LOG_ERROR, "playlist test: next() and pick() returned %"PRIu32" wrong songs, pick() %"PRIu32" of %u songs", wrong, picked, (unsigned int)ArraySize(ids));
+		test_failures++;
+	}
+
+	genre->free(genre);
+	playlist->free(playlist);
+	playlist_library_invalidate();
+}
+
+void playlist_run_test()
+{
+	struct playlist_library *lib;
+	struct timeval start;
+	char cwd[PATH_MAX], root[PATH_MAX];
+
+	debug("PLAYLIST TEST");
+	if(!getcwd(cwd, sizeof(cwd)))
+		return;
+	snprintf(root, sizeof(root), "%s/" TEST_DIR, cwd);
+
+	gettimeofday(&start, NULL);
+	if(!(lib = test_create_tree(root)))
+	{
+		test_remove_tree(root);
+		return;
+	}
+	debug("benchmark: created %u files in %.0f ms", TEST_FILES, test_elapsed(&start));
+
+	test_scan(lib, root);
+	test_playlists(lib);
+
+	test_remove_tree(root);
+	debug("PLAYLIST TEST END: %u failures", test_failures);
+}
+#endif
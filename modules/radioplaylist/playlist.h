@@ -15,9 +15,30 @@ enum playlist_load_flags
 {
 	PL_L_RANDOMIZE	= 0x01, // load playlist in random order
 	PL_L_ALL	= 0x02, // load everything, including blacklisted files
-	PL_L_RANDOMGENRE= 0x04  // load random genre
+	PL_L_RANDOMGENRE= 0x04, // load random genre
+	PL_L_RELOAD	= 0x08  // reload the song library from the database
 };
 
+enum playlist_pick_flags
+{
+	PL_P_GENRE		= 0x01, // only songs from the playlist's genre
+	PL_P_PROMO		= 0x02, // only promo songs
+	PL_P_JINGLE		= 0x04, // only jingles
+	PL_P_NIGHT		= 0x08, // also songs which may only be played at night
+	PL_P_DISTINCT_ARTIST	= 0x10  // at most one song per artist
+};
+
+enum playlist_index_type
+{
+	PL_IDX_FILE,
+	PL_IDX_ID,
+	PL_IDX_INODE, // inode, size and mtime
+	PL_IDX_COUNT
+};
+
+#define PL_NO_ROW	UINT32_MAX
+#define PL_NO_STRING	UINT32_MAX
+
 struct playlist_node
 {
 	uint32_t id;
@@ -41,21 +62,89 @@ struct playlist_node
 	struct playlist_node *next;
 };
 
+// Open addressing hash table mapping keys to library rows (stored as row + 1, 0 = empty)
+struct playlist_index
+{
+	uint32_t size; // power of two
+	uint32_t *rows;
+};
+
+// All songs from the database, stored as one array per column. Strings are
+// offsets into a single arena. A library is immutable after loading except for
+// the blacklist bits; playlists for different genres share the same library.
+struct playlist_library
+{
+	uint32_t count;
+	uint32_t size;
+	unsigned int refcount;
+	time_t loaded;
+
+	uint32_t *ids;
+	uint16_t *durations;
+	uint8_t *tracks;
+	uint8_t *jingles;
+	uint8_t *promos;
+	uint8_t *nightonly;
+	int32_t *last_votes;
+	uint32_t *artist_ids;	// rows with the same artist share the same id
+	uint32_t artist_count;
+	uint32_t *inodes;
+	int32_t *sizes;
+	int32_t *mtimes;
+	uint32_t *files;
+	uint32_t *artists;
+	uint32_t *albums;
+	uint32_t *titles;
+
+	char *arena;
+	size_t arena_len;
+	size_t arena_size;
+
+	uint64_t *blacklist;		// bitset over the rows
+	uint64_t *genres[256];		// one bitset per genre id, NULL if the genre has no songs
+
+	struct playlist_index index[PL_IDX_COUNT];
+};
+
+// Updated atomically by the scanner threads while a scan is running
+struct playlist_scan_progress
+{
+	uint32_t found;		// mp3 files found
+	uint32_t parsed;	// files whose tags and duration have been read
+	uint32_t written;	// rows inserted or updated
+	uint32_t new_count;
+	uint32_t updated_count;
+};
+
+// Returns non-zero if a song may be picked
+typedef uint8_t (playlist_filter_f)(uint32_t id, const char *artist, const char *album, void *ctx);
+
+struct playlist_pick
+{
+	uint8_t flags;			// PL_P_*
+	int32_t last_vote_before;	// only songs which were not in a song vote since then, 0 to disable
+	playlist_filter_f *filter;
+	void *ctx;
+};
+
 struct playlist
 {
 	struct pgsql *conn;
+	struct playlist_library *library;
 
 	struct playlist_node *queue;
 	struct playlist_node *queue_cur;
-	struct playlist_node *head;
-	struct playlist_node *tail;
 	struct playlist_node *cur;
 	struct playlist_node *next_random;
 	struct playlist_node *next_random_cur;
+	struct playlist_node cur_node; // strings point into the library
+
+	uint32_t *order; // library rows in playing order
 	uint32_t count;
+	uint32_t pos;
+	uint8_t started;
 
 	uint8_t load_flags;
-	uint8_t scan_flags;
 	uint8_t genre_id;
 
 	void (*free)(struct playlist *playlist);
@@ -71,10 +160,21 @@ struct playlist
 	void (*enqueue)(struct playlist *playlist, struct playlist_node *node);
 	void (*enqueue_first)(struct playlist *playlist, struct playlist_node *node);
 	void (*prepare)(struct playlist *playlist, struct playlist_node *node);
+	unsigned int (*upcoming)(struct playlist *playlist, const char **files, unsigned int count);
+	// Picks up to count random songs matching pick and stores their ids
+	unsigned int (*pick)(struct playlist *playlist, const struct playlist_pick *pick, uint32_t *ids, unsigned int count);
+	void (*set_last_vote)(struct playlist *playlist, uint32_t id, int32_t ts);
 };
 
-int8_t playlist_scan(const char *path, struct pgsql *conn, uint8_t mode, uint32_t *new_count, uint32_t *updated_count);
+int8_t playlist_scan(const char *path, struct pgsql *conn, uint8_t mode, uint8_t threads, struct playlist_scan_progress *progress);
 int8_t playlist_add_file(const char *file, struct pgsql *conn, struct stat *sb);
 struct playlist *playlist_load(struct pgsql *conn, uint8_t genre_id, uint8_t flags);
+void playlist_library_invalidate();
+// Hashes for the library indexes, also used by the play history
+uint32_t playlist_hash_str(const char *str);
+uint32_t playlist_hash_int(uint32_t value);
+#ifdef PLAYLIST_TEST
+void playlist_run_test();
+#endif
 
 #endif
@@ -17,6 +17,11 @@
 #include "timer.h"
 
 #include "playlist.h"
+#include "cache.h"
+#include "history.h"
+#include "mp3info.h"
+#include "pcm.h"
+#include "ring.h"
 
 #include <pthread.h>
 #include <sys/mman.h>
@@ -26,16 +31,84 @@
 #include <shout/shout.h>
 
 
+// Worst case size of lame's output for one frame or a flush
+#define STREAM_MP3_BLOCK_SIZE	(1152 * 5 / 4 + 7200)
+
+enum stream_block_type {
+	STREAM_BLOCK_SONG_START,	// reinit lame if the sample rate changed, set metadata
+	STREAM_BLOCK_DATA,
+	STREAM_BLOCK_MP3,		// mp3 frames from a passthrough song
+	STREAM_BLOCK_SONG_END,		// flush lame
+	STREAM_BLOCK_EOS		// stream is being closed; stage thread exits
+};
+
+enum stream_passthrough_mode {
+	STREAM_PASSTHROUGH_OFF,
+	STREAM_PASSTHROUGH_ON,
+	STREAM_PASSTHROUGH_VERIFY	// decode passthrough songs both ways before sending them
+};
+
+enum stream_stage {
+	STREAM_STAGE_DECODER,
+	STREAM_STAGE_ENCODER,
+	STREAM_STAGE_SENDER,
+	STREAM_STAGES
+};
+
+// decoder -> encoder
+struct stream_pcm_block {
+	enum stream_block_type type;
+	unsigned int samplerate;
+	unsigned short channels;
+	unsigned short length;
+	uint8_t passthrough;
+	shout_metadata_t *meta;
+	union {
+		float samples[2][1152];
+		unsigned char mp3[STREAM_MP3_BLOCK_SIZE];
+	};
+};
+
+// encoder -> sender
+struct stream_mp3_block {
+	enum stream_block_type type;
+	shout_metadata_t *meta;
+	size_t length;
+	unsigned char data[STREAM_MP3_BLOCK_SIZE];
+};
+
 struct stream_ctx {
 	// reset for each song
 	unsigned char const *start;
 	unsigned long length;
 	unsigned int samplerate;
+	uint8_t passthrough;
 	// kept between songs
 	shout_metadata_t *meta;
 	lame_t lame;
 	shout_t *shout;
 	unsigned int last_samplerate;
+	uint8_t last_passthrough; // only used by the encoder
+	// pipeline; the decoder runs in the stream thread
+	struct ring *pcm_ring;
+	struct ring *mp3_ring;
+	pthread_t encoder_thread;
+	pthread_t sender_thread;
+	volatile uint8_t send_failed;
+	uint64_t cpu_last[STREAM_STAGES]; // each slot only touched by its stage's thread
+};
+
+struct stream_stats {
+	struct ring *pcm_ring;
+	struct ring *mp3_ring;
+	uint64_t cpu_usec[STREAM_STAGES]; // updated by the stage threads with atomic adds
+};
+
+struct song_change_stats {
+	uint64_t last_usec;
+	uint64_t max_usec;
+	uint64_t total_usec;
+	uint32_t count;
 };
 
 struct stream_state {
@@ -62,8 +135,10 @@ struct scan_state {
 	char *path;
 	char *nick;
 	int8_t rc;
-	uint32_t new_count;
-	uint32_t updated_count;
+	uint8_t threads;
+	struct playlist_scan_progress progress;
+	time_t started;
+	time_t last_report;
 };
 
 struct genre_vote_genre {
@@ -134,6 +209,8 @@ static uint8_t should_play_promo();
 static uint8_t should_play_jingle();
 static void songvote_stream_song_changed();
 static void prepare_new_song();
+static uint8_t is_night();
+static time_t history_max_age();
 static void songvote_free();
 static void songvote_reset();
 static void songvote_finish(void *bound, void *data);
@@ -157,9 +234,21 @@ static enum mad_flow input_cb(void *data, struct mad_stream *stream);
 static enum mad_flow output_cb(void *data, struct mad_header const *header, struct mad_pcm *pcm);
 static enum mad_flow error_cb(void *data, struct mad_stream *stream, struct mad_frame *frame);
 static int decode_mp3(struct stream_ctx *stream);
+static uint8_t stream_passthrough_range(const unsigned char *data, size_t len, size_t *start, size_t *end);
+static uint8_t stream_passthrough_verify(const unsigned char *data, size_t len, size_t start, size_t end);
+static void stream_passthrough(struct stream_ctx *stream, const unsigned char *data, size_t len);
+static enum mad_flow stream_check_state(struct stream_ctx *stream);
+static int stream_cache_skip(const unsigned char *data, size_t len);
+static void *stream_encoder_main(void *arg);
+static void *stream_sender_main(void *arg);
+static void stream_push_event(struct stream_ctx *stream, enum stream_block_type type, shout_metadata_t *meta);
+static uint64_t stream_thread_cpu_usec();
+static void stream_update_cpu(struct stream_ctx *stream, enum stream_stage stage);
 
 static struct module *this;
 static struct stream_state stream_state;
+static struct stream_stats stream_stats;
+static struct song_change_stats song_change_stats;
 static struct scan_state scan_state;
 static struct genre_vote genre_vote;
 static struct song_vote song_vote;
@@ -201,8 +290,8 @@ static struct {
 	uint8_t songvote_disable_inactive;
 	uint8_t songvote_songs;
 	uint16_t songvote_block_duration;
-	const char *songvote_block_artist_interval;
-	const char *songvote_block_album_interval;
+	time_t songvote_block_artist_interval;
+	time_t songvote_block_album_interval;
 
 	struct {
 		uint16_t min_delay;
@@ -211,8 +300,8 @@ static struct {
 		uint8_t chance_early;
 		uint8_t chance_late;
 		uint16_t delay_after_jingle;
-		const char *block_song_interval;
-		const char *block_artist_interval;
+		time_t block_song_interval;
+		time_t block_artist_interval;
 	} promo;
 
 	struct {
@@ -222,8 +311,14 @@ static struct {
 		uint8_t chance_early;
 		uint8_t chance_late;
 		uint16_t delay_after_promo;
-		const char *block_song_interval;
+		time_t block_song_interval;
 	} jingles;
+
+	uint8_t scan_threads;
+	uint16_t scan_report_interval;
+	uint16_t stream_buffer_frames;
+	enum stream_passthrough_mode stream_passthrough;
+	uint8_t cache_prefetch;
 } radioplaylist_conf;
 
 MODULE_DEPENDS("commands", "sharedmem", "pgsql", "help", "tools", NULL);
@@ -241,6 +336,15 @@ MODULE_INIT
 	pthread_mutex_init(&stream_state_mutex, NULL);
 	pthread_mutex_init(&conf_mutex, NULL);
 
+	pcm_init();
+	cache_init(stream_cache_skip);
+	history_init();
+
+#ifdef PLAYLIST_TEST
+	mp3_run_test();
+	playlist_run_test();
+#endif
+
 	reg_conf_reload_func(conf_reload_hook);
 	conf_reload_hook(); // Loads the playlist
 
@@ -292,12 +396,14 @@ MODULE_FINI
 	debug("waiting for stream thread to finish");
 	pthread_join(stream_thread, NULL);
 	debug("stream thread finished");
+	cache_fini();
 
 	if(stream_state.playlist)
 		stream_state.playlist->free(stream_state.playlist);
 
 	if(pg_conn)
 		pgsql_fini(pg_conn);
+	history_fini();
 
 	unreg_loop_func(check_song_changed);
 	unreg_irc_handler("JOIN", join);
@@ -547,6 +653,26 @@ COMMAND(playlist_status)
 	else
 		reply("Playlist ist aktiv: unknown [%02u:%02u/%02u:%02u]", elapsed / 60, elapsed % 60, duration / 60, duration % 60);
 
+	pthread_mutex_lock(&stream_state_mutex);
+	if(stream_stats.pcm_ring && stream_stats.mp3_ring)
+	{
+		reply("Puffer: PCM %u/%u, MP3 %u/%u Frames; CPU-Zeit: Decoder %.1fs, Encoder %.1fs, Sender %.1fs",
+		      ring_fill(stream_stats.pcm_ring), stream_stats.pcm_ring->size,
+		      ring_fill(stream_stats.mp3_ring), stream_stats.mp3_ring->size,
+		      __sync_fetch_and_add(&stream_stats.cpu_usec[STREAM_STAGE_DECODER], 0) / 1000000.0,
+		      __sync_fetch_and_add(&stream_stats.cpu_usec[STREAM_STAGE_ENCODER], 0) / 1000000.0,
+		      __sync_fetch_and_add(&stream_stats.cpu_usec[STREAM_STAGE_SENDER], 0) / 1000000.0);
+	}
+	pthread_mutex_unlock(&stream_state_mutex);
+
+	if(song_change_stats.count)
+	{
+		reply("Songwechsel: zuletzt %.1f ms, Durchschnitt %.1f ms, Maximum %.1f ms (%"PRIu32" Songs)",
+		      song_change_stats.last_usec / 1000.0,
+		      song_change_stats.total_usec / 1000.0 / song_change_stats.count,
+		      song_change_stats.max_usec / 1000.0,
+		      song_change_stats.count);
+	}
 
 	if(stream_state.playlist->genre_id)
 	{
@@ -757,7 +883,7 @@ COMMAND(playlist_reload)
 		pgsql_free(res);
 	}
 
-	if(!(playlist = playlist_load(pg_conn, genre_id, PL_L_RANDOMIZE)))
+	if(!(playlist = playlist_load(pg_conn, genre_id, PL_L_RANDOMIZE | PL_L_RELOAD)))
 	{
 		reply("Playlist konnte nicht geladen werden");
 		MyFree(genre);
@@ -870,6 +996,8 @@ COMMAND(playlist_scan)
 	scan_state.mode = mode;
 	scan_state.path = path;
 	scan_state.nick = strdup(src->nick);
+	scan_state.threads = radioplaylist_conf.scan_threads;
+	scan_state.started = scan_state.last_report = now;
 
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -884,6 +1012,7 @@ COMMAND(playlist_check)
 {
 	struct pgsql *conn;
 	int8_t rc;
+	struct playlist_scan_progress progress;
 	uint32_t count;
 
 	if(!(conn = pgsql_init(radioplaylist_conf.db_conn_string)))
@@ -893,7 +1022,8 @@ COMMAND(playlist_check)
 	}
 
 	pgsql_begin(conn);
-	rc = playlist_scan(NULL, conn, PL_S_REMOVE_MISSING, NULL, &count);
+	rc = playlist_scan(NULL, conn, PL_S_REMOVE_MISSING, 0, &progress);
+	count = progress.updated_count;
 	if(rc != 0)
 	{
 		pgsql_rollback(conn);
@@ -931,7 +1061,7 @@ COMMAND(playlist_truncate)
 	}
 
 	pgsql_begin(conn);
-	rc = playlist_scan(NULL, conn, PL_S_TRUNCATE, NULL, NULL);
+	rc = playlist_scan(NULL, conn, PL_S_TRUNCATE, 0, NULL);
 	if(rc >= 0)
 	{
 		pgsql_commit(conn);
@@ -1299,42 +1429,27 @@ static uint8_t should_play_jingle()
 
 static void prepare_new_song()
 {
-	char idbuf[16], tsbuf[16], querybuf[1024];
-	PGresult *res;
-	int num_rows;
+	struct playlist_pick pick;
+	struct history_filter filter;
 	uint8_t has_promo = 0, has_jingle = 0;
 	uint32_t song_id;
 	struct playlist_node *node;
 
-	snprintf(idbuf, sizeof(idbuf), "%"PRIu8, stream_state.playlist->genre_id);
-	snprintf(tsbuf, sizeof(tsbuf), "%lu", (unsigned long)(now - radioplaylist_conf.songvote_block_duration));
+	memset(&pick, 0, sizeof(pick));
+	memset(&filter, 0, sizeof(filter));
+	pick.filter = history_filter;
+	pick.ctx = &filter;
+	if(is_night())
+		pick.flags |= PL_P_NIGHT;
 
 	if(should_play_promo())
 	{
-		snprintf(querybuf, sizeof(querybuf), "\
-			SELECT * FROM ( \
-				SELECT DISTINCT ON (s.artist) s.id \
-				FROM playlist_song_genres sg \
-				JOIN playlist_songs s ON (s.id = sg.song_id) \
-				WHERE s.promo AND not s.blacklist AND s.last_vote < $2 AND sg.genre_id = $1 AND (not s.nightonly OR is_night()) AND NOT EXISTS ( \
-					SELECT song_id \
-					FROM playlist_history \
-					WHERE ts >= (now() at time zone 'UTC') - interval '%s' AND song_id = s.id \
-				) AND NOT EXISTS ( \
-					SELECT h.song_id \
-					FROM playlist_history h \
-					JOIN playlist_songs s2 ON (s2.id = h.song_id) \
-					WHERE h.ts >= (now() at time zone 'UTC') - interval '%s' AND s2.artist = s.artist \
-				) \
-				ORDER BY s.artist, random() \
-			) _anon \
-			ORDER BY random()", radioplaylist_conf.promo.block_song_interval, radioplaylist_conf.promo.block_artist_interval);
-		res = pgsql_query(pg_conn, querybuf, 1, stringlist_build_n(2, idbuf, tsbuf));
-		if(!res || !(num_rows = pgsql_num_rows(res)))
-		{
-			log_append(LOG_WARNING, "Could not load promo song (res=%p, rows=%d)", res, res ? num_rows : -1);
-			pgsql_free(res);
-		}
+		pick.flags |= PL_P_PROMO | PL_P_GENRE | PL_P_DISTINCT_ARTIST;
+		pick.last_vote_before = now - radioplaylist_conf.songvote_block_duration;
+		filter.song_since = now - radioplaylist_conf.promo.block_song_interval;
+		filter.artist_since = now - radioplaylist_conf.promo.block_artist_interval;
+		if(!stream_state.playlist->pick(stream_state.playlist, &pick, &song_id, 1))
+			log_append(LOG_WARNING, "Could not load promo song");
 		else
 		{
 			has_promo = 1;
@@ -1344,21 +1459,12 @@ static void prepare_new_song()
 
 	if(!has_promo && should_play_jingle())
 	{
-		snprintf(querybuf, sizeof(querybuf), "\
-				SELECT s.id \
-				FROM playlist_songs s \
-				WHERE s.jingle AND not s.blacklist AND (not s.nightonly OR is_night()) AND NOT EXISTS ( \
-					SELECT song_id \
-					FROM playlist_history \
-					WHERE ts >= (now() at time zone 'UTC') - interval '%s' AND song_id = s.id \
-				) \
-				ORDER BY random()", radioplaylist_conf.jingles.block_song_interval);
-		res = pgsql_query(pg_conn, querybuf, 1, NULL);
-		if(!res || !(num_rows = pgsql_num_rows(res)))
-		{
-			log_append(LOG_WARNING, "Could not load jingle song (res=%p, rows=%d)", res, res ? num_rows : -1);
-			pgsql_free(res);
-		}
+		pick.flags = (pick.flags & PL_P_NIGHT) | PL_P_JINGLE;
+		pick.last_vote_before = 0;
+		memset(&filter, 0, sizeof(filter));
+		filter.song_since = now - radioplaylist_conf.jingles.block_song_interval;
+		if(!stream_state.playlist->pick(stream_state.playlist, &pick, &song_id, 1))
+			log_append(LOG_WARNING, "Could not load jingle song");
 		else
 		{
 			has_jingle = 1;
@@ -1368,36 +1474,18 @@ static void prepare_new_song()
 
 	if(!has_promo && !has_jingle)
 	{
-		snprintf(querybuf, sizeof(querybuf), "\
-			SELECT * FROM ( \
-				SELECT DISTINCT ON (s.artist) s.id \
-				FROM playlist_song_genres sg \
-				JOIN playlist_songs s ON (s.id = sg.song_id) \
-				WHERE not s.blacklist AND sg.genre_id = $1 AND s.last_vote < $2 AND (not s.nightonly OR is_night()) AND NOT EXISTS ( \
-					SELECT h.song_id \
-					FROM playlist_history h \
-					JOIN playlist_songs s2 ON (s2.id = h.song_id) \
-					WHERE h.ts >= (now() at time zone 'UTC') - interval '%s' AND s2.artist = s.artist \
-				) AND NOT EXISTS ( \
-					SELECT h.song_id \
-					FROM playlist_history h \
-					JOIN playlist_songs s2 ON (s2.id = h.song_id) \
-					WHERE h.ts >= (now() at time zone 'UTC') - interval '%s' AND s2.album = s.album AND s2.album IS NOT NULL \
-				) \
-				ORDER BY s.artist, random() \
-			) _anon \
-			ORDER BY random()", radioplaylist_conf.songvote_block_artist_interval, radioplaylist_conf.songvote_block_album_interval);
-		res = pgsql_query(pg_conn, querybuf, 1, stringlist_build_n(2, idbuf, tsbuf));
-		if(!res || !(num_rows = pgsql_num_rows(res)))
+		pick.flags = (pick.flags & PL_P_NIGHT) | PL_P_GENRE | PL_P_DISTINCT_ARTIST;
+		pick.last_vote_before = now - radioplaylist_conf.songvote_block_duration;
+		memset(&filter, 0, sizeof(filter));
+		filter.artist_since = now - radioplaylist_conf.songvote_block_artist_interval;
+		filter.album_since = now - radioplaylist_conf.songvote_block_album_interval;
+		if(!stream_state.playlist->pick(stream_state.playlist, &pick, &song_id, 1))
 		{
-			log_append(LOG_WARNING, "Could not load new song (res=%p, rows=%d)", res, res ? num_rows : -1);
-			pgsql_free(res);
+			log_append(LOG_WARNING, "Could not load new song");
 			return;
 		}
 	}
 
-	song_id = strtoul(pgsql_nvalue(res, 0, "id"), NULL, 10);
-	pgsql_free(res);
 	node = stream_state.playlist->get_node(stream_state.playlist, song_id);
 	if(!node || !node->title)
 		return;
@@ -1408,12 +1496,32 @@ static void prepare_new_song()
 	pthread_mutex_unlock(&playlist_mutex);
 }
 
+// Same as the is_night() function in the database
+static uint8_t is_night()
+{
+	struct tm *tm = localtime(&now);
+	return tm->tm_hour < 6 || tm->tm_hour > 21;
+}
+
+// The in-memory history has to cover the longest block interval
+static time_t history_max_age()
+{
+	time_t max_age = radioplaylist_conf.songvote_block_artist_interval;
+	max_age = max(max_age, radioplaylist_conf.songvote_block_album_interval);
+	max_age = max(max_age, radioplaylist_conf.promo.block_song_interval);
+	max_age = max(max_age, radioplaylist_conf.promo.block_artist_interval);
+	max_age = max(max_age, radioplaylist_conf.jingles.block_song_interval);
+	return max_age;
+}
+
 static void songvote_stream_song_changed()
 {
 	uint16_t vote_duration = 0;
-	char idbuf[16], limitbuf[8], tsbuf[16], querybuf[768];
-	int num_rows;
-	PGresult *res;
+	struct playlist_pick pick;
+	struct history_filter filter;
+	uint32_t song_ids[UINT8_MAX];
+	unsigned int num_songs;
+	char idbuf[16], tsbuf[16];
 
 	// Song vote mode not enabled?
 	if(!song_vote.enabled)
@@ -1462,47 +1570,30 @@ static void songvote_stream_song_changed()
 	irc_send("PRIVMSG %s :Benutze $b*songvote <id>$b um abzustimmen. Verbleibende Zeit: $b%02u:%02u$b", radioplaylist_conf.radiochan, vote_duration / 60, vote_duration % 60);
 
 	// send song list to channel
-	snprintf(idbuf, sizeof(idbuf), "%"PRIu8, stream_state.playlist->genre_id);
-	snprintf(limitbuf, sizeof(limitbuf), "%"PRIu8, radioplaylist_conf.songvote_songs);
-	snprintf(tsbuf, sizeof(tsbuf), "%lu", (unsigned long)(now - radioplaylist_conf.songvote_block_duration));
-	snprintf(querybuf, sizeof(querybuf), "\
-		SELECT * FROM ( \
-			SELECT DISTINCT ON (s.artist) s.id \
-			FROM playlist_songs s \
-			JOIN playlist_song_genres sg ON (s.id = sg.song_id) \
-			WHERE not s.blacklist AND sg.genre_id = $1 AND s.last_vote < $3 AND (not s.nightonly OR is_night()) AND NOT EXISTS ( \
-				SELECT h.song_id \
-				FROM playlist_history h \
-				JOIN playlist_songs s2 ON (s2.id = h.song_id) \
-				WHERE h.ts >= (now() at time zone 'UTC') - interval '%s' AND s2.artist = s.artist \
-			) AND NOT EXISTS ( \
-				SELECT h.song_id \
-				FROM playlist_history h \
-				JOIN playlist_songs s2 ON (s2.id = h.song_id) \
-				WHERE h.ts >= (now() at time zone 'UTC') - interval '%s' AND s2.album = s.album AND s2.album IS NOT NULL \
-			) \
-			ORDER BY s.artist, random() \
-		) _anon \
-		ORDER BY random() \
-		LIMIT $2", radioplaylist_conf.songvote_block_artist_interval, radioplaylist_conf.songvote_block_album_interval);
-	res = pgsql_query(pg_conn, querybuf, 1, stringlist_build_n(3, idbuf, limitbuf, tsbuf));
-	if(!res || (num_rows = pgsql_num_rows(res)) < 2)
-	{
-		log_append(LOG_WARNING, "Could not load song list (res=%p, rows=%d)", res, res ? num_rows : -1);
+	memset(&pick, 0, sizeof(pick));
+	memset(&filter, 0, sizeof(filter));
+	pick.flags = PL_P_GENRE | PL_P_DISTINCT_ARTIST | (is_night() ? PL_P_NIGHT : 0);
+	pick.last_vote_before = now - radioplaylist_conf.songvote_block_duration;
+	pick.filter = history_filter;
+	pick.ctx = &filter;
+	filter.artist_since = now - radioplaylist_conf.songvote_block_artist_interval;
+	filter.album_since = now - radioplaylist_conf.songvote_block_album_interval;
+	if((num_songs = stream_state.playlist->pick(stream_state.playlist, &pick, song_ids, radioplaylist_conf.songvote_songs)) < 2)
+	{
+		log_append(LOG_WARNING, "Could not load song list (songs=%u)", num_songs);
 		irc_send("PRIVMSG %s :Fehler - Song-Vote abgebrochen!", radioplaylist_conf.radiochan);
 		songvote_reset();
 		debug("disabled song vote");
 		song_vote.enabled = 0;
-		pgsql_free(res);
 		return;
 	}
 
 	song_vote.num_songs = 0;
-	song_vote.songs = calloc(num_rows, sizeof(struct song_vote_song));
+	song_vote.songs = calloc(num_songs, sizeof(struct song_vote_song));
 	snprintf(tsbuf, sizeof(tsbuf), "%lu", (unsigned long)now);
-	for(int i = 0; i < num_rows; i++)
+	for(unsigned int i = 0; i < num_songs; i++)
 	{
-		uint32_t song_id = strtoul(pgsql_nvalue(res, i, "id"), NULL, 10);
+		uint32_t song_id = song_ids[i];
 		struct playlist_node *node = stream_state.playlist->get_node(stream_state.playlist, song_id);
 		if(!node || !node->title)
 			continue;
@@ -1520,10 +1611,10 @@ static void songvote_stream_song_changed()
 		}
 		irc_send("PRIVMSG %s :$b%u$b: %s", radioplaylist_conf.radiochan, song_vote.songs[song_vote.num_songs].id, song_vote.songs[song_vote.num_songs].name);
 		snprintf(idbuf, sizeof(idbuf), "%"PRIu32, song_id);
-		pgsql_query(pg_conn, "UPDATE playlist_songs SET last_vote = $1 WHERE id = $2", 0, stringlist_build_n(2, tsbuf, idbuf));
+		stream_state.playlist->set_last_vote(stream_state.playlist, song_id, now);
+		pgsql_query_async(pg_conn, "UPDATE playlist_songs SET last_vote = $1 WHERE id = $2", stringlist_build_n(2, tsbuf, idbuf), NULL, NULL);
 		song_vote.num_songs++;
 	}
-	pgsql_free(res);
 
 	song_vote.voted_nicks = stringlist_create();
 	song_vote.voted_hosts = stringlist_create();
@@ -2064,11 +2155,15 @@ static void check_countdown()
 static void check_song_changed()
 {
 	struct playlist_node *cur;
+	struct timespec start, end;
 	uint8_t prepare_node = 0;
+	uint32_t cur_id = 0;
+	uint64_t usec;
 
 	if(!stream_state.song_changed)
 		return;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	pthread_mutex_lock(&stream_state_mutex);
 	stream_state.song_changed = 0;
 	pthread_mutex_unlock(&stream_state_mutex);
@@ -2079,13 +2174,19 @@ static void check_song_changed()
 		if(!(cur = stream_state.playlist->next_random_cur) && !(cur = stream_state.playlist->queue_cur))
 			cur = stream_state.playlist->cur;
 		prepare_node = (stream_state.playlist->next_random == NULL);
+		if(cur && cur->id)
+		{
+			cur_id = cur->id;
+			history_add(cur->id, cur->artist, cur->album, now);
+		}
 		pthread_mutex_unlock(&playlist_mutex);
 
-		if(cur && cur->id && pg_conn)
+		// The in-memory history is already up to date so nobody has to wait for the database
+		if(cur_id && pg_conn)
 		{
 			char idbuf[16];
-			snprintf(idbuf, sizeof(idbuf), "%"PRIu32, cur->id);
-			pgsql_query(pg_conn, "INSERT INTO playlist_history (song_id) VALUES ($1)", 0, stringlist_build_n(1, idbuf));
+			snprintf(idbuf, sizeof(idbuf), "%"PRIu32, cur_id);
+			pgsql_query_async(pg_conn, "INSERT INTO playlist_history (song_id) VALUES ($1)", stringlist_build_n(1, idbuf), NULL, NULL);
 		}
 	}
 
@@ -2093,10 +2194,31 @@ static void check_song_changed()
 	songvote_stream_song_changed();
 	if(prepare_node)
 		prepare_new_song();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	song_change_stats.last_usec = usec;
+	song_change_stats.max_usec = max(song_change_stats.max_usec, usec);
+	song_change_stats.total_usec += usec;
+	song_change_stats.count++;
+	debug("song change handled in %.1f ms", usec / 1000.0);
 }
 
 static void check_scan_result()
 {
+	struct playlist_scan_progress *progress = &scan_state.progress;
+	time_t duration;
+
+	if(scan_state.state == SCAN_ACTIVE && radioplaylist_conf.scan_report_interval &&
+	   (now - scan_state.last_report) >= radioplaylist_conf.scan_report_interval)
+	{
+		scan_state.last_report = now;
+		duration = now - scan_state.started;
+		reply_nick(scan_state.nick, "Scan von $b%s$b läuft seit %lus: %"PRIu32" gefunden, %"PRIu32" gelesen, %"PRIu32" gespeichert (%.1f Dateien/s)",
+			   scan_state.path, (unsigned long)duration, progress->found, progress->parsed, progress->written,
+			   duration ? (double)progress->parsed / duration : 0.0);
+	}
+
 	if(scan_state.state != SCAN_FINISHED)
 		return;
 
@@ -2105,7 +2227,12 @@ static void check_scan_result()
 	assert(scan_state.nick);
 
 	if(scan_state.rc == 0)
-		reply_nick(scan_state.nick, "Scan von $b%s$b abgeschlossen; %"PRIu32" neu, %"PRIu32" aktualisiert", scan_state.path, scan_state.new_count, scan_state.updated_count);
+	{
+		duration = now - scan_state.started;
+		reply_nick(scan_state.nick, "Scan von $b%s$b abgeschlossen; %"PRIu32" neu, %"PRIu32" aktualisiert (%"PRIu32" Dateien in %lus, %.1f Dateien/s)",
+			   scan_state.path, progress->new_count, progress->updated_count, progress->found, (unsigned long)duration,
+			   duration ? (double)progress->parsed / duration : (double)progress->parsed);
+	}
 	else
 		reply_nick(scan_state.nick, "Beim Scan von $b%s$b ist ein Fehler aufgetreten", scan_state.path);
 
@@ -2118,6 +2245,7 @@ static void conf_reload_hook()
 {
 	const char *str;
 	struct stringlist *slist;
+	struct cache_params cache_params;
 
 	str = conf_get("radioplaylist/db_conn_string", DB_STRING);
 	radioplaylist_conf.db_conn_string = str ? str : "";
@@ -2149,7 +2277,42 @@ static void conf_reload_hook()
 
 	str = conf_get("radioplaylist/lame_quality", DB_STRING);
 	radioplaylist_conf.lame_quality = str ? atoi(str) : 3;
+
+	// frames buffered between each pipeline stage; 128 frames are ~3s at 44.1kHz
+	str = conf_get("radioplaylist/stream_buffer_frames", DB_STRING);
+	radioplaylist_conf.stream_buffer_frames = str ? max(atoi(str), 4) : 128;
+
+	// send files matching lame_bitrate/lame_samplerate without transcoding them
+	str = conf_get("radioplaylist/stream_passthrough", DB_STRING);
+	if(str && !strcasecmp(str, "verify"))
+		radioplaylist_conf.stream_passthrough = STREAM_PASSTHROUGH_VERIFY;
+	else
+		radioplaylist_conf.stream_passthrough = (str && true_string(str)) ? STREAM_PASSTHROUGH_ON : STREAM_PASSTHROUGH_OFF;
+
+	// encoded files are cached in cache_dir; the next cache_prefetch songs are encoded in advance
+	cache_params.dir = conf_get("radioplaylist/cache_dir", DB_STRING);
+	str = conf_get("radioplaylist/cache_max_size", DB_STRING);
+	cache_params.max_size = (uint64_t)(str ? strtoull(str, NULL, 10) : 1024) << 20; // MiB
+	cache_params.bitrate = radioplaylist_conf.lame_bitrate;
+	cache_params.samplerate = radioplaylist_conf.lame_samplerate;
+	cache_params.quality = radioplaylist_conf.lame_quality;
+
+	str = conf_get("radioplaylist/cache_prefetch", DB_STRING);
+	radioplaylist_conf.cache_prefetch = str ? min(atoi(str), 16) : 3;
 	pthread_mutex_unlock(&conf_mutex); // unlock config
+	cache_configure(&cache_params);
+
+	// 0 means one parser thread per online CPU
+	str = conf_get("radioplaylist/scan_threads", DB_STRING);
+	radioplaylist_conf.scan_threads = str ? atoi(str) : 0;
+	if(!radioplaylist_conf.scan_threads)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		radioplaylist_conf.scan_threads = (cpus > 0) ? min(cpus, 16) : 1;
+	}
+
+	str = conf_get("radioplaylist/scan_report_interval", DB_STRING);
+	radioplaylist_conf.scan_report_interval = str ? atoi(str) : 60;
 
 	str = conf_get("radioplaylist/adminchan", DB_STRING);
 	radioplaylist_conf.adminchan = str;
@@ -2188,10 +2351,10 @@ static void conf_reload_hook()
 	radioplaylist_conf.songvote_songs = str ? atoi(str) : 3;
 
 	str = conf_get("radioplaylist/songvote_block_artist_interval", DB_STRING);
-	radioplaylist_conf.songvote_block_artist_interval = str ? str : "30 minutes";
+	radioplaylist_conf.songvote_block_artist_interval = history_parse_interval(str, 1800);
 
 	str = conf_get("radioplaylist/songvote_block_album_interval", DB_STRING);
-	radioplaylist_conf.songvote_block_album_interval = str ? str : "60 minutes";
+	radioplaylist_conf.songvote_block_album_interval = history_parse_interval(str, 3600);
 
 	str = conf_get("radioplaylist/promo/min_delay", DB_STRING);
 	radioplaylist_conf.promo.min_delay = str ? atoi(str) : 1800;
@@ -2212,10 +2375,10 @@ static void conf_reload_hook()
 	radioplaylist_conf.promo.delay_after_jingle = str ? atoi(str) : 600;
 
 	str = conf_get("radioplaylist/promo/block_song_interval", DB_STRING);
-	radioplaylist_conf.promo.block_song_interval = str ? str : "1 day";
+	radioplaylist_conf.promo.block_song_interval = history_parse_interval(str, 86400);
 
 	str = conf_get("radioplaylist/promo/block_artist_interval", DB_STRING);
-	radioplaylist_conf.promo.block_artist_interval = str ? str : "1 hour";
+	radioplaylist_conf.promo.block_artist_interval = history_parse_interval(str, 3600);
 
 	str = conf_get("radioplaylist/jingles/min_delay", DB_STRING);
 	radioplaylist_conf.jingles.min_delay = str ? atoi(str) : 1800;
@@ -2236,7 +2399,7 @@ static void conf_reload_hook()
 	radioplaylist_conf.jingles.delay_after_promo = str ? atoi(str) : 600;
 
 	str = conf_get("radioplaylist/jingles/block_song_interval", DB_STRING);
-	radioplaylist_conf.jingles.block_song_interval = str ? str : "1 day";
+	radioplaylist_conf.jingles.block_song_interval = history_parse_interval(str, 86400);
 
 	if(!pg_conn || !(str = conf_get_old("radioplaylist/db_conn_string", DB_STRING)) || strcmp(str, radioplaylist_conf.db_conn_string))
 	{
@@ -2247,6 +2410,7 @@ static void conf_reload_hook()
 			if(pg_conn)
 				pgsql_fini(pg_conn);
 			pg_conn = new_conn;
+			history_load(pg_conn, history_max_age());
 		}
 
 		if(pg_conn)
@@ -2292,7 +2456,7 @@ static void *scan_thread_main(void *arg)
 	else
 	{
 		pgsql_begin(conn);
-		scan_state.rc = playlist_scan(scan_state.path, conn, scan_state.mode, &scan_state.new_count, &scan_state.updated_count);
+		scan_state.rc = playlist_scan(scan_state.path, conn, scan_state.mode, scan_state.threads, &scan_state.progress);
 		if(scan_state.rc != 0)
 		{
 			debug("scan failed");
@@ -2300,7 +2464,7 @@ static void *scan_thread_main(void *arg)
 		}
 		else
 		{
-			debug("found %"PRIu32" new files, %"PRIu32" updated", scan_state.new_count, scan_state.updated_count);
+			debug("found %"PRIu32" new files, %"PRIu32" updated", scan_state.progress.new_count, scan_state.progress.updated_count);
 			pgsql_commit(conn);
 		}
 		pgsql_fini(conn);
@@ -2374,6 +2538,15 @@ static void *stream_thread_main(void *arg)
 			strlcpy(file, song->file, sizeof(file));
 			jingle = song->jingle;
 
+			// Encode the next songs while this one is playing
+			if(radioplaylist_conf.cache_prefetch)
+			{
+				const char *upcoming[16];
+				unsigned int count = stream_state.playlist->upcoming(stream_state.playlist, upcoming, radioplaylist_conf.cache_prefetch);
+				for(unsigned int i = 0; i < count; i++)
+					cache_request(upcoming[i]);
+			}
+
 			if(song->artist && song->title)
 				snprintf(titlebuf, sizeof(titlebuf), "%s - %s", song->artist, song->title);
 			else if(song->title)
@@ -2409,9 +2582,9 @@ static void *stream_thread_main(void *arg)
 				stream.meta = NULL;
 			}
 
-			if(shout_get_errno(stream.shout) == SHOUTERR_SOCKET)
+			if(stream.send_failed)
 			{
-				log_append(LOG_WARNING, "shout reports socket error: %s", shout_get_error(stream.shout));
+				log_append(LOG_WARNING, "stream connection failed; stopping");
 				break;
 			}
 		}
@@ -2452,6 +2625,27 @@ static int8_t stream_init(struct stream_ctx *stream)
 		return -1;
 	}
 
+	pthread_mutex_lock(&conf_mutex); // lock config
+	stream->pcm_ring = ring_create(radioplaylist_conf.stream_buffer_frames, sizeof(struct stream_pcm_block));
+	stream->mp3_ring = ring_create(radioplaylist_conf.stream_buffer_frames, sizeof(struct stream_mp3_block));
+	pthread_mutex_unlock(&conf_mutex); // unlock config
+	if(!stream->pcm_ring || !stream->mp3_ring)
+	{
+		log_append(LOG_ERROR, "could not allocate stream buffers");
+		return -1;
+	}
+
+	// The stats must be reset before the stage threads start updating them
+	pthread_mutex_lock(&stream_state_mutex);
+	memset(&stream_stats, 0, sizeof(stream_stats));
+	stream_stats.pcm_ring = stream->pcm_ring;
+	stream_stats.mp3_ring = stream->mp3_ring;
+	pthread_mutex_unlock(&stream_state_mutex);
+
+	// The decoder runs in the stream thread which outlives the stream
+	stream->cpu_last[STREAM_STAGE_DECODER] = stream_thread_cpu_usec();
+	pthread_create(&stream->encoder_thread, NULL, stream_encoder_main, stream);
+	pthread_create(&stream->sender_thread, NULL, stream_sender_main, stream);
 	return 0;
 }
 
@@ -2469,6 +2663,23 @@ static void stream_lame_init(struct stream_ctx *stream)
 
 static void stream_fini(struct stream_ctx *stream)
 {
+	pthread_mutex_lock(&stream_state_mutex);
+	stream_stats.pcm_ring = NULL;
+	stream_stats.mp3_ring = NULL;
+	pthread_mutex_unlock(&stream_state_mutex);
+
+	// The end marker passes through both stages; afterwards no thread uses the rings anymore
+	if(stream->encoder_thread)
+	{
+		stream_push_event(stream, STREAM_BLOCK_EOS, NULL);
+		pthread_join(stream->encoder_thread, NULL);
+		pthread_join(stream->sender_thread, NULL);
+	}
+
+	if(stream->pcm_ring)
+		ring_free(stream->pcm_ring);
+	if(stream->mp3_ring)
+		ring_free(stream->mp3_ring);
 	if(stream->lame)
 		lame_close(stream->lame);
 	shout_close(stream->shout);
@@ -2480,6 +2691,10 @@ static int8_t stream_song(struct stream_ctx *stream, const char *filename)
 	int fd;
 	struct stat sb;
 	void *filedata;
+	enum stream_passthrough_mode passthrough;
+	size_t start, end;
+	off_t cache_size;
+	int cache_fd;
 
 	if((fd = open(filename, O_RDONLY)) == -1)
 	{
@@ -2492,12 +2707,14 @@ static int8_t stream_song(struct stream_ctx *stream, const char *filename)
 	{
 		char errbuf[64];
 		log_append(LOG_WARNING, "fstat() failed: %s", strerror_r(errno, errbuf, sizeof(errbuf)));
+		close(fd);
 		return -1;
 	}
 
 	if(sb.st_size == 0)
 	{
 		log_append(LOG_WARNING, "file %s is empty", filename);
+		close(fd);
 		return -1;
 	}
 
@@ -2505,14 +2722,44 @@ static int8_t stream_song(struct stream_ctx *stream, const char *filename)
 	{
 		char errbuf[64];
 		log_append(LOG_WARNING, "mmap() failed: %s", strerror_r(errno, errbuf, sizeof(errbuf)));
+		close(fd);
 		return -1;
 	}
 
 	stream->start = filedata;
 	stream->length = sb.st_size;
 	stream->samplerate = 0;
+	stream->passthrough = 0;
 
-	decode_mp3(stream);
+	pthread_mutex_lock(&conf_mutex); // lock config
+	passthrough = radioplaylist_conf.stream_passthrough;
+	pthread_mutex_unlock(&conf_mutex); // unlock config
+
+	if((cache_fd = cache_open(&sb, &cache_size)) != -1)
+	{
+		void *cachedata;
+		if(cache_size && (cachedata = mmap(0, cache_size, PROT_READ, MAP_SHARED, cache_fd, 0)) != MAP_FAILED)
+		{
+			debug("streaming %s from the cache", filename);
+			stream_passthrough(stream, cachedata, cache_size);
+			munmap(cachedata, cache_size);
+		}
+		else
+			decode_mp3(stream);
+		close(cache_fd);
+	}
+	else if(passthrough != STREAM_PASSTHROUGH_OFF && stream_passthrough_range(filedata, sb.st_size, &start, &end) &&
+	   (passthrough != STREAM_PASSTHROUGH_VERIFY || stream_passthrough_verify(filedata, sb.st_size, start, end)))
+	{
+		debug("streaming %s without transcoding", filename);
+		stream_passthrough(stream, (const unsigned char *)filedata + start, end - start);
+	}
+	else
+	{
+		decode_mp3(stream);
+		// Songs played again (promos, jingles) do not need to be transcoded again
+		cache_request(filename);
+	}
 
 	munmap(filedata, sb.st_size);
 	close(fd);
@@ -2522,8 +2769,6 @@ static int8_t stream_song(struct stream_ctx *stream, const char *filename)
 static int decode_mp3(struct stream_ctx *stream)
 {
 	struct mad_decoder decoder;
-	unsigned char mp3buf[LAME_MAXMP3BUFFER];
-	ssize_t olen;
 	int result;
 
 	mad_decoder_init(&decoder, stream,
@@ -2531,10 +2776,9 @@ static int decode_mp3(struct stream_ctx *stream)
 			error_cb, NULL /* message */);
 
 	result = mad_decoder_run(&decoder, MAD_DECODER_MODE_SYNC);
-	olen = lame_encode_flush_nogap(stream->lame, mp3buf, sizeof(mp3buf));
-	shout_sync(stream->shout);
-	if(shout_send(stream->shout, mp3buf, olen) != SHOUTERR_SUCCESS)
-		log_append(LOG_WARNING, "shout_send failed: %s", shout_get_error(stream->shout));
+	// Only songs which produced any output have been started
+	if(stream->samplerate)
+		stream_push_event(stream, STREAM_BLOCK_SONG_END, NULL);
 
 	mad_decoder_finish(&decoder);
 	return result;
@@ -2555,15 +2799,10 @@ static enum mad_flow input_cb(void *data, struct mad_stream *stream)
 static enum mad_flow output_cb(void *data, struct mad_header const *header, struct mad_pcm *pcm)
 {
 	struct stream_ctx *ctx = data;
-	unsigned int nchannels, nsamples;
-	mad_fixed_t *left_ch, *right_ch;
-	unsigned char mp3buf[LAME_MAXMP3BUFFER];
-	ssize_t olen;
+	struct stream_pcm_block *block;
+	unsigned int nchannels;
 
 	nchannels = pcm->channels;
-	nsamples = pcm->length;
-	left_ch = pcm->samples[0];
-	right_ch = nchannels > 1 ? pcm->samples[1] : left_ch;
 
 	// First call
 	if(!ctx->samplerate)
@@ -2571,33 +2810,33 @@ static enum mad_flow output_cb(void *data, struct mad_header const *header, stru
 		debug("channels: %u, sample rate: %u kHz", nchannels, header->samplerate);
 		assert_return(nchannels <= 2, MAD_FLOW_BREAK);
 		ctx->samplerate = header->samplerate;
-		if(!ctx->lame || (ctx->last_samplerate && ctx->last_samplerate != ctx->samplerate))
-		{
-			stream_lame_init(ctx);
-			lame_set_in_samplerate(ctx->lame, header->samplerate);
-			lame_init_params(ctx->lame);
-		}
-		if(ctx->meta)
-			shout_set_metadata(ctx->shout, ctx->meta);
+		// The metadata now belongs to the pipeline
+		stream_push_event(ctx, STREAM_BLOCK_SONG_START, ctx->meta);
+		ctx->meta = NULL;
 	}
 
 	assert_return(ctx->samplerate == header->samplerate, MAD_FLOW_BREAK);
+	assert_return(pcm->length <= 1152, MAD_FLOW_BREAK);
+
+	block = ring_reserve(ctx->pcm_ring);
+	block->type = STREAM_BLOCK_DATA;
+	block->samplerate = header->samplerate;
+	block->channels = nchannels;
+	block->length = pcm->length;
+	block->meta = NULL;
+	for(unsigned int i = 0; i < nchannels; i++)
+		pcm_fixed_to_float(block->samples[i], pcm->samples[i], pcm->length);
+	ring_commit(ctx->pcm_ring);
+	stream_update_cpu(ctx, STREAM_STAGE_DECODER);
+
+	return stream_check_state(ctx);
+}
 
-	float pcm_data[2][1152];
-	for(unsigned int i = 0; i < nsamples; i++)
-	{
-		pcm_data[0][i] = (float)mad_f_todouble(left_ch[i]) * 32767.0;
-		pcm_data[1][i] = (float)mad_f_todouble(right_ch[i]) * 32767.0;
-	}
-
-	olen = lame_encode_buffer_float(ctx->lame, pcm_data[0], pcm_data[1], nsamples, mp3buf, sizeof(mp3buf));
-
-	shout_sync(ctx->shout);
-	if(shout_send(ctx->shout, mp3buf, olen) != SHOUTERR_SUCCESS)
-	{
-		log_append(LOG_WARNING, "shout_send failed: %s", shout_get_error(ctx->shout));
+// Decides whether the current song should be continued
+static enum mad_flow stream_check_state(struct stream_ctx *stream)
+{
+	if(stream->send_failed)
 		return MAD_FLOW_BREAK;
-	}
 
 	if(!stream_state.play || stream_state.terminate)
 		return MAD_FLOW_STOP;
@@ -2627,3 +2866,348 @@ static enum mad_flow error_cb(void *data, struct mad_stream *stream, struct mad_
 
 	return MAD_FLOW_CONTINUE;
 }
+
+static void stream_push_event(struct stream_ctx *stream, enum stream_block_type type, shout_metadata_t *meta)
+{
+	struct stream_pcm_block *block = ring_reserve(stream->pcm_ring);
+	block->type = type;
+	block->samplerate = stream->samplerate;
+	block->channels = 0;
+	block->length = 0;
+	block->passthrough = stream->passthrough;
+	block->meta = meta;
+	ring_commit(stream->pcm_ring);
+}
+
+// Checks if all frames between the tags match the encoder settings and directly follow each other.
+// On success, start and end contain the range of audio frames.
+static uint8_t stream_passthrough_range(const unsigned char *data, size_t len, size_t *start, size_t *end)
+{
+	struct mad_stream stream;
+	struct mad_header header;
+	const unsigned char *next = NULL;
+	unsigned long bitrate;
+	unsigned int samplerate;
+	uint8_t ok = 1, ended = 0;
+	size_t offset;
+
+	pthread_mutex_lock(&conf_mutex); // lock config
+	bitrate = radioplaylist_conf.lame_bitrate * 1000;
+	samplerate = radioplaylist_conf.lame_samplerate;
+	pthread_mutex_unlock(&conf_mutex); // unlock config
+
+	// Skip the ID3v2 tags ourselves; their content may look like frames
+	for(offset = 0; offset < len; )
+	{
+		size_t tagsize = mp3_id3v2_length(data + offset, len - offset);
+		if(!tagsize)
+			break;
+		offset += tagsize;
+	}
+
+	if(offset >= len)
+		return 0;
+
+	*start = *end = offset;
+	mad_stream_init(&stream);
+	mad_header_init(&header);
+	mad_stream_buffer(&stream, data + offset, len - offset);
+
+	while(ok)
+	{
+		if(mad_header_decode(&header, &stream) == -1)
+		{
+			if(!MAD_RECOVERABLE(stream.error))
+				break;
+			// Anything but trailing tags after the first frame means a broken file
+			if(next)
+				ended = 1;
+			continue;
+		}
+
+		if(ended || header.layer != MAD_LAYER_III || header.bitrate != bitrate ||
+		   header.samplerate != samplerate || header.mode == MAD_MODE_SINGLE_CHANNEL)
+		{
+			ok = 0;
+			break;
+		}
+
+		if(!next)
+		{
+			// The Xing/Info frame is silence and must not show up in the middle of the stream
+			if(mp3_is_tag_frame(stream.this_frame, stream.next_frame - stream.this_frame, &header))
+			{
+				next = stream.next_frame;
+				*start = next - data;
+				continue;
+			}
+			*start = stream.this_frame - data;
+		}
+		else if(stream.this_frame != next)
+		{
+			ok = 0;
+			break;
+		}
+
+		next = stream.next_frame;
+		*end = next - data;
+	}
+
+	mad_header_finish(&header);
+	mad_stream_finish(&stream);
+	return ok && *end > *start;
+}
+
+struct stream_verify_decoder {
+	struct mad_stream stream;
+	struct mad_frame frame;
+	struct mad_synth synth;
+};
+
+// Decodes the whole file like the transcoder does and the frames passthrough would send;
+// both have to produce the same samples, otherwise the song is transcoded.
+static uint8_t stream_passthrough_verify(const unsigned char *data, size_t len, size_t start, size_t end)
+{
+	struct stream_verify_decoder full, pass;
+	mad_fixed_t max_diff = 0;
+	unsigned long frames = 0;
+	int full_rc = 0, pass_rc = 0;
+	uint8_t ok = 1;
+
+	memset(&full, 0, sizeof(full));
+	memset(&pass, 0, sizeof(pass));
+	mad_stream_init(&full.stream);
+	mad_frame_init(&full.frame);
+	mad_synth_init(&full.synth);
+	mad_stream_init(&pass.stream);
+	mad_frame_init(&pass.frame);
+	mad_synth_init(&pass.synth);
+	mad_stream_buffer(&full.stream, data, len);
+	mad_stream_buffer(&pass.stream, data + start, end - start);
+
+	while(ok)
+	{
+		// The full decoder also decodes the tags and the Xing frame, which are not compared
+		do
+		{
+			while((full_rc = mad_frame_decode(&full.frame, &full.stream)) == -1 && MAD_RECOVERABLE(full.stream.error))
+				;
+			if(full_rc == 0)
+				mad_synth_frame(&full.synth, &full.frame);
+		} while(full_rc == 0 && full.stream.this_frame < data + start);
+
+		while((pass_rc = mad_frame_decode(&pass.frame, &pass.stream)) == -1 && MAD_RECOVERABLE(pass.stream.error))
+			;
+		if(pass_rc == 0)
+			mad_synth_frame(&pass.synth, &pass.frame);
+
+		// Frames after the passthrough range are not sent
+		if(full_rc == 0 && full.stream.this_frame >= data + end)
+			full_rc = -1;
+
+		if(full_rc != 0 || pass_rc != 0)
+		{
+			ok = (full_rc == pass_rc);
+			break;
+		}
+
+		if(full.synth.pcm.length != pass.synth.pcm.length || full.synth.pcm.channels != pass.synth.pcm.channels)
+		{
+			ok = 0;
+			break;
+		}
+
+		for(unsigned int ch = 0; ch < pass.synth.pcm.channels; ch++)
+		{
+			for(unsigned int i = 0; i < pass.synth.pcm.length; i++)
+				max_diff = max(max_diff, abs(full.synth.pcm.samples[ch][i] - pass.synth.pcm.samples[ch][i]));
+		}
+
+		frames++;
+	}
+
+	mad_synth_finish(&full.synth);
+	mad_frame_finish(&full.frame);
+	mad_stream_finish(&full.stream);
+	mad_synth_finish(&pass.synth);
+	mad_frame_finish(&pass.frame);
+	mad_stream_finish(&pass.stream);
+
+	// Allow a difference of one 16 bit sample step
+	if(max_diff > (1L << (MAD_F_FRACBITS - 15)))
+		ok = 0;
+
+	if(ok)
+		debug("passthrough verified: %lu frames, max difference %.6f", frames, mad_f_todouble(max_diff));
+	else
+		log_append(LOG_WARNING, "passthrough verification failed after %lu frames (max difference %.6f); transcoding", frames, mad_f_todouble(max_diff));
+	return ok;
+}
+
+// Files which can be passed through are not cached
+static int stream_cache_skip(const unsigned char *data, size_t len)
+{
+	enum stream_passthrough_mode passthrough;
+	size_t start, end;
+
+	pthread_mutex_lock(&conf_mutex); // lock config
+	passthrough = radioplaylist_conf.stream_passthrough;
+	pthread_mutex_unlock(&conf_mutex); // unlock config
+
+	return passthrough != STREAM_PASSTHROUGH_OFF && stream_passthrough_range(data, len, &start, &end);
+}
+
+// Sends the frames of a song which already matches the stream settings
+static void stream_passthrough(struct stream_ctx *stream, const unsigned char *data, size_t len)
+{
+	struct stream_pcm_block *block;
+
+	stream->passthrough = 1;
+	stream_push_event(stream, STREAM_BLOCK_SONG_START, stream->meta);
+	stream->meta = NULL;
+
+	for(size_t pos = 0; pos < len; )
+	{
+		size_t chunk = min(len - pos, STREAM_MP3_BLOCK_SIZE);
+
+		block = ring_reserve(stream->pcm_ring);
+		block->type = STREAM_BLOCK_MP3;
+		block->passthrough = 1;
+		block->length = chunk;
+		block->meta = NULL;
+		memcpy(block->mp3, data + pos, chunk);
+		ring_commit(stream->pcm_ring);
+		stream_update_cpu(stream, STREAM_STAGE_DECODER);
+
+		pos += chunk;
+		if(stream_check_state(stream) != MAD_FLOW_CONTINUE)
+			break;
+	}
+
+	stream_push_event(stream, STREAM_BLOCK_SONG_END, NULL);
+}
+
+static void *stream_encoder_main(void *arg)
+{
+	struct stream_ctx *ctx = arg;
+	struct stream_pcm_block *pcm;
+	struct stream_mp3_block *mp3;
+	enum stream_block_type type;
+	int olen = 0;
+
+	do
+	{
+		pcm = ring_peek(ctx->pcm_ring);
+		mp3 = ring_reserve(ctx->mp3_ring);
+		type = mp3->type = pcm->type;
+		mp3->meta = pcm->meta;
+
+		switch(type)
+		{
+			case STREAM_BLOCK_SONG_START:
+				olen = 0;
+				if(pcm->passthrough)
+				{
+					ctx->last_passthrough = 1;
+					break;
+				}
+
+				// After a passthrough song lame's bit reservoir does not match the stream anymore
+				if(!ctx->lame || ctx->last_samplerate != pcm->samplerate || ctx->last_passthrough)
+				{
+					stream_lame_init(ctx);
+					lame_set_in_samplerate(ctx->lame, pcm->samplerate);
+					lame_init_params(ctx->lame);
+					ctx->last_samplerate = pcm->samplerate;
+				}
+				ctx->last_passthrough = 0;
+				break;
+
+			case STREAM_BLOCK_DATA:
+				olen = lame_encode_buffer_float(ctx->lame, pcm->samples[0], pcm->samples[pcm->channels > 1 ? 1 : 0], pcm->length, mp3->data, sizeof(mp3->data));
+				break;
+
+			case STREAM_BLOCK_MP3:
+				memcpy(mp3->data, pcm->mp3, pcm->length);
+				olen = pcm->length;
+				break;
+
+			case STREAM_BLOCK_SONG_END:
+				olen = pcm->passthrough ? 0 : lame_encode_flush_nogap(ctx->lame, mp3->data, sizeof(mp3->data));
+				break;
+
+			case STREAM_BLOCK_EOS:
+				olen = 0;
+				break;
+		}
+
+		if(olen < 0)
+			log_append(LOG_WARNING, "lame failed to encode a frame: %d", olen);
+		mp3->length = max(olen, 0);
+
+		ring_release(ctx->pcm_ring);
+		ring_commit(ctx->mp3_ring);
+		stream_update_cpu(ctx, STREAM_STAGE_ENCODER);
+	} while(type != STREAM_BLOCK_EOS);
+
+	return NULL;
+}
+
+// The only stage that waits for the stream's pace; a slow server cannot stall decoding or encoding until the buffers are full
+static void *stream_sender_main(void *arg)
+{
+	struct stream_ctx *ctx = arg;
+	struct stream_mp3_block *mp3;
+	enum stream_block_type type;
+
+	do
+	{
+		mp3 = ring_peek(ctx->mp3_ring);
+		type = mp3->type;
+
+		// After a failure or when shutting down, blocks are only drained
+		if(!ctx->send_failed && !stream_state.terminate)
+		{
+			if(mp3->meta)
+				shout_set_metadata(ctx->shout, mp3->meta);
+
+			if(mp3->length)
+			{
+				shout_sync(ctx->shout);
+				if(shout_send(ctx->shout, mp3->data, mp3->length) != SHOUTERR_SUCCESS)
+				{
+					log_append(LOG_WARNING, "shout_send failed: %s", shout_get_error(ctx->shout));
+					ctx->send_failed = 1;
+				}
+			}
+		}
+
+		if(mp3->meta)
+			shout_metadata_free(mp3->meta);
+
+		ring_release(ctx->mp3_ring);
+		stream_update_cpu(ctx, STREAM_STAGE_SENDER);
+	} while(type != STREAM_BLOCK_EOS);
+
+	return NULL;
+}
+
+static uint64_t stream_thread_cpu_usec()
+{
+	struct timespec ts;
+
+	if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Adds the CPU time the calling stage used since its last update; the main thread reads the totals
+static void stream_update_cpu(struct stream_ctx *stream, enum stream_stage stage)
+{
+	uint64_t usec = stream_thread_cpu_usec();
+
+	if(usec <= stream->cpu_last[stage])
+		return;
+	__sync_fetch_and_add(&stream_stats.cpu_usec[stage], usec - stream->cpu_last[stage]);
+	stream->cpu_last[stage] = usec;
+}
@@ -0,0 +1,63 @@
+#include "global.h"
+#include "ring.h"
+
+struct ring *ring_create(unsigned int size, size_t slot_size)
+{
+	struct ring *ring = malloc(sizeof(struct ring));
+	memset(ring, 0, sizeof(struct ring));
+	ring->size = size;
+	// Keep slots on separate cache lines
+	ring->slot_size = (slot_size + 63) & ~(size_t)63;
+	if(posix_memalign((void **)&ring->slots, 64, ring->size * ring->slot_size))
+	{
+		free(ring);
+		return NULL;
+	}
+	sem_init(&ring->filled, 0, 0);
+	sem_init(&ring->free, 0, size);
+	return ring;
+}
+
+void ring_free(struct ring *ring)
+{
+	sem_destroy(&ring->filled);
+	sem_destroy(&ring->free);
+	free(ring->slots);
+	free(ring);
+}
+
+// The semaphores are only contended when the ring is full or empty; in all
+// other cases they are a single atomic operation and provide the memory
+// ordering between writing a slot and reading it.
+void *ring_reserve(struct ring *ring)
+{
+	while(sem_wait(&ring->free) == -1 && errno == EINTR)
+		;
+	return ring->slots + ring->head * ring->slot_size;
+}
+
+void ring_commit(struct ring *ring)
+{
+	ring->head = (ring->head + 1) % ring->size;
+	sem_post(&ring->filled);
+}
+
+void *ring_peek(struct ring *ring)
+{
+	while(sem_wait(&ring->filled) == -1 && errno == EINTR)
+		;
+	return ring->slots + ring->tail * ring->slot_size;
+}
+
+void ring_release(struct ring *ring)
+{
+	ring->tail = (ring->tail + 1) % ring->size;
+	sem_post(&ring->free);
+}
+
+unsigned int ring_fill(struct ring *ring)
+{
+	int value;
+	sem_getvalue(&ring->filled, &value);
+	return value > 0 ? value : 0;
+}
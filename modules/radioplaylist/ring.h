@@ -0,0 +1,30 @@
+#ifndef RING_H
+#define RING_H
+
+#include <semaphore.h>
+
+// Single-producer/single-consumer ring of fixed-size slots. The producer fills
+// a slot in place between ring_reserve() and ring_commit(), the consumer reads
+// it between ring_peek() and ring_release(). Both sides only block when the
+// ring is full or empty.
+struct ring
+{
+	unsigned int size;
+	size_t slot_size;
+	unsigned char *slots;
+	unsigned int head; // only touched by the producer
+	unsigned int tail; // only touched by the consumer
+	sem_t filled;
+	sem_t free;
+};
+
+struct ring *ring_create(unsigned int size, size_t slot_size);
+void ring_free(struct ring *ring);
+
+void *ring_reserve(struct ring *ring);
+void ring_commit(struct ring *ring);
+void *ring_peek(struct ring *ring);
+void ring_release(struct ring *ring);
+unsigned int ring_fill(struct ring *ring);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef RRD_CANVAS_H
+#define RRD_CANVAS_H
+
+#define CANVAS_CHAR_WIDTH	6
+#define CANVAS_LINE_HEIGHT	10
+
+struct stringbuffer;
+
+// Drawing backend used by the graph renderer. Coordinates are pixels with
+// the origin in the top left corner; colors are 0xRRGGBB.
+struct canvas
+{
+	unsigned int width;
+	unsigned int height;
+
+	void (*rect)(struct canvas *canvas, int x, int y, int w, int h, uint32_t color);
+	void (*line)(struct canvas *canvas, int x1, int y1, int x2, int y2, uint32_t color, uint8_t dashed);
+	// y is the top of the text
+	void (*text)(struct canvas *canvas, int x, int y, const char *text, uint32_t color);
+	// One value per column starting at x; negative values are unknown
+	void (*area)(struct canvas *canvas, int x, int base, const int *ys, unsigned int count, uint32_t color);
+	void (*polyline)(struct canvas *canvas, int x, const int *ys, unsigned int count, uint32_t color);
+	// Appends the encoded image to out
+	void (*finish)(struct canvas *canvas, struct stringbuffer *out);
+	void (*free)(struct canvas *canvas);
+};
+
+#endif
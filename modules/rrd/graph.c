@@ -0,0 +1,583 @@
+#include "global.h"
+#include "conf.h"
+#include "dict.h"
+#include "stringbuffer.h"
+#include "modules/httpd/http.h"
+#include "modules/tools/tools.h"
+#include "rrd.h"
+#include "canvas.h"
+#include "graph.h"
+#include "png.h"
+#include "svg.h"
+
+#include <math.h>
+
+#define GRAPH_WIDTH		400
+#define GRAPH_MARGIN_LEFT	66
+#define GRAPH_MARGIN_RIGHT	20
+#define GRAPH_MARGIN_TOP	32
+#define GRAPH_MARGIN_BOTTOM	22
+#define GRAPH_LEGEND_LINE	12
+
+// Same colors as the rrdtool defaults
+#define COLOR_BACK	0xFFFFFF
+#define COLOR_CANVAS	0xF3F3F3
+#define COLOR_GRID	0x8C8C8C
+#define COLOR_MGRID	0x821E1E
+#define COLOR_FONT	0x000000
+
+#define GRAPH_MONTH	0 // grid unit for calendar months
+
+enum graph_format
+{
+	GRAPH_PNG,
+	GRAPH_SVG,
+	GRAPH_FORMAT_COUNT
+};
+
+struct graph_image
+{
+	struct stringbuffer *data;
+	time_t rendered;
+	time_t last_update; // of the rrd when the image was rendered
+};
+
+struct graph_entry
+{
+	char *name;
+	struct rrd *rrd;
+	struct rrd_graph graph;
+	struct graph_image images[GRAPH_FORMAT_COUNT];
+};
+
+struct graph_stats
+{
+	double max;
+	double average;
+	double current;
+};
+
+HTTP_HANDLER(graph_handler);
+static void graph_conf_reload();
+static void graph_entry_free(struct graph_entry *entry);
+static void graph_render(struct graph_entry *entry, enum graph_format format);
+static void graph_draw(const struct rrd_graph *graph, struct canvas *canvas, time_t end, double **columns, const struct graph_stats *stats, const double *ratios);
+static void graph_draw_time_grid(struct canvas *canvas, time_t start, time_t span, unsigned int top, unsigned int height);
+static void graph_draw_value_grid(struct canvas *canvas, double ymax, unsigned int ticks, unsigned int top, unsigned int height);
+static void graph_resample(const struct rrd_series *series, time_t start, time_t span, double *columns);
+static void graph_stats(struct rrd *rrd, const char *ds, const struct rrd_series *series, time_t start, time_t end, struct graph_stats *stats);
+static double graph_ratio(struct rrd *rrd, const struct rrd_graph_ratio *ratio, time_t start, time_t end);
+static double graph_nice_max(double value, unsigned int *ticks);
+static time_t grid_align(time_t t, time_t unit);
+static time_t grid_next(time_t t, time_t unit);
+static long floor_div(long a, long b);
+static void format_stat(char *buf, size_t size, double value);
+
+static const struct
+{
+	const char *ext;
+	const char *content_type;
+	struct canvas *(*create)(unsigned int width, unsigned int height);
+} formats[GRAPH_FORMAT_COUNT] = {
+	{ "png", "image/png", png_canvas_create },
+	{ "svg", "image/svg+xml", svg_canvas_create }
+};
+
+// The first entry whose max_span is not smaller than the graph span is used
+static const struct
+{
+	time_t max_span;
+	time_t minor;
+	time_t major;
+	const char *format;
+} time_grids[] = {
+	{ 2 * 3600, 300, 900, "%H:%M" },
+	{ 6 * 3600, 900, 3600, "%H:%M" },
+	{ 2 * 86400, 3600, 4 * 3600, "%H:%M" },
+	{ 14 * 86400, 6 * 3600, 86400, "%a" },
+	{ 62 * 86400, 86400, 7 * 86400, "%d.%m." },
+	{ 0, GRAPH_MONTH, GRAPH_MONTH, "%b" }
+};
+
+static struct http_handler handlers[] = {
+	{ "/graphs/?*", graph_handler },
+	{ NULL, NULL }
+};
+
+static struct
+{
+	unsigned int cache_time;
+} graph_conf;
+
+static struct dict *graphs;
+
+
+void graph_init()
+{
+	graphs = dict_create();
+	dict_set_free_funcs(graphs, NULL, (dict_free_f *)graph_entry_free);
+	reg_conf_reload_func(graph_conf_reload);
+	graph_conf_reload();
+	http_handler_add_list(handlers);
+}
+
+void graph_fini()
+{
+	http_handler_del_list(handlers);
+	unreg_conf_reload_func(graph_conf_reload);
+	dict_free(graphs);
+}
+
+static void graph_conf_reload()
+{
+	char *str;
+
+	str = conf_get("rrd/graph_cache_time", DB_STRING);
+	graph_conf.cache_time = str ? atoi(str) : 60;
+}
+
+void rrd_graph_add(const char *name, struct rrd *rrd, const struct rrd_graph *graph)
+{
+	struct graph_entry *entry;
+
+	rrd_graph_del(name);
+
+	entry = malloc(sizeof(struct graph_entry));
+	memset(entry, 0, sizeof(struct graph_entry));
+	entry->name = strdup(name);
+	entry->rrd = rrd;
+	entry->graph = *graph;
+	entry->graph.title = graph->title ? strdup(graph->title) : NULL;
+	entry->graph.vlabel = graph->vlabel ? strdup(graph->vlabel) : NULL;
+	dict_insert(graphs, entry->name, entry);
+}
+
+void rrd_graph_del(const char *name)
+{
+	dict_delete(graphs, name);
+}
+
+void graph_del_rrd(struct rrd *rrd)
+{
+	dict_iter(node, graphs)
+	{
+		struct graph_entry *entry = node->data;
+		if(entry->rrd == rrd)
+			dict_delete_node(graphs, node);
+	}
+}
+
+static void graph_entry_free(struct graph_entry *entry)
+{
+	for(int i = 0; i < GRAPH_FORMAT_COUNT; i++)
+	{
+		if(entry->images[i].data)
+			stringbuffer_free(entry->images[i].data);
+	}
+
+	free((char *)entry->graph.title);
+	free((char *)entry->graph.vlabel);
+	free(entry->name);
+	free(entry);
+}
+
+HTTP_HANDLER(graph_handler)
+{
+	struct graph_entry *entry = NULL;
+	struct graph_image *image;
+	char name[128], nowbuf[64], modbuf[64];
+	char *ext;
+	int format;
+	time_t mod;
+
+	strlcpy(name, argv[argc - 1], sizeof(name));
+	if((ext = strrchr(name, '.')))
+	{
+		*ext++ = '\0';
+		entry = dict_find(graphs, name);
+	}
+
+	for(format = 0; ext && format < GRAPH_FORMAT_COUNT; format++)
+	{
+		if(!strcmp(formats[format].ext, ext))
+			break;
+	}
+
+	if(!entry || format == GRAPH_FORMAT_COUNT)
+	{
+		char *encoded = html_encode(argv[argc - 1]);
+		http_write_header_status(client, 404);
+		http_reply_header("Content-Type", "text/html");
+		http_reply("Graph not found: %s", encoded);
+		free(encoded);
+		return;
+	}
+
+	// Rendering is expensive so images are only updated if they are outdated and old enough
+	image = &entry->images[format];
+	if(!image->data || (image->last_update != rrd_last_update(entry->rrd) && now - image->rendered >= graph_conf.cache_time))
+		graph_render(entry, format);
+
+	mod = image->last_update;
+	strftime(nowbuf, sizeof(nowbuf), RFC1123FMT, gmtime(&now));
+	strftime(modbuf, sizeof(modbuf), RFC1123FMT, gmtime(&mod));
+	mod = mktime(gmtime(&mod));
+
+	http_reply_header("Date", "%s", nowbuf);
+	http_reply_header("Last-Modified", "%s", modbuf);
+	http_reply_header("Content-Type", "%s", formats[format].content_type);
+	http_reply_header("Cache-Control", "max-age=%u", graph_conf.cache_time);
+
+	if(mod <= client->if_modified_since)
+	{
+		http_write_header_status(client, 304);
+		return;
+	}
+
+	stringbuffer_append_string_n(client->wbuf, image->data->string, image->data->len);
+}
+
+static void graph_render(struct graph_entry *entry, enum graph_format format)
+{
+	const struct rrd_graph *graph = &entry->graph;
+	struct graph_image *image = &entry->images[format];
+	struct graph_stats stats[graph->series_count];
+	double *columns[graph->series_count];
+	double ratios[graph->ratio_count + 1];
+	struct canvas *canvas;
+	time_t end, start;
+
+	end = rrd_last_update(entry->rrd);
+	start = end - graph->span;
+
+	for(unsigned int i = 0; i < graph->series_count; i++)
+	{
+		struct rrd_series series;
+
+		columns[i] = malloc(GRAPH_WIDTH * sizeof(double));
+		rrd_fetch(entry->rrd, graph->series[i].ds, RRD_AVERAGE, start, end, &series);
+		graph_resample(&series, start, graph->span, columns[i]);
+		graph_stats(entry->rrd, graph->series[i].ds, &series, start, end, &stats[i]);
+		rrd_series_free(&series);
+	}
+
+	for(unsigned int i = 0; i < graph->ratio_count; i++)
+		ratios[i] = graph_ratio(entry->rrd, &graph->ratios[i], start, end);
+
+	canvas = formats[format].create(GRAPH_MARGIN_LEFT + GRAPH_WIDTH + GRAPH_MARGIN_RIGHT,
+					GRAPH_MARGIN_TOP + graph->height + GRAPH_MARGIN_BOTTOM + (graph->series_count + graph->ratio_count) * GRAPH_LEGEND_LINE + 4);
+	graph_draw(graph, canvas, end, columns, stats, ratios);
+
+	if(image->data)
+		stringbuffer_empty(image->data);
+	else
+		image->data = stringbuffer_create();
+	canvas->finish(canvas, image->data);
+	canvas->free(canvas);
+
+	image->rendered = now;
+	image->last_update = end;
+
+	for(unsigned int i = 0; i < graph->series_count; i++)
+		free(columns[i]);
+}
+
+static void graph_draw(const struct rrd_graph *graph, struct canvas *canvas, time_t end, double **columns, const struct graph_stats *stats, const double *ratios)
+{
+	unsigned int top = GRAPH_MARGIN_TOP, height = graph->height;
+	unsigned int base = top + height - 1;
+	unsigned int ticks, legend_len = 0;
+	int ys[GRAPH_WIDTH];
+	double ymax = 0;
+
+	for(unsigned int i = 0; i < graph->series_count; i++)
+	{
+		for(unsigned int j = 0; j < GRAPH_WIDTH; j++)
+			if(!isnan(columns[i][j]) && columns[i][j] > ymax)
+				ymax = columns[i][j];
+		if(graph->series[i].legend)
+			legend_len = max(legend_len, strlen(graph->series[i].legend));
+	}
+	ymax = graph_nice_max(ymax, &ticks);
+
+	canvas->rect(canvas, 0, 0, canvas->width, canvas->height, COLOR_BACK);
+	canvas->rect(canvas, GRAPH_MARGIN_LEFT, top, GRAPH_WIDTH, height, COLOR_CANVAS);
+	if(graph->title)
+		canvas->text(canvas, (canvas->width - strlen(graph->title) * CANVAS_CHAR_WIDTH) / 2, 4, graph->title, COLOR_FONT);
+	if(graph->vlabel)
+		canvas->text(canvas, 4, top - CANVAS_LINE_HEIGHT - 2, graph->vlabel, COLOR_FONT);
+
+	graph_draw_time_grid(canvas, end - graph->span, graph->span, top, height);
+	graph_draw_value_grid(canvas, ymax, ticks, top, height);
+
+	for(unsigned int i = 0; i < graph->series_count; i++)
+	{
+		const struct rrd_graph_series *series = &graph->series[i];
+
+		for(unsigned int j = 0; j < GRAPH_WIDTH; j++)
+			ys[j] = isnan(columns[i][j]) ? -1 : (int)(base - lround(fmin(columns[i][j], ymax) / ymax * (height - 1)));
+
+		if(series->type == RRD_GRAPH_AREA)
+			canvas->area(canvas, GRAPH_MARGIN_LEFT, base, ys, GRAPH_WIDTH, series->color);
+		else
+			canvas->polyline(canvas, GRAPH_MARGIN_LEFT, ys, GRAPH_WIDTH, series->color);
+	}
+
+	canvas->line(canvas, GRAPH_MARGIN_LEFT, base + 1, GRAPH_MARGIN_LEFT + GRAPH_WIDTH + 4, base + 1, COLOR_FONT, 0);
+	canvas->line(canvas, GRAPH_MARGIN_LEFT - 1, top - 4, GRAPH_MARGIN_LEFT - 1, base + 1, COLOR_FONT, 0);
+
+	for(unsigned int i = 0; i < graph->series_count; i++)
+	{
+		unsigned int y = base + GRAPH_MARGIN_BOTTOM + i * GRAPH_LEGEND_LINE;
+		char maxbuf[16], avgbuf[16], curbuf[16], line[256];
+
+		format_stat(maxbuf, sizeof(maxbuf), stats[i].max);
+		format_stat(avgbuf, sizeof(avgbuf), stats[i].average);
+		format_stat(curbuf, sizeof(curbuf), stats[i].current);
+		snprintf(line, sizeof(line), "%-*s Max: %s  Average: %s  Current: %s", (int)legend_len,
+			 graph->series[i].legend ? graph->series[i].legend : "", maxbuf, avgbuf, curbuf);
+
+		canvas->rect(canvas, 8, y, 8, 8, graph->series[i].color);
+		canvas->text(canvas, 20, y, line, COLOR_FONT);
+	}
+
+	for(unsigned int i = 0; i < graph->ratio_count; i++)
+	{
+		unsigned int y = base + GRAPH_MARGIN_BOTTOM + (graph->series_count + i) * GRAPH_LEGEND_LINE;
+		const struct rrd_graph_ratio *ratio = &graph->ratios[i];
+		char line[256];
+
+		if(isnan(ratios[i]))
+			snprintf(line, sizeof(line), "%s: -", ratio->legend);
+		else
+			snprintf(line, sizeof(line), "%s: %.2f%s", ratio->legend, ratios[i], ratio->unit ? ratio->unit : "");
+		canvas->text(canvas, 20, y, line, COLOR_FONT);
+	}
+}
+
+static void graph_draw_time_grid(struct canvas *canvas, time_t start, time_t span, unsigned int top, unsigned int height)
+{
+	unsigned int grid = 0;
+	time_t end = start + span;
+
+	while(time_grids[grid].max_span && time_grids[grid].max_span < span)
+		grid++;
+
+	if(time_grids[grid].minor != time_grids[grid].major)
+	{
+		for(time_t t = grid_next(grid_align(start, time_grids[grid].minor), time_grids[grid].minor); t < end; t = grid_next(t, time_grids[grid].minor))
+		{
+			int x = GRAPH_MARGIN_LEFT + (t - start) * GRAPH_WIDTH / span;
+			canvas->line(canvas, x, top, x, top + height - 1, COLOR_GRID, 1);
+		}
+	}
+
+	for(time_t t = grid_next(grid_align(start, time_grids[grid].major), time_grids[grid].major); t < end; t = grid_next(t, time_grids[grid].major))
+	{
+		int x = GRAPH_MARGIN_LEFT + (t - start) * GRAPH_WIDTH / span;
+		char label[32];
+		struct tm tm;
+
+		canvas->line(canvas, x, top, x, top + height - 1, COLOR_MGRID, 1);
+		localtime_r(&t, &tm);
+		strftime(label, sizeof(label), time_grids[grid].format, &tm);
+		canvas->text(canvas, x - strlen(label) * CANVAS_CHAR_WIDTH / 2, top + height + 4, label, COLOR_FONT);
+	}
+}
+
+static void graph_draw_value_grid(struct canvas *canvas, double ymax, unsigned int ticks, unsigned int top, unsigned int height)
+{
+	double tick = ymax / ticks;
+	int decimals = tick < 1 ? (int)ceil(-log10(tick)) : 0;
+
+	for(unsigned int i = 0; i <= ticks; i++)
+	{
+		int y = top + height - 1 - i * (height - 1) / ticks;
+		char label[32];
+
+		if(i)
+			canvas->line(canvas, GRAPH_MARGIN_LEFT, y, GRAPH_MARGIN_LEFT + GRAPH_WIDTH - 1, y, COLOR_MGRID, 1);
+		snprintf(label, sizeof(label), "%.*f", decimals, i * tick);
+		canvas->text(canvas, GRAPH_MARGIN_LEFT - 6 - strlen(label) * CANVAS_CHAR_WIDTH, y - 3, label, COLOR_FONT);
+	}
+}
+
+// Resamples a series to one value per column, averaging all rows ending within a column
+static void graph_resample(const struct rrd_series *series, time_t start, time_t span, double *columns)
+{
+	for(unsigned int c = 0; c < GRAPH_WIDTH; c++)
+	{
+		time_t t0 = start + (time_t)c * span / GRAPH_WIDTH;
+		time_t t1 = start + (time_t)(c + 1) * span / GRAPH_WIDTH;
+		long first, last;
+		unsigned int known = 0;
+		double sum = 0;
+
+		columns[c] = NAN;
+		if(!series->count)
+			continue;
+
+		first = floor_div(t0 - series->start, series->step) + 1;
+		last = floor_div(t1 - series->start, series->step);
+		// Rows wider than a column: use the row containing the end of the column
+		if(first > last)
+			first = last = last + 1;
+		first = max(first, 0);
+		last = min(last, (long)series->count - 1);
+
+		for(long i = first; i <= last; i++)
+		{
+			if(isnan(series->values[i]))
+				continue;
+			sum += series->values[i];
+			known++;
+		}
+
+		if(known)
+			columns[c] = sum / known;
+	}
+}
+
+static void graph_stats(struct rrd *rrd, const char *ds, const struct rrd_series *series, time_t start, time_t end, struct graph_stats *stats)
+{
+	struct rrd_series max_series;
+	unsigned int known = 0;
+	double sum = 0;
+
+	stats->max = NAN;
+	stats->average = NAN;
+	stats->current = NAN;
+
+	for(unsigned int i = 0; i < series->count; i++)
+	{
+		if(isnan(series->values[i]))
+			continue;
+		sum += series->values[i];
+		known++;
+		stats->current = series->values[i];
+		if(isnan(stats->max) || series->values[i] > stats->max)
+			stats->max = series->values[i];
+	}
+
+	if(known)
+		stats->average = sum / known;
+
+	// Prefer the real maximum over the maximum of the averages
+	if(rrd_fetch(rrd, ds, RRD_MAX, start, end, &max_series) == 0)
+	{
+		for(unsigned int i = 0; i < max_series.count; i++)
+		{
+			if(!isnan(max_series.values[i]) && (isnan(stats->max) || max_series.values[i] > stats->max))
+				stats->max = max_series.values[i];
+		}
+		rrd_series_free(&max_series);
+	}
+}
+
+// Most recent row in which both data sources are known; NAN if there is none
+static double graph_ratio(struct rrd *rrd, const struct rrd_graph_ratio *ratio, time_t start, time_t end)
+{
+	struct rrd_series num, denom;
+	double value = NAN;
+
+	if(rrd_fetch(rrd, ratio->numerator, RRD_AVERAGE, start, end, &num))
+		return NAN;
+	if(rrd_fetch(rrd, ratio->denominator, RRD_AVERAGE, start, end, &denom))
+	{
+		rrd_series_free(&num);
+		return NAN;
+	}
+
+	// Both series come from the same archive, so rows with the same index cover the same time
+	for(unsigned int i = min(num.count, denom.count); i-- > 0; )
+	{
+		if(isnan(num.values[i]) || isnan(denom.values[i]) || denom.values[i] == 0)
+			continue;
+		value = num.values[i] * ratio->factor / denom.values[i];
+		break;
+	}
+
+	rrd_series_free(&num);
+	rrd_series_free(&denom);
+	return value;
+}
+
+// Rounds up to 1, 2 or 5 times a power of ten and picks a matching number of grid lines
+static double graph_nice_max(double value, unsigned int *ticks)
+{
+	double magnitude;
+
+	if(value <= 0)
+	{
+		*ticks = 5;
+		return 1;
+	}
+
+	magnitude = pow(10, floor(log10(value)));
+	if(value <= magnitude)
+	{
+		*ticks = 5;
+		return magnitude;
+	}
+	else if(value <= 2 * magnitude)
+	{
+		*ticks = 4;
+		return 2 * magnitude;
+	}
+	else if(value <= 5 * magnitude)
+	{
+		*ticks = 5;
+		return 5 * magnitude;
+	}
+
+	*ticks = 5;
+	return 10 * magnitude;
+}
+
+// Aligns to the start of a grid unit in local time; weeks start on monday
+static time_t grid_align(time_t t, time_t unit)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	if(unit == GRAPH_MONTH)
+	{
+		tm.tm_mday = 1;
+		tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		return mktime(&tm);
+	}
+
+	// The epoch was a thursday
+	if(unit % (7 * 86400) == 0)
+		return t - (t + tm.tm_gmtoff + 3 * 86400) % unit;
+	return t - (t + tm.tm_gmtoff) % unit;
+}
+
+static time_t grid_next(time_t t, time_t unit)
+{
+	struct tm tm;
+
+	if(unit != GRAPH_MONTH)
+		return t + unit;
+
+	localtime_r(&t, &tm);
+	tm.tm_mon++;
+	tm.tm_mday = 1;
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+static long floor_div(long a, long b)
+{
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static void format_stat(char *buf, size_t size, double value)
+{
+	if(isnan(value))
+		snprintf(buf, size, "%8s", "-");
+	else
+		snprintf(buf, size, "%8.2f", value);
+}
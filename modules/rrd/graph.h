@@ -0,0 +1,11 @@
+#ifndef RRD_GRAPH_H
+#define RRD_GRAPH_H
+
+struct rrd;
+
+void graph_init();
+void graph_fini();
+// Removes all graphs of an rrd that is being closed
+void graph_del_rrd(struct rrd *rrd);
+
+#endif
@@ -0,0 +1,193 @@
+#include "global.h"
+#include "rrd.h"
+#include "store.h"
+#include "modules/tools/tools.h"
+
+#include <math.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+static xmlNodePtr xml_child(xmlNodePtr node, const char *name);
+static char *xml_child_content(xmlNodePtr node, const char *name);
+static int import_rra(struct rrd *rrd, xmlNodePtr node, const int *ds_map, unsigned int xml_ds_count);
+static double parse_value(const char *str);
+
+
+// Imports the output of `rrdtool dump`. Archives are matched by consolidation
+// function and steps, data sources by name; everything else is skipped.
+int rrd_import_xml(struct rrd *rrd, const char *xml_file)
+{
+	xmlDocPtr doc;
+	xmlNodePtr root, node;
+	char *str;
+	int ds_map[RRD_MAX_DS * 2];
+	unsigned int xml_ds_count = 0, imported = 0;
+	time_t last_update;
+
+	if(!(doc = xmlReadFile(xml_file, NULL, XML_PARSE_NONET | XML_PARSE_NOBLANKS)))
+	{
+		log_append(LOG_WARNING, "could not parse %s", xml_file);
+		return -1;
+	}
+
+	root = xmlDocGetRootElement(doc);
+	if(!root || xmlStrcmp(root->name, (const xmlChar *)"rrd"))
+	{
+		log_append(LOG_WARNING, "%s is not an rrdtool dump", xml_file);
+		xmlFreeDoc(doc);
+		return -1;
+	}
+
+	str = xml_child_content(root, "step");
+	if(!str || strtoul(str, NULL, 10) != rrd->header->step)
+	{
+		log_append(LOG_WARNING, "%s has a different step than %s", xml_file, rrd->file);
+		xmlFree(str);
+		xmlFreeDoc(doc);
+		return -1;
+	}
+	xmlFree(str);
+
+	str = xml_child_content(root, "lastupdate");
+	last_update = str ? strtoll(str, NULL, 10) : 0;
+	xmlFree(str);
+
+	for(node = root->children; node; node = node->next)
+	{
+		char *name;
+
+		if(node->type != XML_ELEMENT_NODE || xmlStrcmp(node->name, (const xmlChar *)"ds"))
+			continue;
+		if(xml_ds_count == ArraySize(ds_map))
+			break;
+
+		name = xml_child_content(node, "name");
+		ds_map[xml_ds_count++] = name ? rrd_ds_index(rrd, trim(name)) : -1;
+		xmlFree(name);
+	}
+
+	rrd->header->last_update = last_update;
+	for(node = root->children; node; node = node->next)
+	{
+		if(node->type == XML_ELEMENT_NODE && !xmlStrcmp(node->name, (const xmlChar *)"rra"))
+			imported += (import_rra(rrd, node, ds_map, xml_ds_count) == 0);
+	}
+	rrd_reset_state(rrd);
+
+	xmlFreeDoc(doc);
+	log_append(LOG_INFO, "imported %u archives from %s", imported, xml_file);
+	return 0;
+}
+
+static int import_rra(struct rrd *rrd, xmlNodePtr node, const int *ds_map, unsigned int xml_ds_count)
+{
+	xmlNodePtr database, row;
+	unsigned int ds_count = rrd->header->ds_count;
+	unsigned int xml_rows = 0, skip, pos;
+	enum rrd_cf cf;
+	uint32_t steps;
+	char *str;
+	int rra = -1;
+	double *rows;
+
+	str = xml_child_content(node, "cf");
+	if(!str)
+		return -1;
+	trim(str);
+	if(!strcmp(str, "AVERAGE"))
+		cf = RRD_AVERAGE;
+	else if(!strcmp(str, "MAX"))
+		cf = RRD_MAX;
+	else
+	{
+		xmlFree(str);
+		return -1;
+	}
+	xmlFree(str);
+
+	str = xml_child_content(node, "pdp_per_row");
+	steps = str ? strtoul(str, NULL, 10) : 0;
+	xmlFree(str);
+
+	for(unsigned int i = 0; i < rrd->header->rra_count; i++)
+	{
+		if(rrd->rra[i].cf == cf && rrd->rra[i].steps == steps)
+		{
+			rra = i;
+			break;
+		}
+	}
+
+	if(rra == -1 || !(database = xml_child(node, "database")))
+		return -1;
+
+	for(row = database->children; row; row = row->next)
+		if(row->type == XML_ELEMENT_NODE)
+			xml_rows++;
+
+	// The dump lists the oldest row first; only the newest ones fit if the archive is smaller
+	skip = xml_rows > rrd->rra[rra].rows ? xml_rows - rrd->rra[rra].rows : 0;
+	pos = rrd->rra[rra].rows - (xml_rows - skip);
+	rows = rrd_rows(rrd, rra);
+	for(row = database->children; row; row = row->next)
+	{
+		xmlNodePtr v;
+		unsigned int ds = 0;
+
+		if(row->type != XML_ELEMENT_NODE)
+			continue;
+		if(skip)
+		{
+			skip--;
+			continue;
+		}
+
+		for(v = row->children; v && ds < xml_ds_count; v = v->next)
+		{
+			if(v->type != XML_ELEMENT_NODE)
+				continue;
+
+			if(ds_map[ds] >= 0)
+			{
+				xmlChar *content = xmlNodeGetContent(v);
+				rows[pos * ds_count + ds_map[ds]] = parse_value((const char *)content);
+				xmlFree(content);
+			}
+			ds++;
+		}
+		pos++;
+	}
+
+	rrd->rra[rra].cur_row = rrd->rra[rra].rows - 1;
+	return 0;
+}
+
+static xmlNodePtr xml_child(xmlNodePtr node, const char *name)
+{
+	for(node = node->children; node; node = node->next)
+	{
+		if(node->type == XML_ELEMENT_NODE && !xmlStrcmp(node->name, (const xmlChar *)name))
+			return node;
+	}
+
+	return NULL;
+}
+
+// Returns the content of the first child element called name; must be freed with xmlFree()
+static char *xml_child_content(xmlNodePtr node, const char *name)
+{
+	if(!(node = xml_child(node, name)))
+		return NULL;
+	return (char *)xmlNodeGetContent(node);
+}
+
+static double parse_value(const char *str)
+{
+	char *end;
+	double value;
+
+	if(!str)
+		return NAN;
+	value = strtod(str, &end);
+	return end == str ? NAN : value;
+}
@@ -0,0 +1,254 @@
+#include "global.h"
+#include "stringbuffer.h"
+#include "canvas.h"
+#include "png.h"
+
+#include <zlib.h>
+
+struct png_canvas
+{
+	struct canvas canvas;
+	uint8_t *pixels; // RGB
+};
+
+static void png_rect(struct canvas *canvas, int x, int y, int w, int h, uint32_t color);
+static void png_line(struct canvas *canvas, int x1, int y1, int x2, int y2, uint32_t color, uint8_t dashed);
+static void png_text(struct canvas *canvas, int x, int y, const char *text, uint32_t color);
+static void png_area(struct canvas *canvas, int x, int base, const int *ys, unsigned int count, uint32_t color);
+static void png_polyline(struct canvas *canvas, int x, const int *ys, unsigned int count, uint32_t color);
+static void png_finish(struct canvas *canvas, struct stringbuffer *out);
+static void png_free(struct canvas *canvas);
+static void png_chunk(struct stringbuffer *out, const char *type, const uint8_t *data, uint32_t len);
+static inline void png_pixel(struct png_canvas *png, int x, int y, uint32_t color);
+static void put_uint32(uint8_t *buf, uint32_t value);
+
+// 5x7 font for ASCII 32-126; one byte per column, bit 0 is the top row
+static const uint8_t font[][5] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5F, 0x00, 0x00 }, { 0x00, 0x07, 0x00, 0x07, 0x00 }, { 0x14, 0x7F, 0x14, 0x7F, 0x14 },
+	{ 0x24, 0x2A, 0x7F, 0x2A, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 }, { 0x36, 0x49, 0x55, 0x22, 0x50 }, { 0x00, 0x05, 0x03, 0x00, 0x00 },
+	{ 0x00, 0x1C, 0x22, 0x41, 0x00 }, { 0x00, 0x41, 0x22, 0x1C, 0x00 }, { 0x08, 0x2A, 0x1C, 0x2A, 0x08 }, { 0x08, 0x08, 0x3E, 0x08, 0x08 },
+	{ 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 }, { 0x00, 0x60, 0x60, 0x00, 0x00 }, { 0x20, 0x10, 0x08, 0x04, 0x02 },
+	{ 0x3E, 0x51, 0x49, 0x45, 0x3E }, { 0x00, 0x42, 0x7F, 0x40, 0x00 }, { 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4B, 0x31 },
+	{ 0x18, 0x14, 0x12, 0x7F, 0x10 }, { 0x27, 0x45, 0x45, 0x45, 0x39 }, { 0x3C, 0x4A, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 },
+	{ 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1E }, { 0x00, 0x36, 0x36, 0x00, 0x00 }, { 0x00, 0x56, 0x36, 0x00, 0x00 },
+	{ 0x08, 0x14, 0x22, 0x41, 0x00 }, { 0x14, 0x14, 0x14, 0x14, 0x14 }, { 0x00, 0x41, 0x22, 0x14, 0x08 }, { 0x02, 0x01, 0x51, 0x09, 0x06 },
+	{ 0x32, 0x49, 0x79, 0x41, 0x3E }, { 0x7E, 0x11, 0x11, 0x11, 0x7E }, { 0x7F, 0x49, 0x49, 0x49, 0x36 }, { 0x3E, 0x41, 0x41, 0x41, 0x22 },
+	{ 0x7F, 0x41, 0x41, 0x22, 0x1C }, { 0x7F, 0x49, 0x49, 0x49, 0x41 }, { 0x7F, 0x09, 0x09, 0x01, 0x01 }, { 0x3E, 0x41, 0x41, 0x51, 0x32 },
+	{ 0x7F, 0x08, 0x08, 0x08, 0x7F }, { 0x00, 0x41, 0x7F, 0x41, 0x00 }, { 0x20, 0x40, 0x41, 0x3F, 0x01 }, { 0x7F, 0x08, 0x14, 0x22, 0x41 },
+	{ 0x7F, 0x40, 0x40, 0x40, 0x40 }, { 0x7F, 0x02, 0x04, 0x02, 0x7F }, { 0x7F, 0x04, 0x08, 0x10, 0x7F }, { 0x3E, 0x41, 0x41, 0x41, 0x3E },
+	{ 0x7F, 0x09, 0x09, 0x09, 0x06 }, { 0x3E, 0x41, 0x51, 0x21, 0x5E }, { 0x7F, 0x09, 0x19, 0x29, 0x46 }, { 0x46, 0x49, 0x49, 0x49, 0x31 },
+	{ 0x01, 0x01, 0x7F, 0x01, 0x01 }, { 0x3F, 0x40, 0x40, 0x40, 0x3F }, { 0x1F, 0x20, 0x40, 0x20, 0x1F }, { 0x7F, 0x20, 0x18, 0x20, 0x7F },
+	{ 0x63, 0x14, 0x08, 0x14, 0x63 }, { 0x03, 0x04, 0x78, 0x04, 0x03 }, { 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x7F, 0x41, 0x41, 0x00 },
+	{ 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x00, 0x41, 0x41, 0x7F, 0x00 }, { 0x04, 0x02, 0x01, 0x02, 0x04 }, { 0x40, 0x40, 0x40, 0x40, 0x40 },
+	{ 0x00, 0x01, 0x02, 0x04, 0x00 }, { 0x20, 0x54, 0x54, 0x54, 0x78 }, { 0x7F, 0x48, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x20 },
+	{ 0x38, 0x44, 0x44, 0x48, 0x7F }, { 0x38, 0x54, 0x54, 0x54, 0x18 }, { 0x08, 0x7E, 0x09, 0x01, 0x02 }, { 0x08, 0x14, 0x54, 0x54, 0x3C },
+	{ 0x7F, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7D, 0x40, 0x00 }, { 0x20, 0x40, 0x44, 0x3D, 0x00 }, { 0x00, 0x7F, 0x10, 0x28, 0x44 },
+	{ 0x00, 0x41, 0x7F, 0x40, 0x00 }, { 0x7C, 0x04, 0x18, 0x04, 0x78 }, { 0x7C, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 },
+	{ 0x7C, 0x14, 0x14, 0x14, 0x08 }, { 0x08, 0x14, 0x14, 0x18, 0x7C }, { 0x7C, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x20 },
+	{ 0x04, 0x3F, 0x44, 0x40, 0x20 }, { 0x3C, 0x40, 0x40, 0x20, 0x7C }, { 0x1C, 0x20, 0x40, 0x20, 0x1C }, { 0x3C, 0x40, 0x30, 0x40, 0x3C },
+	{ 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x0C, 0x50, 0x50, 0x50, 0x3C }, { 0x44, 0x64, 0x54, 0x4C, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 },
+	{ 0x00, 0x00, 0x7F, 0x00, 0x00 }, { 0x00, 0x41, 0x36, 0x08, 0x00 }, { 0x02, 0x01, 0x02, 0x04, 0x02 }
+};
+
+
+struct canvas *png_canvas_create(unsigned int width, unsigned int height)
+{
+	struct png_canvas *png = malloc(sizeof(struct png_canvas));
+
+	memset(png, 0, sizeof(struct png_canvas));
+	png->canvas.width = width;
+	png->canvas.height = height;
+	png->canvas.rect = png_rect;
+	png->canvas.line = png_line;
+	png->canvas.text = png_text;
+	png->canvas.area = png_area;
+	png->canvas.polyline = png_polyline;
+	png->canvas.finish = png_finish;
+	png->canvas.free = png_free;
+	png->pixels = calloc(width * height, 3);
+	return &png->canvas;
+}
+
+static inline void png_pixel(struct png_canvas *png, int x, int y, uint32_t color)
+{
+	uint8_t *pixel;
+
+	if(x < 0 || y < 0 || x >= (int)png->canvas.width || y >= (int)png->canvas.height)
+		return;
+
+	pixel = png->pixels + (y * png->canvas.width + x) * 3;
+	pixel[0] = (color >> 16) & 0xff;
+	pixel[1] = (color >> 8) & 0xff;
+	pixel[2] = color & 0xff;
+}
+
+static void png_rect(struct canvas *canvas, int x, int y, int w, int h, uint32_t color)
+{
+	struct png_canvas *png = (struct png_canvas *)canvas;
+
+	for(int i = y; i < y + h; i++)
+		for(int j = x; j < x + w; j++)
+			png_pixel(png, j, i, color);
+}
+
+// Bresenham; dashed lines alternate two pixels on, two pixels off
+static void png_line(struct canvas *canvas, int x1, int y1, int x2, int y2, uint32_t color, uint8_t dashed)
+{
+	struct png_canvas *png = (struct png_canvas *)canvas;
+	int dx = abs(x2 - x1), dy = -abs(y2 - y1);
+	int sx = x1 < x2 ? 1 : -1, sy = y1 < y2 ? 1 : -1;
+	int err = dx + dy;
+
+	for(unsigned int i = 0; ; i++)
+	{
+		if(!dashed || (i & 2) == 0)
+			png_pixel(png, x1, y1, color);
+		if(x1 == x2 && y1 == y2)
+			break;
+
+		if(err * 2 >= dy)
+		{
+			err += dy;
+			x1 += sx;
+		}
+		if(err * 2 <= dx)
+		{
+			err += dx;
+			y1 += sy;
+		}
+	}
+}
+
+static void png_text(struct canvas *canvas, int x, int y, const char *text, uint32_t color)
+{
+	struct png_canvas *png = (struct png_canvas *)canvas;
+
+	for(; *text; text++, x += CANVAS_CHAR_WIDTH)
+	{
+		uint8_t c = *text;
+		const uint8_t *glyph;
+
+		// UTF-8 sequences are drawn as a single question mark
+		if(c >= 0x80 && c < 0xc0)
+		{
+			x -= CANVAS_CHAR_WIDTH;
+			continue;
+		}
+		if(c < 32 || c > 126)
+			c = '?';
+
+		glyph = font[c - 32];
+		for(int col = 0; col < 5; col++)
+			for(int row = 0; row < 7; row++)
+				if(glyph[col] & (1 << row))
+					png_pixel(png, x + col, y + row, color);
+	}
+}
+
+static void png_area(struct canvas *canvas, int x, int base, const int *ys, unsigned int count, uint32_t color)
+{
+	struct png_canvas *png = (struct png_canvas *)canvas;
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if(ys[i] < 0)
+			continue;
+		for(int y = ys[i]; y <= base; y++)
+			png_pixel(png, x + i, y, color);
+	}
+}
+
+// Two pixels wide, gaps at unknown values
+static void png_polyline(struct canvas *canvas, int x, const int *ys, unsigned int count, uint32_t color)
+{
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if(ys[i] < 0)
+			continue;
+
+		if(i + 1 < count && ys[i + 1] >= 0)
+		{
+			png_line(canvas, x + i, ys[i], x + i + 1, ys[i + 1], color, 0);
+			png_line(canvas, x + i, ys[i] - 1, x + i + 1, ys[i + 1] - 1, color, 0);
+		}
+		else
+			png_line(canvas, x + i, ys[i] - 1, x + i, ys[i], color, 0);
+	}
+}
+
+static void png_finish(struct canvas *canvas, struct stringbuffer *out)
+{
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	struct png_canvas *png = (struct png_canvas *)canvas;
+	size_t row_size = canvas->width * 3 + 1;
+	size_t raw_size = row_size * canvas->height;
+	uLongf compressed_size = compressBound(raw_size);
+	uint8_t *raw, *compressed;
+	uint8_t ihdr[13];
+
+	put_uint32(ihdr, canvas->width);
+	put_uint32(ihdr + 4, canvas->height);
+	ihdr[8] = 8;	// bit depth
+	ihdr[9] = 2;	// truecolor
+	ihdr[10] = 0;	// deflate
+	ihdr[11] = 0;	// adaptive filtering
+	ihdr[12] = 0;	// no interlace
+
+	// Every scanline starts with its filter type; 0 leaves it unfiltered
+	raw = malloc(raw_size);
+	for(unsigned int y = 0; y < canvas->height; y++)
+	{
+		raw[y * row_size] = 0;
+		memcpy(raw + y * row_size + 1, png->pixels + y * canvas->width * 3, canvas->width * 3);
+	}
+
+	compressed = malloc(compressed_size);
+	if(compress2(compressed, &compressed_size, raw, raw_size, Z_BEST_COMPRESSION) != Z_OK)
+	{
+		log_append(LOG_WARNING, "could not compress png image");
+		free(compressed);
+		free(raw);
+		return;
+	}
+
+	stringbuffer_append_string_n(out, (const char *)signature, sizeof(signature));
+	png_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+	png_chunk(out, "IDAT", compressed, compressed_size);
+	png_chunk(out, "IEND", NULL, 0);
+	free(compressed);
+	free(raw);
+}
+
+static void png_free(struct canvas *canvas)
+{
+	struct png_canvas *png = (struct png_canvas *)canvas;
+
+	free(png->pixels);
+	free(png);
+}
+
+static void png_chunk(struct stringbuffer *out, const char *type, const uint8_t *data, uint32_t len)
+{
+	uint8_t buf[4];
+	uLong crc;
+
+	put_uint32(buf, len);
+	stringbuffer_append_string_n(out, (const char *)buf, 4);
+	stringbuffer_append_string_n(out, type, 4);
+	if(len)
+		stringbuffer_append_string_n(out, (const char *)data, len);
+
+	crc = crc32(0, (const Bytef *)type, 4);
+	if(len)
+		crc = crc32(crc, data, len);
+	put_uint32(buf, crc);
+	stringbuffer_append_string_n(out, (const char *)buf, 4);
+}
+
+static void put_uint32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value >> 24;
+	buf[1] = value >> 16;
+	buf[2] = value >> 8;
+	buf[3] = value;
+}
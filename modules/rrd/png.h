@@ -0,0 +1,6 @@
+#ifndef RRD_PNG_H
+#define RRD_PNG_H
+
+struct canvas *png_canvas_create(unsigned int width, unsigned int height);
+
+#endif
@@ -0,0 +1,213 @@
+#include "global.h"
+#include "module.h"
+#include "rrd.h"
+#include "graph.h"
+
+MODULE_DEPENDS("httpd", "tools", NULL);
+
+#ifdef RRD_TEST
+static void run_test();
+#endif
+
+MODULE_INIT
+{
+	graph_init();
+
+#ifdef RRD_TEST
+	run_test();
+#endif
+}
+
+MODULE_FINI
+{
+	graph_fini();
+}
+
+
+/* testing */
+#ifdef RRD_TEST
+#include <math.h>
+
+#define TEST_FILE	"rrd_test.rrdb"
+#define TEST_STEP	60
+
+static const struct rrd_ds_def test_ds[] = {
+	{ "a", 2 * TEST_STEP },
+	{ "b", 60 * TEST_STEP }
+};
+
+static const struct rrd_rra_def test_rra[] = {
+	{ RRD_AVERAGE, 1, 10 },
+	{ RRD_AVERAGE, 5, 4 },
+	{ RRD_MAX, 5, 4 }
+};
+
+static const struct rrd_def test_def = {
+	TEST_STEP, test_ds, ArraySize(test_ds), test_rra, ArraySize(test_rra)
+};
+
+static unsigned int test_failures;
+
+// Compares a fetched series with the expected rows; NAN means unknown
+static void test_fetch(const char *what, struct rrd *rrd, const char *ds, enum rrd_cf cf, time_t start, time_t end,
+		       time_t first, uint32_t step, const double *expected, unsigned int count)
+{
+	struct rrd_series series;
+
+	if(rrd_fetch(rrd, ds, cf, start, end, &series))
+	{
+		log_append(LOG_ERROR, "rrd test %s: fetch failed", what);
+		test_failures++;
+		return;
+	}
+
+	if(series.start != first || series.step != step || series.count != count)
+	{
+		log_append(LOG_ERROR, "rrd test %s: got %u rows of %us from %ld, expected %u rows of %us from %ld",
+			   what, series.count, series.step, (long)series.start, count, step, (long)first);
+		test_failures++;
+		rrd_series_free(&series);
+		return;
+	}
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if(isnan(expected[i]) ? !isnan(series.values[i]) : (isnan(series.values[i]) || fabs(series.values[i] - expected[i]) > 1e-9))
+		{
+			log_append(LOG_ERROR, "rrd test %s: row %u is %f, expected %f", what, i, series.values[i], expected[i]);
+			test_failures++;
+		}
+	}
+
+	rrd_series_free(&series);
+}
+
+static void run_test()
+{
+	static const struct rrd_rra_def other_rra[] = { { RRD_AVERAGE, 1, 20 } };
+	struct rrd_def other_def = { TEST_STEP, test_ds, ArraySize(test_ds), other_rra, ArraySize(other_rra) };
+	struct rrd *rrd;
+	time_t base;
+	double values[2];
+
+	debug("RRD TEST");
+	unlink(TEST_FILE);
+	if(!(rrd = rrd_open(TEST_FILE, &test_def)))
+	{
+		log_append(LOG_ERROR, "rrd test: could not create " TEST_FILE);
+		return;
+	}
+
+	// Rows of the 5-step archives end at multiples of 5 steps
+	base = (now / (5 * TEST_STEP) + 1) * 5 * TEST_STEP;
+	values[0] = values[1] = NAN;
+	rrd_update(rrd, base, values);
+
+	// One update per step: a = k, b = 2k for the step ending at base + k * step
+	for(int k = 1; k <= 10; k++)
+	{
+		values[0] = k;
+		values[1] = 2 * k;
+		rrd_update(rrd, base + k * TEST_STEP, values);
+	}
+
+	{
+		const double avg1[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+		const double avg5[] = { NAN, 3, 8 };
+		const double max5[] = { NAN, 5, 10 };
+		const double max5b[] = { NAN, 10, 20 };
+
+		test_fetch("average", rrd, "a", RRD_AVERAGE, base + TEST_STEP, base + 10 * TEST_STEP, base + TEST_STEP, TEST_STEP, avg1, 10);
+		// Starting before the finest archive reaches back selects the consolidated one
+		test_fetch("consolidated average", rrd, "a", RRD_AVERAGE, base - 299, base + 10 * TEST_STEP, base, 5 * TEST_STEP, avg5, 3);
+		test_fetch("consolidated max", rrd, "a", RRD_MAX, base - 299, base + 10 * TEST_STEP, base, 5 * TEST_STEP, max5, 3);
+		test_fetch("second data source", rrd, "b", RRD_MAX, base - 299, base + 10 * TEST_STEP, base, 5 * TEST_STEP, max5b, 3);
+	}
+
+	// A gap longer than a's heartbeat makes a unknown; b still covers all five steps at once
+	values[0] = values[1] = 100;
+	rrd_update(rrd, base + 15 * TEST_STEP, values);
+
+	// A step is known if at least half of it is
+	values[0] = values[1] = 7;
+	rrd_update(rrd, base + 15 * TEST_STEP + TEST_STEP / 2, values);
+	values[0] = values[1] = NAN;
+	rrd_update(rrd, base + 16 * TEST_STEP, values);
+
+	{
+		// The finest archive has wrapped around and holds the last 10 steps only
+		const double wrapped_a[] = { 7, 8, 9, 10, NAN, NAN, NAN, NAN, NAN, 7 };
+		const double wrapped_b[] = { 14, 16, 18, 20, 100, 100, 100, 100, 100, 7 };
+		const double avg5_a[] = { 3, 8, NAN };
+		const double avg5_b[] = { 6, 16, 100 };
+
+		test_fetch("heartbeat", rrd, "a", RRD_AVERAGE, base + 7 * TEST_STEP, base + 16 * TEST_STEP, base + 7 * TEST_STEP, TEST_STEP, wrapped_a, 10);
+		test_fetch("bulk update", rrd, "b", RRD_AVERAGE, base + 7 * TEST_STEP, base + 16 * TEST_STEP, base + 7 * TEST_STEP, TEST_STEP, wrapped_b, 10);
+		test_fetch("unknown row", rrd, "a", RRD_AVERAGE, base + 1, base + 16 * TEST_STEP, base + 5 * TEST_STEP, 5 * TEST_STEP, avg5_a, 3);
+		test_fetch("bulk row", rrd, "b", RRD_AVERAGE, base + 1, base + 16 * TEST_STEP, base + 5 * TEST_STEP, 5 * TEST_STEP, avg5_b, 3);
+	}
+
+	// Updates must move forward in time
+	values[0] = values[1] = 1;
+	if(rrd_update(rrd, base + 16 * TEST_STEP, values) == 0)
+	{
+		log_append(LOG_ERROR, "rrd test: update at the same time was accepted");
+		test_failures++;
+	}
+
+	// Everything is in the file, including the partially consolidated rows
+	rrd_close(rrd);
+	if(!(rrd = rrd_open(TEST_FILE, &test_def)) || rrd_last_update(rrd) != base + 16 * TEST_STEP)
+	{
+		log_append(LOG_ERROR, "rrd test: reopening failed");
+		test_failures++;
+	}
+	else
+	{
+		const double avg5_a[] = { 8, NAN, 7 };
+
+		// The row ending at base + 20 steps continues with the step consolidated before closing
+		for(int k = 17; k <= 20; k++)
+		{
+			values[0] = values[1] = 7;
+			rrd_update(rrd, base + k * TEST_STEP, values);
+		}
+		test_fetch("reopened", rrd, "a", RRD_AVERAGE, base + 6 * TEST_STEP, base + 20 * TEST_STEP, base + 10 * TEST_STEP, 5 * TEST_STEP, avg5_a, 3);
+
+		// A gap starting in the middle of a row first completes that row, then writes whole ones
+		values[0] = values[1] = 9;
+		rrd_update(rrd, base + 21 * TEST_STEP, values);
+		rrd_update(rrd, base + 22 * TEST_STEP, values);
+		values[0] = values[1] = 5;
+		rrd_update(rrd, base + 42 * TEST_STEP, values);
+		{
+			const double avg5_b[] = { 6.6, 5, 5, 5 };
+			const double max5_b[] = { 9, 5, 5, 5 };
+
+			test_fetch("long gap", rrd, "b", RRD_AVERAGE, base + 21 * TEST_STEP, base + 42 * TEST_STEP, base + 25 * TEST_STEP, 5 * TEST_STEP, avg5_b, 4);
+			test_fetch("long gap max", rrd, "b", RRD_MAX, base + 21 * TEST_STEP, base + 42 * TEST_STEP, base + 25 * TEST_STEP, 5 * TEST_STEP, max5_b, 4);
+		}
+
+		// ... and keeps the steps after the last whole row for the next one
+		values[0] = values[1] = 1;
+		rrd_update(rrd, base + 45 * TEST_STEP, values);
+		{
+			const double avg5_b[] = { 5, 5, 5, 2.6 };
+
+			test_fetch("long gap end", rrd, "b", RRD_AVERAGE, base + 26 * TEST_STEP, base + 45 * TEST_STEP, base + 30 * TEST_STEP, 5 * TEST_STEP, avg5_b, 4);
+		}
+		rrd_close(rrd);
+	}
+
+	// A file with another layout is refused rather than misread
+	if((rrd = rrd_open(TEST_FILE, &other_def)))
+	{
+		log_append(LOG_ERROR, "rrd test: file with a different layout was opened");
+		test_failures++;
+		rrd_close(rrd);
+	}
+
+	unlink(TEST_FILE);
+	debug("RRD TEST END: %u failures", test_failures);
+}
+#endif
@@ -0,0 +1,102 @@
+#ifndef RRD_H
+#define RRD_H
+
+// Round robin time series stored in mmapped files and graphs rendered on
+// demand for the httpd module (/graphs/<name>.png or /graphs/<name>.svg).
+// All data sources are gauges.
+
+#define RRD_DS_NAME_LEN	20
+
+struct rrd;
+
+enum rrd_cf
+{
+	RRD_AVERAGE,
+	RRD_MAX
+};
+
+struct rrd_ds_def
+{
+	const char *name;
+	uint32_t heartbeat; // longer intervals between two updates are unknown
+};
+
+struct rrd_rra_def
+{
+	enum rrd_cf cf;
+	uint32_t steps;	// primary data points per row
+	uint32_t rows;
+};
+
+struct rrd_def
+{
+	uint32_t step; // seconds per primary data point
+	const struct rrd_ds_def *ds;
+	unsigned int ds_count;
+	const struct rrd_rra_def *rra;
+	unsigned int rra_count;
+};
+
+struct rrd_series
+{
+	time_t start;	// end of the first row
+	uint32_t step;	// seconds per row
+	unsigned int count;
+	double *values;	// NAN for unknown rows
+};
+
+enum rrd_graph_type
+{
+	RRD_GRAPH_AREA,
+	RRD_GRAPH_LINE
+};
+
+struct rrd_graph_series
+{
+	const char *ds;
+	enum rrd_graph_type type;
+	uint32_t color; // 0xRRGGBB
+	const char *legend;
+};
+
+// Legend line showing the most recent row of numerator * factor / denominator,
+// e.g. a percentage of two data sources (rrdtool's CDEF with GPRINT:LAST)
+struct rrd_graph_ratio
+{
+	const char *numerator;
+	const char *denominator;
+	double factor;
+	const char *legend;	// printed as "<legend>: <value><unit>"
+	const char *unit;
+};
+
+struct rrd_graph
+{
+	const char *title;
+	const char *vlabel;
+	unsigned int height;	// height of the plot area; the width is fixed
+	time_t span;		// seconds shown in the graph
+	const struct rrd_graph_series *series;
+	unsigned int series_count;
+	const struct rrd_graph_ratio *ratios;
+	unsigned int ratio_count;
+};
+
+// Opens a file, creating it if necessary. If the file does not exist but
+// <file without extension>.xml does, the output of `rrdtool dump` in that
+// file is imported.
+struct rrd *rrd_open(const char *file, const struct rrd_def *def);
+void rrd_close(struct rrd *rrd);
+int rrd_update(struct rrd *rrd, time_t ts, const double *values);
+time_t rrd_last_update(const struct rrd *rrd);
+int rrd_fetch(struct rrd *rrd, const char *ds, enum rrd_cf cf, time_t start, time_t end, struct rrd_series *series);
+void rrd_series_free(struct rrd_series *series);
+int rrd_import_xml(struct rrd *rrd, const char *xml_file);
+
+// Graphs are rendered when they are requested and the rrd has changed since
+// the last rendering. The graph definition is copied except for the series
+// and ratio arrays which must stay valid until the graph is removed.
+void rrd_graph_add(const char *name, struct rrd *rrd, const struct rrd_graph *graph);
+void rrd_graph_del(const char *name);
+
+#endif
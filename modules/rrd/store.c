@@ -0,0 +1,464 @@
+#include "global.h"
+#include "rrd.h"
+#include "store.h"
+#include "graph.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+
+static size_t rrd_layout_size(const struct rrd_def *def);
+static void rrd_setup(struct rrd *rrd);
+static void rrd_create(struct rrd *rrd, const struct rrd_def *def);
+static int rrd_check_layout(struct rrd *rrd, const struct rrd_def *def);
+static void rrd_pdp_add(struct rrd *rrd, const double *values, uint32_t secs);
+static void rrd_pdp_finish(struct rrd *rrd, double *values);
+static void rrd_rra_push(struct rrd *rrd, const double *values, uint64_t count);
+static void rrd_cdp_add(struct rrd *rrd, unsigned int rra, const double *values, uint32_t count);
+static void rrd_cdp_write(struct rrd *rrd, unsigned int rra);
+static int rrd_find_rra(const struct rrd *rrd, enum rrd_cf cf, time_t start);
+
+
+struct rrd *rrd_open(const char *file, const struct rrd_def *def)
+{
+	struct rrd *rrd;
+	struct stat sb;
+	uint8_t created = 0;
+
+	if(def->ds_count > RRD_MAX_DS || !def->ds_count || !def->rra_count)
+	{
+		log_append(LOG_ERROR, "invalid rrd definition for %s", file);
+		return NULL;
+	}
+
+	rrd = malloc(sizeof(struct rrd));
+	memset(rrd, 0, sizeof(struct rrd));
+	rrd->file = strdup(file);
+
+	if((rrd->fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+	{
+		log_append(LOG_WARNING, "could not open %s: %s", file, strerror(errno));
+		free(rrd->file);
+		free(rrd);
+		return NULL;
+	}
+
+	fstat(rrd->fd, &sb);
+	if(sb.st_size == 0)
+	{
+		rrd->size = rrd_layout_size(def);
+		if(ftruncate(rrd->fd, rrd->size) == -1)
+		{
+			log_append(LOG_WARNING, "could not resize %s: %s", file, strerror(errno));
+			goto fail;
+		}
+		created = 1;
+	}
+	else
+		rrd->size = sb.st_size;
+
+	if((rrd->map = mmap(NULL, rrd->size, PROT_READ | PROT_WRITE, MAP_SHARED, rrd->fd, 0)) == MAP_FAILED)
+	{
+		log_append(LOG_WARNING, "could not mmap %s: %s", file, strerror(errno));
+		rrd->map = NULL;
+		goto fail;
+	}
+
+	if(created)
+		rrd_create(rrd, def);
+	else if(rrd_check_layout(rrd, def))
+		goto fail;
+	rrd_setup(rrd);
+
+	if(created)
+	{
+		char xml_file[PATH_MAX];
+		char *ext;
+
+		// Data from rrdtool can be imported by placing a dump next to the new file
+		strlcpy(xml_file, file, sizeof(xml_file) - 4);
+		if((ext = strrchr(xml_file, '.')) && !strchr(ext, '/'))
+			*ext = '\0';
+		strcat(xml_file, ".xml");
+		if(access(xml_file, R_OK) == 0)
+		{
+			log_append(LOG_INFO, "importing %s into %s", xml_file, file);
+			rrd_import_xml(rrd, xml_file);
+		}
+	}
+
+	return rrd;
+
+fail:
+	if(rrd->map)
+		munmap(rrd->map, rrd->size);
+	close(rrd->fd);
+	if(created)
+		unlink(file);
+	free(rrd->file);
+	free(rrd);
+	return NULL;
+}
+
+void rrd_close(struct rrd *rrd)
+{
+	graph_del_rrd(rrd);
+	munmap(rrd->map, rrd->size);
+	close(rrd->fd);
+	free(rrd->file);
+	free(rrd);
+}
+
+time_t rrd_last_update(const struct rrd *rrd)
+{
+	return rrd->header->last_update;
+}
+
+// values contains one value per data source, NAN if it is unknown
+int rrd_update(struct rrd *rrd, time_t ts, const double *values)
+{
+	struct rrd_file_header *header = rrd->header;
+	double known[RRD_MAX_DS], pdp[RRD_MAX_DS];
+	uint64_t pdp_start, pdp_end;
+	time_t interval;
+
+	if(ts <= header->last_update)
+	{
+		debug("ignoring update of %s at %lu; last update was at %lu", rrd->file, (unsigned long)ts, (unsigned long)header->last_update);
+		return -1;
+	}
+
+	interval = ts - header->last_update;
+	for(unsigned int i = 0; i < header->ds_count; i++)
+		known[i] = (interval > rrd->ds[i].heartbeat) ? NAN : values[i];
+
+	pdp_start = header->last_update / header->step;
+	pdp_end = ts / header->step;
+	if(pdp_start == pdp_end)
+		rrd_pdp_add(rrd, known, interval);
+	else
+	{
+		// Finish the current primary data point, then all steps covered completely by this update
+		rrd_pdp_add(rrd, known, (pdp_start + 1) * header->step - header->last_update);
+		rrd_pdp_finish(rrd, pdp);
+		rrd_rra_push(rrd, pdp, 1);
+		if(pdp_end - pdp_start > 1)
+			rrd_rra_push(rrd, known, pdp_end - pdp_start - 1);
+		rrd_pdp_add(rrd, known, ts - pdp_end * header->step);
+	}
+
+	header->last_update = ts;
+	return 0;
+}
+
+int rrd_fetch(struct rrd *rrd, const char *ds, enum rrd_cf cf, time_t start, time_t end, struct rrd_series *series)
+{
+	const struct rrd_file_rra *rra;
+	const double *rows;
+	time_t last_row, first_row;
+	int ds_idx, rra_idx;
+
+	memset(series, 0, sizeof(struct rrd_series));
+	if((ds_idx = rrd_ds_index(rrd, ds)) < 0 || (rra_idx = rrd_find_rra(rrd, cf, start)) < 0)
+		return -1;
+
+	rra = &rrd->rra[rra_idx];
+	rows = rrd_rows(rrd, rra_idx);
+	series->step = rra->steps * rrd->header->step;
+	last_row = rrd_rra_last_row(rrd, rra_idx);
+	first_row = last_row - (time_t)(rra->rows - 1) * series->step;
+
+	// Rows are identified by their end time
+	series->start = ((start + series->step - 1) / series->step) * series->step;
+	series->start = max(series->start, first_row);
+	end = min(end, last_row);
+	if(end < series->start)
+		return 0;
+
+	series->count = (end - series->start) / series->step + 1;
+	series->values = malloc(series->count * sizeof(double));
+	for(unsigned int i = 0; i < series->count; i++)
+	{
+		uint32_t age = (last_row - (series->start + (time_t)i * series->step)) / series->step;
+		uint32_t row = (rra->cur_row + rra->rows - age) % rra->rows;
+		series->values[i] = rows[row * rrd->header->ds_count + ds_idx];
+	}
+
+	return 0;
+}
+
+void rrd_series_free(struct rrd_series *series)
+{
+	MyFree(series->values);
+	series->count = 0;
+}
+
+int rrd_ds_index(const struct rrd *rrd, const char *name)
+{
+	for(unsigned int i = 0; i < rrd->header->ds_count; i++)
+	{
+		if(!strncmp(rrd->ds[i].name, name, RRD_DS_NAME_LEN))
+			return i;
+	}
+
+	return -1;
+}
+
+// Forgets partially consolidated data, keeping rows aligned to last_update
+void rrd_reset_state(struct rrd *rrd)
+{
+	uint64_t pdp = rrd->header->last_update / rrd->header->step;
+
+	for(unsigned int i = 0; i < rrd->header->ds_count; i++)
+	{
+		rrd->ds[i].pdp_sum = 0;
+		rrd->ds[i].pdp_known = 0;
+	}
+
+	for(unsigned int i = 0; i < rrd->header->rra_count; i++)
+	{
+		rrd->rra[i].cdp_pdps = pdp % rrd->rra[i].steps;
+		for(unsigned int j = 0; j < rrd->header->ds_count; j++)
+		{
+			rrd->cdp[i * rrd->header->ds_count + j].value = 0;
+			rrd->cdp[i * rrd->header->ds_count + j].known = 0;
+		}
+	}
+}
+
+static size_t rrd_layout_size(const struct rrd_def *def)
+{
+	size_t size = sizeof(struct rrd_file_header) +
+		def->ds_count * sizeof(struct rrd_file_ds) +
+		def->rra_count * sizeof(struct rrd_file_rra) +
+		def->rra_count * def->ds_count * sizeof(struct rrd_file_cdp);
+
+	for(unsigned int i = 0; i < def->rra_count; i++)
+		size += (size_t)def->rra[i].rows * def->ds_count * sizeof(double);
+	return size;
+}
+
+static void rrd_setup(struct rrd *rrd)
+{
+	rrd->header = rrd->map;
+	rrd->ds = (struct rrd_file_ds *)(rrd->header + 1);
+	rrd->rra = (struct rrd_file_rra *)(rrd->ds + rrd->header->ds_count);
+	rrd->cdp = (struct rrd_file_cdp *)(rrd->rra + rrd->header->rra_count);
+}
+
+static void rrd_create(struct rrd *rrd, const struct rrd_def *def)
+{
+	uint64_t offset;
+
+	memset(rrd->map, 0, rrd->size);
+	rrd->header = rrd->map;
+	memcpy(rrd->header->magic, RRD_MAGIC, sizeof(rrd->header->magic));
+	rrd->header->version = RRD_VERSION;
+	rrd->header->step = def->step;
+	rrd->header->ds_count = def->ds_count;
+	rrd->header->rra_count = def->rra_count;
+	rrd->header->last_update = now;
+	rrd_setup(rrd);
+
+	for(unsigned int i = 0; i < def->ds_count; i++)
+	{
+		strncpy(rrd->ds[i].name, def->ds[i].name, RRD_DS_NAME_LEN);
+		rrd->ds[i].heartbeat = def->ds[i].heartbeat;
+	}
+
+	offset = (char *)(rrd->cdp + def->rra_count * def->ds_count) - (char *)rrd->map;
+	for(unsigned int i = 0; i < def->rra_count; i++)
+	{
+		double *rows;
+
+		rrd->rra[i].cf = def->rra[i].cf;
+		rrd->rra[i].steps = def->rra[i].steps;
+		rrd->rra[i].rows = def->rra[i].rows;
+		rrd->rra[i].offset = offset;
+		offset += (uint64_t)def->rra[i].rows * def->ds_count * sizeof(double);
+
+		rows = rrd_rows(rrd, i);
+		for(uint64_t j = 0; j < (uint64_t)def->rra[i].rows * def->ds_count; j++)
+			rows[j] = NAN;
+	}
+
+	rrd_reset_state(rrd);
+}
+
+static int rrd_check_layout(struct rrd *rrd, const struct rrd_def *def)
+{
+	const struct rrd_file_header *header = rrd->map;
+	const struct rrd_file_ds *ds;
+	const struct rrd_file_rra *rra;
+
+	if(rrd->size < sizeof(struct rrd_file_header) || memcmp(header->magic, RRD_MAGIC, sizeof(header->magic)) || header->version != RRD_VERSION)
+	{
+		log_append(LOG_WARNING, "%s is not a valid rrd file", rrd->file);
+		return -1;
+	}
+
+	if(header->step != def->step || header->ds_count != def->ds_count || header->rra_count != def->rra_count || rrd->size != rrd_layout_size(def))
+	{
+		log_append(LOG_WARNING, "%s has a different layout", rrd->file);
+		return -1;
+	}
+
+	ds = (const struct rrd_file_ds *)(header + 1);
+	rra = (const struct rrd_file_rra *)(ds + header->ds_count);
+	for(unsigned int i = 0; i < def->ds_count; i++)
+	{
+		if(strncmp(ds[i].name, def->ds[i].name, RRD_DS_NAME_LEN))
+		{
+			log_append(LOG_WARNING, "%s has a different data source %u: %.*s", rrd->file, i, RRD_DS_NAME_LEN, ds[i].name);
+			return -1;
+		}
+	}
+
+	for(unsigned int i = 0; i < def->rra_count; i++)
+	{
+		if(rra[i].cf != def->rra[i].cf || rra[i].steps != def->rra[i].steps || rra[i].rows != def->rra[i].rows)
+		{
+			log_append(LOG_WARNING, "%s has a different archive %u", rrd->file, i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void rrd_pdp_add(struct rrd *rrd, const double *values, uint32_t secs)
+{
+	for(unsigned int i = 0; i < rrd->header->ds_count; i++)
+	{
+		if(isnan(values[i]))
+			continue;
+		rrd->ds[i].pdp_sum += values[i] * secs;
+		rrd->ds[i].pdp_known += secs;
+	}
+}
+
+// A primary data point is known if at least half of its step is known
+static void rrd_pdp_finish(struct rrd *rrd, double *values)
+{
+	for(unsigned int i = 0; i < rrd->header->ds_count; i++)
+	{
+		struct rrd_file_ds *ds = &rrd->ds[i];
+		values[i] = (ds->pdp_known * 2 >= rrd->header->step) ? ds->pdp_sum / ds->pdp_known : NAN;
+		ds->pdp_sum = 0;
+		ds->pdp_known = 0;
+	}
+}
+
+// Adds count primary data points with the same values to all archives
+static void rrd_rra_push(struct rrd *rrd, const double *values, uint64_t count)
+{
+	unsigned int ds_count = rrd->header->ds_count;
+
+	for(unsigned int i = 0; i < rrd->header->rra_count; i++)
+	{
+		struct rrd_file_rra *rra = &rrd->rra[i];
+		uint64_t left = count, full;
+		uint32_t take;
+
+		take = min(left, rra->steps - rra->cdp_pdps);
+		rrd_cdp_add(rrd, i, values, take);
+		left -= take;
+		if(rra->cdp_pdps == rra->steps)
+			rrd_cdp_write(rrd, i);
+
+		// Rows consisting of these values only; older rows would be overwritten anyway
+		if((full = left / rra->steps))
+		{
+			double *rows = rrd_rows(rrd, i);
+			uint64_t write = min(full, rra->rows);
+
+			rra->cur_row = (rra->cur_row + (full - write)) % rra->rows;
+			for(uint64_t j = 0; j < write; j++)
+			{
+				rra->cur_row = (rra->cur_row + 1) % rra->rows;
+				for(unsigned int k = 0; k < ds_count; k++)
+					rows[rra->cur_row * ds_count + k] = values[k];
+			}
+			left %= rra->steps;
+		}
+
+		if(left)
+			rrd_cdp_add(rrd, i, values, left);
+	}
+}
+
+static void rrd_cdp_add(struct rrd *rrd, unsigned int rra, const double *values, uint32_t count)
+{
+	struct rrd_file_cdp *cdp = &rrd->cdp[rra * rrd->header->ds_count];
+
+	if(!count)
+		return;
+
+	for(unsigned int i = 0; i < rrd->header->ds_count; i++)
+	{
+		if(isnan(values[i]))
+			continue;
+
+		if(rrd->rra[rra].cf == RRD_AVERAGE)
+			cdp[i].value += values[i] * count;
+		else if(!cdp[i].known || values[i] > cdp[i].value)
+			cdp[i].value = values[i];
+		cdp[i].known += count;
+	}
+
+	rrd->rra[rra].cdp_pdps += count;
+}
+
+// Rows with more than half of their primary data points unknown are unknown
+static void rrd_cdp_write(struct rrd *rrd, unsigned int rra_idx)
+{
+	struct rrd_file_rra *rra = &rrd->rra[rra_idx];
+	struct rrd_file_cdp *cdp = &rrd->cdp[rra_idx * rrd->header->ds_count];
+	unsigned int ds_count = rrd->header->ds_count;
+	double *rows = rrd_rows(rrd, rra_idx);
+
+	rra->cur_row = (rra->cur_row + 1) % rra->rows;
+	for(unsigned int i = 0; i < ds_count; i++)
+	{
+		double value = NAN;
+
+		if(cdp[i].known * 2 >= rra->steps)
+			value = (rra->cf == RRD_AVERAGE) ? cdp[i].value / cdp[i].known : cdp[i].value;
+		rows[rra->cur_row * ds_count + i] = value;
+		cdp[i].value = 0;
+		cdp[i].known = 0;
+	}
+
+	rra->cdp_pdps = 0;
+}
+
+// Returns the finest archive reaching back to start, or the longest one if none does
+static int rrd_find_rra(const struct rrd *rrd, enum rrd_cf cf, time_t start)
+{
+	int best = -1, longest = -1;
+	uint64_t best_res = 0, longest_span = 0;
+
+	for(unsigned int i = 0; i < rrd->header->rra_count; i++)
+	{
+		const struct rrd_file_rra *rra = &rrd->rra[i];
+		uint64_t res = (uint64_t)rra->steps * rrd->header->step;
+		uint64_t span = res * rra->rows;
+
+		if(rra->cf != cf)
+			continue;
+
+		if(span > longest_span)
+		{
+			longest = i;
+			longest_span = span;
+		}
+
+		if(rrd_rra_last_row(rrd, i) - (time_t)span <= start && (best == -1 || res < best_res))
+		{
+			best = i;
+			best_res = res;
+		}
+	}
+
+	return best != -1 ? best : longest;
+}
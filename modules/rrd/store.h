@@ -0,0 +1,77 @@
+#ifndef RRD_STORE_H
+#define RRD_STORE_H
+
+#include <sys/types.h>
+
+#define RRD_MAGIC	"SBRRD\0\0\0"
+#define RRD_VERSION	1
+#define RRD_MAX_DS	16
+
+// File layout: header, data sources, archives, consolidation state
+// (rra_count * ds_count), then the rows of each archive.
+struct rrd_file_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t step;
+	uint32_t ds_count;
+	uint32_t rra_count;
+	int64_t last_update;
+};
+
+struct rrd_file_ds
+{
+	char name[RRD_DS_NAME_LEN];
+	uint32_t heartbeat;
+	double pdp_sum;		// value * seconds of the current primary data point
+	uint32_t pdp_known;	// known seconds of the current primary data point
+	uint32_t unused;
+};
+
+struct rrd_file_rra
+{
+	uint32_t cf;
+	uint32_t steps;
+	uint32_t rows;
+	uint32_t cur_row;	// most recently written row
+	uint32_t cdp_pdps;	// primary data points in the current row
+	uint32_t unused;
+	uint64_t offset;	// of the first row in the file
+};
+
+struct rrd_file_cdp
+{
+	double value;
+	uint32_t known;		// known primary data points in the current row
+	uint32_t unused;
+};
+
+struct rrd
+{
+	char *file;
+	int fd;
+	size_t size;
+	void *map;
+
+	struct rrd_file_header *header;
+	struct rrd_file_ds *ds;
+	struct rrd_file_rra *rra;
+	struct rrd_file_cdp *cdp;
+};
+
+static inline double *rrd_rows(struct rrd *rrd, unsigned int rra)
+{
+	return (double *)((char *)rrd->map + rrd->rra[rra].offset);
+}
+
+// End of the most recently written row
+static inline time_t rrd_rra_last_row(const struct rrd *rrd, unsigned int rra)
+{
+	uint64_t span = (uint64_t)rrd->rra[rra].steps * rrd->header->step;
+	return (rrd->header->last_update / span) * span;
+}
+
+int rrd_ds_index(const struct rrd *rrd, const char *name);
+void rrd_reset_state(struct rrd *rrd);
+
+#endif
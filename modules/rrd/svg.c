@@ -0,0 +1,123 @@
+#include "global.h"
+#include "stringbuffer.h"
+#include "modules/tools/tools.h"
+#include "canvas.h"
+#include "svg.h"
+
+struct svg_canvas
+{
+	struct canvas canvas;
+	struct stringbuffer *body;
+};
+
+static void svg_rect(struct canvas *canvas, int x, int y, int w, int h, uint32_t color);
+static void svg_line(struct canvas *canvas, int x1, int y1, int x2, int y2, uint32_t color, uint8_t dashed);
+static void svg_text(struct canvas *canvas, int x, int y, const char *text, uint32_t color);
+static void svg_area(struct canvas *canvas, int x, int base, const int *ys, unsigned int count, uint32_t color);
+static void svg_polyline(struct canvas *canvas, int x, const int *ys, unsigned int count, uint32_t color);
+static void svg_finish(struct canvas *canvas, struct stringbuffer *out);
+static void svg_free(struct canvas *canvas);
+
+
+struct canvas *svg_canvas_create(unsigned int width, unsigned int height)
+{
+	struct svg_canvas *svg = malloc(sizeof(struct svg_canvas));
+
+	memset(svg, 0, sizeof(struct svg_canvas));
+	svg->canvas.width = width;
+	svg->canvas.height = height;
+	svg->canvas.rect = svg_rect;
+	svg->canvas.line = svg_line;
+	svg->canvas.text = svg_text;
+	svg->canvas.area = svg_area;
+	svg->canvas.polyline = svg_polyline;
+	svg->canvas.finish = svg_finish;
+	svg->canvas.free = svg_free;
+	svg->body = stringbuffer_create();
+	return &svg->canvas;
+}
+
+static void svg_rect(struct canvas *canvas, int x, int y, int w, int h, uint32_t color)
+{
+	struct svg_canvas *svg = (struct svg_canvas *)canvas;
+	stringbuffer_append_printf(svg->body, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" fill=\"#%06X\"/>\n", x, y, w, h, color);
+}
+
+static void svg_line(struct canvas *canvas, int x1, int y1, int x2, int y2, uint32_t color, uint8_t dashed)
+{
+	struct svg_canvas *svg = (struct svg_canvas *)canvas;
+	stringbuffer_append_printf(svg->body, "<line x1=\"%d.5\" y1=\"%d.5\" x2=\"%d.5\" y2=\"%d.5\" stroke=\"#%06X\"%s/>\n",
+				   x1, y1, x2, y2, color, dashed ? " stroke-dasharray=\"2,2\"" : "");
+}
+
+static void svg_text(struct canvas *canvas, int x, int y, const char *text, uint32_t color)
+{
+	struct svg_canvas *svg = (struct svg_canvas *)canvas;
+	char *escaped = html_encode(text);
+
+	// Monospace text matching the character cell of the png font
+	stringbuffer_append_printf(svg->body, "<text x=\"%d\" y=\"%d\" fill=\"#%06X\">%s</text>\n", x, y + CANVAS_LINE_HEIGHT - 2, color, escaped);
+	free(escaped);
+}
+
+static void svg_area(struct canvas *canvas, int x, int base, const int *ys, unsigned int count, uint32_t color)
+{
+	struct svg_canvas *svg = (struct svg_canvas *)canvas;
+	unsigned int i = 0;
+
+	// One polygon per run of known values
+	while(i < count)
+	{
+		unsigned int start;
+
+		for(; i < count && ys[i] < 0; i++)
+			;
+		if(i == count)
+			break;
+
+		start = i;
+		stringbuffer_append_printf(svg->body, "<polygon fill=\"#%06X\" points=\"%u,%d", color, x + start, base + 1);
+		for(; i < count && ys[i] >= 0; i++)
+			stringbuffer_append_printf(svg->body, " %u,%d %u,%d", x + i, ys[i], x + i + 1, ys[i]);
+		stringbuffer_append_printf(svg->body, " %u,%d\"/>\n", x + i, base + 1);
+	}
+}
+
+static void svg_polyline(struct canvas *canvas, int x, const int *ys, unsigned int count, uint32_t color)
+{
+	struct svg_canvas *svg = (struct svg_canvas *)canvas;
+	unsigned int i = 0;
+
+	while(i < count)
+	{
+		for(; i < count && ys[i] < 0; i++)
+			;
+		if(i == count)
+			break;
+
+		stringbuffer_append_printf(svg->body, "<polyline fill=\"none\" stroke=\"#%06X\" stroke-width=\"2\" points=\"", color);
+		for(; i < count && ys[i] >= 0; i++)
+			stringbuffer_append_printf(svg->body, "%u,%d ", x + i, ys[i]);
+		stringbuffer_append_string(svg->body, "\"/>\n");
+	}
+}
+
+static void svg_finish(struct canvas *canvas, struct stringbuffer *out)
+{
+	struct svg_canvas *svg = (struct svg_canvas *)canvas;
+
+	stringbuffer_append_printf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+				   "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%u\" height=\"%u\" viewBox=\"0 0 %u %u\" "
+				   "font-family=\"monospace\" font-size=\"%u\">\n",
+				   canvas->width, canvas->height, canvas->width, canvas->height, CANVAS_LINE_HEIGHT);
+	stringbuffer_append_string_n(out, svg->body->string, svg->body->len);
+	stringbuffer_append_string(out, "</svg>\n");
+}
+
+static void svg_free(struct canvas *canvas)
+{
+	struct svg_canvas *svg = (struct svg_canvas *)canvas;
+
+	stringbuffer_free(svg->body);
+	free(svg);
+}
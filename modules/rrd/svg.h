@@ -0,0 +1,6 @@
+#ifndef RRD_SVG_H
+#define RRD_SVG_H
+
+struct canvas *svg_canvas_create(unsigned int width, unsigned int height);
+
+#endif
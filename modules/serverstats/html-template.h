@@ -26,4 +26,4 @@
 "</html>\n"
 
 
-#define SERVER_LINE "<a href='%s.html'><img src='%s-%s.png' border='0' /></a><br /><br />\n"
+#define SERVER_LINE "<a href='%s.html'><img src='%s%s-%s.png' border='0' /></a><br /><br />\n"
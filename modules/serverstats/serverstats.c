@@ -5,18 +5,19 @@
 #include "irc_handler.h"
 #include "timer.h"
 #include "conf.h"
+#include "modules/rrd/rrd.h"
 
 #include "html-template.h"
 
-#define DEF_COLORS "-c BACK#FFFFFF -c CANVAS#F3F3F3 -c SHADEA#C8C8C8 -c SHADEB#969696 -c GRID#8C8C8C -c MGRID#821E1E -c FONT#000000 -c FRAME#000000 -c ARROW#FF0000"
+#include <math.h>
 
-MODULE_DEPENDS("commands", NULL);
+MODULE_DEPENDS("commands", "rrd", NULL);
 
 static struct
 {
-	const char *rrdtool_path;
 	const char *rrd_dir;
 	const char *output_dir;
+	const char *graph_url;
 	unsigned int stats_update_freq;
 	unsigned int graph_update_freq;
 	const char *network_name;
@@ -57,11 +58,9 @@ COMMAND(serverstats_graphs);
 static void update_stats_tmr(void *bound, void *data);
 static void update_graphs_tmr(void *bound, void *data);
 static void stats_collected();
-static unsigned int rrd_exists(const char *name);
+static struct rrd *stats_rrd_open(const char *name, const char *graph_prefix, const struct rrd_def *def, const struct rrd_graph *graph);
 static void rrd_server_update(const struct irc_server *server);
 static void rrd_network_update();
-static void rrd_server_graph(const char *name);
-static void rrd_network_graph();
 
 static struct module *this;
 static unsigned int stats_requested = 0;
@@ -71,11 +70,87 @@ static unsigned long total_clients = 0;
 static unsigned long total_clients_tmp = 0;
 static struct dict *servers = NULL;
 static struct dict *servers_tmp = NULL;
+static struct dict *server_rrds = NULL;
+static struct rrd *network_rrd = NULL;
+
+static const struct rrd_ds_def server_rrd_ds[] = {
+	{ "localusers", 600 },
+	{ "totalusers", 600 }
+};
+
+static const struct rrd_rra_def server_rrd_rra[] = {
+	{ RRD_AVERAGE, 1, 600 },
+	{ RRD_AVERAGE, 6, 700 },
+	{ RRD_AVERAGE, 24, 775 },
+	{ RRD_AVERAGE, 288, 797 },
+	{ RRD_MAX, 1, 600 },
+	{ RRD_MAX, 6, 700 },
+	{ RRD_MAX, 24, 775 },
+	{ RRD_MAX, 288, 797 }
+};
+
+static const struct rrd_def server_rrd_def = {
+	300, server_rrd_ds, ArraySize(server_rrd_ds), server_rrd_rra, ArraySize(server_rrd_rra)
+};
+
+static const struct rrd_graph_series server_graph_series[] = {
+	{ "localusers", RRD_GRAPH_AREA, 0xFF0000, "Users" }
+};
+
+static const struct rrd_graph_ratio server_graph_ratios[] = {
+	{ "localusers", "totalusers", 100, "Percentage of global users", "%" }
+};
+
+static const struct rrd_ds_def network_rrd_ds[] = {
+	{ "users", 600 },
+	{ "channels", 600 },
+	{ "regchannels", 600 }
+};
+
+static const struct rrd_rra_def network_rrd_rra[] = {
+	{ RRD_AVERAGE, 1, 600 },
+	{ RRD_AVERAGE, 24, 775 },
+	{ RRD_AVERAGE, 288, 797 },
+	{ RRD_MAX, 1, 600 },
+	{ RRD_MAX, 6, 700 },
+	{ RRD_MAX, 24, 775 },
+	{ RRD_MAX, 288, 797 }
+};
+
+static const struct rrd_def network_rrd_def = {
+	300, network_rrd_ds, ArraySize(network_rrd_ds), network_rrd_rra, ArraySize(network_rrd_rra)
+};
+
+static const struct rrd_graph_series network_graph_series[] = {
+	{ "users", RRD_GRAPH_AREA, 0xFF0000, "Users" },
+	{ "channels", RRD_GRAPH_LINE, 0x0000FF, "Channels" },
+	{ "regchannels", RRD_GRAPH_LINE, 0x00FF00, "Channels (reg)" }
+};
+
+static const struct rrd_graph_ratio network_graph_ratios[] = {
+	{ "regchannels", "channels", 100, "Registered channels", "% of all channels" },
+	{ "users", "channels", 1, "Users per channel", NULL }
+};
+
+static const struct
+{
+	const char *name;
+	const char *title;
+	time_t span;
+} graph_spans[] = {
+	{ "day", "1 day", 86400 },
+	{ "week", "1 week", 7 * 86400 },
+	{ "month", "1 month", 31 * 86400 },
+	{ "year", "1 year", 365 * 86400 }
+};
 
 MODULE_INIT
 {
 	this = self;
 
+	server_rrds = dict_create();
+	dict_set_free_funcs(server_rrds, free, (dict_free_f *)rrd_close);
+
 	reg_conf_reload_func(serverstats_conf_reload);
 	serverstats_conf_reload();
 
@@ -96,6 +171,9 @@ MODULE_FINI
 		dict_free(servers_tmp);
 	if(servers)
 		dict_free(servers);
+	dict_free(server_rrds);
+	if(network_rrd)
+		rrd_close(network_rrd);
 
 	unreg_conf_reload_func(serverstats_conf_reload);
 
@@ -124,15 +202,16 @@ static void serverstats_conf_reload()
 {
 	char *str;
 
-	str = conf_get("serverstats/rrdtool_path", DB_STRING);
-	serverstats_conf.rrdtool_path = str ? str : "/usr/bin/rrdtool";
-
 	str = conf_get("serverstats/rrd_dir", DB_STRING);
 	serverstats_conf.rrd_dir = str ? str : ".";
 
 	str = conf_get("serverstats/output_dir", DB_STRING);
 	serverstats_conf.output_dir = str ? str : ".";
 
+	// Graphs are served by the rrd module
+	str = conf_get("serverstats/graph_url", DB_STRING);
+	serverstats_conf.graph_url = str ? str : "/graphs/";
+
 	str = conf_get("serverstats/stats_update_freq", DB_STRING);
 	serverstats_conf.stats_update_freq = str ? atoi(str) : 60;
 
@@ -164,18 +243,6 @@ static void update_graphs_tmr(void *bound, void *data)
 	char str[MAXLEN];
 	FILE *out, *out2;
 
-	rrd_network_graph();
-
-	if(servers)
-	{
-		dict_iter(node, servers)
-		{
-			if(serverstats_conf.ignore_servers && stringlist_find(serverstats_conf.ignore_servers, node->key) != -1)
-				continue;
-			rrd_server_graph(node->key);
-		}
-	}
-
 	snprintf(str, sizeof(str), "%s/index.html", serverstats_conf.output_dir);
 	out = fopen(str, "w");
 	fprintf(out, HEADER, serverstats_conf.graph_update_freq, serverstats_conf.network_name, time2string(now), serverstats_conf.network_name, time2string(now));
@@ -187,31 +254,31 @@ static void update_graphs_tmr(void *bound, void *data)
 			if(serverstats_conf.ignore_servers && stringlist_find(serverstats_conf.ignore_servers, node->key) != -1)
 				continue;
 
-			fprintf(out, SERVER_LINE, node->key, node->key, "day");
+			fprintf(out, SERVER_LINE, node->key, serverstats_conf.graph_url, node->key, "day");
 
 			snprintf(str, sizeof(str), "%s/%s.html", serverstats_conf.output_dir, node->key);
 			out2 = fopen(str, "w");
 			fprintf(out2, HEADER, serverstats_conf.graph_update_freq, node->key, time2string(now), node->key, time2string(now));
-			fprintf(out2, SERVER_LINE, node->key, node->key, "day");
-			fprintf(out2, SERVER_LINE, node->key, node->key, "week");
-			fprintf(out2, SERVER_LINE, node->key, node->key, "month");
-			fprintf(out2, SERVER_LINE, node->key, node->key, "year");
+			fprintf(out2, SERVER_LINE, node->key, serverstats_conf.graph_url, node->key, "day");
+			fprintf(out2, SERVER_LINE, node->key, serverstats_conf.graph_url, node->key, "week");
+			fprintf(out2, SERVER_LINE, node->key, serverstats_conf.graph_url, node->key, "month");
+			fprintf(out2, SERVER_LINE, node->key, serverstats_conf.graph_url, node->key, "year");
 			fputs(FOOTER, out2);
 			fclose(out2);
 		}
 	}
 
-	fprintf(out, SERVER_LINE, "network", "network", "day");
+	fprintf(out, SERVER_LINE, "network", serverstats_conf.graph_url, "network", "day");
 	fputs(FOOTER, out);
 	fclose(out);
 
 	snprintf(str, sizeof(str), "%s/network.html", serverstats_conf.output_dir);
 	out2 = fopen(str, "w");
 	fprintf(out2, HEADER, serverstats_conf.graph_update_freq, serverstats_conf.network_name, time2string(now), serverstats_conf.network_name, time2string(now));
-	fprintf(out2, SERVER_LINE, "network", "network", "day");
-	fprintf(out2, SERVER_LINE, "network", "network", "week");
-	fprintf(out2, SERVER_LINE, "network", "network", "month");
-	fprintf(out2, SERVER_LINE, "network", "network", "year");
+	fprintf(out2, SERVER_LINE, "network", serverstats_conf.graph_url, "network", "day");
+	fprintf(out2, SERVER_LINE, "network", serverstats_conf.graph_url, "network", "week");
+	fprintf(out2, SERVER_LINE, "network", serverstats_conf.graph_url, "network", "month");
+	fprintf(out2, SERVER_LINE, "network", serverstats_conf.graph_url, "network", "year");
 	fputs(FOOTER, out2);
 	fclose(out2);
 
@@ -219,81 +286,91 @@ static void update_graphs_tmr(void *bound, void *data)
 	timer_add(this, "update_graphs", now + serverstats_conf.graph_update_freq, update_graphs_tmr, NULL, 0, 0);
 }
 
-static unsigned int rrd_exists(const char *name)
+// Opens the rrd of a server or the network and registers its graphs
+static struct rrd *stats_rrd_open(const char *name, const char *graph_prefix, const struct rrd_def *def, const struct rrd_graph *graph)
 {
-	char path[MAXLEN];
-	FILE *fp;
+	char path[PATH_MAX];
+	struct rrd *rrd;
 
-	snprintf(path, sizeof(path), "%s/%s.rrd", serverstats_conf.rrd_dir, name);
-	if(!(fp = fopen(path, "r")))
-		return 0;
+	snprintf(path, sizeof(path), "%s/%s.rrdb", serverstats_conf.rrd_dir, name);
+	if(!(rrd = rrd_open(path, def)))
+		return NULL;
 
-	fclose(fp);
-	return 1;
-}
+	for(unsigned int i = 0; i < ArraySize(graph_spans); i++)
+	{
+		struct rrd_graph span_graph = *graph;
+		char graph_name[128], title[128];
 
-static void rrd_server_update(const struct irc_server *server)
-{
-	char str[MAXLEN];
+		snprintf(title, sizeof(title), "%s (%s)", graph->title, graph_spans[i].title);
+		span_graph.title = title;
+		span_graph.span = graph_spans[i].span;
 
-	if(!rrd_exists(server->name))
-		snprintf(str, sizeof(str), "%s create %s/%s.rrd DS:localusers:GAUGE:600:U:U DS:totalusers:GAUGE:600:U:U RRA:AVERAGE:0.5:1:600 RRA:AVERAGE:0.5:6:700 RRA:AVERAGE:0.5:24:775 RRA:AVERAGE:0.5:288:797 RRA:MAX:0.5:1:600 RRA:MAX:0.5:6:700 RRA:MAX:0.5:24:775 RRA:MAX:0.5:288:797 >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.rrd_dir, server->name);
-	else
-		snprintf(str, sizeof(str), "%s update %s/%s.rrd N:%d:%lu >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.rrd_dir, server->name, server->clients, total_clients);
+		snprintf(graph_name, sizeof(graph_name), "%s-%s", graph_prefix, graph_spans[i].name);
+		rrd_graph_add(graph_name, rrd, &span_graph);
+	}
 
-	debug("Updating RRD for %s", server->name);
-	system(str);
+	return rrd;
 }
 
-static void rrd_network_update()
+static void rrd_server_update(const struct irc_server *server)
 {
-	char str[MAXLEN];
+	struct rrd *rrd;
+	double values[2];
 
-	if(!rrd_exists(serverstats_conf.network_name))
-		snprintf(str, sizeof(str), "%s create %s/%s.rrd DS:users:GAUGE:600:U:U DS:channels:GAUGE:600:U:U DS:regchannels:GAUGE:600:U:U RRA:AVERAGE:0.5:1:600 RRA:AVERAGE:0.5:24:775 RRA:AVERAGE:0.5:288:797 RRA:MAX:0.5:1:600 RRA:MAX:0.5:6:700 RRA:MAX:0.5:24:775 RRA:MAX:0.5:288:797", serverstats_conf.rrdtool_path, serverstats_conf.rrd_dir, serverstats_conf.network_name);
-	else if(registered_channels > 0)
-		snprintf(str, sizeof(str), "%s update %s/%s.rrd N:%lu:%lu:%lu", serverstats_conf.rrdtool_path, serverstats_conf.rrd_dir, serverstats_conf.network_name, total_clients, total_channels, registered_channels);
-	else // When we do not know the registered channels for some reason, update it with UNKNOWN so we don't get a zero there.
-		snprintf(str, sizeof(str), "%s update %s/%s.rrd N:%lu:%lu:U", serverstats_conf.rrdtool_path, serverstats_conf.rrd_dir, serverstats_conf.network_name, total_clients, total_channels);
+	if(!(rrd = dict_find(server_rrds, server->name)))
+	{
+		struct rrd_graph graph;
+		char title[128];
+
+		snprintf(title, sizeof(title), "Users connected to %s", server->name);
+		memset(&graph, 0, sizeof(graph));
+		graph.title = title;
+		graph.vlabel = "local users";
+		graph.height = 100;
+		graph.series = server_graph_series;
+		graph.series_count = ArraySize(server_graph_series);
+		graph.ratios = server_graph_ratios;
+		graph.ratio_count = ArraySize(server_graph_ratios);
+
+		if(!(rrd = stats_rrd_open(server->name, server->name, &server_rrd_def, &graph)))
+			return;
+		dict_insert(server_rrds, strdup(server->name), rrd);
+	}
 
-	debug("Updating RRD for %s", serverstats_conf.network_name);
-	system(str);
+	values[0] = server->clients;
+	values[1] = total_clients;
+	debug("Updating RRD for %s", server->name);
+	rrd_update(rrd, now, values);
 }
 
-static void rrd_server_graph(const char *name)
+static void rrd_network_update()
 {
-	char str[4096];
-
-	if(!rrd_exists(name))
-		return;
+	double values[3];
 
-	debug("Creating graphs for %s", name);
-	snprintf(str, sizeof(str), "%s graph %s/%s-day.png %s -a PNG -v \"local users\" -t \"Users connected to %s (1 day)\" DEF:lastglobal=%s/%s.rrd:totalusers:AVERAGE DEF:localusers=%s/%s.rrd:localusers:AVERAGE \"CDEF:perclocal=localusers,100,*,lastglobal,/\" AREA:localusers#FF0000:\"Users connected to %s\\l\" DEF:maxlocal=%s/%s.rrd:localusers:MAX GPRINT:maxlocal:MAX:'Users -> Max\\: %%.lf' GPRINT:localusers:AVERAGE:'Average\\: %%.lf' GPRINT:localusers:LAST:'Current\\: %%.lf\\l' GPRINT:perclocal:LAST:'Percentage\\: %s has %%.2lf%%%% of global users\\l' >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.output_dir, name, DEF_COLORS, name, serverstats_conf.rrd_dir, name, serverstats_conf.rrd_dir, name, name, serverstats_conf.rrd_dir, name, name);
-	system(str);
-	snprintf(str, sizeof(str), "%s graph %s/%s-week.png %s -a PNG -s -1week -v \"local users\" -t \"Users connected to %s (1 week)\" DEF:localusers=%s/%s.rrd:localusers:AVERAGE AREA:localusers#FF0000:\"Users connected to %s\\l\" DEF:maxlocals=%s/%s.rrd:localusers:MAX GPRINT:maxlocals:MAX:'Users -> Max\\: %%.lf' GPRINT:localusers:AVERAGE:'Average\\: %%.lf' GPRINT:localusers:LAST:'Current\\: %%.lf users\\l' >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.output_dir, name, DEF_COLORS, name, serverstats_conf.rrd_dir, name, name, serverstats_conf.rrd_dir, name);
-	system(str);
-	snprintf(str, sizeof(str), "%s graph %s/%s-month.png %s -a PNG -s -1month -v \"local users\" -t \"Users connected to %s (1 month)\" DEF:localusers=%s/%s.rrd:localusers:AVERAGE AREA:localusers#FF0000:\"Users connected to %s\\l\" DEF:maxlocals=%s/%s.rrd:localusers:MAX GPRINT:maxlocals:MAX:'Users -> Max\\: %%.lf' GPRINT:localusers:AVERAGE:'Average\\: %%.lf' GPRINT:localusers:LAST:'Current\\: %%.lf users\\l' >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.output_dir, name, DEF_COLORS, name, serverstats_conf.rrd_dir, name, name, serverstats_conf.rrd_dir, name);
-	system(str);
-	snprintf(str, sizeof(str), "%s graph %s/%s-year.png %s -a PNG -s -1year -v \"local users\" -t \"Users connected to %s (1 year)\" DEF:localusers=%s/%s.rrd:localusers:AVERAGE AREA:localusers#FF0000:\"Users connected to %s\\l\" DEF:maxlocals=%s/%s.rrd:localusers:MAX GPRINT:maxlocals:MAX:'Users -> Max\\: %%.lf' GPRINT:localusers:AVERAGE:'Average\\: %%.lf' GPRINT:localusers:LAST:'Current\\: %%.lf users\\l' >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.output_dir, name, DEF_COLORS, name, serverstats_conf.rrd_dir, name, name, serverstats_conf.rrd_dir, name);
-	system(str);
-}
-
-static void rrd_network_graph()
-{
-	char str[4096];
+	if(!network_rrd)
+	{
+		struct rrd_graph graph;
+
+		memset(&graph, 0, sizeof(graph));
+		graph.title = "Users and channels in the network";
+		graph.vlabel = "users/channels";
+		graph.height = 200;
+		graph.series = network_graph_series;
+		graph.series_count = ArraySize(network_graph_series);
+		graph.ratios = network_graph_ratios;
+		graph.ratio_count = ArraySize(network_graph_ratios);
+
+		if(!(network_rrd = stats_rrd_open(serverstats_conf.network_name, "network", &network_rrd_def, &graph)))
+			return;
+	}
 
-	if(!rrd_exists(serverstats_conf.network_name))
-		return;
+	values[0] = total_clients;
+	values[1] = total_channels;
+	// When we do not know the registered channels for some reason, update it with UNKNOWN so we don't get a zero there.
+	values[2] = registered_channels > 0 ? registered_channels : NAN;
 
-	debug("Creating graphs for %s", serverstats_conf.network_name);
-	snprintf(str, sizeof(str), "%s graph %s/network-day.png %s -a PNG -h 200 -s -1day -v \"users/channels\" -t \"Users and channels in the network (1 day)\" DEF:users=%s/%s.rrd:users:AVERAGE DEF:channels=%s/%s.rrd:channels:AVERAGE DEF:regchannels=%s/%s.rrd:regchannels:AVERAGE \"CDEF:percregistered=regchannels,100,*,channels,/\" \"CDEF:usersperchannel=users,channels,/\" AREA:users#FF0000:\"Users connected\" LINE2:channels#0000FF:\"Channels created\" LINE2:regchannels#00FF00:\"Channels registered\" DEF:maxusers=%s/%s.rrd:users:MAX DEF:maxchannels=%s/%s.rrd:channels:MAX DEF:maxregchannels=%s/%s.rrd:regchannels:MAX GPRINT:maxusers:MAX:'Users -> Max\\: %%.lf' GPRINT:users:AVERAGE:'Average\\: %%.lf' GPRINT:users:LAST:'Current\\: %%.lf\\l' GPRINT:maxchannels:MAX:'Channels -> Max\\: %%.lf' GPRINT:channels:AVERAGE:'Average\\: %%.lf' GPRINT:channels:LAST:'Current\\: %%.lf\\l' GPRINT:maxregchannels:MAX:'Channels (reg) -> Max\\: %%.lf' GPRINT:regchannels:AVERAGE:'Average\\: %%.lf' GPRINT:regchannels:LAST:'Current\\: %%.lf\\l' GPRINT:percregistered:LAST:'Registered\\: %%.2lf%%%% of all channels\\l' GPRINT:usersperchannel:LAST:'Users per channel\\: %%.2lf\\l' >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.output_dir, DEF_COLORS, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name);
-	system(str);
-	snprintf(str, sizeof(str), "%s graph %s/network-week.png %s -a PNG -h 200 -s -1week -v \"users/channels\" -t \"Users and channels in the network (1 week)\" DEF:users=%s/%s.rrd:users:AVERAGE DEF:channels=%s/%s.rrd:channels:AVERAGE DEF:regchannels=%s/%s.rrd:regchannels:AVERAGE AREA:users#FF0000:\"Users connected\" LINE2:channels#0000FF:\"Channels created\" LINE2:regchannels#00FF00:\"Channels registered\" DEF:maxusers=%s/%s.rrd:users:MAX DEF:maxchannels=%s/%s.rrd:channels:MAX DEF:maxregchannels=%s/%s.rrd:regchannels:MAX GPRINT:maxusers:MAX:'Users -> Max\\: %%.lf' GPRINT:users:AVERAGE:'Average\\: %%.lf' GPRINT:users:LAST:'Current\\: %%.lf\\l' GPRINT:maxchannels:MAX:'Channels -> Max\\: %%.lf' GPRINT:channels:AVERAGE:'Average\\: %%.lf' GPRINT:channels:LAST:'Current\\: %%.lf\\l' GPRINT:maxregchannels:MAX:'Channels (reg) -> Max\\: %%.lf' GPRINT:regchannels:AVERAGE:'Average\\: %%.lf' GPRINT:regchannels:LAST:'Current\\: %%.lf\\l' >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.output_dir, DEF_COLORS, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name);
-	system(str);
-	snprintf(str, sizeof(str), "%s graph %s/network-month.png %s -a PNG -h 200 -s -1month -v \"users/channels\" -t \"Users and channels in the network (1 month)\" DEF:users=%s/%s.rrd:users:AVERAGE DEF:channels=%s/%s.rrd:channels:AVERAGE DEF:regchannels=%s/%s.rrd:regchannels:AVERAGE AREA:users#FF0000:\"Users connected\" LINE2:channels#0000FF:\"Channels created\" LINE2:regchannels#00FF00:\"Channels registered\" DEF:maxusers=%s/%s.rrd:users:MAX DEF:maxchannels=%s/%s.rrd:channels:MAX DEF:maxregchannels=%s/%s.rrd:regchannels:MAX GPRINT:maxusers:MAX:'Users -> Max\\: %%.lf' GPRINT:users:AVERAGE:'Average\\: %%.lf' GPRINT:users:LAST:'Current\\: %%.lf\\l' GPRINT:maxchannels:MAX:'Channels -> Max\\: %%.lf' GPRINT:channels:AVERAGE:'Average\\: %%.lf' GPRINT:channels:LAST:'Current\\: %%.lf\\l' GPRINT:maxregchannels:MAX:'Channels (reg) -> Max\\: %%.lf' GPRINT:regchannels:AVERAGE:'Average\\: %%.lf' GPRINT:regchannels:LAST:'Current\\: %%.lf\\l' >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.output_dir, DEF_COLORS, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name);
-	system(str);
-	snprintf(str, sizeof(str), "%s graph %s/network-year.png %s -a PNG -h 200 -s -1year -v \"users/channels\" -t \"Users and channels in the network (1 year)\" DEF:users=%s/%s.rrd:users:AVERAGE DEF:channels=%s/%s.rrd:channels:AVERAGE DEF:regchannels=%s/%s.rrd:regchannels:AVERAGE AREA:users#FF0000:\"Users connected\" LINE2:channels#0000FF:\"Channels created\" LINE2:regchannels#00FF00:\"Channels registered\" DEF:maxusers=%s/%s.rrd:users:MAX DEF:maxchannels=%s/%s.rrd:channels:MAX DEF:maxregchannels=%s/%s.rrd:regchannels:MAX GPRINT:maxusers:MAX:'Users -> Max\\: %%.lf' GPRINT:users:AVERAGE:'Average\\: %%.lf' GPRINT:users:LAST:'Current\\: %%.lf\\l' GPRINT:maxchannels:MAX:'Channels -> Max\\: %%.lf' GPRINT:channels:AVERAGE:'Average\\: %%.lf' GPRINT:channels:LAST:'Current\\: %%.lf\\l' GPRINT:maxregchannels:MAX:'Channels (reg) -> Max\\: %%.lf' GPRINT:regchannels:AVERAGE:'Average\\: %%.lf' GPRINT:regchannels:LAST:'Current\\: %%.lf\\l' >> /dev/null", serverstats_conf.rrdtool_path, serverstats_conf.output_dir, DEF_COLORS, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name, serverstats_conf.rrd_dir, serverstats_conf.network_name);
-	system(str);
+	debug("Updating RRD for %s", serverstats_conf.network_name);
+	rrd_update(network_rrd, now, values);
 }
 
 IRC_HANDLER(num_statsverbose)
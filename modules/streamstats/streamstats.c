@@ -0,0 +1,578 @@
+#include "global.h"
+#include "module.h"
+#include "sock.h"
+#include "stringbuffer.h"
+#include "timer.h"
+#include "streamstats.h"
+
+#include <libxml/parser.h>
+
+#define STATS_TIMEOUT		15
+#define STATS_MAX_HEADERS	8192
+#define STATS_VALUE_LEN		512
+
+enum stats_state
+{
+	STATS_IDLE,
+	STATS_CONNECTING,
+	STATS_HEADERS,
+	STATS_BODY
+};
+
+static void stats_connect(struct streamstats *stats);
+static void stats_send(struct streamstats *stats);
+static void stats_close(struct streamstats *stats);
+static void stats_fail(struct streamstats *stats, const char *error);
+static void stats_finish(struct streamstats *stats);
+static int stats_parse_headers(struct streamstats *stats, char *headers);
+static void stats_body(struct streamstats *stats, const char *buf, size_t len);
+static int stats_key(const char *name);
+static void stats_sock_event(struct sock *sock, enum sock_event event, int err);
+static void stats_sock_read(struct sock *sock, char *buf, size_t len);
+static void stats_timeout(void *bound, struct streamstats *stats);
+static void sax_start_element(void *ctx, const xmlChar *name, const xmlChar **atts);
+static void sax_end_element(void *ctx, const xmlChar *name);
+static void sax_characters(void *ctx, const xmlChar *ch, int len);
+
+struct streamstats
+{
+	struct module *module;
+	const struct streamstats_handler *handler;
+	xmlSAXHandler sax;
+
+	struct sock *sock;
+	char *host;
+	unsigned int port;
+	char *pass;
+	enum stats_state state;
+	unsigned int keep_alive : 1;
+	unsigned int reused : 1; // request was sent on a kept-alive connection
+
+	struct stringbuffer *headers;
+	long content_length; // -1 if the body ends when the connection is closed
+	long body_read;
+
+	xmlParserCtxtPtr parser;
+	int key; // element whose value is being read or -1
+	char value[STATS_VALUE_LEN];
+	size_t value_len;
+};
+
+#ifdef STREAMSTATS_TEST
+static void run_test();
+static void test_fini();
+static struct module *this;
+#endif
+
+MODULE_DEPENDS(NULL);
+
+MODULE_INIT
+{
+#ifdef STREAMSTATS_TEST
+	this = self;
+	run_test();
+#endif
+}
+
+MODULE_FINI
+{
+#ifdef STREAMSTATS_TEST
+	test_fini();
+#endif
+}
+
+
+struct streamstats *streamstats_create(struct module *module, const struct streamstats_handler *handler)
+{
+	struct streamstats *stats = malloc(sizeof(struct streamstats));
+
+	memset(stats, 0, sizeof(struct streamstats));
+	stats->module = module;
+	stats->handler = handler;
+	stats->headers = stringbuffer_create();
+
+	// SAX1 callbacks; only element names and text are needed
+	stats->sax.startElement = sax_start_element;
+	stats->sax.endElement = sax_end_element;
+	stats->sax.characters = sax_characters;
+	return stats;
+}
+
+void streamstats_free(struct streamstats *stats)
+{
+	stats_close(stats);
+	stringbuffer_free(stats->headers);
+	MyFree(stats->host);
+	MyFree(stats->pass);
+	free(stats);
+}
+
+void streamstats_request(struct streamstats *stats, const char *host, unsigned int port, const char *pass)
+{
+	// A running request is restarted
+	if(stats->state != STATS_IDLE || (stats->sock && (strcmp(stats->host, host) || stats->port != port)))
+		stats_close(stats);
+
+	MyFree(stats->host);
+	MyFree(stats->pass);
+	stats->host = strdup(host);
+	stats->port = port;
+	stats->pass = strdup(pass);
+
+	if(stats->sock)
+	{
+		stats->reused = 1;
+		stats_send(stats);
+	}
+	else
+		stats_connect(stats);
+}
+
+int streamstats_busy(struct streamstats *stats)
+{
+	return stats->state != STATS_IDLE;
+}
+
+static void stats_connect(struct streamstats *stats)
+{
+	stats->sock = sock_create(SOCK_IPV4 | SOCK_QUIET, stats_sock_event, stats_sock_read);
+	assert(stats->sock);
+	stats->sock->ctx = stats;
+
+	if(sock_connect(stats->sock, stats->host, stats->port) != 0)
+	{
+		stats->sock = NULL;
+		stats_fail(stats, "connect() failed");
+		return;
+	}
+
+	stats->reused = 0;
+	stats->state = STATS_CONNECTING;
+	timer_add(stats->module, "streamstats_timeout", now + STATS_TIMEOUT, (timer_f *)stats_timeout, stats, 0, 0);
+}
+
+static void stats_send(struct streamstats *stats)
+{
+	sock_write_fmt(stats->sock, "GET /admin.cgi?pass=%s&mode=viewxml&page=0 HTTP/1.0\r\n", stats->pass);
+	sock_write_fmt(stats->sock, "User-agent: Mozilla compatible\r\n");
+	sock_write_fmt(stats->sock, "Host: %s\r\n", stats->host);
+	sock_write_fmt(stats->sock, "Connection: keep-alive\r\n\r\n");
+
+	stringbuffer_flush(stats->headers);
+	stats->state = STATS_HEADERS;
+	timer_del(stats->module, "streamstats_timeout", 0, NULL, stats, TIMER_IGNORE_TIME|TIMER_IGNORE_FUNC);
+	timer_add(stats->module, "streamstats_timeout", now + STATS_TIMEOUT, (timer_f *)stats_timeout, stats, 0, 0);
+}
+
+static void stats_close(struct streamstats *stats)
+{
+	timer_del(stats->module, "streamstats_timeout", 0, NULL, stats, TIMER_IGNORE_TIME|TIMER_IGNORE_FUNC);
+
+	if(stats->sock)
+		sock_close(stats->sock);
+	stats->sock = NULL;
+
+	if(stats->parser)
+		xmlFreeParserCtxt(stats->parser);
+	stats->parser = NULL;
+	stats->state = STATS_IDLE;
+}
+
+static void stats_fail(struct streamstats *stats, const char *error)
+{
+	log_append(LOG_WARNING, "Could not get stats from stream server %s:%u: %s", stats->host, stats->port, error);
+	stats_close(stats);
+	stats->handler->done(error);
+}
+
+static void stats_finish(struct streamstats *stats)
+{
+	int well_formed;
+
+	xmlParseChunk(stats->parser, NULL, 0, 1);
+	well_formed = stats->parser->wellFormed;
+	xmlFreeParserCtxt(stats->parser);
+	stats->parser = NULL;
+
+	timer_del(stats->module, "streamstats_timeout", 0, NULL, stats, TIMER_IGNORE_TIME|TIMER_IGNORE_FUNC);
+	stats->state = STATS_IDLE;
+	if(!stats->keep_alive && stats->sock)
+	{
+		sock_close(stats->sock);
+		stats->sock = NULL;
+	}
+
+	if(!well_formed)
+	{
+		log_append(LOG_WARNING, "Could not parse xml stats");
+		stats->handler->done("invalid xml");
+		return;
+	}
+
+	stats->handler->done(NULL);
+}
+
+// headers must not contain the empty line ending them
+static int stats_parse_headers(struct streamstats *stats, char *headers)
+{
+	char *line, *saveptr = NULL;
+	int version_minor = 0, status = 0;
+	int keep_alive = -1; // -1: not specified
+
+	if(!(line = strtok_r(headers, "\r\n", &saveptr)) || sscanf(line, "HTTP/1.%d %d", &version_minor, &status) != 2)
+	{
+		stats_fail(stats, "invalid response");
+		return -1;
+	}
+
+	if(status != 200)
+	{
+		char error[32];
+		snprintf(error, sizeof(error), "HTTP status %d", status);
+		stats_fail(stats, error);
+		return -1;
+	}
+
+	stats->content_length = -1;
+	while((line = strtok_r(NULL, "\r\n", &saveptr)))
+	{
+		if(!strncasecmp(line, "Content-Length:", 15))
+			stats->content_length = strtol(line + 15, NULL, 10);
+		else if(!strncasecmp(line, "Connection:", 11))
+			keep_alive = (strcasestr(line + 11, "keep-alive") != NULL);
+	}
+
+	// Without a length the end of the body is only known when the server closes the connection
+	if(keep_alive == -1)
+		keep_alive = (version_minor >= 1);
+	stats->keep_alive = (keep_alive && stats->content_length >= 0);
+
+	stats->parser = xmlCreatePushParserCtxt(&stats->sax, stats, NULL, 0, "stats.xml");
+	xmlCtxtResetPush(stats->parser, NULL, 0, "stats.xml", "iso-8859-15");
+	xmlCtxtUseOptions(stats->parser, XML_PARSE_NOERROR | XML_PARSE_NOWARNING | XML_PARSE_NONET);
+	stats->key = -1;
+	stats->body_read = 0;
+	stats->state = STATS_BODY;
+	return 0;
+}
+
+static void stats_body(struct streamstats *stats, const char *buf, size_t len)
+{
+	if(stats->content_length >= 0 && stats->body_read + (long)len > stats->content_length)
+		len = stats->content_length - stats->body_read;
+
+	if(len)
+	{
+		xmlParseChunk(stats->parser, buf, len, 0);
+		stats->body_read += len;
+	}
+
+	if(stats->content_length >= 0 && stats->body_read >= stats->content_length)
+		stats_finish(stats);
+}
+
+// All element names we are interested in have different lengths
+static int stats_key(const char *name)
+{
+	switch(strlen(name))
+	{
+		case 7:
+			return strcasecmp(name, "BITRATE") ? -1 : STATS_BITRATE;
+		case 9:
+			return strcasecmp(name, "SONGTITLE") ? -1 : STATS_SONGTITLE;
+		case 12:
+			return strcasecmp(name, "MAXLISTENERS") ? -1 : STATS_MAXLISTENERS;
+		case 13:
+			return strcasecmp(name, "PEAKLISTENERS") ? -1 : STATS_PEAKLISTENERS;
+		case 16:
+			return strcasecmp(name, "CURRENTLISTENERS") ? -1 : STATS_CURRENTLISTENERS;
+		case 17:
+			return strcasecmp(name, "REPORTEDLISTENERS") ? -1 : STATS_REPORTEDLISTENERS;
+	}
+
+	return -1;
+}
+
+static void stats_sock_event(struct sock *sock, enum sock_event event, int err)
+{
+	struct streamstats *stats = sock->ctx;
+
+	if(sock != stats->sock)
+		return;
+
+	if(event == EV_CONNECT)
+		stats_send(stats);
+	else if(event == EV_ERROR)
+	{
+		stats->sock = NULL;
+		stats_fail(stats, strerror(err));
+	}
+	else if(event == EV_HANGUP)
+	{
+		stats->sock = NULL;
+		if(stats->state == STATS_BODY && stats->content_length < 0)
+			stats_finish(stats);
+		// The server closed the kept-alive connection before it got our request
+		else if(stats->state == STATS_HEADERS && stats->reused && !stats->headers->len)
+			stats_connect(stats);
+		else if(stats->state != STATS_IDLE)
+			stats_fail(stats, "connection closed");
+	}
+}
+
+static void stats_sock_read(struct sock *sock, char *buf, size_t len)
+{
+	struct streamstats *stats = sock->ctx;
+
+	if(sock != stats->sock)
+		return;
+
+	if(stats->state == STATS_HEADERS)
+	{
+		char *end;
+		size_t header_len;
+
+		stringbuffer_append_string_n(stats->headers, buf, len);
+		if(!(end = strstr(stats->headers->string, "\r\n\r\n")))
+		{
+			if(stats->headers->len > STATS_MAX_HEADERS)
+				stats_fail(stats, "response headers too long");
+			return;
+		}
+
+		*end = '\0';
+		header_len = end + 4 - stats->headers->string;
+		if(stats_parse_headers(stats, stats->headers->string) == 0)
+			stats_body(stats, stats->headers->string + header_len, stats->headers->len - header_len);
+	}
+	else if(stats->state == STATS_BODY)
+		stats_body(stats, buf, len);
+}
+
+static void stats_timeout(void *bound, struct streamstats *stats)
+{
+	stats_fail(stats, "timeout");
+}
+
+static void sax_start_element(void *ctx, const xmlChar *name, const xmlChar **atts)
+{
+	struct streamstats *stats = ctx;
+
+	stats->key = stats_key((const char *)name);
+	stats->value_len = 0;
+}
+
+static void sax_end_element(void *ctx, const xmlChar *name)
+{
+	struct streamstats *stats = ctx;
+
+	if(stats->key == -1)
+		return;
+
+	stats->value[stats->value_len] = '\0';
+	stats->handler->value(stats->key, stats->value);
+	stats->key = -1;
+}
+
+static void sax_characters(void *ctx, const xmlChar *ch, int len)
+{
+	struct streamstats *stats = ctx;
+	size_t n;
+
+	if(stats->key == -1)
+		return;
+
+	n = min(len, sizeof(stats->value) - 1 - stats->value_len);
+	memcpy(stats->value + stats->value_len, ch, n);
+	stats->value_len += n;
+}
+
+
+/* testing */
+#ifdef STREAMSTATS_TEST
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#define TEST_POLLS	500
+#define TEST_LISTENERS	150
+#define TEST_REQUEST	"GET /admin.cgi?pass=test&mode=viewxml&page=0 HTTP/1.0\r\n"
+
+static struct sock *test_listener, *test_client;
+static struct stringbuffer *test_body, *test_request;
+static struct streamstats *test_stats;
+static unsigned int test_port, test_polls, test_connections, test_failures, test_seen;
+static struct timeval test_wall;
+static struct rusage test_usage;
+
+static void test_value(enum streamstats_key key, const char *value);
+static void test_done(const char *error);
+
+static const struct streamstats_handler test_handler = { test_value, test_done };
+
+// What the parser must report for the page built by test_build_body(); the title is iso-8859-15 on the wire
+static const char *test_expected[] = {
+	[STATS_CURRENTLISTENERS] = "150",
+	[STATS_PEAKLISTENERS] = "312",
+	[STATS_MAXLISTENERS] = "500",
+	[STATS_REPORTEDLISTENERS] = "148",
+	[STATS_BITRATE] = "128",
+	[STATS_SONGTITLE] = "Artist - T\xc3\xa4tel & more"
+};
+
+// The admin.cgi?mode=viewxml page of a shoutcast 1.9 server with its listener list and song history
+static void test_build_body()
+{
+	test_body = stringbuffer_create();
+	stringbuffer_append_string(test_body, "<?xml version=\"1.0\" standalone=\"yes\" ?><SHOUTCASTSERVER>"
+		"<CURRENTLISTENERS>150</CURRENTLISTENERS><PEAKLISTENERS>312</PEAKLISTENERS><MAXLISTENERS>500</MAXLISTENERS>"
+		"<REPORTEDLISTENERS>148</REPORTEDLISTENERS><AVERAGETIME>1843</AVERAGETIME><SERVERGENRE>Various</SERVERGENRE>"
+		"<SERVERURL>http://www.example.org</SERVERURL><SERVERTITLE>Example Radio</SERVERTITLE>"
+		"<SONGTITLE>Artist - T\xe4tel &amp; more</SONGTITLE><SONGURL></SONGURL><IRC>#radio</IRC><ICQ>N/A</ICQ><AIM>N/A</AIM>"
+		"<WEBHITS>53021</WEBHITS><STREAMHITS>20013</STREAMHITS><STREAMSTATUS>1</STREAMSTATUS><BITRATE>128</BITRATE>"
+		"<CONTENT>audio/mpeg</CONTENT><VERSION>1.9.8</VERSION>"
+		"<WEBDATA><INDEX>1</INDEX><LISTEN>4</LISTEN><PALM7>0</PALM7><LOGIN>0</LOGIN><LOGINFAIL>0</LOGINFAIL><PLAYED>2</PLAYED>"
+		"<COOKIE>0</COOKIE><ADMIN>9</ADMIN><UPDINFO>1712</UPDINFO><KICKSRC>0</KICKSRC><KICKDST>0</KICKDST><UNBANDST>0</UNBANDST>"
+		"<BANDST>0</BANDST><VIEWBAN>0</VIEWBAN><UNRIPDST>0</UNRIPDST><RIPDST>0</RIPDST><VIEWRIP>0</VIEWRIP><VIEWXML>51290</VIEWXML>"
+		"<VIEWLOG>0</VIEWLOG><INVALID>0</INVALID></WEBDATA><LISTENERS>");
+	for(unsigned int i = 0; i < TEST_LISTENERS; i++)
+	{
+		stringbuffer_append_printf(test_body, "<LISTENER><HOSTNAME>10.%u.%u.%u</HOSTNAME><USERAGENT>%s</USERAGENT>"
+			"<UNDERRUNS>0</UNDERRUNS><CONNECTTIME>%u</CONNECTTIME><POINTER>0</POINTER><UID>%u</UID></LISTENER>",
+			i / 65536, (i / 256) % 256, i % 256, (i % 3 ? "WinampMPEG/5.66, Ultravox/2.1" : "VLC/2.2.4 LibVLC/2.2.4"), 60 + i * 37, 1000 + i);
+	}
+	stringbuffer_append_string(test_body, "</LISTENERS><SONGHISTORY>");
+	for(unsigned int i = 0; i < 10; i++)
+		stringbuffer_append_printf(test_body, "<SONG><PLAYEDAT>%u</PLAYEDAT><TITLE>Artist %u - Song %u</TITLE></SONG>", 1700000000 - i * 240, i, i);
+	stringbuffer_append_string(test_body, "</SONGHISTORY></SHOUTCASTSERVER>");
+}
+
+// Stub server: answers every request on the same connection
+static void test_client_read(struct sock *sock, char *buf, size_t len)
+{
+	char *end;
+
+	stringbuffer_append_string_n(test_request, buf, len);
+	while((end = strstr(test_request->string, "\r\n\r\n")))
+	{
+		if(strncmp(test_request->string, TEST_REQUEST, sizeof(TEST_REQUEST) - 1))
+			test_failures++;
+		sock_write_fmt(sock, "HTTP/1.0 200 OK\r\ncontent-type:text/xml\r\nContent-Length: %u\r\nConnection: keep-alive\r\n\r\n", (unsigned int)test_body->len);
+		sock_write(sock, test_body->string, test_body->len);
+		stringbuffer_erase(test_request, 0, end + 4 - test_request->string);
+	}
+}
+
+static void test_client_event(struct sock *sock, enum sock_event event, int err)
+{
+	if((event == EV_HANGUP || event == EV_ERROR) && sock == test_client)
+		test_client = NULL;
+}
+
+static void test_listener_event(struct sock *sock, enum sock_event event, int err)
+{
+	struct sock *client;
+
+	if(event != EV_ACCEPT || !(client = sock_accept(sock, test_client_event, test_client_read)))
+		return;
+	client->flags |= SOCK_QUIET;
+	if(test_client)
+		sock_close(test_client);
+	test_client = client;
+	stringbuffer_flush(test_request);
+	test_connections++;
+}
+
+static void test_value(enum streamstats_key key, const char *value)
+{
+	if(strcmp(value, test_expected[key]))
+	{
+		log_append(LOG_ERROR, "streamstats test: got '%s' for key %d, expected '%s'", value, key, test_expected[key]);
+		test_failures++;
+	}
+	test_seen |= 1 << key;
+}
+
+static void test_end(void *bound, void *data)
+{
+	struct timeval wall;
+	struct rusage usage;
+	double wall_ms, cpu_ms;
+
+	gettimeofday(&wall, NULL);
+	getrusage(RUSAGE_SELF, &usage);
+	wall_ms = (wall.tv_sec - test_wall.tv_sec) * 1000.0 + (wall.tv_usec - test_wall.tv_usec) / 1000.0;
+	cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec - test_usage.ru_utime.tv_sec - test_usage.ru_stime.tv_sec) * 1000.0 +
+		 (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec - test_usage.ru_utime.tv_usec - test_usage.ru_stime.tv_usec) / 1000.0;
+
+	// Every poll after the first one reuses the kept-alive connection
+	if(test_connections != 1)
+	{
+		log_append(LOG_ERROR, "streamstats test: %u connections for %u polls", test_connections, test_polls);
+		test_failures++;
+	}
+
+	debug("benchmark: %u polls of a %u byte page with %u listeners, %.3f ms each (%.3f ms cpu), %u connection(s)",
+	      test_polls, (unsigned int)test_body->len, TEST_LISTENERS, wall_ms / test_polls, cpu_ms / test_polls, test_connections);
+	debug("STREAMSTATS TEST END: %u failures", test_failures);
+	test_fini();
+}
+
+static void test_done(const char *error)
+{
+	if(error || test_seen != (1 << ArraySize(test_expected)) - 1)
+	{
+		log_append(LOG_ERROR, "streamstats test: poll %u failed (%s), got keys %#x", test_polls, (error ? error : "no error"), test_seen);
+		test_failures++;
+	}
+
+	test_seen = 0;
+	if(++test_polls < TEST_POLLS && !error)
+		streamstats_request(test_stats, "127.0.0.1", test_port, "test");
+	else
+		timer_add(this, "streamstats_test_end", now, test_end, NULL, 0, 0);
+}
+
+static void run_test()
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	debug("STREAMSTATS TEST");
+	test_listener = sock_create(SOCK_IPV4 | SOCK_QUIET, test_listener_event, NULL);
+	if(sock_bind(test_listener, "127.0.0.1", 0) || sock_listen(test_listener, NULL) ||
+	   getsockname(test_listener->fd, (struct sockaddr *)&sin, &len))
+	{
+		log_append(LOG_ERROR, "streamstats test: could not create the stub server");
+		sock_close(test_listener);
+		test_listener = NULL;
+		return;
+	}
+	test_port = ntohs(sin.sin_port);
+
+	test_build_body();
+	test_request = stringbuffer_create();
+	test_stats = streamstats_create(this, &test_handler);
+
+	gettimeofday(&test_wall, NULL);
+	getrusage(RUSAGE_SELF, &test_usage);
+	streamstats_request(test_stats, "127.0.0.1", test_port, "test");
+}
+
+static void test_fini()
+{
+	timer_del_boundname(this, "streamstats_test_end");
+	if(test_stats)
+		streamstats_free(test_stats);
+	if(test_client)
+		sock_close(test_client);
+	if(test_listener)
+		sock_close(test_listener);
+	if(test_body)
+		stringbuffer_free(test_body);
+	if(test_request)
+		stringbuffer_free(test_request);
+	test_stats = NULL;
+	test_client = test_listener = NULL;
+	test_body = test_request = NULL;
+}
+#endif
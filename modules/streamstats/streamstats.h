@@ -0,0 +1,32 @@
+#ifndef STREAMSTATS_H
+#define STREAMSTATS_H
+
+struct module;
+struct streamstats;
+
+enum streamstats_key
+{
+	STATS_CURRENTLISTENERS,
+	STATS_PEAKLISTENERS,
+	STATS_MAXLISTENERS,
+	STATS_REPORTEDLISTENERS,
+	STATS_BITRATE,
+	STATS_SONGTITLE
+};
+
+// value is called for every known element while the response is parsed,
+// done once the response is complete (error is NULL) or the request failed.
+struct streamstats_handler
+{
+	void (*value)(enum streamstats_key key, const char *value);
+	void (*done)(const char *error);
+};
+
+// Each module polling a stream server creates its own instance; its timers are bound to module
+struct streamstats *streamstats_create(struct module *module, const struct streamstats_handler *handler);
+void streamstats_free(struct streamstats *stats);
+// Requests the shoutcast xml stats, reusing an idle keep-alive connection if possible
+void streamstats_request(struct streamstats *stats, const char *host, unsigned int port, const char *pass);
+int streamstats_busy(struct streamstats *stats);
+
+#endif
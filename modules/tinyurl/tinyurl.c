@@ -132,7 +132,7 @@ static struct tinyurl *tinyurl_create(char *channel, const char *alias, unsigned
 
 	request = malloc(12 /* strlen("tinyurl.com/") */ + strlen(alias) + 1);
 	sprintf(request, "%s/%s", tinyurl_services[service_index].domain, alias);
-	tinyurl->http = HTTPRequest_create(request, event_func, read_func);
+	tinyurl->http = HTTPRequest_create_cached(request, event_func, read_func, 86400);
 	tinyurl->http->forward_request = 1;
 	tinyurl->http->forward_request_foreign = 0;
 	HTTPRequest_connect(tinyurl->http);
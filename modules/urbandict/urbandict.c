@@ -99,7 +99,7 @@ COMMAND(urbandict)
 	sprintf(target, "%s%s", url_prefix, request_encoded);
 	debug("UrbanDict: Querying %s", target);
 
-	req->http = HTTPRequest_create(target, event_func, read_func);
+	req->http = HTTPRequest_create_cached(target, event_func, read_func, 0);
 	req->http->read_linewise = 1;
 	HTTPRequest_connect(req->http);
 
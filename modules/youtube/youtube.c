@@ -198,7 +198,7 @@ static struct youtube_request *youtube_request_create(const char *id, const char
 
 	request = malloc(24 + strlen(req->id) + 1); // strlen("www.youtube.com/watch?v=") == 24
 	sprintf(request, "www.youtube.com/watch?v=%s", req->id);
-	req->http = HTTPRequest_create(request, event_func, read_func);
+	req->http = HTTPRequest_create_cached(request, event_func, read_func, 0);
 	free(request);
 
 	dict_set_free_funcs(req->targets, free, free);